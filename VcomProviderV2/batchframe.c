@@ -0,0 +1,89 @@
+/*++
+
+Module Name:
+
+    batchframe.c
+
+Abstract:
+
+    IOCTL_VCOM_BATCH framing
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "batchframe.h"
+
+VOID
+BatchCursorInitialize(
+    _Out_ PBATCH_CURSOR       Cursor,
+    _In_  const UCHAR*        Input,
+    _In_  size_t              InputLength,
+    _In_  size_t              OutputLength
+)
+{
+    Cursor->Input = Input;
+    Cursor->InputLength = InputLength;
+    Cursor->OutputLength = OutputLength;
+    Cursor->InputOffset = 0;
+    Cursor->OutputOffset = 0;
+}
+
+NTSTATUS
+BatchCursorNext(
+    _Inout_ PBATCH_CURSOR     Cursor,
+    _Out_ PVCOM_BATCH_ENTRY   Entry,
+    _Out_ size_t*             PayloadOffset,
+    _Out_ size_t*             Payload,
+    _Out_ size_t*             Room
+)
+{
+    size_t left = Cursor->InputLength - Cursor->InputOffset;
+
+    *PayloadOffset = 0;
+    *Payload = 0;
+    *Room = 0;
+
+    if (left < sizeof(*Entry) ||
+        Cursor->OutputLength - Cursor->OutputOffset < sizeof(*Entry)) {
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    RtlCopyMemory(Entry, Cursor->Input + Cursor->InputOffset, sizeof(*Entry));
+
+    if (Entry->Op == VCOM_BATCH_OP_PUSH) {
+        if (Entry->Length > left - sizeof(*Entry)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        *PayloadOffset = Cursor->InputOffset + sizeof(*Entry);
+        *Payload = Entry->Length;
+    }
+    else if (Entry->Op == VCOM_BATCH_OP_DRAIN) {
+        // Whole alignment units only, so the padding fits as well
+        *Room = (Cursor->OutputLength - Cursor->OutputOffset - sizeof(*Entry)) & ~(size_t)7;
+        *Room = min(*Room, (size_t)Entry->Length);
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID
+BatchCursorAdvance(
+    _Inout_ PBATCH_CURSOR     Cursor,
+    _In_  PVCOM_BATCH_ENTRY   Entry,
+    _In_  size_t              Payload,
+    _In_  size_t              Done
+)
+{
+    Cursor->OutputOffset += sizeof(*Entry);
+    if (Entry->Op == VCOM_BATCH_OP_DRAIN) {
+        Cursor->OutputOffset += VCOM_BATCH_ALIGN(Done);
+    }
+
+    // The last payload's padding may be left off the input
+    Cursor->InputOffset += sizeof(*Entry) + VCOM_BATCH_ALIGN(Payload);
+    Cursor->InputOffset = min(Cursor->InputOffset, Cursor->InputLength);
+}
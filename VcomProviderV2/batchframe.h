@@ -0,0 +1,65 @@
+/*++
+
+Module Name:
+
+    batchframe.h
+
+Abstract:
+
+    Framing of IOCTL_VCOM_BATCH (VCOM_BATCH_ENTRY in public.h): walks the
+    entries of the input and lays out the result headers and drained bytes
+    in the output, keeping both offsets within their buffers. The queue
+    does the pushing and draining for each entry (QueueProcessBatch).
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _BATCH_CURSOR {
+        const UCHAR*    Input;
+        size_t          InputLength;
+        size_t          OutputLength;
+        size_t          InputOffset;    // next entry header
+        size_t          OutputOffset;   // next result header
+    } BATCH_CURSOR, * PBATCH_CURSOR;
+
+    VOID
+        BatchCursorInitialize(
+            _Out_ PBATCH_CURSOR       Cursor,
+            _In_  const UCHAR*        Input,
+            _In_  size_t              InputLength,
+            _In_  size_t              OutputLength
+        );
+
+    // Reads the entry at InputOffset. For a PUSH, PayloadOffset and Payload
+    // locate its bytes in the input; for a DRAIN, Room is the most it may
+    // drain, already limited so the padded bytes fit after its result
+    // header. STATUS_NO_MORE_ENTRIES at the end of the input or when the
+    // output has no room for another result header; STATUS_INVALID_PARAMETER
+    // if a payload runs past the end of the input.
+    NTSTATUS
+        BatchCursorNext(
+            _Inout_ PBATCH_CURSOR     Cursor,
+            _Out_ PVCOM_BATCH_ENTRY   Entry,
+            _Out_ size_t*             PayloadOffset,
+            _Out_ size_t*             Payload,
+            _Out_ size_t*             Room
+        );
+
+    // Moves past the entry BatchCursorNext returned, once its result header
+    // has been written at OutputOffset and Done bytes drained after it
+    VOID
+        BatchCursorAdvance(
+            _Inout_ PBATCH_CURSOR     Cursor,
+            _In_  PVCOM_BATCH_ENTRY   Entry,
+            _In_  size_t              Payload,
+            _In_  size_t              Done
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,35 @@
+/*++
+
+Module Name:
+
+    charscan.h
+
+Abstract:
+
+    Vectorized search of the data path for special characters: XON and
+    XOFF, and the event character, in incoming data. Like memchr, but for
+    either of two characters, and with no locks or state, so it runs the
+    same in a host build.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Offset of the first byte in Buffer that is A or B; Length if none is.
+    // Pass the same character twice to look for just one.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        CharScanFind2(
+            _In_reads_(Length) const UCHAR* Buffer,
+            _In_  size_t              Length,
+            _In_  UCHAR               A,
+            _In_  UCHAR               B
+        );
+
+#ifdef __cplusplus
+}
+#endif
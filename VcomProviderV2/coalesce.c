@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+
+    coalesce.c
+
+Abstract:
+
+    GET_OUTGOING coalescing targets and deadlines
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "coalesce.h"
+
+NTSTATUS
+CoalesceSet(
+    _Inout_ PCOALESCE_STATE   Self,
+    _In_  PVCOM_COALESCE      Settings,
+    _In_  ULONG64             DelayTicks
+)
+{
+    if (Settings->Flags & ~VCOM_COALESCE_ADAPTIVE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Waiting for bytes with no deadline could hold data forever
+    if (Settings->MinBytes > 1 && Settings->MaxDelayMs == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Self->MinBytes = Settings->MinBytes;
+    Self->Target = max(Settings->MinBytes, 1);
+    Self->DelayTicks = DelayTicks;
+    Self->Adaptive = (Settings->Flags & VCOM_COALESCE_ADAPTIVE) != 0;
+    Self->Deadline = 0;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+CoalesceReady(
+    _Inout_ PCOALESCE_STATE   Self,
+    _In_  size_t              Available,
+    _In_  BOOLEAN             Forced,
+    _In_  ULONG64             Now,
+    _Out_ PBOOLEAN            Arm
+)
+{
+    *Arm = FALSE;
+
+    if (Self->MinBytes <= 1 || Available >= Self->Target || Forced) {
+        return TRUE;
+    }
+
+    if (Self->Deadline == 0) {
+        Self->Deadline = Now + Self->DelayTicks;
+        *Arm = TRUE;
+        return FALSE;
+    }
+
+    return Now >= Self->Deadline;
+}
+
+BOOLEAN
+CoalesceDrained(
+    _Inout_ PCOALESCE_STATE   Self,
+    _In_  size_t              Available,
+    _In_  BOOLEAN             Empty,
+    _In_  ULONG64             Now
+)
+{
+    if (Self->MinBytes <= 1) {
+        return FALSE;
+    }
+
+    if (Self->Adaptive) {
+        if (Self->Deadline != 0 && Now >= Self->Deadline) {
+            Self->Target = (ULONG)max(1, min(Available, (size_t)Self->MinBytes));
+        }
+        else if (Available > Self->Target) {
+            Self->Target = (ULONG)min((ULONG64)Self->Target * 2, Self->MinBytes);
+        }
+    }
+
+    // Bytes left behind keep their deadline; the next ones start a new one
+    if (Empty && Self->Deadline != 0) {
+        Self->Deadline = 0;
+        return TRUE;
+    }
+    return FALSE;
+}
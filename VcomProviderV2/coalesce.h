@@ -0,0 +1,67 @@
+/*++
+
+Module Name:
+
+    coalesce.h
+
+Abstract:
+
+    GET_OUTGOING coalescing (IOCTL_VCOM_SET_COALESCING): when buffered bytes
+    are enough, or old enough, to complete a GET_OUTGOING, and how the
+    adaptive byte target follows the traffic. Times are timer wheel ticks;
+    the queue keeps the timer and calls these under the ToUser read lock.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _COALESCE_STATE {
+        ULONG           MinBytes;       // 0 or 1: coalescing off
+        ULONG           Target;         // == MinBytes unless adaptive
+        ULONG64         DelayTicks;
+        BOOLEAN         Adaptive;
+        ULONG64         Deadline;       // 0: none yet
+    } COALESCE_STATE, * PCOALESCE_STATE;
+
+    // Validates and applies IOCTL_VCOM_SET_COALESCING settings, DelayTicks
+    // being MaxDelayMs in ticks. Any deadline is dropped.
+    NTSTATUS
+        CoalesceSet(
+            _Inout_ PCOALESCE_STATE   Self,
+            _In_  PVCOM_COALESCE      Settings,
+            _In_  ULONG64             DelayTicks
+        );
+
+    // Whether Available (non-zero) buffered bytes complete a GET_OUTGOING at
+    // Now. Forced is a full ring or a blocked write, which always do. The
+    // first call that holds data back stamps the deadline and sets *Arm, for
+    // the caller to arm its timer for Self->Deadline.
+    BOOLEAN
+        CoalesceReady(
+            _Inout_ PCOALESCE_STATE   Self,
+            _In_  size_t              Available,
+            _In_  BOOLEAN             Forced,
+            _In_  ULONG64             Now,
+            _Out_ PBOOLEAN            Arm
+        );
+
+    // After a GET_OUTGOING took data from Available buffered bytes, Empty
+    // being whether the ring is now empty. In adaptive mode a completion
+    // forced by the deadline drops the target to what built up in that time,
+    // and a burst that overshot it doubles it, up to MinBytes. TRUE if the
+    // deadline was dropped, for the caller to cancel its timer.
+    BOOLEAN
+        CoalesceDrained(
+            _Inout_ PCOALESCE_STATE   Self,
+            _In_  size_t              Available,
+            _In_  BOOLEAN             Empty,
+            _In_  ULONG64             Now
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,9 +1,5 @@
 #pragma once
-#ifdef _KERNEL_MODE
-#include <ntddk.h>
-#else
-#include <windows.h>
-#endif
+#include "platform.h"
 #include <Ntstrsafe.h>
 #include <wdf.h>
 
@@ -12,7 +8,30 @@
 #include "driver.h"
 #include "device.h"
 #include "ringbuffer.h"
+#include "ringpolicy.h"
+#include "segbuffer.h"
+#include "sharedring.h"
+#include "batchframe.h"
+#include "recordframe.h"
+#include "marklog.h"
+#include "pendxfer.h"
+#include "waitmask.h"
+#include "coalesce.h"
+#include "timerwheel.h"
+#include "timeoutengine.h"
+#include "pacing.h"
+#include "dataformat.h"
+#include "charscan.h"
+#include "swflow.h"
+#include "lineflow.h"
+#include "counterpage.h"
+#include "portcounters.h"
+#include "latencyhist.h"
+#include "tracecore.h"
+#include "tracering.h"
+#include "portslots.h"
 #include "queue.h"
+#include "porttable.h"
 
 
 
@@ -20,13 +39,44 @@
 // Tracing and Assert
 //
 
-#define Trace(level, _fmt_, ...)                    \
-    DbgPrintEx(DPFLTR_DEFAULT_ID, level,            \
-                _fmt_ "\n", __VA_ARGS__)
-
 #define TRACE_LEVEL_ERROR   DPFLTR_ERROR_LEVEL
+#define TRACE_LEVEL_WARNING DPFLTR_WARNING_LEVEL
 #define TRACE_LEVEL_INFO    DPFLTR_INFO_LEVEL
 
+// Levels above these are compiled out. Text goes to the debugger and is
+// meant for rare events; TracePoint records an event ID and two arguments
+// in the binary trace ring (tracering.h) and is cheap enough for every
+// request. The level tests fold away at compile time (hence C4127).
+#ifndef VCOM_TRACE_LEVEL
+#if DBG
+#define VCOM_TRACE_LEVEL        TRACE_LEVEL_INFO
+#else
+#define VCOM_TRACE_LEVEL        TRACE_LEVEL_WARNING
+#endif
+#endif
+
+#ifndef VCOM_TRACE_EVENT_LEVEL
+#define VCOM_TRACE_EVENT_LEVEL  TRACE_LEVEL_INFO
+#endif
+
+#define Trace(level, _fmt_, ...)                    \
+    do {                                            \
+        __pragma(warning(suppress: 4127))           \
+        if ((level) <= VCOM_TRACE_LEVEL) {          \
+            DbgPrintEx(DPFLTR_DEFAULT_ID, level,    \
+                _fmt_ "\n", __VA_ARGS__);           \
+        }                                           \
+    } while (0)
+
+#define TracePoint(level, _id_, _port_, _arg0_, _arg1_)                 \
+    do {                                                                \
+        __pragma(warning(suppress: 4127))                               \
+        if ((level) <= VCOM_TRACE_EVENT_LEVEL) {                        \
+            TraceRingWrite((USHORT)(level), (USHORT)(_id_), (_port_),   \
+                (ULONG64)(_arg0_), (ULONG64)(_arg1_));                  \
+        }                                                               \
+    } while (0)
+
 #ifndef ASSERT
 #define ASSERT(exp) {                               \
     if (!(exp)) {                                   \
@@ -0,0 +1,163 @@
+/*++
+
+Module Name:
+
+    counterpage.c
+
+Abstract:
+
+    Named, read-only performance counter page per port
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include <ntifs.h>      // SeExports and the ACL routines
+#include "common.h"
+
+#define COUNTER_PAGE_NAME_FORMAT    L"\\BaseNamedObjects\\VcomCounters%u"
+
+static
+NTSTATUS
+CounterPageBuildSecurity(
+    _Out_ PSECURITY_DESCRIPTOR Descriptor,
+    _Out_writes_bytes_(AclSize) PACL Acl,
+    _In_  ULONG               AclSize
+)
+{
+    NTSTATUS status;
+
+    // Anyone may map the page for reading; only the driver writes it
+    status = RtlCreateSecurityDescriptor(Descriptor, SECURITY_DESCRIPTOR_REVISION);
+    if (NT_SUCCESS(status)) {
+        status = RtlCreateAcl(Acl, AclSize, ACL_REVISION);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlAddAccessAllowedAce(Acl, ACL_REVISION,
+            SECTION_MAP_READ | SECTION_QUERY, SeExports->SeWorldSid);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlAddAccessAllowedAce(Acl, ACL_REVISION,
+            SECTION_ALL_ACCESS, SeExports->SeLocalSystemSid);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlSetDaclSecurityDescriptor(Descriptor, TRUE, Acl, FALSE);
+    }
+    return status;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+CounterPageCreate(
+    _Out_ PCOUNTER_PAGE       Self,
+    _In_  ULONG               PortId
+)
+{
+    NTSTATUS status;
+    WCHAR nameBuffer[64];
+    UNICODE_STRING name;
+    SECURITY_DESCRIPTOR descriptor;
+    ULONG aclBuffer[32];
+    OBJECT_ATTRIBUTES attributes;
+    LARGE_INTEGER size;
+    PVOID section;
+    SIZE_T viewSize = 0;
+    PMDL mdl;
+
+    RtlZeroMemory(Self, sizeof(*Self));
+
+    status = RtlStringCbPrintfW(nameBuffer, sizeof(nameBuffer), COUNTER_PAGE_NAME_FORMAT, PortId);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    RtlInitUnicodeString(&name, nameBuffer);
+
+    status = CounterPageBuildSecurity(&descriptor, (PACL)aclBuffer, sizeof(aclBuffer));
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    InitializeObjectAttributes(&attributes, &name,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, &descriptor);
+    size.QuadPart = PAGE_SIZE;
+
+    // A leftover section of the same name would be someone else's; fail
+    // rather than publish into it
+    status = ZwCreateSection(&Self->Section, SECTION_ALL_ACCESS, &attributes, &size,
+        PAGE_READWRITE, SEC_COMMIT, NULL);
+    if (!NT_SUCCESS(status)) {
+        Self->Section = NULL;
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(Self->Section, SECTION_MAP_READ | SECTION_MAP_WRITE,
+        NULL, KernelMode, &section, NULL);
+    if (NT_SUCCESS(status)) {
+        // The view holds its own reference on the section
+        status = MmMapViewInSystemSpace(section, &Self->View, &viewSize);
+        ObDereferenceObject(section);
+    }
+    if (!NT_SUCCESS(status)) {
+        Self->View = NULL;
+        goto _exit;
+    }
+
+    // The view is pageable. Lock it so the hot paths can write the counters
+    // at DISPATCH_LEVEL.
+    mdl = IoAllocateMdl(Self->View, PAGE_SIZE, FALSE, FALSE, NULL);
+    if (mdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto _exit;
+    }
+
+    __try {
+        MmProbeAndLockPages(mdl, KernelMode, IoWriteAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+    if (!NT_SUCCESS(status)) {
+        IoFreeMdl(mdl);
+        goto _exit;
+    }
+    Self->Mdl = mdl;
+
+    Self->Counters = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (Self->Counters == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto _exit;
+    }
+
+    PortCountersInitialize(Self->Counters, PortId);
+    return STATUS_SUCCESS;
+
+_exit:
+    CounterPageDestroy(Self);
+    return status;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CounterPageDestroy(
+    _Inout_ PCOUNTER_PAGE     Self
+)
+{
+    Self->Counters = NULL;
+
+    if (Self->Mdl) {
+        // Also releases the nonpaged mapping of the page
+        MmUnlockPages(Self->Mdl);
+        IoFreeMdl(Self->Mdl);
+        Self->Mdl = NULL;
+    }
+    if (Self->View) {
+        MmUnmapViewInSystemSpace(Self->View);
+        Self->View = NULL;
+    }
+    if (Self->Section) {
+        ZwClose(Self->Section);
+        Self->Section = NULL;
+    }
+}
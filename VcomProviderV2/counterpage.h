@@ -0,0 +1,58 @@
+/*++
+
+Module Name:
+
+    counterpage.h
+
+Abstract:
+
+    Per-port performance counter page. The counters live in a one-page
+    named section that monitoring tools map read-only by name (see
+    VCOM_PORT_COUNTERS in public.h). The driver keeps the page locked and
+    mapped in system space, so it can be written from any IRQL up to
+    DISPATCH_LEVEL.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    C_ASSERT(sizeof(VCOM_PORT_COUNTERS) <= PAGE_SIZE);
+
+    typedef struct _COUNTER_PAGE
+    {
+        // Kernel handle keeping the section and its name alive
+        HANDLE Section;
+
+        // System-space view of the section and the MDL locking it
+        PVOID View;
+        PMDL Mdl;
+
+        // Nonpaged mapping of the locked page; NULL unless created
+        PVCOM_PORT_COUNTERS Counters;
+
+    } COUNTER_PAGE, * PCOUNTER_PAGE;
+
+    // Creates the page for PortId, zeroed apart from its header. On failure
+    // Self is left empty and may still be passed to CounterPageDestroy.
+    _IRQL_requires_(PASSIVE_LEVEL)
+        NTSTATUS
+        CounterPageCreate(
+            _Out_ PCOUNTER_PAGE       Self,
+            _In_  ULONG               PortId
+        );
+
+    // Tears the page down. Views that monitoring tools still hold stay
+    // valid but stop changing.
+    _IRQL_requires_(PASSIVE_LEVEL)
+        VOID
+        CounterPageDestroy(
+            _Inout_ PCOUNTER_PAGE     Self
+        );
+
+#ifdef __cplusplus
+}
+#endif
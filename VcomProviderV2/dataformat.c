@@ -0,0 +1,373 @@
+/*++
+
+Module Name:
+
+    dataformat.c
+
+Abstract:
+
+    Word-length masking and parity kernels
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "dataformat.h"
+
+// x64 kernel code may use SSE2 freely; AVX needs its state saved first.
+// Elsewhere only the scalar kernels are built. A host build on x64 builds
+// them all.
+#if defined(_M_AMD64) || (defined(VCOM_HOST_BUILD) && defined(__x86_64__))
+#include <immintrin.h>
+#define DATA_FORMAT_SIMD
+#endif
+
+#ifdef DATA_FORMAT_SIMD
+static BOOLEAN DataFormatAvx2 = FALSE;
+#endif
+
+VOID
+DataFormatInitialize(
+    VOID
+)
+{
+#ifdef DATA_FORMAT_SIMD
+    // The OS has to be saving the YMM registers as well
+    DataFormatAvx2 = ExIsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE) &&
+        (RtlGetEnabledExtendedFeatures(XSTATE_MASK_AVX) & XSTATE_MASK_AVX) != 0;
+#endif
+}
+
+VOID
+DataFormatConfigure(
+    _Out_ PDATA_FORMAT        Self,
+    _In_  UCHAR               ValidDataMask,
+    _In_  ULONG               LineControl,
+    _In_  BOOLEAN             Parity,
+    _In_  BOOLEAN             Replace,
+    _In_  UCHAR               ErrorChar
+)
+{
+    ULONG parity = LineControl & SERIAL_PARITY_MASK;
+
+    Self->Mask = ValidDataMask;
+    Self->Shift = (UCHAR)(5 + (LineControl & SERIAL_DATA_MASK));
+    Self->Parity = Parity && Self->Shift < 8 && parity != SERIAL_NONE_PARITY;
+    Self->ParityUse = (parity == SERIAL_EVEN_PARITY || parity == SERIAL_ODD_PARITY) ? 1 : 0;
+    Self->ParityXor = (parity == SERIAL_ODD_PARITY || parity == SERIAL_MARK_PARITY) ? 1 : 0;
+    Self->Replace = Self->Parity && Replace;
+    Self->ErrorChar = ErrorChar;
+}
+
+//
+// Scalar kernels; they also finish the tails the vector kernels leave
+//
+
+static __forceinline
+UCHAR
+DataFormatParityBit(
+    _In_  const DATA_FORMAT*  Self,
+    _In_  UCHAR               Data
+)
+{
+    Data ^= Data >> 4;
+    Data ^= Data >> 2;
+    Data ^= Data >> 1;
+    return (UCHAR)((Data & Self->ParityUse) ^ Self->ParityXor);
+}
+
+static
+VOID
+DataFormatEncodeScalar(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length
+)
+{
+    size_t i;
+    UCHAR data;
+
+    for (i = 0; i < Length; i++) {
+        data = Buffer[i] & Self->Mask;
+        if (Self->Parity) {
+            data |= (UCHAR)(DataFormatParityBit(Self, data) << Self->Shift);
+        }
+        Buffer[i] = data;
+    }
+}
+
+static
+size_t
+DataFormatDecodeScalar(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length
+)
+{
+    size_t i;
+    size_t failed = 0;
+    UCHAR data;
+
+    for (i = 0; i < Length; i++) {
+        data = Buffer[i] & Self->Mask;
+        if (Self->Parity && ((Buffer[i] >> Self->Shift) & 1) != DataFormatParityBit(Self, data)) {
+            failed++;
+            if (Self->Replace) {
+                data = Self->ErrorChar;
+            }
+        }
+        Buffer[i] = data;
+    }
+    return failed;
+}
+
+#ifdef DATA_FORMAT_SIMD
+
+static __forceinline
+ULONG
+DataFormatCountBits(
+    _In_  ULONG               Bits
+)
+{
+    ULONG count = 0;
+
+    // Parity errors are rare, so this seldom loops
+    while (Bits != 0) {
+        Bits &= Bits - 1;
+        count++;
+    }
+    return count;
+}
+
+//
+// SSE2 kernels, 16 bytes at a time. There are no byte shifts, so the parity
+// fold shifts 16-bit lanes: that pulls the neighbouring byte's bits into the
+// top of each byte, but after the three folds bit 0 only depends on the
+// byte's own bits, and only bit 0 is kept. Shifting the 0/1 parity bytes up
+// by less than 8 keeps them within their byte the same way.
+//
+
+static __forceinline
+__m128i
+DataFormatParity128(
+    _In_  __m128i             Data,
+    _In_  __m128i             Use,
+    _In_  __m128i             Flip
+)
+{
+    Data = _mm_xor_si128(Data, _mm_srli_epi16(Data, 4));
+    Data = _mm_xor_si128(Data, _mm_srli_epi16(Data, 2));
+    Data = _mm_xor_si128(Data, _mm_srli_epi16(Data, 1));
+    return _mm_xor_si128(_mm_and_si128(Data, Use), Flip);
+}
+
+static
+size_t
+DataFormatEncodeSse2(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length
+)
+{
+    __m128i mask = _mm_set1_epi8((char)Self->Mask);
+    __m128i use = _mm_set1_epi8((char)Self->ParityUse);
+    __m128i flip = _mm_set1_epi8((char)Self->ParityXor);
+    __m128i shift = _mm_cvtsi32_si128(Self->Shift);
+    __m128i data;
+    size_t i;
+
+    for (i = 0; i + sizeof(__m128i) <= Length; i += sizeof(__m128i)) {
+        data = _mm_and_si128(_mm_loadu_si128((const __m128i*)(Buffer + i)), mask);
+        if (Self->Parity) {
+            data = _mm_or_si128(data, _mm_sll_epi16(DataFormatParity128(data, use, flip), shift));
+        }
+        _mm_storeu_si128((__m128i*)(Buffer + i), data);
+    }
+    return i;
+}
+
+static
+size_t
+DataFormatDecodeSse2(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length,
+    _Out_ size_t*             Failed
+)
+{
+    __m128i mask = _mm_set1_epi8((char)Self->Mask);
+    __m128i use = _mm_set1_epi8((char)Self->ParityUse);
+    __m128i flip = _mm_set1_epi8((char)Self->ParityXor);
+    __m128i shift = _mm_cvtsi32_si128(Self->Shift);
+    __m128i one = _mm_set1_epi8(1);
+    __m128i errorChar = _mm_set1_epi8((char)Self->ErrorChar);
+    __m128i raw;
+    __m128i data;
+    __m128i bad;
+    ULONG bits;
+    size_t i;
+
+    *Failed = 0;
+    for (i = 0; i + sizeof(__m128i) <= Length; i += sizeof(__m128i)) {
+        raw = _mm_loadu_si128((const __m128i*)(Buffer + i));
+        data = _mm_and_si128(raw, mask);
+        if (Self->Parity) {
+            // 0xFF where the received parity bit differs from the expected one
+            bad = _mm_xor_si128(DataFormatParity128(data, use, flip), _mm_srl_epi16(raw, shift));
+            bad = _mm_cmpeq_epi8(_mm_and_si128(bad, one), one);
+            bits = (ULONG)_mm_movemask_epi8(bad);
+            if (bits != 0) {
+                *Failed += DataFormatCountBits(bits);
+                if (Self->Replace) {
+                    data = _mm_or_si128(_mm_and_si128(bad, errorChar), _mm_andnot_si128(bad, data));
+                }
+            }
+        }
+        _mm_storeu_si128((__m128i*)(Buffer + i), data);
+    }
+    return i;
+}
+
+//
+// AVX2 kernels, 32 bytes at a time, the same way. The caller has saved the
+// AVX state.
+//
+
+static __forceinline DECLSPEC_TARGET_AVX2
+__m256i
+DataFormatParity256(
+    _In_  __m256i             Data,
+    _In_  __m256i             Use,
+    _In_  __m256i             Flip
+)
+{
+    Data = _mm256_xor_si256(Data, _mm256_srli_epi16(Data, 4));
+    Data = _mm256_xor_si256(Data, _mm256_srli_epi16(Data, 2));
+    Data = _mm256_xor_si256(Data, _mm256_srli_epi16(Data, 1));
+    return _mm256_xor_si256(_mm256_and_si256(Data, Use), Flip);
+}
+
+static DECLSPEC_TARGET_AVX2
+size_t
+DataFormatEncodeAvx2(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length
+)
+{
+    __m256i mask = _mm256_set1_epi8((char)Self->Mask);
+    __m256i use = _mm256_set1_epi8((char)Self->ParityUse);
+    __m256i flip = _mm256_set1_epi8((char)Self->ParityXor);
+    __m128i shift = _mm_cvtsi32_si128(Self->Shift);
+    __m256i data;
+    size_t i;
+
+    for (i = 0; i + sizeof(__m256i) <= Length; i += sizeof(__m256i)) {
+        data = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(Buffer + i)), mask);
+        if (Self->Parity) {
+            data = _mm256_or_si256(data, _mm256_sll_epi16(DataFormatParity256(data, use, flip), shift));
+        }
+        _mm256_storeu_si256((__m256i*)(Buffer + i), data);
+    }
+
+    // No penalty for the SSE code that follows
+    _mm256_zeroupper();
+    return i;
+}
+
+static DECLSPEC_TARGET_AVX2
+size_t
+DataFormatDecodeAvx2(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length,
+    _Out_ size_t*             Failed
+)
+{
+    __m256i mask = _mm256_set1_epi8((char)Self->Mask);
+    __m256i use = _mm256_set1_epi8((char)Self->ParityUse);
+    __m256i flip = _mm256_set1_epi8((char)Self->ParityXor);
+    __m128i shift = _mm_cvtsi32_si128(Self->Shift);
+    __m256i one = _mm256_set1_epi8(1);
+    __m256i errorChar = _mm256_set1_epi8((char)Self->ErrorChar);
+    __m256i raw;
+    __m256i data;
+    __m256i bad;
+    ULONG bits;
+    size_t i;
+
+    *Failed = 0;
+    for (i = 0; i + sizeof(__m256i) <= Length; i += sizeof(__m256i)) {
+        raw = _mm256_loadu_si256((const __m256i*)(Buffer + i));
+        data = _mm256_and_si256(raw, mask);
+        if (Self->Parity) {
+            bad = _mm256_xor_si256(DataFormatParity256(data, use, flip), _mm256_srl_epi16(raw, shift));
+            bad = _mm256_cmpeq_epi8(_mm256_and_si256(bad, one), one);
+            bits = (ULONG)_mm256_movemask_epi8(bad);
+            if (bits != 0) {
+                *Failed += DataFormatCountBits(bits);
+                if (Self->Replace) {
+                    data = _mm256_blendv_epi8(data, errorChar, bad);
+                }
+            }
+        }
+        _mm256_storeu_si256((__m256i*)(Buffer + i), data);
+    }
+
+    _mm256_zeroupper();
+    return i;
+}
+
+#endif // DATA_FORMAT_SIMD
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+DataFormatEncode(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length
+)
+{
+    size_t done = 0;
+#ifdef DATA_FORMAT_SIMD
+    XSTATE_SAVE xstate;
+
+    if (DataFormatAvx2 && Length >= DATA_FORMAT_AVX2_MIN &&
+        NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &xstate))) {
+        done = DataFormatEncodeAvx2(Self, Buffer, Length);
+        KeRestoreExtendedProcessorState(&xstate);
+    }
+    done += DataFormatEncodeSse2(Self, Buffer + done, Length - done);
+#endif
+    DataFormatEncodeScalar(Self, Buffer + done, Length - done);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+DataFormatDecode(
+    _In_  const DATA_FORMAT*  Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length
+)
+{
+    size_t done = 0;
+    size_t failed = 0;
+#ifdef DATA_FORMAT_SIMD
+    XSTATE_SAVE xstate;
+    size_t vectorFailed;
+
+    if (DataFormatAvx2 && Length >= DATA_FORMAT_AVX2_MIN &&
+        NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &xstate))) {
+        done = DataFormatDecodeAvx2(Self, Buffer, Length, &vectorFailed);
+        KeRestoreExtendedProcessorState(&xstate);
+        failed += vectorFailed;
+    }
+    done += DataFormatDecodeSse2(Self, Buffer + done, Length - done, &vectorFailed);
+    failed += vectorFailed;
+#endif
+    return failed + DataFormatDecodeScalar(Self, Buffer + done, Length - done);
+}
@@ -0,0 +1,101 @@
+/*++
+
+Module Name:
+
+    dataformat.h
+
+Abstract:
+
+    Character formatting of the data path. Bytes going out are masked to
+    the port's word length and may carry a generated parity bit just above
+    the data bits; bytes coming in may have that bit checked, and are then
+    masked. Words of 8 bits have no room for a parity bit, so only the mask
+    (a no-op) applies to them.
+
+    The kernels are vectorized with SSE2, and with AVX2 for long spans on
+    processors that have it, with a scalar fallback elsewhere. They take no
+    locks and keep no state beyond the DATA_FORMAT passed in.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Shortest span worth saving the AVX state for
+#define DATA_FORMAT_AVX2_MIN    512
+
+    typedef struct _DATA_FORMAT
+    {
+        // Data bits of a word (ValidDataMask)
+        UCHAR Mask;
+
+        // Word length; the parity bit, if carried, is 1 << Shift
+        UCHAR Shift;
+
+        // Carry a parity bit: generate it going out, check it coming in
+        BOOLEAN Parity;
+
+        // The parity bit is (parity of the data bits & ParityUse) ^ ParityXor:
+        // 1/0 for even, 1/1 odd, 0/1 mark and 0/0 space
+        UCHAR ParityUse;
+        UCHAR ParityXor;
+
+        // Coming in: bytes that fail the check become ErrorChar
+        BOOLEAN Replace;
+        UCHAR ErrorChar;
+
+    } DATA_FORMAT, * PDATA_FORMAT;
+
+    // Picks the kernels for the processor; call once before any port exists
+    VOID
+        DataFormatInitialize(
+            VOID
+        );
+
+    // Sets Self from ValidDataMask and LineControl (SERIAL_*_DATA and
+    // SERIAL_*_PARITY). Parity is only carried when asked for and the word
+    // is shorter than 8 bits; Replace only applies with it.
+    VOID
+        DataFormatConfigure(
+            _Out_ PDATA_FORMAT        Self,
+            _In_  UCHAR               ValidDataMask,
+            _In_  ULONG               LineControl,
+            _In_  BOOLEAN             Parity,
+            _In_  BOOLEAN             Replace,
+            _In_  UCHAR               ErrorChar
+        );
+
+    // TRUE if the format leaves every byte as it is
+    __forceinline BOOLEAN DataFormatIsPassThrough(
+        _In_  const DATA_FORMAT*  Self
+    )
+    {
+        return Self->Mask == 0xFF && !Self->Parity;
+    }
+
+    // Masks Buffer in place and, with Parity, sets each byte's parity bit
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        DataFormatEncode(
+            _In_  const DATA_FORMAT*  Self,
+            _Inout_updates_(Length) PUCHAR Buffer,
+            _In_  size_t              Length
+        );
+
+    // With Parity, checks each byte's parity bit; then masks Buffer in place,
+    // replacing the bytes that failed if Replace is set. Returns how many
+    // failed.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        DataFormatDecode(
+            _In_  const DATA_FORMAT*  Self,
+            _Inout_updates_(Length) PUCHAR Buffer,
+            _In_  size_t              Length
+        );
+
+#ifdef __cplusplus
+}
+#endif
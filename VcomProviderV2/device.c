@@ -11,7 +11,11 @@ DeviceCreate(
 
 	NTSTATUS status;
 	WDF_OBJECT_ATTRIBUTES deviceAttributes;
+	WDF_OBJECT_ATTRIBUTES requestAttributes;
+	WDF_OBJECT_ATTRIBUTES fileAttributes;
+	WDF_OBJECT_ATTRIBUTES lockAttributes;
 	WDF_FILEOBJECT_CONFIG fileCfg;
+	WDF_IO_QUEUE_CONFIG queueConfig;
 	WDFDEVICE device;
 	PDEVICE_CONTEXT pDeviceContext;
 	WDF_DEVICE_PNP_CAPABILITIES pnpCaps;
@@ -25,11 +29,20 @@ DeviceCreate(
 		VcomEvtFileClose,
 		VcomEvtFileCleanup);
 
-	WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileCfg, WDF_NO_OBJECT_ATTRIBUTES);
+	// Each handle remembers the port it was opened on
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, FILE_OBJECT_CONTEXT);
+	WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileCfg, &fileAttributes);
 
 	WdfDeviceInitSetDeviceType(DeviceInit, FILE_DEVICE_SERIAL_PORT);
 	WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoBuffered);
 
+	// IOCTL_VCOM_MAP_RINGS has to run in the calling process
+	WdfDeviceInitSetIoInCallerContextCallback(DeviceInit, VcomEvtIoInCallerContext);
+
+	// Writes that pend keep their progress in the request context
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, REQUEST_CONTEXT);
+	WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+
 	status = WdfDeviceCreate(
 		&DeviceInit,
 		&deviceAttributes,
@@ -42,20 +55,24 @@ DeviceCreate(
 
 	pDeviceContext = GetDeviceContext(device);
 	pDeviceContext->Device = device;
-	pDeviceContext->Started = FALSE;
+	RtlZeroMemory(pDeviceContext->Ports, sizeof(pDeviceContext->Ports));
 
-	pDeviceContext->ComPortIsOpen = FALSE;
-	pDeviceContext->ComPortFileObject = NULL;
-	pDeviceContext->ControlFileObject = NULL; 
+	WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+	lockAttributes.ParentObject = device;
+	status = WdfWaitLockCreate(&lockAttributes, &pDeviceContext->PortLock);
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("WdfWaitLockCreate failed with status 0x%08X\n", status));
+		return status;
+	}
 
-	// Initialize standard serial port state
-	pDeviceContext->BaudRate = 9600;
-	pDeviceContext->ModemControlRegister = 0;
-	pDeviceContext->FifoControlRegister = 0;
-	pDeviceContext->LineControlRegister = (SERIAL_8_DATA | SERIAL_1_STOP | SERIAL_NONE_PARITY);
-	pDeviceContext->ValidDataMask = 0xFF;
-	RtlZeroMemory(&pDeviceContext->Timeouts, sizeof(pDeviceContext->Timeouts));
-	pDeviceContext->FlowControl = 0;
+	// The default queue only routes: every port has its own I/O queue
+	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig, WdfIoQueueDispatchParallel);
+	queueConfig.EvtIoDefault = VcomEvtIoDispatch;
+	status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDeviceContext->DispatchQueue);
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("WdfIoQueueCreate (dispatch) failed with status 0x%08X\n", status));
+		return status;
+	}
 
 	WDF_DEVICE_PNP_CAPABILITIES_INIT(&pnpCaps);
 	pnpCaps.SurpriseRemovalOK = WdfTrue;
@@ -75,8 +92,14 @@ NTSTATUS DeviceConfigure(
 	WDFKEY registryKey = NULL;
 	LPGUID guid;
 	errno_t errorNo;
+	VCOM_PORT_CREATE config = { 0 };
+	PPORT_CONTEXT portContext;
 
 	DECLARE_CONST_UNICODE_STRING(portName, REG_VALUENAME_PORTNAME);
+	DECLARE_CONST_UNICODE_STRING(rxQueueSizeName, REG_VALUENAME_RXQUEUESIZE);
+	DECLARE_CONST_UNICODE_STRING(txQueueSizeName, REG_VALUENAME_TXQUEUESIZE);
+	DECLARE_CONST_UNICODE_STRING(maxQueueSizeName, REG_VALUENAME_MAXQUEUESIZE);
+	DECLARE_CONST_UNICODE_STRING(segmentedName, REG_VALUENAME_SEGMENTED);
 	DECLARE_UNICODE_STRING_SIZE(comPort, 10);
 	DECLARE_UNICODE_STRING_SIZE(symbolicLinkName, SYMBOLIC_LINK_NAME_LENGTH);
 
@@ -113,6 +136,24 @@ NTSTATUS DeviceConfigure(
 		comPort.Length = (USHORT)(wcslen(comPort.Buffer) * sizeof(WCHAR));
 		status = STATUS_SUCCESS; // continue
 	}
+
+	// Optional per-device ring sizes; QueueCreate rounds and clamps them
+	if (!NT_SUCCESS(WdfRegistryQueryULong(registryKey, &rxQueueSizeName, &config.InQueueSize))) {
+		config.InQueueSize = DATA_BUFFER_SIZE;
+	}
+	if (!NT_SUCCESS(WdfRegistryQueryULong(registryKey, &txQueueSizeName, &config.OutQueueSize))) {
+		config.OutQueueSize = DATA_BUFFER_SIZE;
+	}
+	if (!NT_SUCCESS(WdfRegistryQueryULong(registryKey, &maxQueueSizeName, &config.MaxQueueSize))) {
+		config.MaxQueueSize = DEFAULT_MAX_QUEUE_SIZE;
+	}
+	if (!NT_SUCCESS(WdfRegistryQueryULong(registryKey, &segmentedName, &config.Flags))) {
+		config.Flags = 0;
+	}
+	config.Flags = config.Flags ? VCOM_PORT_SEGMENTED : 0;
+	KdPrint(("Ring sizes: in %u, out %u, max %u%s\n", config.InQueueSize,
+		config.OutQueueSize, config.MaxQueueSize,
+		(config.Flags & VCOM_PORT_SEGMENTED) ? " (segmented)" : ""));
 	symbolicLinkName.Length = (USHORT)((wcslen(comPort.Buffer) * sizeof(wchar_t))
 		+ sizeof(SYMBOLIC_LINK_NAME_PREFIX) - sizeof(UNICODE_NULL));
 
@@ -167,9 +208,11 @@ NTSTATUS DeviceConfigure(
 	if (NT_SUCCESS(status)) {
 		DeviceContext->bCreatedLegacyHardwareKey = TRUE;
 	}
-	status = QueueCreate(DeviceContext);
+	RtlStringCchCopyNW(config.PortName, VCOM_PORT_NAME_LENGTH,
+		comPort.Buffer, comPort.Length / sizeof(WCHAR));
+	status = DevicePortCreate(DeviceContext, &config, FALSE, &portContext);
 	if(!NT_SUCCESS(status)) {
-		KdPrint(("Failed to create I/O queue with status 0x%08X\n", status));
+		KdPrint(("Failed to create port %ws with status 0x%08X\n", config.PortName, status));
 		goto _exit;
 	}
 
@@ -266,6 +309,32 @@ _exit:
 	return status;
 }
 
+VOID DeviceRemoveLegacyHardwareKey(
+	_In_ PWSTR PdoName,
+	_In_ WDFDEVICE Device
+	)
+{
+	NTSTATUS status;
+	WDFKEY key = NULL;
+	UNICODE_STRING PdoString = { 0 };
+
+	DECLARE_CONST_UNICODE_STRING(deviceSubkey, SERIAL_DEVICE_MAP);
+
+	RtlInitUnicodeString(&PdoString, PdoName);
+	status = WdfDeviceOpenDevicemapKey(
+		Device,
+		&deviceSubkey,
+		KEY_SET_VALUE,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&key);
+
+	if (NT_SUCCESS(status))
+	{
+		WdfRegistryRemoveValue(key, &PdoString); // Best effort, ignore status
+		WdfRegistryClose(key);
+	}
+}
+
 VOID
 VcomEvtDeviceCleanup(
 	_In_ WDFOBJECT DeviceAsObject
@@ -273,28 +342,281 @@ VcomEvtDeviceCleanup(
 {
 	WDFDEVICE device = (WDFDEVICE)DeviceAsObject;
 	PDEVICE_CONTEXT deviceContext = GetDeviceContext(device);
-	NTSTATUS status;
-	WDFKEY key = NULL;
-	UNICODE_STRING PdoString = { 0 };
-
-	DECLARE_CONST_UNICODE_STRING(deviceSubkey, SERIAL_DEVICE_MAP);
 
+	// Dynamic ports are children of the device and clean up after themselves
 	if (deviceContext->bCreatedLegacyHardwareKey == TRUE && deviceContext->PdoName)
 	{
-		RtlInitUnicodeString(&PdoString, deviceContext->PdoName);
-		status = WdfDeviceOpenDevicemapKey(
-			device,
-			&deviceSubkey,
-			KEY_SET_VALUE,
-			WDF_NO_OBJECT_ATTRIBUTES,
-			&key);
-
-		if (NT_SUCCESS(status))
-		{
-			WdfRegistryRemoveValue(key, &PdoString); // Best effort, ignore status
-			WdfRegistryClose(key);
+		DeviceRemoveLegacyHardwareKey(deviceContext->PdoName, device);
+	}
+}
+
+static
+BOOLEAN
+DevicePortNameIs(
+	_In_ PPORT_CONTEXT PortContext,
+	_In_ PCUNICODE_STRING Name
+)
+{
+	UNICODE_STRING portName;
+
+	RtlInitUnicodeString(&portName, PortContext->PortName);
+	return RtlEqualUnicodeString(&portName, Name, TRUE);
+}
+
+// Called with PortLock held. Only opening and managing ports look up by
+// name; I/O reaches its port through the file object.
+static
+PPORT_CONTEXT
+DeviceFindPort(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ PCUNICODE_STRING Name
+)
+{
+	ULONG i;
+
+	for (i = 0; i < DEVICE_MAX_PORTS; i++) {
+		if (DeviceContext->Ports[i] != NULL && DevicePortNameIs(DeviceContext->Ports[i], Name)) {
+			return DeviceContext->Ports[i];
+		}
+	}
+	return NULL;
+}
+
+NTSTATUS DevicePortCreate(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ PVCOM_PORT_CREATE Config,
+	_In_ BOOLEAN Dynamic,
+	_Out_ PPORT_CONTEXT* PortContext
+)
+{
+	NTSTATUS status;
+	WDF_OBJECT_ATTRIBUTES portAttributes;
+	WDFOBJECT portObject;
+	PPORT_CONTEXT port;
+	UNICODE_STRING name;
+	UNICODE_STRING linkName;
+	UNICODE_STRING linkTarget;
+	size_t nameLength;
+	ULONG slot;
+
+	*PortContext = NULL;
+
+	// A port name is a single component of the names VcomEvtFileCreate parses
+	if (!NT_SUCCESS(RtlStringCchLengthW(Config->PortName, VCOM_PORT_NAME_LENGTH, &nameLength)) ||
+		nameLength == 0 || wcschr(Config->PortName, L'\\') != NULL) {
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+	RtlInitUnicodeString(&name, Config->PortName);
+
+	WdfWaitLockAcquire(DeviceContext->PortLock, NULL);
+
+	if (DeviceFindPort(DeviceContext, &name) != NULL) {
+		status = STATUS_OBJECT_NAME_COLLISION;
+		goto _exit;
+	}
+
+	// Ports[0] is kept for the installed port
+	slot = 0;
+	if (Dynamic) {
+		slot = 1;
+		while (slot < DEVICE_MAX_PORTS && DeviceContext->Ports[slot] != NULL) {
+			slot++;
+		}
+	}
+	if (slot == DEVICE_MAX_PORTS || DeviceContext->Ports[slot] != NULL) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto _exit;
+	}
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&portAttributes, PORT_CONTEXT);
+	portAttributes.ParentObject = DeviceContext->Device;
+	portAttributes.EvtCleanupCallback = VcomEvtPortCleanup;
+	status = WdfObjectCreate(&portAttributes, &portObject);
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("WdfObjectCreate (port) failed with status 0x%08X\n", status));
+		goto _exit;
+	}
+
+	port = GetPortContext(portObject);
+	port->Object = portObject;
+	port->Device = DeviceContext->Device;
+	port->Dynamic = Dynamic;
+	RtlStringCchCopyW(port->PortName, VCOM_PORT_NAME_LENGTH, Config->PortName);
+	port->Started = FALSE;
+
+	port->ComPortIsOpen = FALSE;
+	port->ComPortFileObject = NULL;
+	port->ControlFileObject = NULL;
+	port->ControlProcess = NULL;
+	port->OpenHandles = 0;
+
+	// Initialize standard serial port state
+	port->BaudRate = 9600;
+	port->ModemControlRegister = 0;
+	port->FifoControlRegister = 0;
+	port->LineControlRegister = (SERIAL_8_DATA | SERIAL_1_STOP | SERIAL_NONE_PARITY);
+	port->ValidDataMask = 0xFF;
+	RtlZeroMemory(&port->Timeouts, sizeof(port->Timeouts));
+	port->FlowControl = 0;
+	port->InQueueSize = Config->InQueueSize ? Config->InQueueSize : DATA_BUFFER_SIZE;
+	port->OutQueueSize = Config->OutQueueSize ? Config->OutQueueSize : DATA_BUFFER_SIZE;
+	port->MaxQueueSize = Config->MaxQueueSize ? Config->MaxQueueSize : DEFAULT_MAX_QUEUE_SIZE;
+	port->SegmentedBuffers = (Config->Flags & VCOM_PORT_SEGMENTED) ? 1 : 0;
+
+	// serial.sys defaults: DTR and RTS on, XON/XOFF off with the usual
+	// characters, XON at half the receive buffer and XOFF an eighth from full
+	RtlZeroMemory(&port->HandFlow, sizeof(port->HandFlow));
+	port->HandFlow.ControlHandShake = SERIAL_DTR_CONTROL;
+	port->HandFlow.FlowReplace = SERIAL_RTS_CONTROL;
+	port->HandFlow.XonLimit = (LONG)(port->InQueueSize / 2);
+	port->HandFlow.XoffLimit = (LONG)(port->InQueueSize / 8);
+	RtlZeroMemory(&port->Chars, sizeof(port->Chars));
+	port->Chars.XonChar = SERIAL_DEF_XON;
+	port->Chars.XoffChar = SERIAL_DEF_XOFF;
+
+	status = QueueCreate(port);
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("Failed to create I/O queue with status 0x%08X\n", status));
+		goto _failed;
+	}
+
+	if (Dynamic) {
+		// IOCTL_VCOM_DESTROY_PORT names ports by PortId
+		if (GetQueueContext(port->IoQueue)->Port.PortId == VCOM_INVALID_PORT_ID) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			goto _failed;
+		}
+
+		status = RtlStringCchPrintfW(port->LinkName, SYMBOLIC_LINK_NAME_LENGTH,
+			L"%ws%ws", SYMBOLIC_LINK_NAME_PREFIX, port->PortName);
+		if (NT_SUCCESS(status)) {
+			status = RtlStringCchPrintfW(port->LinkTarget, PORT_LINK_TARGET_LENGTH,
+				L"%ws\\%ws", DeviceContext->PdoName, port->PortName);
+		}
+		if (!NT_SUCCESS(status)) {
+			goto _failed;
+		}
+
+		// Opening the link reaches our stack with the port name as FileName
+		RtlInitUnicodeString(&linkName, port->LinkName);
+		RtlInitUnicodeString(&linkTarget, port->LinkTarget);
+		status = IoCreateSymbolicLink(&linkName, &linkTarget);
+		if (!NT_SUCCESS(status)) {
+			KdPrint(("Failed to create symbolic link %wZ with status 0x%08X\n", &linkName, status));
+			goto _failed;
 		}
+		port->bCreatedSymbolicLink = TRUE;
+
+		if (NT_SUCCESS(DeviceWriteLegacyHardwareKey(port->LinkTarget, port->PortName, port->Device))) {
+			port->bCreatedLegacyHardwareKey = TRUE;
+		}
+	}
+
+	DeviceContext->Ports[slot] = port;
+	*PortContext = port;
+	goto _exit;
+
+_failed:
+	if (port->IoQueue != NULL) {
+		QueueDestroy(GetQueueContext(port->IoQueue));
 	}
+	WdfObjectDelete(portObject);
+
+_exit:
+	WdfWaitLockRelease(DeviceContext->PortLock);
+	return status;
+}
+
+NTSTATUS DevicePortDestroy(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONG PortId
+)
+{
+	NTSTATUS status = STATUS_NOT_FOUND;
+	PPORT_CONTEXT port = NULL;
+	ULONG slot;
+
+	WdfWaitLockAcquire(DeviceContext->PortLock, NULL);
+
+	// The installed port only goes with its device
+	for (slot = 1; slot < DEVICE_MAX_PORTS; slot++) {
+		if (DeviceContext->Ports[slot] != NULL &&
+			GetQueueContext(DeviceContext->Ports[slot]->IoQueue)->Port.PortId == PortId) {
+			port = DeviceContext->Ports[slot];
+			break;
+		}
+	}
+
+	if (port != NULL && port->OpenHandles != 0) {
+		status = STATUS_DEVICE_BUSY;
+		port = NULL;
+	}
+	else if (port != NULL) {
+		DeviceContext->Ports[slot] = NULL;
+		status = STATUS_SUCCESS;
+	}
+
+	WdfWaitLockRelease(DeviceContext->PortLock);
+
+	if (port == NULL) {
+		return status;
+	}
+
+	// Unlisted and without handles, the port has no requests and cannot get
+	// any; QueueDestroy cuts off its timers and other ports' IOCTLs
+	QueueDestroy(GetQueueContext(port->IoQueue));
+	WdfObjectDelete(port->Object);
+	return STATUS_SUCCESS;
+}
+
+VOID
+VcomEvtPortCleanup(
+	_In_ WDFOBJECT PortObject
+)
+{
+	PPORT_CONTEXT port = GetPortContext(PortObject);
+	UNICODE_STRING linkName;
+
+	if (port->bCreatedLegacyHardwareKey) {
+		DeviceRemoveLegacyHardwareKey(port->LinkTarget, port->Device);
+	}
+
+	if (port->bCreatedSymbolicLink) {
+		RtlInitUnicodeString(&linkName, port->LinkName);
+		(VOID)IoDeleteSymbolicLink(&linkName);
+	}
+}
+
+// Splits "\First" or "\First\Rest" into its two components
+static
+VOID
+DeviceSplitFileName(
+	_In_ PCUNICODE_STRING FileName,
+	_Out_ PUNICODE_STRING First,
+	_Out_ PUNICODE_STRING Rest
+)
+{
+	USHORT i;
+
+	*First = *FileName;
+	RtlZeroMemory(Rest, sizeof(*Rest));
+
+	if (First->Length >= sizeof(WCHAR) && First->Buffer[0] == L'\\') {
+		First->Buffer++;
+		First->Length -= sizeof(WCHAR);
+	}
+
+	for (i = 0; i < First->Length / sizeof(WCHAR); i++) {
+		if (First->Buffer[i] == L'\\') {
+			Rest->Buffer = &First->Buffer[i + 1];
+			Rest->Length = First->Length - (i + 1) * sizeof(WCHAR);
+			First->Length = i * sizeof(WCHAR);
+			break;
+		}
+	}
+
+	First->MaximumLength = First->Length;
+	Rest->MaximumLength = Rest->Length;
 }
 
 VOID
@@ -305,16 +627,54 @@ VcomEvtFileCreate(
 )
 {
 	PDEVICE_CONTEXT devCtx = GetDeviceContext(Device);
+	PFILE_OBJECT_CONTEXT fileCtx = GetFileObjectContext(FileObject);
 	PUNICODE_STRING fileName = WdfFileObjectGetFileName(FileObject);
+	PPORT_CONTEXT port = NULL;
+	BOOLEAN isComPort = TRUE;
+	UNICODE_STRING first;
+	UNICODE_STRING rest;
 	NTSTATUS status = STATUS_SUCCESS;
 
 	KdPrint(("VCOM: FileCreate request received.\n"));
-	KdPrint(("VCOM: FileName: %ws\n", fileName->Buffer));
+	KdPrint(("VCOM: FileName: %wZ\n", fileName));
+
+	WdfWaitLockAcquire(devCtx->PortLock, NULL);
+
+	// The FileName picks the port and the side:
+	//   ""                  installed port, COM side (its symbolic link)
+	//   "\<installed name>" installed port, control side (the control
+	//                       interface, whose reference string is the name)
+	//   "\<ref>\<name>"     port <name>, control side (the control interface
+	//                       with the name appended)
+	//   "\<name>"           dynamic port <name>, COM side (its symbolic link)
+	if (fileName == NULL || fileName->Length == 0) {
+		port = devCtx->Ports[0];
+	}
+	else {
+		DeviceSplitFileName(fileName, &first, &rest);
+		if (rest.Length != 0) {
+			port = DeviceFindPort(devCtx, &rest);
+			isComPort = FALSE;
+		}
+		else if (devCtx->Ports[0] != NULL && DevicePortNameIs(devCtx->Ports[0], &first)) {
+			port = devCtx->Ports[0];
+			isComPort = FALSE;
+		}
+		else {
+			port = DeviceFindPort(devCtx, &first);
+		}
+	}
+
+	if (port == NULL)
+	{
+		KdPrint(("VCOM: No such port. Denying access.\n"));
+		status = STATUS_OBJECT_NAME_NOT_FOUND;
+	}
 	// Case 1 Control App
-	if (fileName != NULL && fileName->Length > 0)
+	else if (!isComPort)
 	{
-		KdPrint(("VCOM: FileCreate request for Control Interface\n"));
-		if (devCtx->ControlFileObject != NULL) // Check if a handle is already stored
+		KdPrint(("VCOM: FileCreate request for Control Interface of %ws\n", port->PortName));
+		if (port->ControlFileObject != NULL) // Check if a handle is already stored
 		{
 			KdPrint(("VCOM: Control Interface is already open. Denying access.\n"));
 			status = STATUS_ACCESS_DENIED;
@@ -322,14 +682,15 @@ VcomEvtFileCreate(
 		else
 		{
 			KdPrint(("VCOM: Granting access to Control Interface.\n"));
-			devCtx->ControlFileObject = FileObject; // Store the handle
+			port->ControlFileObject = FileObject; // Store the handle
+			port->ControlProcess = IoGetRequestorProcess(WdfRequestWdmGetIrp(Request));
 		}
 	}
 	// Case 1: Serial App
 	else
 	{
-		KdPrint(("VCOM: FileCreate request for COM Port\n"));
-		if (devCtx->ComPortFileObject != NULL) // Check if a handle is already stored
+		KdPrint(("VCOM: FileCreate request for COM Port %ws\n", port->PortName));
+		if (port->ComPortFileObject != NULL) // Check if a handle is already stored
 		{
 			KdPrint(("VCOM: COM Port is already open. Denying access.\n"));
 			status = STATUS_ACCESS_DENIED;
@@ -337,11 +698,20 @@ VcomEvtFileCreate(
 		else
 		{
 			KdPrint(("VCOM: Granting access to COM Port.\n"));
-			devCtx->ComPortFileObject = FileObject; // Store the handle
-			devCtx->ComPortIsOpen = TRUE;           // Set the flag
+			port->ComPortFileObject = FileObject; // Store the handle
+			port->ComPortIsOpen = TRUE;           // Set the flag
 		}
 	}
 
+	if (NT_SUCCESS(status)) {
+		fileCtx->Port = port;
+		fileCtx->IsComPortHandle = isComPort;
+		fileCtx->Process = IoGetRequestorProcess(WdfRequestWdmGetIrp(Request));
+		port->OpenHandles++;
+	}
+
+	WdfWaitLockRelease(devCtx->PortLock);
+
 	WdfRequestComplete(Request, status);
 }
 
@@ -352,87 +722,278 @@ VcomEvtFileCleanup(
 {
 	WDFDEVICE device = WdfFileObjectGetDevice(FileObject);
 	PDEVICE_CONTEXT devCtx = GetDeviceContext(device);
+	PPORT_CONTEXT port = GetFileObjectContext(FileObject)->Port;
+	BOOLEAN isControl = FALSE;
+	BOOLEAN isComPort = FALSE;
+	BOOLEAN lastHandle;
 
-	if (devCtx->IoQueue == NULL) {
+	if (port == NULL || port->IoQueue == NULL) {
 		return;
 	}
 
-	PQUEUE_CONTEXT queueCtx = GetQueueContext(devCtx->IoQueue);
+	PQUEUE_CONTEXT queueCtx = GetQueueContext(port->IoQueue);
 
 	// Identify which handle is being closed and clear its reference
-	if (devCtx->ControlFileObject == FileObject)
+	WdfWaitLockAcquire(devCtx->PortLock, NULL);
+	if (port->ControlFileObject == FileObject)
+	{
+		port->ControlFileObject = NULL;
+		port->ControlProcess = NULL;
+		isControl = TRUE;
+	}
+	else if (port->ComPortFileObject == FileObject)
+	{
+		port->ComPortFileObject = NULL;
+		isComPort = TRUE;
+	}
+	lastHandle = (port->ControlFileObject == NULL && port->ComPortFileObject == NULL);
+	WdfWaitLockRelease(devCtx->PortLock);
+
+	if (isControl)
 	{
+		VCOM_COALESCE coalesceOff = { 0 };
+
 		KdPrint(("VCOM: Control App handle is closing.\n"));
-		devCtx->ControlFileObject = NULL;
+		QueueUnmapSharedRings(queueCtx);
+		// A paired port's pended pushes are its peer's writes, not the service's
+		if (queueCtx->Port.PeerId == VCOM_INVALID_PORT_ID) {
+			QueueCancelPendingWrites(queueCtx, FALSE);
+		}
+		queueCtx->PushMode = VCOM_PUSH_MODE_PARTIAL;
+		(VOID)QueueSetCoalescing(queueCtx, &coalesceOff);
 	}
-	else if (devCtx->ComPortFileObject == FileObject)
+	else if (isComPort)
 	{
 		KdPrint(("VCOM: COM Port handle is closing.\n"));
-		devCtx->ComPortFileObject = NULL;
+		QueueResetWaitMask(queueCtx);
+		QueueCancelPendingReads(queueCtx);
+		QueueCancelPendingWrites(queueCtx, TRUE);
 	}
 
-	if (devCtx->ControlFileObject == NULL && devCtx->ComPortFileObject == NULL)
+	if (lastHandle)
 	{
 		KdPrint(("VCOM: Last handle closed. Performing full session cleanup.\n"));
 
-		devCtx->Started = FALSE;
-		devCtx->ComPortIsOpen = FALSE;
+		port->Started = FALSE;
+		port->ComPortIsOpen = FALSE;
 
 		WdfIoQueuePurgeSynchronously(queueCtx->ReadQueue);
 		WdfIoQueuePurgeSynchronously(queueCtx->OutgoingQueue);
+		WdfIoQueuePurgeSynchronously(queueCtx->ReadyWaitQueue);
+		WdfIoQueuePurgeSynchronously(queueCtx->CreditQueue);
+		WdfIoQueuePurgeSynchronously(queueCtx->WaitMaskQueue);
+		QueueCancelPendingReads(queueCtx);
+		QueueCancelPendingWrites(queueCtx, TRUE);
+		QueueCancelPendingWrites(queueCtx, FALSE);
+
+		QueueResetRings(queueCtx);
+		(VOID)QueueSetOutgoingMode(queueCtx, VCOM_OUTGOING_MODE_STREAM);
+	}
+}
 
-		WdfSpinLockAcquire(queueCtx->RingBufferFromNetworkLock);
-		RingBufferReset(&queueCtx->RingBufferFromNetwork);
-		WdfSpinLockRelease(queueCtx->RingBufferFromNetworkLock);
+BOOLEAN
+DeviceIsControlHandle(
+	_In_ PPORT_CONTEXT Port,
+	_In_opt_ WDFFILEOBJECT FileObject
+)
+{
+	return FileObject != NULL && FileObject == Port->ControlFileObject;
+}
+
+BOOLEAN
+DeviceControlsPort(
+	_In_opt_ WDFFILEOBJECT FileObject,
+	_In_ PPORT_CONTEXT Port
+)
+{
+	PFILE_OBJECT_CONTEXT fileCtx;
 
-		WdfSpinLockAcquire(queueCtx->RingBufferToUserModeLock);
-		RingBufferReset(&queueCtx->RingBufferToUserMode);
-		WdfSpinLockRelease(queueCtx->RingBufferToUserModeLock);
+	if (FileObject == NULL) {
+		return FALSE;
+	}
+	if (FileObject == Port->ControlFileObject) {
+		return TRUE;
+	}
+
+	fileCtx = GetFileObjectContext(FileObject);
+	return fileCtx->Port != NULL && !fileCtx->IsComPortHandle &&
+		fileCtx->Port->ControlFileObject == FileObject &&
+		fileCtx->Process != NULL && Port->ControlProcess == fileCtx->Process;
+}
+
+// IOCTL_VCOM_CREATE_PORT and IOCTL_VCOM_DESTROY_PORT
+static
+NTSTATUS
+DeviceProcessPortRequest(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request,
+	_In_ ULONG IoControlCode,
+	_Out_ size_t* Information
+)
+{
+	NTSTATUS status;
+	PVOID inBuffer;
+	PULONG portId;
+	VCOM_PORT_CREATE config;
+	PPORT_CONTEXT portContext;
+
+	*Information = 0;
+
+	status = WdfRequestRetrieveInputBuffer(Request,
+		(IoControlCode == IOCTL_VCOM_CREATE_PORT) ? sizeof(VCOM_PORT_CREATE) : sizeof(ULONG),
+		&inBuffer, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (IoControlCode == IOCTL_VCOM_DESTROY_PORT) {
+		return DevicePortDestroy(DeviceContext, *(PULONG)inBuffer);
+	}
+
+	// Input and output share the system buffer
+	config = *(PVCOM_PORT_CREATE)inBuffer;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), (PVOID*)&portId, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = DevicePortCreate(DeviceContext, &config, TRUE, &portContext);
+	if (NT_SUCCESS(status)) {
+		*portId = GetQueueContext(portContext->IoQueue)->Port.PortId;
+		*Information = sizeof(ULONG);
+	}
+	return status;
+}
+
+VOID
+VcomEvtIoInCallerContext(
+	_In_ WDFDEVICE  Device,
+	_In_ WDFREQUEST Request
+)
+{
+	PDEVICE_CONTEXT devCtx = GetDeviceContext(Device);
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	PPORT_CONTEXT port = (fileObject != NULL) ? GetFileObjectContext(fileObject)->Port : NULL;
+	WDF_REQUEST_PARAMETERS params;
+	NTSTATUS status;
+	size_t information;
+
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(Request, &params);
+
+	if (params.Type == WdfRequestTypeDeviceControl &&
+		params.Parameters.DeviceIoControl.IoControlCode == IOCTL_VCOM_MAP_RINGS)
+	{
+		// The user-mode mapping is created in whatever process we are running
+		// in, so it is only done here, for the control handle.
+		if (port == NULL || port->IoQueue == NULL || fileObject != port->ControlFileObject) {
+			WdfRequestComplete(Request, STATUS_ACCESS_DENIED);
+			return;
+		}
+		status = QueueMapSharedRings(GetQueueContext(port->IoQueue), Request);
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	if (params.Type == WdfRequestTypeDeviceControl &&
+		(params.Parameters.DeviceIoControl.IoControlCode == IOCTL_VCOM_CREATE_PORT ||
+		 params.Parameters.DeviceIoControl.IoControlCode == IOCTL_VCOM_DESTROY_PORT))
+	{
+		// Creating and destroying ports needs PASSIVE_LEVEL, which only the
+		// caller's context guarantees. Control handles only.
+		if (port == NULL || fileObject != port->ControlFileObject) {
+			WdfRequestComplete(Request, STATUS_ACCESS_DENIED);
+			return;
+		}
+		status = DeviceProcessPortRequest(devCtx, Request,
+			params.Parameters.DeviceIoControl.IoControlCode, &information);
+		WdfRequestCompleteWithInformation(Request, status, information);
+		return;
+	}
+
+	status = WdfDeviceEnqueueRequest(Device, Request);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+	}
+}
+
+VOID
+VcomEvtIoDispatch(
+	_In_ WDFQUEUE   Queue,
+	_In_ WDFREQUEST Request
+)
+{
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	PPORT_CONTEXT port = (fileObject != NULL) ? GetFileObjectContext(fileObject)->Port : NULL;
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(Queue);
+
+	// The handle was bound to its port when it was opened, so this is all
+	// the lookup a request needs
+	if (port == NULL) {
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+		return;
+	}
+
+	status = WdfRequestForwardToIoQueue(Request, port->IoQueue);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
 	}
 }
 
 VOID
 VcomEvtFileClose(_In_ WDFFILEOBJECT FileObject)
 {
-	UNREFERENCED_PARAMETER(FileObject);
+	PDEVICE_CONTEXT devCtx = GetDeviceContext(WdfFileObjectGetDevice(FileObject));
+	PPORT_CONTEXT port = GetFileObjectContext(FileObject)->Port;
+
+	// Every request on the handle is done by now; a dynamic port can be
+	// destroyed once it has no handles left
+	if (port != NULL) {
+		WdfWaitLockAcquire(devCtx->PortLock, NULL);
+		port->OpenHandles--;
+		WdfWaitLockRelease(devCtx->PortLock);
 	}
+}
 
 
 
 
-ULONG GetBaudRate(_In_ PDEVICE_CONTEXT Ctx) {
+ULONG GetBaudRate(_In_ PPORT_CONTEXT Ctx) {
 	return (ULONG)ReadNoFence((LONG*)&Ctx->BaudRate);
 }
 
 VOID SetBaudRate(
-	_Inout_ PDEVICE_CONTEXT Ctx,
+	_Inout_ PPORT_CONTEXT Ctx,
 	_In_ ULONG BaudRate
 ) {
 	InterlockedExchange((LONG*)&Ctx->BaudRate, (LONG)BaudRate);
 }
 
 PULONG GetModemControlRegister(
-	_Inout_ PDEVICE_CONTEXT Ctx
+	_Inout_ PPORT_CONTEXT Ctx
 ) { return &Ctx->ModemControlRegister; }
 
 PULONG GetFifoControlRegisterPtr(
-	_Inout_ PDEVICE_CONTEXT Ctx) {
+	_Inout_ PPORT_CONTEXT Ctx) {
 	return &Ctx->FifoControlRegister;
 }
 
 PULONG GetLineControlRegisterPtr(
-	_Inout_ PDEVICE_CONTEXT Ctx) {
+	_Inout_ PPORT_CONTEXT Ctx) {
 	return &Ctx->LineControlRegister;
 }
 
 VOID   SetValidDataMask(
-	_Inout_ PDEVICE_CONTEXT Ctx,
+	_Inout_ PPORT_CONTEXT Ctx,
 	_In_ UCHAR Mask) {
 	Ctx->ValidDataMask = Mask;
 }
 
 VOID   SetTimeouts(
-	_Inout_ PDEVICE_CONTEXT Ctx,
+	_Inout_ PPORT_CONTEXT Ctx,
 	_In_ SERIAL_TIMEOUTS To) {
 	Ctx->Timeouts = To;
 }
@@ -1,8 +1,14 @@
 #pragma once
 
 
+typedef struct _PORT_CONTEXT* PPORT_CONTEXT;
+
+// Set by VcomEvtFileCreate; every request on the handle goes to Port.
+// Process is the one that opened the handle, compared but not referenced.
 typedef struct _FILE_OBJECT_CONTEXT {
+	PPORT_CONTEXT Port;
 	BOOLEAN IsComPortHandle;
+	PEPROCESS Process;
 } FILE_OBJECT_CONTEXT, * PFILE_OBJECT_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_OBJECT_CONTEXT, GetFileObjectContext);
@@ -15,13 +21,35 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_OBJECT_CONTEXT, GetFileObjectContext);
 #define REG_PATH_DEVICEMAP          L"HARDWARE\\DEVICEMAP"
 #define SERIAL_DEVICE_MAP           L"SERIALCOMM"
 #define REG_VALUENAME_PORTNAME      L"PortName"
+#define REG_VALUENAME_RXQUEUESIZE   L"RxQueueSize"   // optional, bytes
+#define REG_VALUENAME_TXQUEUESIZE   L"TxQueueSize"   // optional, bytes
+#define REG_VALUENAME_MAXQUEUESIZE  L"MaxQueueSize"  // optional, elastic ceiling in bytes
+#define REG_VALUENAME_SEGMENTED     L"SegmentedBuffers" // optional, nonzero = segment chains
 #define REG_PATH_SERIALCOMM         REG_PATH_DEVICEMAP L"\\" SERIAL_DEVICE_MAP
 
-typedef struct _DEVICE_CONTEXT {
-	WDFDEVICE Device; 
-	
-	WDFQUEUE IoQueue; // To clean up the queue on device close
-	
+// Ports per device, the installed one (always Ports[0]) included
+#define DEVICE_MAX_PORTS            256
+
+// Dynamic ports link \DosDevices\Global\<PortName> to <PDO name>\<PortName>
+#define PORT_LINK_TARGET_LENGTH     128
+
+// One virtual serial port. The installed port is created with its device;
+// more are created and destroyed with IOCTL_VCOM_CREATE_PORT and
+// IOCTL_VCOM_DESTROY_PORT. The object is parented to the device, and the
+// port's QUEUE_CONTEXT holds a reference on it until the queue is gone.
+typedef struct _PORT_CONTEXT {
+	WDFOBJECT Object;
+	WDFDEVICE Device;
+
+	WDFQUEUE IoQueue; // The port's I/O queue, carrying its QUEUE_CONTEXT
+
+	WCHAR PortName[VCOM_PORT_NAME_LENGTH];
+	BOOLEAN Dynamic;
+	BOOLEAN bCreatedSymbolicLink;      // dynamic ports only
+	BOOLEAN bCreatedLegacyHardwareKey; // dynamic ports only; the device keeps the installed one's
+	WCHAR LinkName[SYMBOLIC_LINK_NAME_LENGTH];
+	WCHAR LinkTarget[PORT_LINK_TARGET_LENGTH]; // also its SERIALCOMM value name
+
 	volatile BOOLEAN Started;      // gate I/O
 	ULONG           BaudRate;
 	ULONG           ModemControlRegister;
@@ -30,15 +58,43 @@ typedef struct _DEVICE_CONTEXT {
 	UCHAR           ValidDataMask;
 	SERIAL_TIMEOUTS Timeouts;
 	UCHAR FlowControl;
+	SERIAL_HANDFLOW HandFlow;      // under the queue's FlowLock
+	SERIAL_CHARS    Chars;
+
+	// Initial ring sizes (bytes) used by QueueCreate
+	ULONG InQueueSize;   // RingBufferFromNetwork
+	ULONG OutQueueSize;  // RingBufferToUserMode
+	ULONG MaxQueueSize;  // elastic growth ceiling, per ring
+	ULONG SegmentedBuffers; // nonzero: pooled segment chains instead of rings
+
+	// Under the device's PortLock. DeviceControlsPort reads ControlFileObject
+	// and ControlProcess unlocked; a handle is cleared from them before it
+	// goes away, so a live handle never matches one that is gone.
+	WDFFILEOBJECT ComPortFileObject;
+	WDFFILEOBJECT ControlFileObject;  // Handle for our control client app
+	PEPROCESS ControlProcess;         // its opener, compared but not referenced
+	BOOLEAN ComPortIsOpen;
+	ULONG OpenHandles;  // file objects bound to the port, until they close
+
+} PORT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(PORT_CONTEXT, GetPortContext);
+
+typedef struct _DEVICE_CONTEXT {
+	WDFDEVICE Device; 
+	
+	WDFQUEUE DispatchQueue; // Default queue; hands each request to its port
+
+	// Ports by slot, Ports[0] being the installed port. Creating, destroying
+	// and opening ports look up by name under PortLock; I/O finds its port
+	// through the file object instead.
+	WDFWAITLOCK PortLock;
+	PPORT_CONTEXT Ports[DEVICE_MAX_PORTS];
 
 	// PDO /\ Reg Info
 	PWSTR PdoName;
 	BOOLEAN bCreatedLegacyHardwareKey;
 
-	WDFFILEOBJECT ComPortFileObject;
-	WDFFILEOBJECT ControlFileObject;  // Handle for our control client app
-	BOOLEAN ComPortIsOpen;
-
 } DEVICE_CONTEXT, * PDEVICE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, GetDeviceContext);
@@ -46,6 +102,9 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, GetDeviceContext);
 EVT_WDF_DEVICE_FILE_CREATE VcomEvtFileCreate;
 EVT_WDF_FILE_CLOSE         VcomEvtFileClose;
 EVT_WDF_FILE_CLEANUP       VcomEvtFileCleanup;
+EVT_WDF_IO_IN_CALLER_CONTEXT VcomEvtIoInCallerContext;
+EVT_WDF_IO_QUEUE_IO_DEFAULT  VcomEvtIoDispatch;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP VcomEvtPortCleanup;
 
 NTSTATUS 
 DeviceCreate(
@@ -61,6 +120,36 @@ DeviceConfigure(
 
 EVT_WDF_DEVICE_CONTEXT_CLEANUP  VcomEvtDeviceCleanup;
 
+// Creates a port from Config (see VCOM_PORT_CREATE). Dynamic ports get their
+// own symbolic link and SERIALCOMM entry; the installed port's are made by
+// DeviceConfigure.
+NTSTATUS DevicePortCreate(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ PVCOM_PORT_CREATE Config,
+	_In_ BOOLEAN Dynamic,
+	_Out_ PPORT_CONTEXT* PortContext
+);
+
+NTSTATUS DevicePortDestroy(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONG PortId
+);
+
+// TRUE if FileObject is Port's control handle
+BOOLEAN DeviceIsControlHandle(
+	_In_ PPORT_CONTEXT Port,
+	_In_opt_ WDFFILEOBJECT FileObject
+);
+
+// TRUE if FileObject may act on Port in the multi-port IOCTLs: it is Port's
+// control handle, or another control handle opened by the process that
+// holds Port's. A service that opens one control handle per port can drive
+// them all from any one of them; a COM-side handle never can.
+BOOLEAN DeviceControlsPort(
+	_In_opt_ WDFFILEOBJECT FileObject,
+	_In_ PPORT_CONTEXT Port
+);
+
 NTSTATUS DeviceGetPdoName(
 	_In_ PDEVICE_CONTEXT DeviceContext
 );
@@ -70,29 +159,33 @@ NTSTATUS DeviceWriteLegacyHardwareKey(
 	_In_ PWSTR ComPort,
 	_In_ WDFDEVICE Device);
 
+VOID DeviceRemoveLegacyHardwareKey(
+	_In_ PWSTR PdoName,
+	_In_ WDFDEVICE Device);
+
 ULONG GetBaudRate(
-	_In_ PDEVICE_CONTEXT Ctx
+	_In_ PPORT_CONTEXT Ctx
 );
 
 VOID SetBaudRate(
-	_Inout_ PDEVICE_CONTEXT Ctx,
+	_Inout_ PPORT_CONTEXT Ctx,
 	_In_ ULONG BaudRate
 );
 
 PULONG GetModemControlRegister(
-	_Inout_ PDEVICE_CONTEXT Ctx
+	_Inout_ PPORT_CONTEXT Ctx
 );
 
 PULONG GetFifoControlRegisterPtr(
-	_Inout_ PDEVICE_CONTEXT Ctx);
+	_Inout_ PPORT_CONTEXT Ctx);
 
 PULONG GetLineControlRegisterPtr(
-	_Inout_ PDEVICE_CONTEXT Ctx);
+	_Inout_ PPORT_CONTEXT Ctx);
 
 VOID   SetValidDataMask(
-	_Inout_ PDEVICE_CONTEXT Ctx, 
+	_Inout_ PPORT_CONTEXT Ctx, 
 	_In_ UCHAR Mask);
 
 VOID   SetTimeouts(
-	_Inout_ PDEVICE_CONTEXT Ctx, 
+	_Inout_ PPORT_CONTEXT Ctx, 
 	_In_ SERIAL_TIMEOUTS To);
@@ -9,24 +9,74 @@ NTSTATUS DriverEntry(
 {
 	NTSTATUS status;
 	WDF_DRIVER_CONFIG config;
+	WDF_OBJECT_ATTRIBUTES attributes;
+
+	// Without the trace ring events are just dropped
+	status = TraceRingInitialize();
+	if(!NT_SUCCESS(status)) {
+		KdPrint(("TraceRingInitialize failed with status 0x%08X\n", status));
+	}
+
+	// Segment pool shared by every port that uses segmented buffers
+	status = SegBufferPoolInitialize(QUEUE_GLOBAL_RING_BUDGET);
+	if(!NT_SUCCESS(status)) {
+		KdPrint(("SegBufferPoolInitialize failed with status 0x%08X\n", status));
+		TraceRingUninitialize();
+		return status;
+	}
+
+	// One timer wheel enforces serial timeouts for every port
+	status = TimeoutEngineInitialize();
+	if(!NT_SUCCESS(status)) {
+		KdPrint(("TimeoutEngineInitialize failed with status 0x%08X\n", status));
+		SegBufferPoolUninitialize();
+		TraceRingUninitialize();
+		return status;
+	}
+
+	// The data path's word-length and parity kernels, picked for this processor
+	DataFormatInitialize();
 
 	WDF_DRIVER_CONFIG_INIT(&config, VcomEvtDeviceAdd);
 
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.EvtCleanupCallback = VcomEvtDriverContextCleanup;
+
 	status = WdfDriverCreate(
 		DriverObject,
 		RegistryPath,
-		WDF_NO_OBJECT_ATTRIBUTES,
+		&attributes,
 		&config,
 		WDF_NO_HANDLE
 	);
 	if(!NT_SUCCESS(status)) {
 		KdPrint(("WdfDriverCreate failed with status 0x%08X\n", status));
+		TimeoutEngineUninitialize();
+		SegBufferPoolUninitialize();
+		TraceRingUninitialize();
+		return status;
+	}
+
+	status = PortTableInitialize();
+	if(!NT_SUCCESS(status)) {
+		KdPrint(("PortTableInitialize failed with status 0x%08X\n", status));
 		return status;
 	}
 	KdPrint(("DriverEntry completed successfully\n"));
 	return status;
 }
 
+VOID VcomEvtDriverContextCleanup(
+	_In_ WDFOBJECT DriverObject
+)
+{
+	UNREFERENCED_PARAMETER(DriverObject);
+
+	TimeoutEngineUninitialize();
+	SegBufferPoolUninitialize();
+	TraceRingUninitialize();
+}
+
 NTSTATUS VcomEvtDeviceAdd(
 	_In_ WDFDRIVER Driver,
 	_Inout_ PWDFDEVICE_INIT DeviceInit
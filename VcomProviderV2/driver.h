@@ -1,4 +1,5 @@
 #pragma once
 
 EVT_WDF_DRIVER_DEVICE_ADD VcomEvtDeviceAdd;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP VcomEvtDriverContextCleanup;
 
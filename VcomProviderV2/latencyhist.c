@@ -0,0 +1,43 @@
+/*++
+
+Module Name:
+
+    latencyhist.c
+
+Abstract:
+
+    Log-linear latency histograms
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "latencyhist.h"
+
+// The last bucket must be the one LatencyHistogramBucket maps the top of the
+// range to
+C_ASSERT(VCOM_LATENCY_BUCKETS ==
+    2 * VCOM_LATENCY_SUB_BUCKETS + (VCOM_LATENCY_RANGE_BITS - VCOM_LATENCY_SUB_BITS - 1) * VCOM_LATENCY_SUB_BUCKETS);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+LatencyHistogramSnapshot(
+    _Inout_ PLATENCY_HISTOGRAM Self,
+    _In_  BOOLEAN             Reset,
+    _Out_ PVCOM_LATENCY_HISTOGRAM Snapshot
+)
+{
+    ULONG i;
+    LONG64 count;
+
+    Snapshot->Samples = 0;
+    for (i = 0; i < VCOM_LATENCY_BUCKETS; i++) {
+        count = Reset ? InterlockedExchange64(&Self->Counts[i], 0) : ReadNoFence64(&Self->Counts[i]);
+        Snapshot->Counts[i] = (ULONG64)count;
+        Snapshot->Samples += (ULONG64)count;
+    }
+}
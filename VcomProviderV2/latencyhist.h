@@ -0,0 +1,75 @@
+/*++
+
+Module Name:
+
+    latencyhist.h
+
+Abstract:
+
+    Fixed-size log-linear latency histogram. Values below
+    2 * VCOM_LATENCY_SUB_BUCKETS get a bucket each; above that every power of
+    two is split into VCOM_LATENCY_SUB_BUCKETS equal buckets, so a bucket's
+    width is at most 1/VCOM_LATENCY_SUB_BUCKETS of its lower bound whatever
+    the magnitude. Values past the range land in the last bucket.
+
+    Recording is one relaxed interlocked increment and may run concurrently
+    with other recordings and with snapshots, at any IRQL.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _LATENCY_HISTOGRAM
+    {
+        volatile LONG64 Counts[VCOM_LATENCY_BUCKETS];
+
+    } LATENCY_HISTOGRAM, * PLATENCY_HISTOGRAM;
+
+    __forceinline ULONG LatencyHistogramBucket(
+        _In_  ULONG64             Value
+    )
+    {
+        ULONG msb;
+        ULONG shift;
+
+        if (Value < 2 * VCOM_LATENCY_SUB_BUCKETS) {
+            return (ULONG)Value;
+        }
+        if (Value >= (1ULL << VCOM_LATENCY_RANGE_BITS)) {
+            return VCOM_LATENCY_BUCKETS - 1;
+        }
+
+        // Value has msb + 1 significant bits; the ones just below the top
+        // bit pick the sub-bucket within its power of two
+        (VOID)_BitScanReverse64(&msb, Value);
+        shift = msb - VCOM_LATENCY_SUB_BITS;
+        return 2 * VCOM_LATENCY_SUB_BUCKETS + (shift - 1) * VCOM_LATENCY_SUB_BUCKETS +
+            (ULONG)((Value >> shift) & (VCOM_LATENCY_SUB_BUCKETS - 1));
+    }
+
+    __forceinline VOID LatencyHistogramRecord(
+        _Inout_ PLATENCY_HISTOGRAM Self,
+        _In_  ULONG64             Value
+    )
+    {
+        InterlockedIncrementNoFence64(&Self->Counts[LatencyHistogramBucket(Value)]);
+    }
+
+    // Copies the counts out. With Reset each bucket is swapped for zero, so a
+    // sample recorded meanwhile lands in either this snapshot or the next,
+    // never in neither.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        LatencyHistogramSnapshot(
+            _Inout_ PLATENCY_HISTOGRAM Self,
+            _In_  BOOLEAN             Reset,
+            _Out_ PVCOM_LATENCY_HISTOGRAM Snapshot
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,49 @@
+/*++
+
+Module Name:
+
+    lineflow.c
+
+Abstract:
+
+    Ring-driven flow-control lines
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "lineflow.h"
+
+VOID
+LineFlowConfigure(
+    _Out_ PLINE_FLOW          Self,
+    _In_  ULONG               OffLimit,
+    _In_  ULONG               OnLimit
+)
+{
+    Self->OffLimit = OffLimit;
+    Self->OnLimit = OnLimit;
+    Self->Off = FALSE;
+}
+
+BOOLEAN
+LineFlowUpdate(
+    _Inout_ PLINE_FLOW        Self,
+    _In_  size_t              Buffered,
+    _In_  size_t              Free
+)
+{
+    // With limits that overlap, off wins: the ring filling up matters more
+    if (!Self->Off && Free <= Self->OffLimit) {
+        Self->Off = TRUE;
+        return TRUE;
+    }
+    if (Self->Off && Buffered <= Self->OnLimit && Free > Self->OffLimit) {
+        Self->Off = FALSE;
+        return TRUE;
+    }
+    return FALSE;
+}
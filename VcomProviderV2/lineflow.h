@@ -0,0 +1,54 @@
+/*++
+
+Module Name:
+
+    lineflow.h
+
+Abstract:
+
+    Hardware flow-control lines driven from a ring's fill level. A line goes
+    off once OffLimit or fewer bytes of the ring are free, and comes back on
+    once OnLimit or fewer are buffered: the hysteresis serial.sys applies to
+    RTS and DTR handshaking with XoffLimit and XonLimit.
+
+    The state takes no locks and keeps everything in the LINE_FLOW passed
+    in, so it runs the same in a host build. The caller serializes all calls
+    on one LINE_FLOW.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _LINE_FLOW
+    {
+        ULONG   OffLimit;       // off once this many bytes or fewer are free
+        ULONG   OnLimit;        // on again once this many or fewer are buffered
+        BOOLEAN Off;
+
+    } LINE_FLOW, * PLINE_FLOW;
+
+    // Sets the limits and turns the line on; the next LineFlowUpdate puts
+    // it where the ring says
+    VOID
+        LineFlowConfigure(
+            _Out_ PLINE_FLOW          Self,
+            _In_  ULONG               OffLimit,
+            _In_  ULONG               OnLimit
+        );
+
+    // Moves the line for a ring that holds Buffered bytes and has Free more
+    // room. TRUE if it changed.
+    BOOLEAN
+        LineFlowUpdate(
+            _Inout_ PLINE_FLOW        Self,
+            _In_  size_t              Buffered,
+            _In_  size_t              Free
+        );
+
+#ifdef __cplusplus
+}
+#endif
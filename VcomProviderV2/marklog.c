@@ -0,0 +1,89 @@
+/*++
+
+Module Name:
+
+    marklog.c
+
+Abstract:
+
+    Byte-count timestamps alongside a ring
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "marklog.h"
+
+VOID
+DataMarkStamp(
+    _Inout_ PDATA_MARK_LOG    Log,
+    _In_  size_t              Count,
+    _In_  ULONG64             Timestamp
+)
+{
+    PDATA_MARK mark = NULL;
+
+    if (Count == 0) {
+        return;
+    }
+
+    Log->In += Count;
+    if (Log->Head != Log->Tail) {
+        mark = &Log->Marks[(Log->Tail - 1) & DATA_MARK_MASK];
+        if (mark->Timestamp != Timestamp && Log->Tail - Log->Head < DATA_MARKS) {
+            mark = NULL;
+        }
+    }
+    if (mark == NULL) {
+        mark = &Log->Marks[Log->Tail++ & DATA_MARK_MASK];
+        mark->Timestamp = Timestamp;
+    }
+    mark->End = Log->In;
+}
+
+BOOLEAN
+DataMarkRetire(
+    _Inout_ PDATA_MARK_LOG    Log,
+    _Out_ PULONG64            Timestamp
+)
+{
+    PDATA_MARK mark;
+
+    *Timestamp = 0;
+    if (Log->Head == Log->Tail) {
+        return FALSE;
+    }
+
+    mark = &Log->Marks[Log->Head & DATA_MARK_MASK];
+    if (mark->End > Log->Out) {
+        return FALSE;
+    }
+    *Timestamp = mark->Timestamp;
+    Log->Head++;
+    return TRUE;
+}
+
+ULONG64
+DataMarkOldest(
+    _In_  PDATA_MARK_LOG      Log
+)
+{
+    if (Log->Head == Log->Tail) {
+        return 0;
+    }
+    return Log->Marks[Log->Head & DATA_MARK_MASK].Timestamp;
+}
+
+VOID
+DataMarkReset(
+    _Out_ PDATA_MARK_LOG      Log
+)
+{
+    Log->Head = 0;
+    Log->Tail = 0;
+    Log->In = 0;
+    Log->Out = 0;
+}
@@ -0,0 +1,92 @@
+/*++
+
+Module Name:
+
+    marklog.h
+
+Abstract:
+
+    Data timing for one ring. Each write or push leaves a mark holding the
+    running count of bytes put in the ring after it and when it went in;
+    taking bytes out retires the marks whose bytes are all gone. Marks count
+    bytes rather than ring offsets, so they stay aligned across wraparound,
+    partial reads and elastic resizes. The queue keeps a log per ring under
+    a lock of its own (QUEUE_MARK_LOG).
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // When the bytes up to End (a running count of bytes put in a ring) went in
+    typedef struct _DATA_MARK {
+        ULONG64         End;
+        ULONG64         Timestamp;
+    } DATA_MARK, * PDATA_MARK;
+
+#define DATA_MARKS              64      // power of two
+#define DATA_MARK_MASK          (DATA_MARKS - 1)
+
+    // Marks[Head] through Marks[Tail - 1] cover the bytes in the ring,
+    // oldest first
+    typedef struct _DATA_MARK_LOG {
+        DATA_MARK       Marks[DATA_MARKS];
+        ULONG           Head;
+        ULONG           Tail;
+        ULONG64         In;             // bytes stamped since the last reset
+        ULONG64         Out;            // of those, bytes taken out
+    } DATA_MARK_LOG, * PDATA_MARK_LOG;
+
+    // Count bytes went in at Timestamp. Bytes with the newest mark's time
+    // (later pieces of a pended write) extend it. When the marks run out,
+    // new bytes are folded into the newest one, which keeps its older time,
+    // so ages and latencies err on the long side.
+    VOID
+        DataMarkStamp(
+            _Inout_ PDATA_MARK_LOG    Log,
+            _In_  size_t              Count,
+            _In_  ULONG64             Timestamp
+        );
+
+    // Count bytes were taken out; the marks they finish are retired with
+    // DataMarkRetire
+    __forceinline VOID DataMarkConsume(
+        _Inout_ PDATA_MARK_LOG    Log,
+        _In_  size_t              Count
+    )
+    {
+        Log->Out += Count;
+    }
+
+    // Retires the oldest mark if all its bytes are out, returning when they
+    // went in
+    BOOLEAN
+        DataMarkRetire(
+            _Inout_ PDATA_MARK_LOG    Log,
+            _Out_ PULONG64            Timestamp
+        );
+
+    // When the oldest byte still in the ring went in; 0 if there is none
+    ULONG64
+        DataMarkOldest(
+            _In_  PDATA_MARK_LOG      Log
+        );
+
+    __forceinline ULONG64 DataMarkUnread(
+        _In_  PDATA_MARK_LOG      Log
+    )
+    {
+        return Log->In - Log->Out;
+    }
+
+    VOID
+        DataMarkReset(
+            _Out_ PDATA_MARK_LOG      Log
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,95 @@
+/*++
+
+Module Name:
+
+    pacing.c
+
+Abstract:
+
+    Baud-rate token buckets
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "timerwheel.h"
+#include "pacing.h"
+
+VOID
+PacingBucketConfigure(
+    _Out_ PPACING_BUCKET      Self,
+    _In_  ULONG               BaudRate,
+    _In_  ULONG               LineControl,
+    _In_  ULONG64             Now
+)
+{
+    ULONG64 burst;
+
+    Self->Rate = 2 * (ULONG64)BaudRate;
+    Self->ByteCost = PacingFrameHalfBits(LineControl) * PACING_CLOCK_HZ;
+    Self->Last = Now;
+
+    // Rate is at most 2^33 and PACING_BURST_TIME well under 2^30
+    burst = Self->Rate * PACING_BURST_TIME;
+    Self->Capacity = max(burst, PACING_FIFO_BYTES * Self->ByteCost);
+    Self->Tokens = Self->Capacity;
+}
+
+size_t
+PacingBucketAvailable(
+    _Inout_ PPACING_BUCKET    Self,
+    _In_  ULONG64             Now,
+    _In_  size_t              Wanted
+)
+{
+    ULONG64 elapsed;
+    ULONG64 bytes;
+
+    if (Self->Rate == 0) {
+        return Wanted;
+    }
+
+    // A full bucket only needs Capacity / Rate to refill; capping elapsed
+    // there keeps the product in range however long the port sat idle
+    if (Now > Self->Last) {
+        elapsed = min(Now - Self->Last, Self->Capacity / Self->Rate + 1);
+        Self->Tokens = min(Self->Capacity, Self->Tokens + elapsed * Self->Rate);
+        Self->Last = Now;
+    }
+
+    bytes = Self->Tokens / Self->ByteCost;
+    return (size_t)min((ULONG64)Wanted, bytes);
+}
+
+VOID
+PacingBucketConsume(
+    _Inout_ PPACING_BUCKET    Self,
+    _In_  size_t              Bytes
+)
+{
+    ULONG64 cost;
+
+    if (Self->Rate == 0) {
+        return;
+    }
+
+    cost = (ULONG64)Bytes * Self->ByteCost;
+    Self->Tokens = (cost < Self->Tokens) ? Self->Tokens - cost : 0;
+}
+
+ULONG64
+PacingBucketDelay(
+    _In_  PPACING_BUCKET      Self
+)
+{
+    if (Self->Rate == 0 || Self->Tokens >= Self->ByteCost) {
+        return 0;
+    }
+
+    // Rounded up, so the byte is there by then
+    return (Self->ByteCost - Self->Tokens + Self->Rate - 1) / Self->Rate;
+}
@@ -0,0 +1,111 @@
+/*++
+
+Module Name:
+
+    pacing.h
+
+Abstract:
+
+    Baud-rate pacing. A token bucket per direction lets bytes through at the
+    rate a UART would move them at the port's baud rate and line control:
+    each character costs its whole frame, start bit, data bits, parity and
+    stop bits included. The bucket holds at most a FIFO's worth of
+    characters or PACING_BURST_TIME's worth, whichever is more, so that a
+    timer ticking at TIMER_WHEEL_TICK_MS can keep the line busy.
+
+    The bucket only deals in clock values passed in by the caller (100ns
+    units, as KeQueryInterruptTime) and takes no locks, so it can be driven
+    by a simulated clock. The caller serializes all calls on one bucket.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PACING_CLOCK_HZ         10000000ULL     // clock units per second
+#define PACING_FIFO_BYTES       16              // as a 16550's transmit FIFO
+#define PACING_BURST_TIME       (2ULL * TIMER_WHEEL_TICK_MS * (PACING_CLOCK_HZ / 1000))
+
+    // Tokens are half-bit times scaled by PACING_CLOCK_HZ, so refills and
+    // 1.5 stop bits are exact in integers: a second at Rate half-bits per
+    // second adds Rate * PACING_CLOCK_HZ.
+    typedef struct _PACING_BUCKET
+    {
+        ULONG64 Tokens;
+
+        // Clock value Tokens was last brought up to date at
+        ULONG64 Last;
+
+        // Half-bits per second, twice the baud rate; 0 lets everything through
+        ULONG64 Rate;
+
+        // Tokens one character frame costs
+        ULONG64 ByteCost;
+
+        // Most tokens the bucket holds
+        ULONG64 Capacity;
+
+    } PACING_BUCKET, * PPACING_BUCKET;
+
+    // Half-bit times one character takes on the line: a start bit, the data
+    // bits, the parity bit if any and the stop bits, from SERIAL_*_DATA,
+    // SERIAL_*_PARITY and SERIAL_*_STOP in LineControl
+    __forceinline ULONG PacingFrameHalfBits(
+        _In_  ULONG               LineControl
+    )
+    {
+        ULONG dataBits = 5 + (LineControl & SERIAL_DATA_MASK);
+        ULONG halfBits = 2 * (1 + dataBits);
+
+        if ((LineControl & SERIAL_PARITY_MASK) != SERIAL_NONE_PARITY) {
+            halfBits += 2;
+        }
+        if (LineControl & SERIAL_STOP_MASK) {
+            // 1.5 stop bits with 5 data bits, 2 otherwise
+            halfBits += (dataBits == 5) ? 3 : 4;
+        }
+        else {
+            halfBits += 2;
+        }
+        return halfBits;
+    }
+
+    // Sets the rate from BaudRate and LineControl, starting with a full
+    // bucket. A BaudRate of 0 turns pacing off.
+    VOID
+        PacingBucketConfigure(
+            _Out_ PPACING_BUCKET      Self,
+            _In_  ULONG               BaudRate,
+            _In_  ULONG               LineControl,
+            _In_  ULONG64             Now
+        );
+
+    // How many of Wanted bytes may go through at Now
+    size_t
+        PacingBucketAvailable(
+            _Inout_ PPACING_BUCKET    Self,
+            _In_  ULONG64             Now,
+            _In_  size_t              Wanted
+        );
+
+    // Takes Bytes that went through out of the bucket. Call after
+    // PacingBucketAvailable with the same Now, with at most what it allowed.
+    VOID
+        PacingBucketConsume(
+            _Inout_ PPACING_BUCKET    Self,
+            _In_  size_t              Bytes
+        );
+
+    // Clock units from the last PacingBucketAvailable until one more byte
+    // may go through; 0 if one may already
+    ULONG64
+        PacingBucketDelay(
+            _In_  PPACING_BUCKET      Self
+        );
+
+#ifdef __cplusplus
+}
+#endif
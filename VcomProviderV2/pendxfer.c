@@ -0,0 +1,246 @@
+/*++
+
+Module Name:
+
+    pendxfer.c
+
+Abstract:
+
+    Pended writes and pushes
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "pendxfer.h"
+
+VOID
+PendInitialize(
+    _Out_ PPEND_QUEUE         Self,
+    _In_  const PEND_QUEUE_OPS* Ops,
+    _In_  PVOID               Owner
+)
+{
+    Self->Ops = Ops;
+    Self->Owner = Owner;
+    Self->Current = NULL;
+}
+
+PEND_STEP
+PendStart(
+    _Inout_ PPEND_QUEUE       Self,
+    _In_  PVOID               Request,
+    _Out_ NTSTATUS*           Status,
+    _Out_ size_t*             Written
+)
+{
+    NTSTATUS status;
+
+    *Status = STATUS_PENDING;
+    *Written = 0;
+
+    // Keep byte order: nothing overtakes the requests already waiting
+    if (PendPending(Self) != 0) {
+        return PendStepQueue;
+    }
+
+    status = Self->Ops->Transfer(Self, Request, Written);
+    if (status == STATUS_BUFFER_OVERFLOW) {
+        // Only part of it fit; the rest goes in as the ring drains
+        status = Self->Ops->Hold(Self, Request);
+        if (NT_SUCCESS(status)) {
+            Self->Current = Request;
+            return PendStepWaiting;
+        }
+    }
+
+    *Status = status;
+    return PendStepDone;
+}
+
+PEND_STEP
+PendService(
+    _Inout_ PPEND_QUEUE       Self,
+    _Out_ PVOID*              Request,
+    _Out_ NTSTATUS*           Status,
+    _Out_ size_t*             Written
+)
+{
+    PVOID request = Self->Current;
+    NTSTATUS status;
+
+    *Request = NULL;
+    *Status = STATUS_PENDING;
+    *Written = 0;
+
+    if (request == NULL) {
+        if (!Self->Ops->Dequeue(Self, &request)) {
+            return PendStepIdle;
+        }
+
+        status = Self->Ops->Hold(Self, request);
+        if (!NT_SUCCESS(status)) {
+            *Request = request;
+            *Status = status;
+            return PendStepDone;
+        }
+        Self->Current = request;
+    }
+
+    status = Self->Ops->Transfer(Self, request, Written);
+    if (status == STATUS_BUFFER_OVERFLOW) {
+        return PendStepWaiting;
+    }
+
+    // Fully in, or failed; either way this request is finished
+    Self->Current = NULL;
+    *Request = request;
+    *Status = status;
+    return PendStepFinished;
+}
+
+BOOLEAN
+PendRemove(
+    _Inout_ PPEND_QUEUE       Self,
+    _In_  PVOID               Request
+)
+{
+    if (Request == NULL || Self->Current != Request) {
+        return FALSE;
+    }
+    Self->Current = NULL;
+    return TRUE;
+}
+
+PVOID
+PendTakeCurrent(
+    _Inout_ PPEND_QUEUE       Self
+)
+{
+    PVOID request = Self->Current;
+
+    Self->Current = NULL;
+    return request;
+}
+
+ULONG
+PendPending(
+    _In_  PPEND_QUEUE         Self
+)
+{
+    return PendCount(Self->Current != NULL, Self->Ops->Queued(Self));
+}
+
+NTSTATUS
+PendTransferStatus(
+    _In_  size_t              Length,
+    _In_  size_t              Transferred,
+    _In_  NTSTATUS            CopyStatus
+)
+{
+    if (!NT_SUCCESS(CopyStatus) && CopyStatus != STATUS_BUFFER_OVERFLOW) {
+        return CopyStatus;
+    }
+    return (Transferred < Length) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+ULONG
+PendCount(
+    _In_  BOOLEAN             HasCurrent,
+    _In_  ULONG               Queued
+)
+{
+    return (HasCurrent ? 1 : 0) + Queued;
+}
+
+size_t
+PendPartialAllowance(
+    _In_  size_t              Length,
+    _In_  ULONG               Pending
+)
+{
+    return (Pending != 0) ? 0 : Length;
+}
+
+VOID
+PendCreditCompute(
+    _In_  size_t              FreeSpace,
+    _In_  size_t              Capacity,
+    _In_  ULONG               Pending,
+    _Out_ PVCOM_PUSH_CREDIT   Credit
+)
+{
+    Credit->FreeBytes = (Pending != 0) ? 0 : (ULONG)min(FreeSpace, (size_t)MAXULONG);
+    Credit->Capacity = (ULONG)min(Capacity, (size_t)MAXULONG);
+    Credit->PushesPending = Pending;
+}
+
+BOOLEAN
+PendCreditSatisfied(
+    _In_  PVCOM_PUSH_CREDIT   Credit,
+    _In_  ULONG               Minimum
+)
+{
+    return Credit->FreeBytes >= min(Minimum, Credit->Capacity);
+}
+
+VOID
+PendCreditWaitInitialize(
+    _Out_ PPEND_CREDIT_WAIT   Self
+)
+{
+    Self->Lowest = (LONG)PEND_CREDIT_NONE;
+}
+
+VOID
+PendCreditWaitNote(
+    _Inout_ PPEND_CREDIT_WAIT Self,
+    _In_  ULONG               Minimum
+)
+{
+    LONG seen = ReadNoFence(&Self->Lowest);
+    LONG prior;
+
+    // PEND_CREDIT_NONE is never a minimum; capped, it still waits for a full ring
+    Minimum = min(Minimum, PEND_CREDIT_NONE - 1);
+
+    while ((ULONG)seen > Minimum) {
+        prior = InterlockedCompareExchange(&Self->Lowest, (LONG)Minimum, seen);
+        if (prior == seen) {
+            break;
+        }
+        seen = prior;
+    }
+}
+
+BOOLEAN
+PendCreditWaiting(
+    _In_  PPEND_CREDIT_WAIT   Self
+)
+{
+    // Orders the caller's freeing of space before the look at the notes
+    KeMemoryBarrier();
+    return (ULONG)ReadNoFence(&Self->Lowest) != PEND_CREDIT_NONE;
+}
+
+BOOLEAN
+PendCreditWake(
+    _Inout_ PPEND_CREDIT_WAIT Self,
+    _In_  PVCOM_PUSH_CREDIT   Credit
+)
+{
+    ULONG lowest;
+
+    KeMemoryBarrier();
+    lowest = (ULONG)ReadNoFence(&Self->Lowest);
+    if (lowest == PEND_CREDIT_NONE || !PendCreditSatisfied(Credit, lowest)) {
+        return FALSE;
+    }
+
+    (VOID)InterlockedExchange(&Self->Lowest, (LONG)PEND_CREDIT_NONE);
+    return TRUE;
+}
@@ -0,0 +1,233 @@
+/*++
+
+Module Name:
+
+    pendxfer.h
+
+Abstract:
+
+    Writes and pushes that wait on a full ring. A PEND_QUEUE keeps the one
+    being filled in (current) and decides, for a new request and after
+    every drain, what happens next: it goes straight in, waits behind the
+    others, stays current with part of it in, or is finished. The owner
+    supplies the ring and the waiting queue through PEND_QUEUE_OPS, which
+    keeps WDF out of here so the host tests run the same code queue.c does.
+    Also the rules for partial-mode pushes, the credit a service is given
+    while pushes are pended, and when a drain wakes the GET_CREDIT requests
+    waiting for space.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _PEND_QUEUE PEND_QUEUE, * PPEND_QUEUE;
+
+    // Puts as much of the rest of Request into the ring as it takes now,
+    // with Written the bytes moved; the status is PendTransferStatus's
+    typedef NTSTATUS PEND_TRANSFER(
+        _In_  PPEND_QUEUE         Self,
+        _In_  PVOID               Request,
+        _Out_ size_t*             Written
+    );
+
+    // Requests waiting behind the current one
+    typedef ULONG PEND_QUEUED(
+        _In_  PPEND_QUEUE         Self
+    );
+
+    // Takes the oldest waiting request off the queue; FALSE when there is
+    // none, or none may start now
+    typedef BOOLEAN PEND_DEQUEUE(
+        _In_  PPEND_QUEUE         Self,
+        _Out_ PVOID*              Request
+    );
+
+    // Request is about to become the current one (made cancelable, timed).
+    // A failure finishes it with that status instead.
+    typedef NTSTATUS PEND_HOLD(
+        _In_  PPEND_QUEUE         Self,
+        _In_  PVOID               Request
+    );
+
+    typedef struct _PEND_QUEUE_OPS
+    {
+        PEND_TRANSFER*  Transfer;
+        PEND_QUEUED*    Queued;
+        PEND_DEQUEUE*   Dequeue;
+        PEND_HOLD*      Hold;
+    } PEND_QUEUE_OPS, * PPEND_QUEUE_OPS;
+
+    struct _PEND_QUEUE
+    {
+        const PEND_QUEUE_OPS* Ops;
+        PVOID Owner;
+
+        // The request part way into the ring, NULL when none. Changed only
+        // by the calls below, under the owner's ring write lock.
+        PVOID Current;
+    };
+
+    typedef enum _PEND_STEP {
+        PendStepIdle,       // nothing is waiting to go in
+        PendStepQueue,      // PendStart: the caller queues the request behind the waiting ones
+        PendStepWaiting,    // the current request is in as far as the ring allows
+        PendStepDone,       // Request finished without having been held
+        PendStepFinished    // the current request finished and is current no longer
+    } PEND_STEP;
+
+    //
+    // The queue. The caller holds the ring's write lock across each call,
+    // and completes a finished request once it has dropped it.
+    //
+
+    VOID
+        PendInitialize(
+            _Out_ PPEND_QUEUE         Self,
+            _In_  const PEND_QUEUE_OPS* Ops,
+            _In_  PVOID               Owner
+        );
+
+    // A new request. With others waiting it must queue behind them
+    // (PendStepQueue); otherwise as much goes in as fits, and the request
+    // is done (PendStepDone, with Status) or becomes current
+    // (PendStepWaiting). Written is what went in.
+    PEND_STEP
+        PendStart(
+            _Inout_ PPEND_QUEUE       Self,
+            _In_  PVOID               Request,
+            _Out_ NTSTATUS*           Status,
+            _Out_ size_t*             Written
+        );
+
+    // After the ring drained: carries on with the current request, or
+    // starts the oldest waiting one. Returns at the first request that
+    // finishes (PendStepFinished, or PendStepDone if it could not be held)
+    // so the caller can complete it and call again; PendStepWaiting once
+    // the ring is full, PendStepIdle once nothing is left.
+    PEND_STEP
+        PendService(
+            _Inout_ PPEND_QUEUE       Self,
+            _Out_ PVOID*              Request,
+            _Out_ NTSTATUS*           Status,
+            _Out_ size_t*             Written
+        );
+
+    // Request is going away (cancelled or timed out). TRUE if it was the
+    // current one, which the next PendService moves past; its bytes stay.
+    BOOLEAN
+        PendRemove(
+            _Inout_ PPEND_QUEUE       Self,
+            _In_  PVOID               Request
+        );
+
+    // Takes the current request away, if any, when flushing the queue
+    PVOID
+        PendTakeCurrent(
+            _Inout_ PPEND_QUEUE       Self
+        );
+
+    // Requests waiting: the current one, if any, and those queued behind
+    // it. Without the lock this is a snapshot.
+    ULONG
+        PendPending(
+            _In_  PPEND_QUEUE         Self
+        );
+
+    // The outcome of putting part of a request of Length bytes into its
+    // ring, Transferred bytes being in so far. STATUS_BUFFER_OVERFLOW while
+    // any are left, whether the ring was full or pacing held the rest back;
+    // a failed copy keeps its own status.
+    NTSTATUS
+        PendTransferStatus(
+            _In_  size_t              Length,
+            _In_  size_t              Transferred,
+            _In_  NTSTATUS            CopyStatus
+        );
+
+    // Requests waiting on the ring: the current one, if any, and those
+    // queued behind it
+    ULONG
+        PendCount(
+            _In_  BOOLEAN             HasCurrent,
+            _In_  ULONG               Queued
+        );
+
+    // Bytes of a partial-mode push (PUSH_INCOMING or a BATCH entry) the
+    // ring may take. None while Pending pushes wait, whose bytes come first.
+    size_t
+        PendPartialAllowance(
+            _In_  size_t              Length,
+            _In_  ULONG               Pending
+        );
+
+    // The credit reported to the service. A push only goes straight in when
+    // none are pending, so until then there is no free space to offer.
+    VOID
+        PendCreditCompute(
+            _In_  size_t              FreeSpace,
+            _In_  size_t              Capacity,
+            _In_  ULONG               Pending,
+            _Out_ PVCOM_PUSH_CREDIT   Credit
+        );
+
+    // Whether a GET_CREDIT waiting for Minimum bytes may complete; a minimum
+    // beyond the ring is capped at its capacity
+    BOOLEAN
+        PendCreditSatisfied(
+            _In_  PVCOM_PUSH_CREDIT   Credit,
+            _In_  ULONG               Minimum
+        );
+
+    //
+    // GET_CREDIT requests waiting for space. Only the smallest minimum among
+    // them is kept, so a drain that frees less than that wakes none of them;
+    // one that frees enough hands them all back to be looked at again, and
+    // those still short note themselves once more.
+    //
+    // A waiter queues its request first, then notes its minimum, then looks
+    // at the credit again and wakes the waiters itself if it is satisfied. A
+    // drain frees the space first, then asks PendCreditWake. Either the
+    // drain sees the note, or the waiter sees the space.
+    //
+
+#define PEND_CREDIT_NONE    MAXULONG
+
+    typedef struct _PEND_CREDIT_WAIT
+    {
+        // Smallest minimum waited for, PEND_CREDIT_NONE when nobody waits
+        volatile LONG Lowest;
+    } PEND_CREDIT_WAIT, * PPEND_CREDIT_WAIT;
+
+    VOID
+        PendCreditWaitInitialize(
+            _Out_ PPEND_CREDIT_WAIT   Self
+        );
+
+    // A GET_CREDIT for Minimum bytes has just been queued
+    VOID
+        PendCreditWaitNote(
+            _Inout_ PPEND_CREDIT_WAIT Self,
+            _In_  ULONG               Minimum
+        );
+
+    // Whether anybody waits; lets a drain skip working out the credit
+    BOOLEAN
+        PendCreditWaiting(
+            _In_  PPEND_CREDIT_WAIT   Self
+        );
+
+    // After a drain, with the credit it left: whether to hand every waiter
+    // back. TRUE clears the notes, which the waiters still short renew.
+    BOOLEAN
+        PendCreditWake(
+            _Inout_ PPEND_CREDIT_WAIT Self,
+            _In_  PVCOM_PUSH_CREDIT   Credit
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,404 @@
+/*++
+
+Module Name:
+
+    platform.h
+
+Abstract:
+
+    Base definitions for the modules that own no WDF objects: the rings,
+    the timer wheel, the flow-control and formatting state machines. In the
+    driver this is just the kernel headers.
+
+    With VCOM_HOST_BUILD defined it instead maps the handful of kernel
+    types and routines those modules use onto the C runtime and GCC
+    builtins, so the same sources build as ordinary Linux user-mode code
+    for the tests and benchmarks under tests/.
+
+--*/
+
+#pragma once
+
+#ifndef VCOM_HOST_BUILD
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#else
+#include <windows.h>
+#endif
+
+// MSVC compiles AVX2 intrinsics in any function
+#define DECLSPEC_TARGET_AVX2
+
+#else // VCOM_HOST_BUILD
+
+#include <assert.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//
+// Types
+//
+
+typedef void                VOID, * PVOID;
+typedef unsigned char       UCHAR, * PUCHAR, BYTE, * PBYTE, BOOLEAN, * PBOOLEAN;
+typedef char                CHAR, * PCHAR;
+typedef unsigned short      USHORT, * PUSHORT;
+typedef short               SHORT;
+typedef uint32_t            ULONG, * PULONG;
+typedef int32_t             LONG, * PLONG;
+typedef int64_t             LONG64, * PLONG64, LONGLONG;
+typedef uint64_t            ULONG64, * PULONG64, ULONGLONG;
+typedef size_t              SIZE_T, * PSIZE_T, ULONG_PTR;
+typedef uint16_t            WCHAR, * PWCHAR;
+typedef int32_t             NTSTATUS;
+typedef PVOID               HANDLE;
+typedef UCHAR               KIRQL;
+
+#define MAXULONG    0xffffffffUL
+
+typedef struct _GUID {
+    ULONG   Data1;
+    USHORT  Data2;
+    USHORT  Data3;
+    UCHAR   Data4[8];
+} GUID;
+
+#define DEFINE_GUID(_name_, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    static const GUID _name_ = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+
+#define TRUE    1
+#define FALSE   0
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING                  ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001AL)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_CANCELLED                ((NTSTATUS)0xC0000120L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_INTERNAL_ERROR           ((NTSTATUS)0xC00000E5L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184L)
+#define STATUS_DEVICE_BUSY              ((NTSTATUS)0x80000011L)
+
+#define NT_SUCCESS(_status_)    (((NTSTATUS)(_status_)) >= 0)
+
+#define CTL_CODE(_type_, _function_, _method_, _access_) \
+    (((_type_) << 16) | ((_access_) << 14) | ((_function_) << 2) | (_method_))
+#define FILE_DEVICE_SERIAL_PORT     0x0000001b
+#define METHOD_BUFFERED             0
+#define METHOD_IN_DIRECT            1
+#define METHOD_OUT_DIRECT           2
+#define FILE_ANY_ACCESS             0
+
+//
+// Annotations and compiler spellings
+//
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+#define _Notnull_
+#define _In_reads_(_size_)
+#define _In_reads_bytes_(_size_)
+#define _Inout_updates_(_size_)
+#define _Out_writes_(_size_)
+#define _Out_writes_bytes_(_size_)
+#define _Out_writes_to_(_size_, _count_)
+#define _Out_writes_bytes_to_(_size_, _count_)
+#define _When_(_expr_, _annotation_)
+#define _IRQL_requires_(_irql_)
+#define _IRQL_requires_max_(_irql_)
+
+// An inline definition that never needs an out-of-line copy
+#define __forceinline           __inline__ __attribute__((__always_inline__))
+#define DECLSPEC_ALIGN(_x_)     __attribute__((__aligned__(_x_)))
+#define DECLSPEC_CACHEALIGN     DECLSPEC_ALIGN(64)
+
+#define C_ASSERT(_e_)           _Static_assert(_e_, #_e_)
+#define DECLSPEC_TARGET_AVX2    __attribute__((__target__("avx2")))
+#define UNREFERENCED_PARAMETER(_p_)     ((void)(_p_))
+#define FIELD_OFFSET(_type_, _field_)   offsetof(_type_, _field_)
+#define RTL_FIELD_SIZE(_type_, _field_) (sizeof(((_type_*)0)->_field_))
+#define RTL_NUMBER_OF(_a_)      (sizeof(_a_) / sizeof((_a_)[0]))
+#define CONTAINING_RECORD(_address_, _type_, _field_) \
+    ((_type_*)((PUCHAR)(_address_) - offsetof(_type_, _field_)))
+
+#ifndef min
+#define min(a, b)   (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b)   (((a) > (b)) ? (a) : (b))
+#endif
+
+#define ASSERT(_e_)             assert(_e_)
+
+// Debug output levels, which trace records carry
+#define DPFLTR_ERROR_LEVEL      0
+#define DPFLTR_WARNING_LEVEL    1
+#define DPFLTR_TRACE_LEVEL      2
+#define DPFLTR_INFO_LEVEL       3
+
+//
+// Memory
+//
+
+#define RtlCopyMemory(_d_, _s_, _n_)    memcpy((_d_), (_s_), (_n_))
+#define RtlMoveMemory(_d_, _s_, _n_)    memmove((_d_), (_s_), (_n_))
+#define RtlFillMemory(_d_, _n_, _c_)    memset((_d_), (_c_), (_n_))
+#define RtlZeroMemory(_d_, _n_)         memset((_d_), 0, (_n_))
+
+//
+// Interlocked operations and ordered accesses. Generic over the operand
+// width, as the kernel's typed variants are not needed to pick one.
+//
+
+#define InterlockedIncrement(_p_)               __atomic_add_fetch((_p_), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(_p_)               __atomic_sub_fetch((_p_), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(_p_, _v_)           __atomic_exchange_n((_p_), (_v_), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(_p_, _v_)        __atomic_fetch_add((_p_), (_v_), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(_p_, _exchange_, _comparand_)                        \
+    ({                                                                                  \
+        __typeof__(+*(_p_)) _old_ = (_comparand_);                                      \
+        __atomic_compare_exchange_n((_p_), &_old_, (_exchange_), 0,                     \
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);                                        \
+        _old_;                                                                          \
+    })
+
+#define InterlockedIncrement64(_p_)             __atomic_add_fetch((_p_), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrementNoFence64(_p_)      __atomic_add_fetch((_p_), 1, __ATOMIC_RELAXED)
+#define InterlockedExchange64(_p_, _v_)         __atomic_exchange_n((_p_), (_v_), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange64(_p_, _exchange_, _comparand_)                      \
+    InterlockedCompareExchange((_p_), (_exchange_), (_comparand_))
+#define InterlockedExchangeAdd64(_p_, _v_)      __atomic_fetch_add((_p_), (_v_), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(_p_, _v_)              __atomic_add_fetch((_p_), (_v_), __ATOMIC_SEQ_CST)
+#define InterlockedAddNoFence64(_p_, _v_)       __atomic_add_fetch((_p_), (_v_), __ATOMIC_RELAXED)
+#define InterlockedExchangePointer(_p_, _v_)    __atomic_exchange_n((_p_), (_v_), __ATOMIC_SEQ_CST)
+
+#define ReadAcquire(_p_)                        __atomic_load_n((_p_), __ATOMIC_ACQUIRE)
+#define ReadNoFence(_p_)                        __atomic_load_n((_p_), __ATOMIC_RELAXED)
+#define ReadAcquire64(_p_)                      __atomic_load_n((_p_), __ATOMIC_ACQUIRE)
+#define ReadNoFence64(_p_)                      __atomic_load_n((_p_), __ATOMIC_RELAXED)
+#define ReadULongNoFence(_p_)                   __atomic_load_n((_p_), __ATOMIC_RELAXED)
+#define ReadBooleanNoFence(_p_)                 __atomic_load_n((_p_), __ATOMIC_RELAXED)
+#define ReadULong64Acquire(_p_)                 __atomic_load_n((_p_), __ATOMIC_ACQUIRE)
+#define ReadULong64NoFence(_p_)                 __atomic_load_n((_p_), __ATOMIC_RELAXED)
+#define WriteRelease(_p_, _v_)                  __atomic_store_n((_p_), (_v_), __ATOMIC_RELEASE)
+#define WriteNoFence(_p_, _v_)                  __atomic_store_n((_p_), (_v_), __ATOMIC_RELAXED)
+#define WriteRelease64(_p_, _v_)                __atomic_store_n((_p_), (_v_), __ATOMIC_RELEASE)
+#define WriteNoFence64(_p_, _v_)                __atomic_store_n((_p_), (_v_), __ATOMIC_RELAXED)
+#define WriteULongNoFence(_p_, _v_)             __atomic_store_n((_p_), (_v_), __ATOMIC_RELAXED)
+#define WriteULong64Release(_p_, _v_)           __atomic_store_n((_p_), (_v_), __ATOMIC_RELEASE)
+#define WriteULong64NoFence(_p_, _v_)           __atomic_store_n((_p_), (_v_), __ATOMIC_RELAXED)
+
+#define KeMemoryBarrier()                       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define _BitScanForward(_index_, _mask_)                                                \
+    ({                                                                                  \
+        ULONG _m_ = (_mask_);                                                           \
+        if (_m_ != 0) {                                                                 \
+            *(_index_) = (ULONG)__builtin_ctz(_m_);                                     \
+        }                                                                               \
+        (BOOLEAN)(_m_ != 0);                                                            \
+    })
+
+#define _BitScanReverse64(_index_, _mask_)                                              \
+    ({                                                                                  \
+        ULONG64 _m_ = (_mask_);                                                         \
+        if (_m_ != 0) {                                                                 \
+            *(_index_) = 63 - (ULONG)__builtin_clzll(_m_);                              \
+        }                                                                               \
+        (BOOLEAN)(_m_ != 0);                                                            \
+    })
+
+//
+// Processor features. User mode has no extended state to save around AVX
+// code.
+//
+
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE  40
+#define XSTATE_MASK_AVX                 (1ULL << 2)
+
+typedef struct _XSTATE_SAVE {
+    ULONG   Unused;
+} XSTATE_SAVE, * PXSTATE_SAVE;
+
+#if defined(__x86_64__)
+#define ExIsProcessorFeaturePresent(_feature_)  \
+    ((_feature_) == PF_AVX2_INSTRUCTIONS_AVAILABLE && __builtin_cpu_supports("avx2"))
+#else
+#define ExIsProcessorFeaturePresent(_feature_)  FALSE
+#endif
+#define RtlGetEnabledExtendedFeatures(_mask_)   ((ULONG64)(_mask_))
+#define KeSaveExtendedProcessorState(_mask_, _save_)    ((void)(_save_), STATUS_SUCCESS)
+#define KeRestoreExtendedProcessorState(_save_)         ((void)(_save_))
+
+//
+// Doubly linked lists
+//
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, * PLIST_ENTRY;
+
+static inline VOID
+InitializeListHead(
+    PLIST_ENTRY Head
+)
+{
+    Head->Flink = Head->Blink = Head;
+}
+
+static inline BOOLEAN
+IsListEmpty(
+    const LIST_ENTRY* Head
+)
+{
+    return Head->Flink == Head;
+}
+
+static inline VOID
+InsertTailList(
+    PLIST_ENTRY Head,
+    PLIST_ENTRY Entry
+)
+{
+    Entry->Flink = Head;
+    Entry->Blink = Head->Blink;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+
+static inline VOID
+InsertHeadList(
+    PLIST_ENTRY Head,
+    PLIST_ENTRY Entry
+)
+{
+    Entry->Flink = Head->Flink;
+    Entry->Blink = Head;
+    Head->Flink->Blink = Entry;
+    Head->Flink = Entry;
+}
+
+// TRUE if the list is empty afterwards
+static inline BOOLEAN
+RemoveEntryList(
+    PLIST_ENTRY Entry
+)
+{
+    PLIST_ENTRY next = Entry->Flink;
+    PLIST_ENTRY prev = Entry->Blink;
+
+    prev->Flink = next;
+    next->Blink = prev;
+    return next == prev;
+}
+
+static inline PLIST_ENTRY
+RemoveHeadList(
+    PLIST_ENTRY Head
+)
+{
+    PLIST_ENTRY entry = Head->Flink;
+
+    RemoveEntryList(entry);
+    return entry;
+}
+
+//
+// Pool. Lookaside lists go straight to the heap.
+//
+
+typedef enum _POOL_TYPE {
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+typedef struct _LOOKASIDE_LIST_EX {
+    size_t  Size;
+} LOOKASIDE_LIST_EX, * PLOOKASIDE_LIST_EX;
+
+#define ExInitializeLookasideListEx(_list_, _allocate_, _free_, _type_, _flags_, _size_, _tag_, _depth_) \
+    ((_list_)->Size = (_size_), STATUS_SUCCESS)
+#define ExDeleteLookasideListEx(_list_)                 ((void)(_list_))
+#define ExAllocateFromLookasideListEx(_list_)           malloc((_list_)->Size)
+#define ExFreeToLookasideListEx(_list_, _entry_)        free(_entry_)
+
+//
+// Events. A KEVENT is an auto-reset flag with a futex behind it, so an
+// event placed in memory shared between processes wakes a waiter in any of
+// them. Waiting is the tests' business; the modules only set events.
+//
+
+typedef struct _KEVENT {
+    volatile LONG   Signaled;
+} KEVENT, * PKEVENT, * PRKEVENT;
+
+#define IO_NO_INCREMENT     0
+
+static inline LONG
+KeSetEvent(
+    PRKEVENT Event,
+    LONG Increment,
+    BOOLEAN Wait
+)
+{
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    if (__atomic_exchange_n(&Event->Signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+        syscall(SYS_futex, &Event->Signaled, FUTEX_WAKE, 1, NULL, NULL, 0);
+        return 0;
+    }
+    return 1;
+}
+
+//
+// Rundown protection. References count in twos; the low bit is set once
+// the owner starts waiting, after which no new reference is granted.
+//
+
+typedef struct _EX_RUNDOWN_REF {
+    volatile LONG64 Count;
+} EX_RUNDOWN_REF, * PEX_RUNDOWN_REF;
+
+#define ExInitializeRundownProtection(_ref_)    ((_ref_)->Count = 0)
+#define ExReleaseRundownProtection(_ref_)       ((VOID)__atomic_sub_fetch(&(_ref_)->Count, 2, __ATOMIC_RELEASE))
+
+static inline BOOLEAN
+ExAcquireRundownProtection(
+    PEX_RUNDOWN_REF RunRef
+)
+{
+    LONG64 count = __atomic_load_n(&RunRef->Count, __ATOMIC_RELAXED);
+
+    do {
+        if (count & 1) {
+            return FALSE;
+        }
+    } while (!__atomic_compare_exchange_n(&RunRef->Count, &count, count + 2, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return TRUE;
+}
+
+static inline VOID
+ExWaitForRundownProtectionRelease(
+    PEX_RUNDOWN_REF RunRef
+)
+{
+    __atomic_fetch_or(&RunRef->Count, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&RunRef->Count, __ATOMIC_ACQUIRE) != 1) {
+        sched_yield();
+    }
+}
+
+#endif // VCOM_HOST_BUILD
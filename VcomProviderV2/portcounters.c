@@ -0,0 +1,62 @@
+/*++
+
+Module Name:
+
+    portcounters.c
+
+Abstract:
+
+    Per-port performance counter updates
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "portcounters.h"
+
+VOID
+PortCountersInitialize(
+    _Out_ PVCOM_PORT_COUNTERS Counters,
+    _In_  ULONG               PortId
+)
+{
+    RtlZeroMemory(Counters, sizeof(*Counters));
+    Counters->Version = VCOM_COUNTERS_VERSION;
+    Counters->Size = sizeof(*Counters);
+    Counters->PortId = PortId;
+}
+
+VOID
+PortCountersTransfer(
+    _Inout_ PVCOM_PORT_COUNTERS Counters,
+    _In_  BOOLEAN             ToUser,
+    _In_  BOOLEAN             Produced,
+    _In_  size_t              Count,
+    _In_  size_t              Occupancy
+)
+{
+    volatile LONG64* bytes;
+    volatile LONG64* gauge;
+    volatile LONG64* highWater;
+
+    if (ToUser) {
+        bytes = Produced ? &Counters->BytesWritten : &Counters->BytesDrained;
+        gauge = &Counters->ToUserOccupancy;
+        highWater = &Counters->ToUserHighWater;
+    }
+    else {
+        bytes = Produced ? &Counters->BytesPushed : &Counters->BytesRead;
+        gauge = &Counters->FromNetOccupancy;
+        highWater = &Counters->FromNetHighWater;
+    }
+
+    WriteNoFence64(bytes, ReadNoFence64(bytes) + (LONG64)Count);
+    WriteNoFence64(gauge, (LONG64)Occupancy);
+    if (Produced && (LONG64)Occupancy > ReadNoFence64(highWater)) {
+        WriteNoFence64(highWater, (LONG64)Occupancy);
+    }
+}
@@ -0,0 +1,45 @@
+/*++
+
+Module Name:
+
+    portcounters.h
+
+Abstract:
+
+    Updates to a VCOM_PORT_COUNTERS block (public.h) from the hot paths,
+    wherever the block lives: in a port's published page (counterpage.h) or
+    in the queue context when it has none.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Zeroes the counters and fills in the header
+    VOID
+        PortCountersInitialize(
+            _Out_ PVCOM_PORT_COUNTERS Counters,
+            _In_  ULONG               PortId
+        );
+
+    // Count bytes went into (Produced) or came out of the ToUser or
+    // FromNetwork ring, which now holds Occupancy. The caller holds the
+    // ring's write lock when producing and its read lock when consuming,
+    // which makes it the only writer of the byte count and, for the
+    // producer, of the high-water mark, so plain relaxed stores do.
+    // Occupancy is stored from both sides and the later store wins.
+    VOID
+        PortCountersTransfer(
+            _Inout_ PVCOM_PORT_COUNTERS Counters,
+            _In_  BOOLEAN             ToUser,
+            _In_  BOOLEAN             Produced,
+            _In_  size_t              Count,
+            _In_  size_t              Occupancy
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,213 @@
+/*++
+
+Module Name:
+
+    portslots.c
+
+Abstract:
+
+    Port table slots, pairing and readiness hint
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "portslots.h"
+
+VOID
+PortSlotInitialize(
+    _Out_ PPORT_SLOT          Slot
+)
+{
+    Slot->PortId = VCOM_INVALID_PORT_ID;
+    Slot->PeerId = VCOM_INVALID_PORT_ID;
+    Slot->Mapped = FALSE;
+    Slot->ReadyWaiters = 0;
+    ExInitializeRundownProtection(&Slot->Rundown);
+}
+
+NTSTATUS
+PortSlotsInsert(
+    _Inout_ PPORT_SLOTS       Slots,
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    ULONG i;
+
+    for (i = 0; i < VCOM_MAX_PORTS; i++) {
+        if (Slots->Entries[i] == NULL) {
+            ExInitializeRundownProtection(&Slot->Rundown);
+            Slot->PortId = i;
+            Slots->Entries[i] = Slot;
+            return STATUS_SUCCESS;
+        }
+    }
+    return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+PortSlotsRemove(
+    _Inout_ PPORT_SLOTS       Slots,
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    if (Slot->PortId < VCOM_MAX_PORTS && Slots->Entries[Slot->PortId] == Slot) {
+        Slots->Entries[Slot->PortId] = NULL;
+    }
+}
+
+VOID
+PortSlotsRundown(
+    _Inout_ PPORT_SLOTS       Slots,
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    if (Slot->PortId == VCOM_INVALID_PORT_ID) {
+        return;
+    }
+
+    ExWaitForRundownProtectionRelease(&Slot->Rundown);
+
+    // Any waits still pended went away with the port
+    (VOID)PortSlotClearReadyWaiter(Slots, Slot);
+    Slot->PortId = VCOM_INVALID_PORT_ID;
+}
+
+PPORT_SLOT
+PortSlotsAcquire(
+    _In_  PPORT_SLOTS         Slots,
+    _In_  ULONG               PortId
+)
+{
+    PPORT_SLOT slot;
+
+    if (PortId >= VCOM_MAX_PORTS) {
+        return NULL;
+    }
+
+    slot = Slots->Entries[PortId];
+    if (slot != NULL && !ExAcquireRundownProtection(&slot->Rundown)) {
+        slot = NULL;
+    }
+    return slot;
+}
+
+NTSTATUS
+PortSlotsLink(
+    _Inout_ PPORT_SLOT        Slot,
+    _Inout_ PPORT_SLOT        Peer
+)
+{
+    if (Slot->PeerId == Peer->PortId && Peer->PeerId == Slot->PortId) {
+        // Already wired this way
+        return STATUS_SUCCESS;
+    }
+    if (Slot->PeerId != VCOM_INVALID_PORT_ID || Peer->PeerId != VCOM_INVALID_PORT_ID) {
+        return STATUS_DEVICE_BUSY;
+    }
+    if (Slot->Mapped || Peer->Mapped) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    Slot->PeerId = Peer->PortId;
+    Peer->PeerId = Slot->PortId;
+    return STATUS_SUCCESS;
+}
+
+ULONG
+PortSlotsUnlink(
+    _Inout_ PPORT_SLOTS       Slots,
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    ULONG peerId = Slot->PeerId;
+
+    if (peerId != VCOM_INVALID_PORT_ID) {
+        Slot->PeerId = VCOM_INVALID_PORT_ID;
+
+        // A port unlinks before it leaves the table, so the peer is there
+        if (peerId < VCOM_MAX_PORTS && Slots->Entries[peerId] != NULL) {
+            Slots->Entries[peerId]->PeerId = VCOM_INVALID_PORT_ID;
+        }
+    }
+    return peerId;
+}
+
+NTSTATUS
+PortSlotMap(
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    if (Slot->PeerId != VCOM_INVALID_PORT_ID) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    Slot->Mapped = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID
+PortSlotUnmap(
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    Slot->Mapped = FALSE;
+}
+
+VOID
+PortSlotNoteReadyWaiter(
+    _Inout_ PPORT_SLOTS       Slots,
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    // Full barrier either way
+    if (InterlockedCompareExchange(&Slot->ReadyWaiters, 1, 0) == 0) {
+        InterlockedIncrement(&Slots->ReadyWaiters);
+    }
+}
+
+BOOLEAN
+PortSlotClearReadyWaiter(
+    _Inout_ PPORT_SLOTS       Slots,
+    _Inout_ PPORT_SLOT        Slot
+)
+{
+    if (InterlockedExchange(&Slot->ReadyWaiters, 0) != 0) {
+        InterlockedDecrement(&Slots->ReadyWaiters);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+BOOLEAN
+PortSlotsAnyWaiters(
+    _In_  PPORT_SLOTS         Slots
+)
+{
+    // Pairs with the barrier in PortSlotNoteReadyWaiter: the ring update
+    // that made a port ready is visible before we look for waiters.
+    KeMemoryBarrier();
+    return ReadNoFence(&Slots->ReadyWaiters) != 0;
+}
+
+ULONG
+PortSlotsCollectWaiters(
+    _In_  PPORT_SLOTS         Slots,
+    _Out_writes_(VCOM_MAX_PORTS / 32) PULONG Waiting
+)
+{
+    ULONG count = 0;
+    ULONG i;
+
+    RtlZeroMemory(Waiting, (VCOM_MAX_PORTS / 32) * sizeof(ULONG));
+    for (i = 0; i < VCOM_MAX_PORTS; i++) {
+        if (Slots->Entries[i] != NULL && ReadNoFence(&Slots->Entries[i]->ReadyWaiters) != 0) {
+            Waiting[i / 32] |= 1UL << (i % 32);
+            count++;
+        }
+    }
+    return count;
+}
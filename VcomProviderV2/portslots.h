@@ -0,0 +1,161 @@
+/*++
+
+Module Name:
+
+    portslots.h
+
+Abstract:
+
+    The port table's slots: PortId assignment, lookups that take a rundown
+    reference, null-modem pairing and the readiness waiter hint. Each port
+    embeds a PORT_SLOT; porttable.c keeps the one PORT_SLOTS table and the
+    lock the routines below marked as such run under.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VCOM_MAX_PORTS  256
+
+    typedef struct _PORT_SLOT {
+        ULONG           PortId;         // VCOM_INVALID_PORT_ID while out of the table
+        EX_RUNDOWN_REF  Rundown;
+
+        // Null-modem peer, VCOM_INVALID_PORT_ID when unpaired and PortId for
+        // loopback. Changed only under the table lock and on both ends at
+        // once; readers may look at it unlocked and look the peer up by id.
+        volatile ULONG  PeerId;
+
+        // Set from the start of a switch to shared-ring mode until the port
+        // leaves it. Changed only under the table lock, like PeerId, so a
+        // port is never both paired and mapped.
+        BOOLEAN         Mapped;
+
+        // Non-zero while the port has readiness waits pended
+        volatile LONG   ReadyWaiters;
+    } PORT_SLOT, * PPORT_SLOT;
+
+    typedef struct _PORT_SLOTS {
+        PPORT_SLOT      Entries[VCOM_MAX_PORTS];
+        volatile LONG   ReadyWaiters;   // slots with ReadyWaiters set
+    } PORT_SLOTS, * PPORT_SLOTS;
+
+    VOID
+        PortSlotInitialize(
+            _Out_ PPORT_SLOT          Slot
+        );
+
+    // Under the table lock. Gives Slot the lowest free PortId, or fails with
+    // STATUS_INSUFFICIENT_RESOURCES when all VCOM_MAX_PORTS are taken.
+    NTSTATUS
+        PortSlotsInsert(
+            _Inout_ PPORT_SLOTS       Slots,
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    // Under the table lock. Takes Slot out of the table so no new lookup
+    // finds it; PortSlotsRundown then waits out the ones that did.
+    VOID
+        PortSlotsRemove(
+            _Inout_ PPORT_SLOTS       Slots,
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    // Not under the lock, after PortSlotsRemove. Waits for the references
+    // PortSlotsAcquire handed out, then drops Slot's waiter hint and PortId.
+    VOID
+        PortSlotsRundown(
+            _Inout_ PPORT_SLOTS       Slots,
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    // Under the table lock. The slot with PortId, holding a reference that
+    // PortSlotRelease gives back, or NULL.
+    PPORT_SLOT
+        PortSlotsAcquire(
+            _In_  PPORT_SLOTS         Slots,
+            _In_  ULONG               PortId
+        );
+
+    __forceinline VOID PortSlotRelease(
+        _Inout_ PPORT_SLOT        Slot
+    )
+    {
+        ExReleaseRundownProtection(&Slot->Rundown);
+    }
+
+    // Under the table lock. Pairs two slots, or a slot with itself. Pairing
+    // the two again succeeds; otherwise fails with STATUS_DEVICE_BUSY if
+    // either is paired elsewhere and with STATUS_INVALID_DEVICE_STATE if
+    // either is Mapped.
+    NTSTATUS
+        PortSlotsLink(
+            _Inout_ PPORT_SLOT        Slot,
+            _Inout_ PPORT_SLOT        Peer
+        );
+
+    // Under the table lock. Undoes Slot's pair, on the peer too if it is
+    // still in the table, and returns the PeerId it had or
+    // VCOM_INVALID_PORT_ID.
+    ULONG
+        PortSlotsUnlink(
+            _Inout_ PPORT_SLOTS       Slots,
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    // Under the table lock. Marks Slot Mapped, or fails with
+    // STATUS_INVALID_DEVICE_STATE if it is paired.
+    NTSTATUS
+        PortSlotMap(
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    // Under the table lock
+    VOID
+        PortSlotUnmap(
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    //
+    // Readiness waiter hint. A slot with waits pended counts once in
+    // Slots->ReadyWaiters, so a state change only looks through the table
+    // when that is non-zero. No lock.
+    //
+
+    // Before evaluating a wait that may pend. Full barrier, so the re-check
+    // of port state that follows cannot move ahead of it.
+    VOID
+        PortSlotNoteReadyWaiter(
+            _Inout_ PPORT_SLOTS       Slots,
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    // TRUE if Slot had waiters
+    BOOLEAN
+        PortSlotClearReadyWaiter(
+            _Inout_ PPORT_SLOTS       Slots,
+            _Inout_ PPORT_SLOT        Slot
+        );
+
+    // After a change that may make a port ready. FALSE if no slot has
+    // waiters; otherwise call PortSlotsCollectWaiters under the lock.
+    BOOLEAN
+        PortSlotsAnyWaiters(
+            _In_  PPORT_SLOTS         Slots
+        );
+
+    // Under the table lock. Sets bit PortId of Waiting for each slot with
+    // waiters; returns how many.
+    ULONG
+        PortSlotsCollectWaiters(
+            _In_  PPORT_SLOTS         Slots,
+            _Out_writes_(VCOM_MAX_PORTS / 32) PULONG Waiting
+        );
+
+#ifdef __cplusplus
+}
+#endif
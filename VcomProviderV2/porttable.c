@@ -0,0 +1,196 @@
+/*++
+
+Module Name:
+
+    porttable.c
+
+Abstract:
+
+    Driver-wide port table and readiness wakeups
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "common.h"
+
+static WDFSPINLOCK      PortTableLock = NULL;
+static PORT_SLOTS       PortTableSlots;
+
+NTSTATUS
+PortTableInitialize(
+    VOID
+)
+{
+    RtlZeroMemory(&PortTableSlots, sizeof(PortTableSlots));
+
+    // Parented to the driver, so it lives as long as any port can
+    return WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &PortTableLock);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+PortTableRegister(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    NTSTATUS status;
+
+    WdfSpinLockAcquire(PortTableLock);
+    status = PortSlotsInsert(&PortTableSlots, &QueueContext->Port);
+    WdfSpinLockRelease(PortTableLock);
+
+    return status;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+PortTableUnregister(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    if (QueueContext->Port.PortId == VCOM_INVALID_PORT_ID) {
+        return;
+    }
+
+    WdfSpinLockAcquire(PortTableLock);
+    PortSlotsRemove(&PortTableSlots, &QueueContext->Port);
+    WdfSpinLockRelease(PortTableLock);
+
+    PortSlotsRundown(&PortTableSlots, &QueueContext->Port);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PQUEUE_CONTEXT
+PortTableAcquire(
+    _In_  ULONG             PortId
+)
+{
+    PPORT_SLOT slot;
+
+    WdfSpinLockAcquire(PortTableLock);
+    slot = PortSlotsAcquire(&PortTableSlots, PortId);
+    WdfSpinLockRelease(PortTableLock);
+
+    return (slot != NULL) ? CONTAINING_RECORD(slot, QUEUE_CONTEXT, Port) : NULL;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableRelease(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    PortSlotRelease(&QueueContext->Port);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+PortTableLink(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PQUEUE_CONTEXT    Peer
+)
+{
+    NTSTATUS status;
+
+    WdfSpinLockAcquire(PortTableLock);
+    status = PortSlotsLink(&QueueContext->Port, &Peer->Port);
+    WdfSpinLockRelease(PortTableLock);
+
+    return status;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+PortTableUnlink(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    ULONG peerId;
+
+    WdfSpinLockAcquire(PortTableLock);
+    peerId = PortSlotsUnlink(&PortTableSlots, &QueueContext->Port);
+    WdfSpinLockRelease(PortTableLock);
+
+    return peerId;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+PortTableMapShared(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    NTSTATUS status;
+
+    WdfSpinLockAcquire(PortTableLock);
+    status = PortSlotMap(&QueueContext->Port);
+    WdfSpinLockRelease(PortTableLock);
+
+    return status;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableUnmapShared(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    WdfSpinLockAcquire(PortTableLock);
+    PortSlotUnmap(&QueueContext->Port);
+    WdfSpinLockRelease(PortTableLock);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableNoteReadyWaiter(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    PortSlotNoteReadyWaiter(&PortTableSlots, &QueueContext->Port);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+PortTableClearReadyWaiter(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    return PortSlotClearReadyWaiter(&PortTableSlots, &QueueContext->Port);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableSignalReady(
+    VOID
+)
+{
+    PQUEUE_CONTEXT queueContext;
+    ULONG waiting[VCOM_MAX_PORTS / 32];
+    ULONG i;
+
+    if (!PortSlotsAnyWaiters(&PortTableSlots)) {
+        return;
+    }
+
+    // Entries are only dereferenced under the lock; Unregister removes a
+    // port under it before the port can go away.
+    WdfSpinLockAcquire(PortTableLock);
+    (VOID)PortSlotsCollectWaiters(&PortTableSlots, waiting);
+    WdfSpinLockRelease(PortTableLock);
+
+    for (i = 0; i < VCOM_MAX_PORTS; i++) {
+        if ((waiting[i / 32] & (1UL << (i % 32))) == 0) {
+            continue;
+        }
+
+        queueContext = PortTableAcquire(i);
+        if (queueContext == NULL) {
+            continue;
+        }
+        QueueWakeReadyWaiters(queueContext);
+        PortTableRelease(queueContext);
+    }
+}
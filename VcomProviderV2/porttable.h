@@ -0,0 +1,119 @@
+/*++
+
+Module Name:
+
+    porttable.h
+
+Abstract:
+
+    Driver-wide table of ports, so control IOCTLs issued on one port's
+    control handle can address others by PortId. Entries are protected by
+    rundown: a port looked up with PortTableAcquire stays alive until
+    PortTableRelease, and unregistering waits for all such users. The
+    slots themselves are portslots.h; this adds the lock and the ports'
+    QUEUE_CONTEXTs.
+
+--*/
+
+#pragma once
+
+NTSTATUS
+PortTableInitialize(
+    VOID
+);
+
+// Assigns the lowest free PortId. Fails with STATUS_INSUFFICIENT_RESOURCES
+// when all VCOM_MAX_PORTS slots are taken.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+PortTableRegister(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+// Removes the port and waits for outstanding PortTableAcquire references
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+PortTableUnregister(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PQUEUE_CONTEXT
+PortTableAcquire(
+    _In_  ULONG             PortId
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableRelease(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+//
+// Null-modem pairs (IOCTL_VCOM_PAIR_PORTS). Both ends' Port.PeerId change
+// together under the table lock.
+//
+
+// Pairs two acquired ports, or a port with itself. Fails with
+// STATUS_DEVICE_BUSY if either is paired elsewhere and with
+// STATUS_INVALID_DEVICE_STATE if either is in shared-ring mode or on its
+// way there (PortTableMapShared).
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+PortTableLink(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PQUEUE_CONTEXT    Peer
+);
+
+// Undoes the port's pair and returns the PeerId it had, or
+// VCOM_INVALID_PORT_ID if it was not paired
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+PortTableUnlink(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+// Called by IOCTL_VCOM_MAP_RINGS before it switches the port over, and
+// fails with STATUS_INVALID_DEVICE_STATE if the port is paired. Deciding
+// under the same lock as PortTableLink keeps a concurrent pairing and
+// mapping from both succeeding. PortTableUnmapShared undoes it once the
+// port is back on its own storage, or the switch failed.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+PortTableMapShared(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableUnmapShared(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+//
+// Readiness waits (IOCTL_VCOM_WAIT_READY). A port with pended waits counts
+// once in the global waiter hint; state changes only pay for a table scan
+// when that hint is non-zero.
+//
+
+// Called by a port before it evaluates a wait that it may pend
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableNoteReadyWaiter(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+// Called by a port when it hands its pended waits back for re-evaluation;
+// returns TRUE if it had any.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+PortTableClearReadyWaiter(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+// Called after a port's outgoing data or incoming space changed
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PortTableSignalReady(
+    VOID
+);
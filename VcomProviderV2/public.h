@@ -17,5 +17,531 @@ DEFINE_GUID(GUID_DEVINTERFACE_VCOM_CONTROL,
 #define IOCTL_VCOM_PUSH_INCOMING  CTL_CODE(FILE_DEVICE_VCOM, 0x802, METHOD_IN_DIRECT,  FILE_ANY_ACCESS)
 #define IOCTL_VCOM_START          CTL_CODE(FILE_DEVICE_VCOM, 0x803, METHOD_BUFFERED,   FILE_ANY_ACCESS)
 #define IOCTL_VCOM_STOP           CTL_CODE(FILE_DEVICE_VCOM, 0x804, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_GET_RING_STATS CTL_CODE(FILE_DEVICE_VCOM, 0x805, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_MAP_RINGS      CTL_CODE(FILE_DEVICE_VCOM, 0x806, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_DOORBELL       CTL_CODE(FILE_DEVICE_VCOM, 0x807, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_GET_PORT_ID    CTL_CODE(FILE_DEVICE_VCOM, 0x808, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_WAIT_READY     CTL_CODE(FILE_DEVICE_VCOM, 0x809, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_BATCH          CTL_CODE(FILE_DEVICE_VCOM, 0x80A, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_PUSH_MODE  CTL_CODE(FILE_DEVICE_VCOM, 0x80B, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_GET_CREDIT     CTL_CODE(FILE_DEVICE_VCOM, 0x80C, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_LINE_STATE CTL_CODE(FILE_DEVICE_VCOM, 0x80D, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_COALESCING CTL_CODE(FILE_DEVICE_VCOM, 0x80E, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_OUTGOING_MODE CTL_CODE(FILE_DEVICE_VCOM, 0x80F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_VCOM_GET_INCOMING_AGE  CTL_CODE(FILE_DEVICE_VCOM, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_VCOM_GET_LATENCY    CTL_CODE(FILE_DEVICE_VCOM, 0x811, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_DRAIN_TRACE    CTL_CODE(FILE_DEVICE_VCOM, 0x812, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_VCOM_CREATE_PORT    CTL_CODE(FILE_DEVICE_VCOM, 0x813, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_DESTROY_PORT   CTL_CODE(FILE_DEVICE_VCOM, 0x814, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_PAIR_PORTS     CTL_CODE(FILE_DEVICE_VCOM, 0x815, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_PACING     CTL_CODE(FILE_DEVICE_VCOM, 0x816, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_PARITY_MODE CTL_CODE(FILE_DEVICE_VCOM, 0x817, METHOD_BUFFERED,  FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_LINE_FLOW  CTL_CODE(FILE_DEVICE_VCOM, 0x818, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+#define IOCTL_VCOM_GET_MODEM_CONTROL CTL_CODE(FILE_DEVICE_VCOM, 0x819, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_VCOM_SET_READ_MODE  CTL_CODE(FILE_DEVICE_VCOM, 0x81A, METHOD_BUFFERED,   FILE_ANY_ACCESS)
+
+// Output of IOCTL_VCOM_GET_RING_STATS, one per ring direction
+typedef struct _VCOM_RING_STATS {
+	ULONG   Capacity;       // current ring size in bytes
+	ULONG   Occupancy;      // bytes buffered at the time of the call
+	ULONG   MinCapacity;    // elastic floor (configured size / SET_QUEUE_SIZE)
+	ULONG   MaxCapacity;    // elastic ceiling for this port
+	ULONG   GrowCount;      // elastic grow events since the port was created
+	ULONG   ShrinkCount;    // elastic shrink events since the port was created
+	ULONG64 DroppedBytes;   // bytes refused because the ring was full
+} VCOM_RING_STATS, * PVCOM_RING_STATS;
+
+typedef struct _VCOM_QUEUE_STATS {
+	VCOM_RING_STATS ToUser;         // App -> Service (IOCTL_VCOM_GET_OUTGOING)
+	VCOM_RING_STATS FromNetwork;    // Service -> App (IOCTL_VCOM_PUSH_INCOMING)
+	ULONG64         GlobalBytesInUse;   // ring storage across all ports
+	ULONG64         GlobalBudget;
+} VCOM_QUEUE_STATS, * PVCOM_QUEUE_STATS;
+
+//
+// Performance counters. Every port that has a PortId publishes a
+// VCOM_PORT_COUNTERS page in a named section, VCOM_COUNTERS_NAME_FORMAT with
+// the PortId filled in. Monitoring tools map it with
+// OpenFileMapping(FILE_MAP_READ) and MapViewOfFile and read it directly, no
+// IOCTL needed; they should close the section handle once it is mapped, so
+// the name is free again when the port is recreated.
+//
+// Counters are updated without locks or barriers. Each one is a naturally
+// aligned 64-bit value and never reads torn, but different counters are not
+// read as of the same instant. Counts run from when the port was created.
+// In shared-ring mode the service moves its ends of the rings itself, so
+// BytesDrained, BytesPushed and FromNetHighWater do not advance, and
+// FromNetFree stays 0.
+//
+// FromNetFree is the push credit: what IOCTL_VCOM_PUSH_INCOMING can take
+// without dropping or pending, as of the last transfer in either direction.
+// A service that reads it before each push needs no IOCTL_VCOM_GET_CREDIT
+// round trip. Pended pushes take freed space first, so while any are
+// waiting a new push gets less than it says.
+//
+
+#define VCOM_COUNTERS_VERSION       2
+#define VCOM_COUNTERS_NAME_FORMAT   L"Global\\VcomCounters%u"
+
+typedef struct _VCOM_PORT_COUNTERS {
+	ULONG   Version;                // VCOM_COUNTERS_VERSION
+	ULONG   Size;                   // of this structure
+	ULONG   PortId;
+	ULONG   Reserved;
+
+	// App -> Service
+	volatile LONG64 BytesWritten;       // taken from application writes
+	volatile LONG64 BytesDrained;       // handed to the service
+	volatile LONG64 TruncatedBytes;     // of writes cancelled or timed out before all went in
+	volatile LONG64 ToUserOccupancy;    // buffered as of the last transfer
+	volatile LONG64 ToUserHighWater;
+
+	// Service -> App
+	volatile LONG64 BytesPushed;        // taken from the service
+	volatile LONG64 BytesRead;          // handed to the application
+	volatile LONG64 DroppedBytes;       // pushed bytes refused because the ring was full
+	volatile LONG64 FromNetOccupancy;
+	volatile LONG64 FromNetHighWater;
+
+	// Requests that had to wait
+	volatile LONG64 ReadsPended;
+	volatile LONG64 WritesPended;
+	volatile LONG64 OutgoingPended;     // IOCTL_VCOM_GET_OUTGOING
+
+	volatile LONG64 Starts;             // IOCTL_VCOM_START
+	volatile LONG64 Stops;              // IOCTL_VCOM_STOP
+
+	volatile LONG64 ParityErrors;       // incoming bytes that failed the parity check
+
+	volatile LONG64 FromNetFree;        // version 2: free space in the incoming ring
+} VCOM_PORT_COUNTERS, * PVCOM_PORT_COUNTERS;
+
+//
+// Push flow control. IOCTL_VCOM_SET_PUSH_MODE takes a ULONG mode. In the
+// default partial mode PUSH_INCOMING takes what fits and returns the count;
+// in pend mode a push that does not fit stays pending, with the bytes that
+// did fit already in the ring, and completes once the application has read
+// enough for the rest. Pended pushes complete in order, and a partial-mode
+// push (or BATCH push) takes nothing while any are pending. The mode reverts
+// to partial when the control handle closes.
+//
+// A push with an output buffer of at least sizeof(VCOM_PUSH_CREDIT) gets the
+// credit left after it written there, when it completes; the returned byte
+// count is still what was pushed. With that, or FromNetFree in the counter
+// page, the service can size its next network read without asking.
+//
+// IOCTL_VCOM_GET_CREDIT returns a VCOM_PUSH_CREDIT too. It is for the
+// service that has nothing to push into: with a ULONG minimum as input it
+// pends until that much space is free (capped at Capacity).
+//
+
+#define VCOM_PUSH_MODE_PARTIAL  0
+#define VCOM_PUSH_MODE_PEND     1
+
+typedef struct _VCOM_PUSH_CREDIT {
+	ULONG   FreeBytes;      // bytes a push can take right now without pending
+	ULONG   Capacity;       // current size of the incoming ring
+	ULONG   PushesPending;  // pended pushes waiting for space; FreeBytes is 0 until they are in
+} VCOM_PUSH_CREDIT, * PVCOM_PUSH_CREDIT;
+
+//
+// GET_OUTGOING coalescing. By default a pended GET_OUTGOING completes as soon
+// as one byte is written, which costs the service a wakeup per byte against
+// an application that writes a byte at a time. IOCTL_VCOM_SET_COALESCING
+// takes a VCOM_COALESCE: GET_OUTGOING then completes once MinBytes are
+// buffered, or MaxDelayMs after the oldest of them was first seen, whichever
+// comes first (a full ring or a blocked write always completes it). With
+// VCOM_COALESCE_ADAPTIVE the byte target moves between 1 and MinBytes with
+// the write pattern, so sparse traffic stops paying the delay. MinBytes of 0
+// or 1 turns coalescing off, which is the default and what latency-sensitive
+// ports should keep; it reverts to off when the control handle closes.
+//
+
+#define VCOM_COALESCE_ADAPTIVE  0x00000001
+
+typedef struct _VCOM_COALESCE {
+	ULONG   MinBytes;
+	ULONG   MaxDelayMs;     // required when MinBytes > 1
+	ULONG   Flags;          // VCOM_COALESCE_*
+} VCOM_COALESCE, * PVCOM_COALESCE;
+
+//
+// Framed GET_OUTGOING. IOCTL_VCOM_SET_OUTGOING_MODE takes a ULONG mode and is
+// only accepted while the port is stopped and not in shared-ring mode. In
+// framed mode GET_OUTGOING (and batch DRAIN) return a sequence of chunks,
+// each a VCOM_RECORD_HEADER followed by Length bytes padded to
+// VCOM_RECORD_ALIGN. A chunk holds bytes of exactly one application write;
+// every write gets the next Sequence number, and a write that is split
+// across chunks (or drains) keeps it, with FIRST on its first chunk and LAST
+// on its last. A write that was cancelled or timed out part way carries
+// TRUNCATED on its last chunk, which may then be empty. Timestamp is when
+// the driver took the write. An XON or XOFF the driver sends itself (see
+// IOCTL_SERIAL_SET_HANDFLOW) comes as a one-byte chunk of its own, flagged
+// CONTROL and FIRST|LAST, with a Sequence of 0. The mode is kept until the
+// last handle on the port closes.
+//
+// Timestamps here and in VCOM_INCOMING_AGE are interrupt time in 100ns units,
+// the clock user mode reads with QueryInterruptTimePrecise.
+//
+
+#define VCOM_OUTGOING_MODE_STREAM   0
+#define VCOM_OUTGOING_MODE_FRAMED   1
+
+#define VCOM_RECORD_FIRST       0x00000001
+#define VCOM_RECORD_LAST        0x00000002
+#define VCOM_RECORD_TRUNCATED   0x00000004
+#define VCOM_RECORD_CONTROL     0x00000008
+
+#define VCOM_RECORD_ALIGN(_len_) (((_len_) + 7) & ~(size_t)7)
+
+typedef struct _VCOM_RECORD_HEADER {
+	ULONG   Length;         // data bytes following this header
+	ULONG   Flags;          // VCOM_RECORD_*
+	ULONG64 Sequence;       // per-port write number, starting at 1
+	ULONG64 Timestamp;
+} VCOM_RECORD_HEADER, * PVCOM_RECORD_HEADER;
+
+// Output of IOCTL_VCOM_GET_INCOMING_AGE: how long the oldest byte not yet
+// read by the application has been waiting (Now - Oldest). Oldest is 0 when
+// nothing is waiting. Not maintained in shared-ring mode.
+typedef struct _VCOM_INCOMING_AGE {
+	ULONG64 Now;
+	ULONG64 Oldest;
+	ULONG   Unread;         // bytes pushed and not yet read
+	ULONG   Reserved;
+} VCOM_INCOMING_AGE, * PVCOM_INCOMING_AGE;
+
+//
+// Latency histograms. Each port keeps two: Outgoing, from EvtIoWrite taking
+// a write to its last byte being drained to the service, and Incoming, from
+// a push landing in the ring to its last byte being copied into a read. One
+// sample is taken per write or push, in the same 100ns units as the
+// timestamps above. Not kept in shared-ring mode.
+//
+// IOCTL_VCOM_GET_LATENCY returns a VCOM_LATENCY_SNAPSHOT. An optional ULONG
+// input of VCOM_LATENCY_RESET zeroes the histograms as they are read, without
+// losing samples recorded meanwhile.
+//
+// Buckets are log-linear: values below 2 * VCOM_LATENCY_SUB_BUCKETS have a
+// bucket each; above that each power of two is split into
+// VCOM_LATENCY_SUB_BUCKETS equal buckets (under 12.5% wide). Bucket i holds
+// values from VCOM_LATENCY_BUCKET_LOW(i) up to the next bucket's low bound;
+// the last one also holds everything past 2^VCOM_LATENCY_RANGE_BITS (about
+// 1.9 hours).
+//
+
+#define VCOM_LATENCY_RESET          0x00000001
+
+#define VCOM_LATENCY_SUB_BITS       3
+#define VCOM_LATENCY_SUB_BUCKETS    (1 << VCOM_LATENCY_SUB_BITS)
+#define VCOM_LATENCY_RANGE_BITS     36
+#define VCOM_LATENCY_BUCKETS        272
+
+#define VCOM_LATENCY_BUCKET_LOW(_i_)                                                    \
+	(((_i_) < 2 * VCOM_LATENCY_SUB_BUCKETS) ? (ULONG64)(_i_) :                          \
+	 (ULONG64)(VCOM_LATENCY_SUB_BUCKETS + ((_i_) - 2 * VCOM_LATENCY_SUB_BUCKETS) % VCOM_LATENCY_SUB_BUCKETS) \
+	    << (((_i_) - 2 * VCOM_LATENCY_SUB_BUCKETS) / VCOM_LATENCY_SUB_BUCKETS + 1))
+
+typedef struct _VCOM_LATENCY_HISTOGRAM {
+	ULONG64 Samples;                        // sum of Counts
+	ULONG64 Counts[VCOM_LATENCY_BUCKETS];
+} VCOM_LATENCY_HISTOGRAM, * PVCOM_LATENCY_HISTOGRAM;
+
+typedef struct _VCOM_LATENCY_SNAPSHOT {
+	VCOM_LATENCY_HISTOGRAM Outgoing;        // write -> GET_OUTGOING
+	VCOM_LATENCY_HISTOGRAM Incoming;        // PUSH_INCOMING -> read
+} VCOM_LATENCY_SNAPSHOT, * PVCOM_LATENCY_SNAPSHOT;
+
+//
+// Binary trace. The driver records events into per-processor rings instead
+// of formatting debug output on its hot paths. IOCTL_VCOM_DRAIN_TRACE, on
+// any port's control handle (STATUS_ACCESS_DENIED on a COM-side handle),
+// moves the oldest records not yet drained into its output buffer as an
+// array of VCOM_TRACE_RECORD; the byte count returned says how many.
+// Records come grouped by processor, each group in order; sort on
+// Timestamp (interrupt time, 100ns) to merge them. Records lost to a full
+// ring are counted in a VCOM_TRACE_EVENT_LOST record at the end.
+//
+
+#define VCOM_TRACE_EVENT_IOCTL          1   // Args: IoControlCode, input length
+#define VCOM_TRACE_EVENT_WRITE          2   // Args: length
+#define VCOM_TRACE_EVENT_READ           3   // Args: length
+#define VCOM_TRACE_EVENT_WRITE_TIMEOUT  4   // Args: bytes transferred
+#define VCOM_TRACE_EVENT_READ_TIMEOUT   5   // Args: bytes transferred
+#define VCOM_TRACE_EVENT_OUTGOING_RESIZED 6 // Args: old capacity, new capacity
+#define VCOM_TRACE_EVENT_INCOMING_RESIZED 7 // Args: old capacity, new capacity
+#define VCOM_TRACE_EVENT_PORT_ADDED     8
+#define VCOM_TRACE_EVENT_PORT_REMOVED   9
+#define VCOM_TRACE_EVENT_LOST           0xFFFF  // Args: records lost
+
+typedef struct _VCOM_TRACE_RECORD {
+	ULONG64 Timestamp;
+	USHORT  EventId;        // VCOM_TRACE_EVENT_*
+	USHORT  Level;          // DPFLTR_*_LEVEL
+	ULONG   Processor;
+	ULONG   PortId;         // VCOM_INVALID_PORT_ID if none
+	ULONG   Reserved;
+	ULONG64 Args[2];
+} VCOM_TRACE_RECORD, * PVCOM_TRACE_RECORD;
+
+//
+// Serial events. The application's IOCTL_SERIAL_WAIT_ON_MASK pends until an
+// event in its mask occurs: EV_RXCHAR when pushed data lands in the incoming
+// ring, EV_TXEMPTY when the outgoing ring has been drained empty, and the
+// modem and line events below. Events that occur while no wait is pending
+// are remembered until the next one.
+//
+// IOCTL_VCOM_SET_LINE_STATE takes a VCOM_LINE_STATE with the remote end's
+// modem lines (SERIAL_MSR_CTS/DSR/RI/DCD) and any line errors seen since the
+// last call (SERIAL_ERROR_*). Line changes raise EV_CTS, EV_DSR, EV_RLSD and
+// EV_RING (RI falling); errors raise EV_BREAK and EV_ERR and are reported to
+// the application by IOCTL_SERIAL_GET_COMMSTATUS.
+//
+
+#define VCOM_SUPPORTED_EVENTS   (SERIAL_EV_RXCHAR | SERIAL_EV_RXFLAG | SERIAL_EV_TXEMPTY | SERIAL_EV_CTS | \
+                                 SERIAL_EV_DSR | SERIAL_EV_RLSD | SERIAL_EV_BREAK | SERIAL_EV_ERR | \
+                                 SERIAL_EV_RING)
+#define VCOM_LINE_MODEM_MASK    (SERIAL_MSR_CTS | SERIAL_MSR_DSR | SERIAL_MSR_RI | SERIAL_MSR_DCD)
+
+typedef struct _VCOM_LINE_STATE {
+	ULONG   ModemStatus;    // SERIAL_MSR_* lines as now
+	ULONG   Errors;         // SERIAL_ERROR_* since the last call
+} VCOM_LINE_STATE, * PVCOM_LINE_STATE;
+
+//
+// Multi-port control. Every port has a driver-wide PortId (returned as a ULONG
+// by IOCTL_VCOM_GET_PORT_ID), and the IOCTLs below may be issued on any one
+// control handle to act on many ports at once: on its own port, and on every
+// port whose control handle the same process has open. They fail with
+// STATUS_ACCESS_DENIED on a COM-side handle. Other ports are left out:
+// WAIT_READY never reports them ready, and BATCH entries for them fail with
+// STATUS_ACCESS_DENIED.
+//
+
+#define VCOM_INVALID_PORT_ID    0xFFFFFFFF
+
+// IOCTL_VCOM_WAIT_READY: the input is an array of VCOM_PORT_READY with the
+// events of interest. The request completes as soon as at least one of them
+// holds; the output is the array of ports that are ready and which events.
+#define VCOM_READY_OUTGOING     0x00000001  // outgoing data is waiting to be drained
+#define VCOM_READY_INCOMING     0x00000002  // incoming ring has free space for a push
+#define VCOM_READY_LINES        0x00000004  // DTR or RTS changed (IOCTL_VCOM_GET_MODEM_CONTROL)
+
+typedef struct _VCOM_PORT_READY {
+	ULONG   PortId;
+	ULONG   Events;
+} VCOM_PORT_READY, * PVCOM_PORT_READY;
+
+// IOCTL_VCOM_BATCH: the input is a sequence of VCOM_BATCH_ENTRY headers, a
+// PUSH header being followed by Length bytes of payload (padded to
+// VCOM_BATCH_ALIGN). The output holds one header per processed entry, with
+// Length and Status filled in; a DRAIN header is followed by the drained
+// bytes (padded likewise). Processing stops early when the output is full.
+#define VCOM_BATCH_OP_PUSH      1   // Length: payload bytes, pushed to the port's incoming ring
+#define VCOM_BATCH_OP_DRAIN     2   // Length: most bytes to drain from the port's outgoing ring
+
+#define VCOM_BATCH_ALIGN(_len_) (((_len_) + 7) & ~(size_t)7)
+
+typedef struct _VCOM_BATCH_ENTRY {
+	ULONG   PortId;
+	USHORT  Op;
+	USHORT  Reserved;
+	ULONG   Length;
+	LONG    Status;     // output only (NTSTATUS)
+} VCOM_BATCH_ENTRY, * PVCOM_BATCH_ENTRY;
+
+//
+// Dynamic ports. Besides the port it is installed with, a device can host
+// more ports created at run time: IOCTL_VCOM_CREATE_PORT, on a control
+// handle, takes a VCOM_PORT_CREATE and returns the new port's PortId as a
+// ULONG. Sizes of 0 take the driver defaults. Applications open the port as
+// \\.\<PortName>; its service opens the control interface path with
+// "\<PortName>" appended. IOCTL_VCOM_DESTROY_PORT takes a PortId of a port
+// created this way on the same device and fails with STATUS_DEVICE_BUSY
+// while any handle to that port is open. Ports still there when the device
+// goes away are destroyed with it.
+//
+
+#define VCOM_PORT_NAME_LENGTH   16          // WCHARs, terminator included
+#define VCOM_PORT_SEGMENTED     0x00000001  // pooled segment chains, as SegmentedBuffers
+
+typedef struct _VCOM_PORT_CREATE {
+	WCHAR   PortName[VCOM_PORT_NAME_LENGTH];    // e.g. L"COM17"; no backslashes
+	ULONG   InQueueSize;        // as the RxQueueSize registry value
+	ULONG   OutQueueSize;       // as TxQueueSize
+	ULONG   MaxQueueSize;       // as MaxQueueSize
+	ULONG   Flags;              // VCOM_PORT_*
+} VCOM_PORT_CREATE, * PVCOM_PORT_CREATE;
+
+//
+// Null-modem pairs. IOCTL_VCOM_PAIR_PORTS, on a control handle that controls
+// both ports (see multi-port control above), takes a VCOM_PORT_PAIR and
+// wires two ports together inside the driver, with no service in between:
+// what one port's application writes lands in the other's incoming ring,
+// and each side's DTR and RTS show up as the other's DSR/DCD and CTS. A
+// port paired with itself loops back. Writes pend until the peer reads, as
+// pended pushes do, and are not subject to write timeouts. Pushes are
+// refused on a paired port, and ports in shared-ring mode cannot be paired
+// or mapped while paired. A PeerId of
+// VCOM_INVALID_PORT_ID undoes PortId's pair; writes still pending across it
+// complete with STATUS_CANCELLED, and the crossed lines drop. Paired ports
+// are started and stopped with IOCTL_VCOM_START and IOCTL_VCOM_STOP as usual.
+//
+
+typedef struct _VCOM_PORT_PAIR {
+	ULONG   PortId;
+	ULONG   PeerId;     // PortId for loopback, VCOM_INVALID_PORT_ID to unpair
+} VCOM_PORT_PAIR, * PVCOM_PORT_PAIR;
+
+//
+// Baud-rate pacing. By default bytes move as fast as memory allows.
+// IOCTL_VCOM_SET_PACING takes a ULONG of VCOM_PACE_* flags: with TRANSMIT,
+// application writes go into the outgoing ring only as fast as a UART would
+// send them at the port's baud rate and line control (start, data, parity
+// and stop bits all count), so writes complete at line speed; with RECEIVE,
+// application reads take bytes out of the incoming ring at that rate, and
+// pushes back up behind them. Changes of baud rate or line control apply at
+// once. Pacing is off by default and kept until changed.
+//
+
+#define VCOM_PACE_TRANSMIT      0x00000001
+#define VCOM_PACE_RECEIVE       0x00000002
+
+//
+// Word length and parity. Bytes in both directions are always masked to the
+// word length set by IOCTL_SERIAL_SET_LINE_CONTROL. IOCTL_VCOM_SET_PARITY_MODE
+// takes a VCOM_PARITY_MODE that also carries the line control's parity on the
+// data path, in the bit just above the data bits: with GENERATE, application
+// writes have it set as a UART would send it; with CHECK, incoming bytes
+// have it checked and stripped, and each byte that fails counts as a
+// SERIAL_ERROR_PARITY line error and raises SERIAL_EV_ERR. With REPLACE as
+// well, failed bytes are delivered as ErrorChar. Words of 8 bits carry no
+// parity bit, so only the mask applies to them. On a paired port the
+// writer's GENERATE and the reader's CHECK apply in turn. Bytes the service
+// writes straight into a shared ring are not masked or checked. Off by
+// default and kept until changed.
+//
+
+#define VCOM_PARITY_GENERATE    0x00000001
+#define VCOM_PARITY_CHECK       0x00000002
+#define VCOM_PARITY_REPLACE     0x00000004
+
+typedef struct _VCOM_PARITY_MODE {
+	ULONG   Flags;          // VCOM_PARITY_*
+	UCHAR   ErrorChar;      // with VCOM_PARITY_REPLACE
+	UCHAR   Reserved[3];
+} VCOM_PARITY_MODE, * PVCOM_PARITY_MODE;
+
+//
+// Software flow control. When the application turns on XON/XOFF with
+// IOCTL_SERIAL_SET_HANDFLOW, the service sees it on the data path only.
+// With SERIAL_AUTO_TRANSMIT, XON and XOFF in pushed data are taken out of it,
+// and after an XOFF GET_OUTGOING returns nothing more until XON. With
+// SERIAL_AUTO_RECEIVE, the driver sends XOFF when the incoming ring gets
+// close to full and XON when it has drained: the character comes first in
+// the next GET_OUTGOING, ahead of queued data and even while transmission is
+// held. Paired and shared-ring ports pass XON and XOFF through as data.
+//
+
+//
+// Hardware flow control, emulated from the rings' fill levels.
+//
+// IOCTL_VCOM_SET_LINE_FLOW takes a VCOM_LINE_FLOW naming the application's
+// input lines (SERIAL_MSR_CTS/DSR/DCD) the driver should drive itself: they
+// drop once OffLimit or fewer bytes of the outgoing ring are free, and come
+// back once OnLimit or fewer are left in it, so the application sees CTS
+// fall when the service falls behind. Limits of zero pick an eighth free
+// and half full. Lines is zero to hand them back to IOCTL_VCOM_SET_LINE_STATE.
+//
+// With SERIAL_RTS_HANDSHAKE or SERIAL_DTR_HANDSHAKE the application's RTS or
+// DTR follow the incoming ring in the same way, between the XoffLimit and
+// XonLimit of its SERIAL_HANDFLOW. Any change of DTR or RTS sets
+// VCOM_READY_LINES until the service reads them (SERIAL_MCR_*) with
+// IOCTL_VCOM_GET_MODEM_CONTROL, and should hold its pushes while they are
+// low. With SERIAL_CTS_HANDSHAKE, SERIAL_DSR_HANDSHAKE or
+// SERIAL_DCD_HANDSHAKE application writes wait while the line is low, once
+// it has been reported or driven. Shared-ring ports do not take part.
+//
+
+typedef struct _VCOM_LINE_FLOW {
+	ULONG   Lines;          // SERIAL_MSR_CTS/DSR/DCD driven from the outgoing ring
+	ULONG   OffLimit;       // lines drop at this many free bytes or fewer
+	ULONG   OnLimit;        // and come back at this many buffered or fewer
+} VCOM_LINE_FLOW, * PVCOM_LINE_FLOW;
+
+//
+// Event character. Bytes entering the incoming ring are searched for the
+// SERIAL_CHARS.EventChar set with IOCTL_SERIAL_SET_CHARS while the
+// application waits for SERIAL_EV_RXFLAG, which is raised when one comes in.
+// IOCTL_VCOM_SET_READ_MODE takes a ULONG of VCOM_READ_* flags: with
+// EVENT_CHAR, reads also complete right after an event character, so a
+// line- or frame-oriented application gets one line or frame per read.
+// Bytes the service writes straight into a shared ring are not searched.
+//
+
+#define VCOM_READ_EVENT_CHAR    0x00000001
+
+//
+// Shared-memory ring mode.
+//
+// IOCTL_VCOM_MAP_RINGS (control handle only, device stopped) maps a
+// VCOM_SHARED_HEADER and both data areas into the calling process. From then
+// on the service moves data by updating ring indices directly instead of
+// issuing GET_OUTGOING / PUSH_INCOMING; the mapping is removed when the
+// control handle is closed.
+//
+// Each ring is single-producer/single-consumer. Indices are free-running byte
+// counts; a byte's offset in the data area is its index & (Capacity - 1).
+// Each side writes only its own index (with release semantics) and reads the
+// other side's index with acquire semantics.
+//
+// Blocking and wakeups (event suppression):
+//  - A side about to block sets its *Waiting flag, issues a full barrier,
+//    re-checks the ring and only then waits.
+//  - After moving its index the other side issues a full barrier and kicks
+//    the waiter only if the flag is set.
+//  - The driver kicks the service through the events passed to MAP_RINGS.
+//    The service kicks the driver with IOCTL_VCOM_DOORBELL, and only when
+//    FromNetwork.ConsumerWaiting is set (an application read is pending) or
+//    ToUser.ProducerWaiting is set (an application write is pending).
+//
+
+#define VCOM_SHARED_RING_VERSION  1
+
+typedef struct _VCOM_SHARED_RING_CONTROL {
+	volatile ULONG64 ProducerIndex;     // written by the producer only
+	UCHAR            Reserved0[56];
+	volatile ULONG64 ConsumerIndex;     // written by the consumer only
+	UCHAR            Reserved1[56];
+	volatile LONG    ProducerWaiting;   // producer is blocked on a full ring
+	volatile LONG    ConsumerWaiting;   // consumer is blocked on an empty ring
+	UCHAR            Reserved2[56];
+} VCOM_SHARED_RING_CONTROL, * PVCOM_SHARED_RING_CONTROL;
+
+typedef struct _VCOM_SHARED_HEADER {
+	ULONG   Version;                // VCOM_SHARED_RING_VERSION
+	ULONG   Size;                   // whole mapping, header included
+	ULONG   ToUserOffset;           // data area offsets from the header
+	ULONG   ToUserCapacity;         // power of two
+	ULONG   FromNetworkOffset;
+	ULONG   FromNetworkCapacity;    // power of two
+	UCHAR   Reserved[40];
+	VCOM_SHARED_RING_CONTROL ToUser;        // driver produces, service consumes
+	VCOM_SHARED_RING_CONTROL FromNetwork;   // service produces, driver consumes
+} VCOM_SHARED_HEADER, * PVCOM_SHARED_HEADER;
+
+// Input of IOCTL_VCOM_MAP_RINGS. Handles are auto-reset events owned by the
+// service; they are carried as 64-bit values so 32-bit services can use them.
+typedef struct _VCOM_MAP_RINGS_IN {
+	ULONG64 ToUserEvent;        // set when ToUser gains data while ToUser.ConsumerWaiting
+	ULONG64 FromNetworkEvent;   // set when FromNetwork gains space while FromNetwork.ProducerWaiting
+} VCOM_MAP_RINGS_IN, * PVCOM_MAP_RINGS_IN;
+
+// Output of IOCTL_VCOM_MAP_RINGS
+typedef struct _VCOM_MAP_RINGS_OUT {
+	ULONG64 BaseAddress;        // VCOM_SHARED_HEADER in the caller's address space
+	ULONG   Size;
+	ULONG   Reserved;
+} VCOM_MAP_RINGS_OUT, * PVCOM_MAP_RINGS_OUT;
 
 #endif // _PUBLIC_H_
\ No newline at end of file
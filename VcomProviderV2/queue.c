@@ -1,20 +1,69 @@
 #include "common.h"
 
+#define QUEUE_TOUSER_POOL_TAG   'moVT'
+#define QUEUE_FROMNET_POOL_TAG  'moVF'
+#define QUEUE_RECORD_POOL_TAG   'mRoV'
+
+// Ring storage currently allocated across every port, checked against
+// QUEUE_GLOBAL_RING_BUDGET whenever a ring grows.
+static volatile LONG64 QueueRingBytesInUse = 0;
+
+// The pending-request pumps and the timeout callbacks call into each other
+static VOID QueuePumpIncoming(_In_ PQUEUE_CONTEXT QueueContext);
+static VOID QueuePumpOutgoing(_In_ PQUEUE_CONTEXT QueueContext);
+static VOID QueueCompleteWaitOnMask(_In_ WDFREQUEST Request, _In_ ULONG Events);
+static TIMER_WHEEL_CALLBACK QueueReadTimerExpired;
+static TIMER_WHEEL_CALLBACK QueueWriteTimerExpired;
+static TIMER_WHEEL_CALLBACK QueueCoalesceTimerExpired;
+static TIMER_WHEEL_CALLBACK QueueTxPacingTimerExpired;
+static TIMER_WHEEL_CALLBACK QueueRxPacingTimerExpired;
+
+// Ring resets clear the data timing and event characters along with the data
+static VOID QueueMarkReset(_Inout_ PQUEUE_MARK_LOG Log);
+static VOID QueueEventCharReset(_Inout_ PQUEUE_EVENT_CHAR_LOG Log);
+
+// A port going away takes its null-modem pair down with it
+static VOID QueueUnpair(_In_ PQUEUE_CONTEXT QueueContext);
+
+// Pushed bytes go through XON/XOFF flow control as they land
+static BOOLEAN QueueFlowApplies(_In_ PQUEUE_CONTEXT QueueContext);
+
+// Flow control settings and ring fill levels move the modem lines
+static VOID QueueSetLineState(_In_ PQUEUE_CONTEXT QueueContext, _In_opt_ PVCOM_LINE_STATE LineState);
+static VOID QueueUpdateLineFlow(_In_ PQUEUE_CONTEXT QueueContext);
+static VOID QueueModemControlChanged(_In_ PQUEUE_CONTEXT QueueContext);
+
+// Pended writes and pushes go through pendxfer.c, which reaches the rings
+// and the manual queues through these
+static PEND_TRANSFER QueuePendTransfer;
+static PEND_QUEUED QueuePendQueued;
+static PEND_DEQUEUE QueuePendDequeue;
+static PEND_HOLD QueuePendHold;
+
+static const PEND_QUEUE_OPS QueuePendOps = {
+    QueuePendTransfer, QueuePendQueued, QueuePendDequeue, QueuePendHold
+};
+
+// The counter page and finished pushes report the credit left for pushes
+static VOID QueuePublishPushCredit(_In_ PQUEUE_CONTEXT QueueContext);
+static VOID QueueReturnPushCredit(_In_ PQUEUE_CONTEXT QueueContext, _In_ WDFREQUEST Request);
+
 NTSTATUS
 QueueCreate(
-    _In_  PDEVICE_CONTEXT   DeviceContext
+    _In_  PPORT_CONTEXT     PortContext
 )
 {
     NTSTATUS                status;
-    WDFDEVICE               device = DeviceContext->Device;
+    WDFDEVICE               device = PortContext->Device;
     WDF_IO_QUEUE_CONFIG     queueConfig;
     WDF_OBJECT_ATTRIBUTES   queueAttributes;
     WDFQUEUE                queue;
     PQUEUE_CONTEXT          queueContext;
 
     
-    // 1) Create the default parallel queue
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
+    // 1) Create the port's parallel queue; VcomEvtIoDispatch forwards the
+    // port's requests here from the device's default queue
+    WDF_IO_QUEUE_CONFIG_INIT(
         &queueConfig,
         WdfIoQueueDispatchParallel);
 
@@ -25,6 +74,7 @@ QueueCreate(
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(
         &queueAttributes,
         QUEUE_CONTEXT);
+    queueAttributes.EvtCleanupCallback = EvtQueueCleanup;
 
     status = WdfIoQueueCreate(
         device,
@@ -39,8 +89,33 @@ QueueCreate(
 
     queueContext = GetQueueContext(queue);
     queueContext->Queue = queue;
-    queueContext->DeviceContext = DeviceContext;
-    queueContext->DeviceContext->IoQueue = queue; // let cleanup reach our manual queues & rings
+    queueContext->PortContext = PortContext;
+    queueContext->PortContext->IoQueue = queue; // let cleanup reach our manual queues & rings
+
+    // The port object stays until EvtQueueCleanup, however late that runs
+    WdfObjectReference(PortContext->Object);
+
+    // Before anything can fail: EvtQueueCleanup shuts these down
+    TimeoutEntryInitialize(&queueContext->ReadTimer, QueueReadTimerExpired, queueContext);
+    TimeoutEntryInitialize(&queueContext->WriteTimer, QueueWriteTimerExpired, queueContext);
+    TimeoutEntryInitialize(&queueContext->CoalesceTimer, QueueCoalesceTimerExpired, queueContext);
+    TimeoutEntryInitialize(&queueContext->TxPacingTimer, QueueTxPacingTimerExpired, queueContext);
+    TimeoutEntryInitialize(&queueContext->RxPacingTimer, QueueRxPacingTimerExpired, queueContext);
+    queueContext->Counters = &queueContext->CounterFallback;
+    PortSlotInitialize(&queueContext->Port);
+    PendInitialize(&queueContext->WritePend, &QueuePendOps, queueContext);
+    PendInitialize(&queueContext->PushPend, &QueuePendOps, queueContext);
+    PendCreditWaitInitialize(&queueContext->CreditWait);
+    KeInitializeEvent(&queueContext->SharedMappingDone, SynchronizationEvent, FALSE);
+
+    // Mask to the default word length; nothing else sees the port yet
+    DataFormatConfigure(&queueContext->TxFormat, PortContext->ValidDataMask,
+        PortContext->LineControlRegister, FALSE, FALSE, 0);
+    queueContext->RxFormat = queueContext->TxFormat;
+    SwFlowConfigure(&queueContext->SwFlow, &PortContext->HandFlow, &PortContext->Chars);
+    queueContext->EventChar = PortContext->Chars.EventChar;
+    LineFlowConfigure(&queueContext->RxLines,
+        (ULONG)PortContext->HandFlow.XoffLimit, (ULONG)PortContext->HandFlow.XonLimit);
 
     // 2) Manual queue for pending reads (IRP_MJ_READ)
     WDF_IO_QUEUE_CONFIG_INIT(
@@ -80,312 +155,5165 @@ QueueCreate(
         return status;
     }
 
-    // 4) Create spinlocks for each ring
-    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->RingBufferToUserModeLock);
+    // 3b) Manual queue for writes waiting on ring space
+    WDF_IO_QUEUE_CONFIG_INIT(
+        &queueConfig,
+        WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    queueConfig.EvtIoCanceledOnQueue = EvtIoCanceledOnQueue;
+    status = WdfIoQueueCreate(
+        device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &queueContext->WriteQueue);
+
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfIoQueueCreate WriteQueue failed 0x%x", status);
+        return status;
+    }
+
+    // 3c) Manual queues for pended pushes and IOCTL_VCOM_GET_CREDIT waits
+    WDF_IO_QUEUE_CONFIG_INIT(
+        &queueConfig,
+        WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    queueConfig.EvtIoCanceledOnQueue = EvtIoCanceledOnQueue;
+    status = WdfIoQueueCreate(
+        device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &queueContext->PushQueue);
+
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfIoQueueCreate PushQueue failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfIoQueueCreate(
+        device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &queueContext->CreditQueue);
+
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfIoQueueCreate CreditQueue failed 0x%x", status);
+        return status;
+    }
+
+    // 3d) Manual queue for pending IOCTL_VCOM_WAIT_READY
+    WDF_IO_QUEUE_CONFIG_INIT(
+        &queueConfig,
+        WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    queueConfig.EvtIoCanceledOnQueue = EvtIoCanceledOnQueue;
+    status = WdfIoQueueCreate(
+        device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &queueContext->ReadyWaitQueue);
+
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfIoQueueCreate ReadyWaitQueue failed 0x%x", status);
+        return status;
+    }
+
+    // 3e) Manual queue for the pending IOCTL_SERIAL_WAIT_ON_MASK
+    status = WdfIoQueueCreate(
+        device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &queueContext->WaitMaskQueue);
+
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfIoQueueCreate WaitMaskQueue failed 0x%x", status);
+        return status;
+    }
+
+    // 4) Create producer/consumer spinlocks for each ring
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->RingBufferToUserModeWriteLock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "RingBufferToUserModeWriteLock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->RingBufferToUserModeReadLock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "RingBufferToUserModeReadLock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->RingBufferFromNetworkWriteLock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "RingBufferFromNetworkWriteLock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->RingBufferFromNetworkReadLock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "RingBufferFromNetworkReadLock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->EventLock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "EventLock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->RecordLock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "RecordLock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->FlowLock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "FlowLock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->EgressLog.Lock);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "EgressLog lock create failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->IngressLog.Lock);
     if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR, "RingBufferToUserModeLock create failed 0x%x", status);
+        Trace(TRACE_LEVEL_ERROR, "IngressLog lock create failed 0x%x", status);
         return status;
     }
 
-    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->RingBufferFromNetworkLock);
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &queueContext->EventChars.Lock);
     if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR, "RingBufferFromNetworkLock create failed 0x%x", status);
+        Trace(TRACE_LEVEL_ERROR, "EventChars lock create failed 0x%x", status);
         return status;
     }
 
+    // 4b) Take a driver-wide PortId. Without one the port still works on its
+    // own handles; it just cannot be named in multi-port IOCTLs.
+    status = PortTableRegister(queueContext);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_WARNING, "PortTableRegister failed 0x%x", status);
+    }
+    else {
+        TracePoint(TRACE_LEVEL_INFO, VCOM_TRACE_EVENT_PORT_ADDED, queueContext->Port.PortId, 0, 0);
+
+        // 4c) Publish the port's counters under its PortId. Failing that the
+        // port keeps counting, just where nobody can see.
+        status = CounterPageCreate(&queueContext->CounterPage, queueContext->Port.PortId);
+        if (NT_SUCCESS(status)) {
+            queueContext->Counters = queueContext->CounterPage.Counters;
+        }
+        else {
+            Trace(TRACE_LEVEL_WARNING, "CounterPageCreate failed 0x%x", status);
+        }
+    }
+
     // 5) Allocate nonpaged backing storage via KMDF and init rings
     WDF_OBJECT_ATTRIBUTES memAttr;
     WDF_OBJECT_ATTRIBUTES_INIT(&memAttr);
     // Tie lifetime to the default queue; device lifetime works too
     memAttr.ParentObject = queueContext->Queue;
 
-    status = WdfMemoryCreate(&memAttr, NonPagedPoolNx, 'moVT',
-        DATA_BUFFER_SIZE,
+    queueContext->ToUserCapacity = RingPolicyRoundSize(PortContext->OutQueueSize);
+    queueContext->FromNetCapacity = RingPolicyRoundSize(PortContext->InQueueSize);
+
+    queueContext->ToUserPolicy.MinCapacity = queueContext->ToUserCapacity;
+    queueContext->ToUserPolicy.MaxCapacity = max(queueContext->ToUserCapacity,
+        RingPolicyRoundSize(PortContext->MaxQueueSize));
+    queueContext->FromNetPolicy.MinCapacity = queueContext->FromNetCapacity;
+    queueContext->FromNetPolicy.MaxCapacity = max(queueContext->FromNetCapacity,
+        RingPolicyRoundSize(PortContext->MaxQueueSize));
+    KeInitializeEvent(&queueContext->ToUserPolicy.ResizeDone, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&queueContext->FromNetPolicy.ResizeDone, SynchronizationEvent, FALSE);
+
+    if (PortContext->SegmentedBuffers) {
+        // Segment chains take memory from the shared pool as data arrives;
+        // the policy ceiling bounds how much each direction may hold.
+        queueContext->Segmented = TRUE;
+        queueContext->ToUserCapacity = 0;
+        queueContext->FromNetCapacity = 0;
+
+        status = SegBufferInitialize(&queueContext->SegToUserMode,
+            queueContext->ToUserPolicy.MaxCapacity);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "SegBufferInitialize(ToUser) failed 0x%x", status);
+            return status;
+        }
+
+        status = SegBufferInitialize(&queueContext->SegFromNetwork,
+            queueContext->FromNetPolicy.MaxCapacity);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "SegBufferInitialize(FromNet) failed 0x%x", status);
+            return status;
+        }
+
+        QueuePublishPushCredit(queueContext);
+        return STATUS_SUCCESS;
+    }
+
+    status = WdfMemoryCreate(&memAttr, NonPagedPoolNx, QUEUE_TOUSER_POOL_TAG,
+        queueContext->ToUserCapacity,
         &queueContext->ToUserMem,
         (PVOID*)&queueContext->ToUserBuffer);
     if (!NT_SUCCESS(status)) {
         Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate(ToUser) failed 0x%x", status);
+        queueContext->ToUserCapacity = 0;
+        queueContext->FromNetCapacity = 0;
         return status;
     }
+    InterlockedExchangeAdd64(&QueueRingBytesInUse, (LONG64)queueContext->ToUserCapacity);
 
-    status = WdfMemoryCreate(&memAttr, NonPagedPoolNx, 'moVF',
-        DATA_BUFFER_SIZE,
+    status = WdfMemoryCreate(&memAttr, NonPagedPoolNx, QUEUE_FROMNET_POOL_TAG,
+        queueContext->FromNetCapacity,
         &queueContext->FromNetMem,
         (PVOID*)&queueContext->FromNetBuffer);
     if (!NT_SUCCESS(status)) {
         Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate(FromNet) failed 0x%x", status);
+        queueContext->FromNetCapacity = 0;
         return status;
     }
+    InterlockedExchangeAdd64(&QueueRingBytesInUse, (LONG64)queueContext->FromNetCapacity);
 
-    queueContext->ToUserCapacity = DATA_BUFFER_SIZE;
-    queueContext->FromNetCapacity = DATA_BUFFER_SIZE;
-
-    RingBufferInitialize(&queueContext->RingBufferToUserMode,
+    status = RingBufferP2Initialize(&queueContext->RingBufferToUserMode,
         queueContext->ToUserBuffer,
         queueContext->ToUserCapacity);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "RingBufferP2Initialize(ToUser) failed 0x%x", status);
+        return status;
+    }
 
-    RingBufferInitialize(&queueContext->RingBufferFromNetwork,
+    status = RingBufferP2Initialize(&queueContext->RingBufferFromNetwork,
         queueContext->FromNetBuffer,
         queueContext->FromNetCapacity);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "RingBufferP2Initialize(FromNet) failed 0x%x", status);
+        return status;
+    }
 
+    QueuePublishPushCredit(queueContext);
     return STATUS_SUCCESS;
 }
 
 
-NTSTATUS
-RequestCopyFromBuffer(
-    _In_  WDFREQUEST        Request,
-    _In_  PVOID             SourceBuffer,
-    _In_  size_t            NumBytesToCopyFrom
+VOID
+EvtQueueCleanup(
+    _In_  WDFOBJECT         Object
 )
 {
-    NTSTATUS                status;
-    WDFMEMORY               memory;
+    PQUEUE_CONTEXT          queueContext = GetQueueContext((WDFQUEUE)Object);
+
+    // First, so neither a timeout nor another port's IOCTL can reach this
+    // one while it goes away
+    TimeoutEntryShutdown(&queueContext->ReadTimer);
+    TimeoutEntryShutdown(&queueContext->WriteTimer);
+    TimeoutEntryShutdown(&queueContext->CoalesceTimer);
+    TimeoutEntryShutdown(&queueContext->TxPacingTimer);
+    TimeoutEntryShutdown(&queueContext->RxPacingTimer);
+    QueueUnpair(queueContext);
+    PortTableUnregister(queueContext);
+
+    queueContext->Counters = &queueContext->CounterFallback;
+    CounterPageDestroy(&queueContext->CounterPage);
+
+    // The ring memory is parented to the queue and goes away with it
+    InterlockedExchangeAdd64(&QueueRingBytesInUse,
+        -(LONG64)(queueContext->ToUserCapacity + queueContext->FromNetCapacity));
+
+    // Segments belong to the driver-wide pool and must be handed back
+    if (queueContext->Segmented) {
+        SegBufferUninitialize(&queueContext->SegToUserMode);
+        SegBufferUninitialize(&queueContext->SegFromNetwork);
+    }
 
-    status = WdfRequestRetrieveOutputMemory(Request, &memory);
-    if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR,
-            "Error: WdfRequestRetrieveOutputMemory failed 0x%x", status);
-        return status;
+    // Normally already unmapped when the control handle closed
+    QueueUnmapSharedRings(queueContext);
+    if (queueContext->SharedMdl) {
+        MmUnmapLockedPages(queueContext->SharedHeader, queueContext->SharedMdl);
+        MmFreePagesFromMdl(queueContext->SharedMdl);
+        ExFreePool(queueContext->SharedMdl);
+        queueContext->SharedMdl = NULL;
+        queueContext->SharedHeader = NULL;
     }
 
-    status = WdfMemoryCopyFromBuffer(memory, 0,
-        SourceBuffer, NumBytesToCopyFrom);
-    if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR,
-            "Error: WdfMemoryCopyFromBuffer failed 0x%x", status);
-        return status;
+    WdfObjectDereference(queueContext->PortContext->Object);
+}
+
+
+VOID
+QueueDestroy(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    WDFQUEUE*               queues[] = {
+        &QueueContext->ReadQueue, &QueueContext->OutgoingQueue, &QueueContext->WriteQueue,
+        &QueueContext->PushQueue, &QueueContext->CreditQueue, &QueueContext->ReadyWaitQueue,
+        &QueueContext->WaitMaskQueue };
+    ULONG                   i;
+
+    // EvtQueueCleanup does both again, harmlessly
+    TimeoutEntryShutdown(&QueueContext->ReadTimer);
+    TimeoutEntryShutdown(&QueueContext->WriteTimer);
+    TimeoutEntryShutdown(&QueueContext->CoalesceTimer);
+    TimeoutEntryShutdown(&QueueContext->TxPacingTimer);
+    TimeoutEntryShutdown(&QueueContext->RxPacingTimer);
+    if (QueueContext->Port.PortId != VCOM_INVALID_PORT_ID) {
+        TracePoint(TRACE_LEVEL_INFO, VCOM_TRACE_EVENT_PORT_REMOVED, QueueContext->Port.PortId, 0, 0);
+    }
+    QueueUnpair(QueueContext);
+    PortTableUnregister(QueueContext);
+
+    // A write the former peer looked this port up for just before the
+    // unpair may still have been queued here
+    QueueCancelPendingWrites(QueueContext, FALSE);
+
+    // Unlike the device's default queue these can be deleted on their own.
+    // The manual queues are empty; the port's queue goes last, taking the
+    // rings with it.
+    for (i = 0; i < ARRAY_SIZE(queues); i++) {
+        if (*queues[i] != NULL) {
+            WdfObjectDelete(*queues[i]);
+            *queues[i] = NULL;
+        }
     }
+    WdfObjectDelete(QueueContext->Queue);
+}
 
-    WdfRequestSetInformation(Request, NumBytesToCopyFrom);
-    return status;
+
+VOID
+QueueResetRings(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // Resetting moves both cursors, so it must exclude the producer and the
+    // consumer of each ring. Always take the write lock before the read lock.
+    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeWriteLock);
+    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeReadLock);
+    if (QueueContext->Shared) {
+        // The service owns the consumer side; what it has not read stays
+    }
+    else if (QueueContext->Segmented) {
+        SegBufferReset(&QueueContext->SegToUserMode);
+    }
+    else {
+        RingBufferP2Reset(&QueueContext->RingBufferToUserMode);
+    }
+    WdfSpinLockAcquire(QueueContext->RecordLock);
+    QueueContext->RecordHead = 0;
+    QueueContext->RecordTail = 0;
+    WdfSpinLockRelease(QueueContext->RecordLock);
+    QueueMarkReset(&QueueContext->EgressLog);
+    WdfSpinLockRelease(QueueContext->RingBufferToUserModeReadLock);
+    WdfSpinLockRelease(QueueContext->RingBufferToUserModeWriteLock);
+
+    WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkWriteLock);
+    WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkReadLock);
+    if (QueueContext->Shared) {
+        // Indices are shared with the service, so drop data by consuming it
+        SharedRingDiscard(&QueueContext->SharedFromNetwork);
+    }
+    else if (QueueContext->Segmented) {
+        SegBufferReset(&QueueContext->SegFromNetwork);
+    }
+    else {
+        RingBufferP2Reset(&QueueContext->RingBufferFromNetwork);
+    }
+    QueueMarkReset(&QueueContext->IngressLog);
+    QueueEventCharReset(&QueueContext->EventChars);
+    QueuePublishPushCredit(QueueContext);
+    WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+    WdfSpinLockRelease(QueueContext->RingBufferFromNetworkWriteLock);
 }
 
 
+static
 NTSTATUS
-RequestCopyToBuffer(
-    _In_  WDFREQUEST        Request,
-    _In_  PVOID             DestinationBuffer,
-    _In_  size_t            NumBytesToCopyTo
+QueueResizeRing(
+    _Inout_ PRING_BUFFER_P2   Ring,
+    _In_    WDFSPINLOCK       WriteLock,
+    _In_    WDFSPINLOCK       ReadLock,
+    _In_    WDFOBJECT         Parent,
+    _In_    ULONG             PoolTag,
+    _Inout_ WDFMEMORY*        Memory,
+    _Inout_ PUCHAR*           Buffer,
+    _Inout_ SIZE_T*           Capacity,
+    _In_    size_t            RequestedSize
 )
+/*++
+Routine Description:
+
+    Replaces a ring's backing storage with a new allocation and migrates the
+    buffered bytes into it. The new size is RequestedSize rounded up to a
+    power of two, and never smaller than what is currently buffered, so no
+    data is lost when shrinking.
+
+    The allocation happens without any lock held; if the producer outgrows
+    the new size before both locks are taken, the allocation is retried at
+    the larger size.
+
+    Growing is refused with STATUS_QUOTA_EXCEEDED if the new allocation would
+    take the driver past QUEUE_GLOBAL_RING_BUDGET. Shrinking always proceeds.
+
+--*/
 {
     NTSTATUS                status;
-    WDFMEMORY               memory;
+    WDF_OBJECT_ATTRIBUTES   memAttr;
+    WDFMEMORY               newMemory;
+    PUCHAR                  newBuffer;
+    WDFMEMORY               oldMemory;
+    size_t                  oldSize;
+    size_t                  occupancy;
+    size_t                  newSize;
 
-    status = WdfRequestRetrieveInputMemory(Request, &memory);
-    if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR,
-            "Error: WdfRequestRetrieveInputMemory failed 0x%x", status);
-        return status;
+    newSize = RingPolicyRoundSize(RequestedSize);
+
+    for (;;) {
+        RingBufferP2GetAvailableData(Ring, &occupancy);
+        newSize = max(newSize, RingPolicyRoundSize(occupancy));
+
+        if (newSize == *Capacity) {
+            return STATUS_SUCCESS;
+        }
+
+        // Charge the new allocation up front; the old one is released below
+        if ((InterlockedExchangeAdd64(&QueueRingBytesInUse, (LONG64)newSize) + (LONG64)newSize >
+                QUEUE_GLOBAL_RING_BUDGET) && (newSize > *Capacity)) {
+            InterlockedExchangeAdd64(&QueueRingBytesInUse, -(LONG64)newSize);
+            return STATUS_QUOTA_EXCEEDED;
+        }
+
+        WDF_OBJECT_ATTRIBUTES_INIT(&memAttr);
+        memAttr.ParentObject = Parent;
+
+        status = WdfMemoryCreate(&memAttr, NonPagedPoolNx, PoolTag,
+            newSize, &newMemory, (PVOID*)&newBuffer);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate(resize %Iu) failed 0x%x", newSize, status);
+            InterlockedExchangeAdd64(&QueueRingBytesInUse, -(LONG64)newSize);
+            return status;
+        }
+
+        WdfSpinLockAcquire(WriteLock);
+        WdfSpinLockAcquire(ReadLock);
+
+        status = RingBufferP2Migrate(Ring, newBuffer, newSize);
+        if (NT_SUCCESS(status)) {
+            oldSize = *Capacity;
+            oldMemory = *Memory;
+            *Memory = newMemory;
+            *Buffer = newBuffer;
+            *Capacity = newSize;
+        }
+
+        WdfSpinLockRelease(ReadLock);
+        WdfSpinLockRelease(WriteLock);
+
+        if (NT_SUCCESS(status)) {
+            WdfObjectDelete(oldMemory);
+            InterlockedExchangeAdd64(&QueueRingBytesInUse, -(LONG64)oldSize);
+            return STATUS_SUCCESS;
+        }
+
+        WdfObjectDelete(newMemory);
+        InterlockedExchangeAdd64(&QueueRingBytesInUse, -(LONG64)newSize);
+
+        if (status != STATUS_BUFFER_TOO_SMALL || newSize == MAX_DATA_BUFFER_SIZE) {
+            return status;
+        }
+
+        // More bytes arrived while we were allocating; try again bigger.
+        newSize <<= 1;
     }
+}
 
-    status = WdfMemoryCopyToBuffer(memory, 0,
-        DestinationBuffer, NumBytesToCopyTo);
-    if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR,
-            "Error: WdfMemoryCopyToBuffer failed 0x%x", status);
-        return status;
+
+static
+NTSTATUS
+QueueResizeDirection(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  size_t            RequestedSize
+)
+{
+    if (ToUser) {
+        return QueueResizeRing(&QueueContext->RingBufferToUserMode,
+            QueueContext->RingBufferToUserModeWriteLock,
+            QueueContext->RingBufferToUserModeReadLock,
+            QueueContext->Queue,
+            QUEUE_TOUSER_POOL_TAG,
+            &QueueContext->ToUserMem,
+            &QueueContext->ToUserBuffer,
+            &QueueContext->ToUserCapacity,
+            RequestedSize);
     }
 
-    return status;
+    return QueueResizeRing(&QueueContext->RingBufferFromNetwork,
+        QueueContext->RingBufferFromNetworkWriteLock,
+        QueueContext->RingBufferFromNetworkReadLock,
+        QueueContext->Queue,
+        QUEUE_FROMNET_POOL_TAG,
+        &QueueContext->FromNetMem,
+        &QueueContext->FromNetBuffer,
+        &QueueContext->FromNetCapacity,
+        RequestedSize);
 }
 
 
+_IRQL_requires_(PASSIVE_LEVEL)
+static
 VOID
-EvtIoDeviceControl(
-    _In_  WDFQUEUE          Queue,
-    _In_  WDFREQUEST        Request,
-    _In_  size_t            OutputBufferLength,
-    _In_  size_t            InputBufferLength,
-    _In_  ULONG             IoControlCode
+QueueAcquireResizing(
+    _In_  PQUEUE_RING_POLICY Policy
+)
+/*++
+Routine Description:
+
+    Takes a ring's Resizing flag for an explicit resize, waiting out any
+    elastic grow or shrink that holds it. The elastic paths only try for
+    the flag and skip their resize when it is taken, so the wait is short.
+
+    The holder sets ResizeDone as it lets go. A release that lands between
+    a failed try and the wait leaves the event set, so the wait returns at
+    once and the flag is tried again; a wake taken by another waiter, or
+    lost to an elastic resize that got the flag first, is followed by
+    another release.
+
+--*/
+{
+    NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    while (!RingPolicyTryBeginResize(Policy)) {
+        (VOID)KeWaitForSingleObject(&Policy->ResizeDone, Executive, KernelMode, FALSE, NULL);
+    }
+}
+
+
+NTSTATUS
+QueueSetRingSizes(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  size_t            InSize,
+    _In_  size_t            OutSize
 )
 {
     NTSTATUS                status = STATUS_SUCCESS;
-    PQUEUE_CONTEXT          queueContext = GetQueueContext(Queue);
-    PDEVICE_CONTEXT         deviceContext = queueContext->DeviceContext;
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
+    PQUEUE_RING_POLICY      policy;
+
+    // Shared rings are sized when they are mapped
+    if (QueueContext->Shared) {
+        return STATUS_SUCCESS;
+    }
+
+    // Segment chains have no fixed size; the request only moves their limit
+    if (QueueContext->Segmented) {
+        if (InSize != 0) {
+            policy = &QueueContext->FromNetPolicy;
+            policy->MaxCapacity = max(policy->MaxCapacity, RingPolicyRoundSize(InSize));
+            SegBufferSetLimit(&QueueContext->SegFromNetwork, policy->MaxCapacity);
+            QueuePublishPushCredit(QueueContext);
+        }
+        if (OutSize != 0) {
+            policy = &QueueContext->ToUserPolicy;
+            policy->MaxCapacity = max(policy->MaxCapacity, RingPolicyRoundSize(OutSize));
+            SegBufferSetLimit(&QueueContext->SegToUserMode, policy->MaxCapacity);
+        }
+        return STATUS_SUCCESS;
+    }
 
-    Trace(TRACE_LEVEL_INFO,
-        "EvtIoDeviceControl 0x%x", IoControlCode);
+    // An explicit size becomes the floor for elastic shrinking, and lifts the
+    // ceiling if it is above it. Both happen under the Resizing flag, so an
+    // elastic resize neither races the reallocation nor works from the old
+    // limits.
+    if (InSize != 0) {
+        policy = &QueueContext->FromNetPolicy;
+        QueueAcquireResizing(policy);
+        status = QueueResizeDirection(QueueContext, FALSE, InSize);
+        if (NT_SUCCESS(status)) {
+            policy->MinCapacity = RingPolicyRoundSize(InSize);
+            policy->MaxCapacity = max(policy->MaxCapacity, policy->MinCapacity);
+            QueuePublishPushCredit(QueueContext);
+        }
+        RingPolicyEndResize(policy);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    if (OutSize != 0) {
+        policy = &QueueContext->ToUserPolicy;
+        QueueAcquireResizing(policy);
+        status = QueueResizeDirection(QueueContext, TRUE, OutSize);
+        if (NT_SUCCESS(status)) {
+            policy->MinCapacity = RingPolicyRoundSize(OutSize);
+            policy->MaxCapacity = max(policy->MaxCapacity, policy->MinCapacity);
+        }
+        RingPolicyEndResize(policy);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    return status;
+}
+
+
+//
+// Storage dispatch. Every ring access below goes through these so a port can
+// use either a contiguous ring or a segment chain; both expose the same
+// span contract and locking rules.
+//
+
+static
+size_t
+QueueRingGetAvailableData(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser
+)
+{
+    size_t                  available;
+
+    if (QueueContext->Shared) {
+        available = SharedRingGetAvailableData(ToUser ? &QueueContext->SharedToUser : &QueueContext->SharedFromNetwork);
+    }
+    else if (QueueContext->Segmented) {
+        SegBufferGetAvailableData(ToUser ? &QueueContext->SegToUserMode : &QueueContext->SegFromNetwork,
+            &available);
+    }
+    else {
+        RingBufferP2GetAvailableData(ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork,
+            &available);
+    }
+    return available;
+}
+
+
+static
+size_t
+QueueRingGetAvailableSpace(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser
+)
+{
+    size_t                  space;
+
+    if (QueueContext->Shared) {
+        // The service owns the other ends of the shared rings
+        space = 0;
+    }
+    else if (QueueContext->Segmented) {
+        SegBufferGetAvailableSpace(ToUser ? &QueueContext->SegToUserMode : &QueueContext->SegFromNetwork,
+            &space);
+    }
+    else {
+        RingBufferP2GetAvailableSpace(ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork,
+            &space);
+    }
+    return space;
+}
+
+
+static
+size_t
+QueueRingReserve(
+    _In_  PQUEUE_CONTEXT     QueueContext,
+    _In_  BOOLEAN            ToUser,
+    _In_  size_t             MaxSize,
+    _Out_ PRING_BUFFER_SPANS Spans
+)
+{
+    if (QueueContext->Shared) {
+        return ToUser ? SharedRingReserve(&QueueContext->SharedToUser, MaxSize, Spans) : 0;
+    }
+    if (QueueContext->Segmented) {
+        return SegBufferReserve(ToUser ? &QueueContext->SegToUserMode : &QueueContext->SegFromNetwork,
+            MaxSize, Spans);
+    }
+    return RingBufferP2Reserve(ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork,
+        MaxSize, Spans);
+}
+
+
+static
+VOID
+QueueRingCommit(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  size_t            Count
+)
+{
+    if (QueueContext->Shared) {
+        ASSERT(ToUser);
+        SharedRingCommit(&QueueContext->SharedToUser, Count);
+    }
+    else if (QueueContext->Segmented) {
+        SegBufferCommit(ToUser ? &QueueContext->SegToUserMode : &QueueContext->SegFromNetwork, Count);
+    }
+    else {
+        RingBufferP2Commit(ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork, Count);
+    }
+}
+
+
+static
+size_t
+QueueRingPeek(
+    _In_  PQUEUE_CONTEXT     QueueContext,
+    _In_  BOOLEAN            ToUser,
+    _In_  size_t             MaxSize,
+    _Out_ PRING_BUFFER_SPANS Spans
+)
+{
+    if (QueueContext->Shared) {
+        return ToUser ? 0 : SharedRingPeek(&QueueContext->SharedFromNetwork, MaxSize, Spans);
+    }
+    if (QueueContext->Segmented) {
+        return SegBufferPeek(ToUser ? &QueueContext->SegToUserMode : &QueueContext->SegFromNetwork,
+            MaxSize, Spans);
+    }
+    return RingBufferP2Peek(ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork,
+        MaxSize, Spans);
+}
+
+
+static
+VOID
+QueueRingConsume(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  size_t            Count
+)
+{
+    if (QueueContext->Shared) {
+        ASSERT(!ToUser);
+        SharedRingConsume(&QueueContext->SharedFromNetwork, Count);
+    }
+    else if (QueueContext->Segmented) {
+        SegBufferConsume(ToUser ? &QueueContext->SegToUserMode : &QueueContext->SegFromNetwork, Count);
+    }
+    else {
+        RingBufferP2Consume(ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork, Count);
+    }
+}
+
+
+static
+VOID
+QueueElasticBeforeWrite(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  size_t            Length
+)
+/*++
+Routine Description:
+
+    Grows a ring ahead of a write that would take it past the high
+    watermark. Called by the producer without the ring locks held. Failing
+    to grow is not an error; the write then simply takes what fits.
+
+--*/
+{
+    PRING_BUFFER_P2         ring = ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork;
+    PQUEUE_RING_POLICY      policy = ToUser ? &QueueContext->ToUserPolicy : &QueueContext->FromNetPolicy;
+    size_t                  capacity = ToUser ? QueueContext->ToUserCapacity : QueueContext->FromNetCapacity;
+    size_t                  occupancy;
+    size_t                  needed;
+    size_t                  target;
+    NTSTATUS                status;
+
+    if (QueueContext->Segmented || QueueContext->Shared) {
+        return;
+    }
+
+    RingBufferP2GetAvailableData(ring, &occupancy);
+    needed = occupancy + Length;
+
+    if (RingPolicyGrowTarget(policy, capacity, needed) == 0 ||
+        !RingPolicyTryBeginResize(policy)) {
+        return;
+    }
+
+    // An explicit resize may have run since the check above
+    capacity = ToUser ? QueueContext->ToUserCapacity : QueueContext->FromNetCapacity;
+    target = RingPolicyGrowTarget(policy, capacity, needed);
+    if (target == 0) {
+        RingPolicyEndResize(policy);
+        return;
+    }
+
+    status = QueueResizeDirection(QueueContext, ToUser, target);
+    if (NT_SUCCESS(status)) {
+        InterlockedIncrement(&policy->GrowCount);
+        TracePoint(TRACE_LEVEL_INFO, ToUser ? VCOM_TRACE_EVENT_OUTGOING_RESIZED : VCOM_TRACE_EVENT_INCOMING_RESIZED,
+            QueueContext->Port.PortId, capacity, target);
+    }
+    else {
+        Trace(TRACE_LEVEL_WARNING, "Ring %s grow to %Iu failed 0x%x",
+            ToUser ? "ToUser" : "FromNet", target, status);
+    }
+
+    RingPolicyEndResize(policy);
+}
+
+
+static
+VOID
+QueueElasticAfterRead(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser
+)
+/*++
+Routine Description:
+
+    Samples a ring's occupancy after a consumer read and halves the ring once
+    it has stayed below the low watermark for QUEUE_RING_SHRINK_SAMPLES reads
+    in a row. Called by the consumer without the ring locks held.
+
+--*/
+{
+    PRING_BUFFER_P2         ring = ToUser ? &QueueContext->RingBufferToUserMode : &QueueContext->RingBufferFromNetwork;
+    PQUEUE_RING_POLICY      policy = ToUser ? &QueueContext->ToUserPolicy : &QueueContext->FromNetPolicy;
+    size_t                  capacity = ToUser ? QueueContext->ToUserCapacity : QueueContext->FromNetCapacity;
+    size_t                  occupancy;
+    size_t                  target;
+
+    if (QueueContext->Segmented || QueueContext->Shared) {
+        policy->LowSamples = 0;
+        return;
+    }
+
+    RingBufferP2GetAvailableData(ring, &occupancy);
+    if (!RingPolicySampleRead(policy, capacity, occupancy) ||
+        !RingPolicyTryBeginResize(policy)) {
+        return;
+    }
+
+    // An explicit resize may have run since the check above
+    capacity = ToUser ? QueueContext->ToUserCapacity : QueueContext->FromNetCapacity;
+    target = RingPolicyShrinkTarget(policy, capacity);
+    if (target == 0) {
+        RingPolicyEndResize(policy);
+        return;
+    }
+
+    if (NT_SUCCESS(QueueResizeDirection(QueueContext, ToUser, target))) {
+        InterlockedIncrement(&policy->ShrinkCount);
+        TracePoint(TRACE_LEVEL_INFO, ToUser ? VCOM_TRACE_EVENT_OUTGOING_RESIZED : VCOM_TRACE_EVENT_INCOMING_RESIZED,
+            QueueContext->Port.PortId, capacity, target);
+    }
+
+    RingPolicyEndResize(policy);
+}
+
+
+static
+VOID
+QueueFillRingStats(
+    _In_  size_t                Occupancy,
+    _In_  PQUEUE_RING_POLICY    Policy,
+    _In_  size_t                Capacity,
+    _Out_ PVCOM_RING_STATS      Stats
+)
+{
+
+    Stats->Capacity = (ULONG)Capacity;
+    Stats->Occupancy = (ULONG)Occupancy;
+    Stats->MinCapacity = (ULONG)Policy->MinCapacity;
+    Stats->MaxCapacity = (ULONG)Policy->MaxCapacity;
+    Stats->GrowCount = (ULONG)Policy->GrowCount;
+    Stats->ShrinkCount = (ULONG)Policy->ShrinkCount;
+    Stats->DroppedBytes = (ULONG64)Policy->DroppedBytes;
+}
+
+
+NTSTATUS
+QueueGetRingStats(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _Out_ PVCOM_QUEUE_STATS Stats
+)
+{
+    RtlZeroMemory(Stats, sizeof(*Stats));
+
+    // For segmented ports Capacity reports the segment storage currently held
+    if (QueueContext->Shared) {
+        QueueFillRingStats(QueueRingGetAvailableData(QueueContext, TRUE), &QueueContext->ToUserPolicy,
+            QueueContext->SharedToUser.Capacity, &Stats->ToUser);
+        QueueFillRingStats(QueueRingGetAvailableData(QueueContext, FALSE), &QueueContext->FromNetPolicy,
+            QueueContext->SharedFromNetwork.Capacity, &Stats->FromNetwork);
+    }
+    else if (QueueContext->Segmented) {
+        QueueFillRingStats(QueueRingGetAvailableData(QueueContext, TRUE), &QueueContext->ToUserPolicy,
+            SegBufferGetAllocatedBytes(&QueueContext->SegToUserMode), &Stats->ToUser);
+        QueueFillRingStats(QueueRingGetAvailableData(QueueContext, FALSE), &QueueContext->FromNetPolicy,
+            SegBufferGetAllocatedBytes(&QueueContext->SegFromNetwork), &Stats->FromNetwork);
+    }
+    else {
+        QueueFillRingStats(QueueRingGetAvailableData(QueueContext, TRUE), &QueueContext->ToUserPolicy,
+            QueueContext->ToUserCapacity, &Stats->ToUser);
+        QueueFillRingStats(QueueRingGetAvailableData(QueueContext, FALSE), &QueueContext->FromNetPolicy,
+            QueueContext->FromNetCapacity, &Stats->FromNetwork);
+    }
+
+    Stats->GlobalBytesInUse = (ULONG64)QueueRingBytesInUse + SegBufferPoolGetBytesInUse();
+    Stats->GlobalBudget = QUEUE_GLOBAL_RING_BUDGET;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+QueueSharedLockAll(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // Same order as QueueResetRings
+    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeWriteLock);
+    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeReadLock);
+    WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkWriteLock);
+    WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkReadLock);
+}
+
+
+static
+VOID
+QueueSharedUnlockAll(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+    WdfSpinLockRelease(QueueContext->RingBufferFromNetworkWriteLock);
+    WdfSpinLockRelease(QueueContext->RingBufferToUserModeReadLock);
+    WdfSpinLockRelease(QueueContext->RingBufferToUserModeWriteLock);
+}
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+static
+VOID
+QueueAcquireSharedMapping(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Takes the SharedMapping flag, waiting for a map or unmap running on
+    another thread to finish, so the mapping state is tested and changed
+    by one of them at a time. The wait is on SharedMappingDone, which
+    QueueReleaseSharedMapping sets; a release before the wait leaves it
+    set, so the flag is tried again.
+
+--*/
+{
+    NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    while (InterlockedCompareExchange(&QueueContext->SharedMapping, 1, 0) != 0) {
+        (VOID)KeWaitForSingleObject(&QueueContext->SharedMappingDone, Executive, KernelMode, FALSE, NULL);
+    }
+}
+
+
+static
+VOID
+QueueReleaseSharedMapping(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    InterlockedExchange(&QueueContext->SharedMapping, 0);
+    KeSetEvent(&QueueContext->SharedMappingDone, IO_NO_INCREMENT, FALSE);
+}
+
+
+static
+NTSTATUS
+QueueReferenceUserEvent(
+    _In_  ULONG64           Handle,
+    _Out_ PKEVENT*          Event
+)
+{
+    return ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)Handle,
+        EVENT_MODIFY_STATE,
+        *ExEventObjectType,
+        UserMode,
+        (PVOID*)Event,
+        NULL);
+}
+
+
+NTSTATUS
+QueueMapSharedRings(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFREQUEST        Request
+)
+/*++
+Routine Description:
+
+    Handles IOCTL_VCOM_MAP_RINGS. Allocates the shared region on first use,
+    maps it into the current process and switches both directions of the
+    port over to it.
+
+    The region is whole pages from MmAllocatePagesForMdlEx, so the mapping
+    exposes nothing to the service but the rings themselves.
+
+    Must be called in the context of the requesting process, before
+    IOCTL_VCOM_START.
+
+--*/
+{
+    NTSTATUS                status;
+    PVCOM_MAP_RINGS_IN      in;
+    PVCOM_MAP_RINGS_OUT     out;
+    PKEVENT                 toUserEvent = NULL;
+    PKEVENT                 fromNetEvent = NULL;
+    PVOID                   userVa = NULL;
+    size_t                  toUserCapacity;
+    size_t                  fromNetCapacity;
+    size_t                  headerSize;
+    PHYSICAL_ADDRESS        lowAddress;
+    PHYSICAL_ADDRESS        highAddress;
+    PHYSICAL_ADDRESS        skipBytes;
+    BOOLEAN                 mapped = FALSE;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(*in), (PVOID*)&in, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*out), (PVOID*)&out, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = QueueReferenceUserEvent(in->ToUserEvent, &toUserEvent);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "MAP_RINGS: bad ToUser event handle 0x%x", status);
+        return status;
+    }
+    status = QueueReferenceUserEvent(in->FromNetworkEvent, &fromNetEvent);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "MAP_RINGS: bad FromNetwork event handle 0x%x", status);
+        ObDereferenceObject(toUserEvent);
+        return status;
+    }
+
+    // Two MAP_RINGS, or a MAP_RINGS and the unmap on close, must not both
+    // pass the checks below
+    QueueAcquireSharedMapping(QueueContext);
+
+    if (QueueContext->PortContext->Started || QueueContext->Shared || QueueContext->Framed) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto _exit;
+    }
+
+    // Fails if the port is paired, and from here on pairing it fails instead
+    status = PortTableMapShared(QueueContext);
+    if (!NT_SUCCESS(status)) {
+        goto _exit;
+    }
+    mapped = TRUE;
+
+    // Header page followed by the two data areas, each a whole number of
+    // pages so the service sees page-aligned rings.
+    headerSize = ROUND_TO_PAGES(sizeof(VCOM_SHARED_HEADER));
+    toUserCapacity = max(PAGE_SIZE, RingPolicyRoundSize(QueueContext->PortContext->OutQueueSize));
+    fromNetCapacity = max(PAGE_SIZE, RingPolicyRoundSize(QueueContext->PortContext->InQueueSize));
+
+    if (QueueContext->SharedMdl == NULL) {
+        QueueContext->SharedSize = headerSize + toUserCapacity + fromNetCapacity;
+
+        lowAddress.QuadPart = 0;
+        highAddress.QuadPart = -1;
+        skipBytes.QuadPart = 0;
+
+        QueueContext->SharedMdl = MmAllocatePagesForMdlEx(lowAddress, highAddress, skipBytes,
+            QueueContext->SharedSize, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+        if (QueueContext->SharedMdl == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            Trace(TRACE_LEVEL_ERROR, "MAP_RINGS: page allocation failed 0x%x", status);
+            goto _exit;
+        }
+
+        QueueContext->SharedHeader = (PVCOM_SHARED_HEADER)MmGetSystemAddressForMdlSafe(
+            QueueContext->SharedMdl, NormalPagePriority | MdlMappingNoExecute);
+        if (QueueContext->SharedHeader == NULL) {
+            MmFreePagesFromMdl(QueueContext->SharedMdl);
+            ExFreePool(QueueContext->SharedMdl);
+            QueueContext->SharedMdl = NULL;
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto _exit;
+        }
+    }
+    else {
+        // Reuse the region from an earlier session; its layout is fixed
+        toUserCapacity = QueueContext->SharedToUser.Capacity;
+        fromNetCapacity = QueueContext->SharedFromNetwork.Capacity;
+    }
+
+    RtlZeroMemory(QueueContext->SharedHeader, headerSize);
+    QueueContext->SharedHeader->Version = VCOM_SHARED_RING_VERSION;
+    QueueContext->SharedHeader->Size = (ULONG)QueueContext->SharedSize;
+    QueueContext->SharedHeader->ToUserOffset = (ULONG)headerSize;
+    QueueContext->SharedHeader->ToUserCapacity = (ULONG)toUserCapacity;
+    QueueContext->SharedHeader->FromNetworkOffset = (ULONG)(headerSize + toUserCapacity);
+    QueueContext->SharedHeader->FromNetworkCapacity = (ULONG)fromNetCapacity;
+
+    __try {
+        userVa = MmMapLockedPagesSpecifyCache(QueueContext->SharedMdl,
+            UserMode,
+            MmCached,
+            NULL,
+            FALSE,
+            NormalPagePriority | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        userVa = NULL;
+    }
+    if (userVa == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        Trace(TRACE_LEVEL_ERROR, "MAP_RINGS: user mapping failed 0x%x", status);
+        goto _exit;
+    }
+
+    QueueSharedLockAll(QueueContext);
+
+    SharedRingInitialize(&QueueContext->SharedToUser,
+        &QueueContext->SharedHeader->ToUser,
+        (BYTE*)QueueContext->SharedHeader + headerSize,
+        toUserCapacity,
+        TRUE,
+        toUserEvent);
+    SharedRingInitialize(&QueueContext->SharedFromNetwork,
+        &QueueContext->SharedHeader->FromNetwork,
+        (BYTE*)QueueContext->SharedHeader + headerSize + toUserCapacity,
+        fromNetCapacity,
+        FALSE,
+        fromNetEvent);
+
+    QueueContext->SharedUserVa = userVa;
+    QueueContext->SharedProcess = PsGetCurrentProcess();
+    ObReferenceObject(QueueContext->SharedProcess);
+    QueueContext->SharedToUserEvent = toUserEvent;
+    QueueContext->SharedFromNetEvent = fromNetEvent;
+    QueueContext->Shared = TRUE;
+
+    QueueSharedUnlockAll(QueueContext);
+
+    QueueReleaseSharedMapping(QueueContext);
+
+    out->BaseAddress = (ULONG64)(ULONG_PTR)userVa;
+    out->Size = (ULONG)QueueContext->SharedSize;
+    out->Reserved = 0;
+    WdfRequestSetInformation(Request, sizeof(*out));
+
+    KdPrint(("VCOM: Shared rings mapped at %p (%Iu bytes)\n", userVa, QueueContext->SharedSize));
+    return STATUS_SUCCESS;
+
+_exit:
+    if (mapped) {
+        PortTableUnmapShared(QueueContext);
+    }
+    QueueReleaseSharedMapping(QueueContext);
+    ObDereferenceObject(fromNetEvent);
+    ObDereferenceObject(toUserEvent);
+    return status;
+}
+
+
+VOID
+QueueUnmapSharedRings(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Switches the port back to its own storage and removes the service's
+    mapping. The shared region itself is kept for the next MAP_RINGS.
+
+--*/
+{
+    KAPC_STATE              apcState;
+
+    QueueAcquireSharedMapping(QueueContext);
+
+    if (!QueueContext->Shared) {
+        QueueReleaseSharedMapping(QueueContext);
+        return;
+    }
+
+    QueueSharedLockAll(QueueContext);
+    QueueContext->Shared = FALSE;
+    QueueSharedUnlockAll(QueueContext);
+    PortTableUnmapShared(QueueContext);
+
+    // The mapping belongs to the service's address space, which need not be
+    // the one we are running in.
+    KeStackAttachProcess(QueueContext->SharedProcess, &apcState);
+    MmUnmapLockedPages(QueueContext->SharedUserVa, QueueContext->SharedMdl);
+    KeUnstackDetachProcess(&apcState);
+
+    ObDereferenceObject(QueueContext->SharedProcess);
+    ObDereferenceObject(QueueContext->SharedToUserEvent);
+    ObDereferenceObject(QueueContext->SharedFromNetEvent);
+    QueueContext->SharedProcess = NULL;
+    QueueContext->SharedUserVa = NULL;
+    QueueContext->SharedToUserEvent = NULL;
+    QueueContext->SharedFromNetEvent = NULL;
+
+    QueueReleaseSharedMapping(QueueContext);
+
+    KdPrint(("VCOM: Shared rings unmapped\n"));
+}
+
+
+NTSTATUS
+RequestCopyFromBuffer(
+    _In_  WDFREQUEST        Request,
+    _In_  PVOID             SourceBuffer,
+    _In_  size_t            NumBytesToCopyFrom
+)
+{
+    NTSTATUS                status;
+    WDFMEMORY               memory;
+
+    status = WdfRequestRetrieveOutputMemory(Request, &memory);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfRequestRetrieveOutputMemory failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfMemoryCopyFromBuffer(memory, 0,
+        SourceBuffer, NumBytesToCopyFrom);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfMemoryCopyFromBuffer failed 0x%x", status);
+        return status;
+    }
+
+    WdfRequestSetInformation(Request, NumBytesToCopyFrom);
+    return status;
+}
+
+
+NTSTATUS
+RequestCopyToBuffer(
+    _In_  WDFREQUEST        Request,
+    _In_  PVOID             DestinationBuffer,
+    _In_  size_t            NumBytesToCopyTo
+)
+{
+    NTSTATUS                status;
+    WDFMEMORY               memory;
+
+    status = WdfRequestRetrieveInputMemory(Request, &memory);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfRequestRetrieveInputMemory failed 0x%x", status);
+        return status;
+    }
+
+    status = WdfMemoryCopyToBuffer(memory, 0,
+        DestinationBuffer, NumBytesToCopyTo);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: WdfMemoryCopyToBuffer failed 0x%x", status);
+        return status;
+    }
+
+    return status;
+}
+
+
+static
+ULONG64
+QueueTimestamp(
+    VOID
+)
+{
+    ULONG64                 qpc;
+
+    // Data timestamps are interrupt time (100ns units, monotonic); user mode
+    // reads the same clock with QueryInterruptTimePrecise.
+    return KeQueryInterruptTimePrecise(&qpc);
+}
+
+
+//
+// Data timing (marklog.c). Taking bytes out retires the marks whose bytes
+// are all gone and records how long each stayed. Shared-ring traffic
+// bypasses the driver on one end and is not timed.
+//
+
+static
+VOID
+QueueMarkStamp(
+    _Inout_ PQUEUE_MARK_LOG Log,
+    _In_  size_t            Count,
+    _In_  ULONG64           Timestamp
+)
+{
+    // The caller holds the ring's write lock
+    WdfSpinLockAcquire(Log->Lock);
+    DataMarkStamp(&Log->Data, Count, Timestamp);
+    WdfSpinLockRelease(Log->Lock);
+}
+
+
+static
+VOID
+QueueMarkConsume(
+    _Inout_ PQUEUE_MARK_LOG Log,
+    _In_  size_t            Count
+)
+{
+    ULONG64                 stamped;
+    ULONG64                 now = 0;
+
+    // The caller holds the ring's read lock
+    WdfSpinLockAcquire(Log->Lock);
+    DataMarkConsume(&Log->Data, Count);
+    while (DataMarkRetire(&Log->Data, &stamped)) {
+        if (now == 0) {
+            now = QueueTimestamp();
+        }
+        LatencyHistogramRecord(&Log->Latency, (now > stamped) ? now - stamped : 0);
+    }
+    WdfSpinLockRelease(Log->Lock);
+}
+
+
+static
+VOID
+QueueMarkReset(
+    _Inout_ PQUEUE_MARK_LOG Log
+)
+{
+    // The caller holds both of the ring's locks
+    WdfSpinLockAcquire(Log->Lock);
+    DataMarkReset(&Log->Data);
+    WdfSpinLockRelease(Log->Lock);
+}
+
+
+//
+// Event characters. Pushed bytes are searched for SERIAL_CHARS.EventChar
+// while they are still in cache, with the vectorized CharScanFind2, so a
+// stream with none costs one pass at memory speed. Each one found raises
+// EV_RXFLAG and, with VCOM_READ_EVENT_CHAR, has reads complete right after
+// it. When the log runs out, later ones still raise the event but reads do
+// not stop at them.
+//
+
+static
+ULONG
+QueueEventCharScan(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_reads_(Length) const UCHAR* Buffer,
+    _In_  size_t            Length,
+    _In_  ULONG64           Position
+)
+/*++
+Routine Description:
+
+    Logs the event characters in Length bytes about to be committed to the
+    incoming ring at Position (a running count of bytes put in it).
+    Returns how many there are.
+
+    The caller must hold the FromNet write lock.
+
+--*/
+{
+    PQUEUE_EVENT_CHAR_LOG   log = &QueueContext->EventChars;
+    UCHAR                   eventChar = QueueContext->EventChar;
+    size_t                  at = CharScanFind2(Buffer, Length, eventChar, eventChar);
+    ULONG                   found = 0;
+
+    if (at == Length) {
+        return 0;
+    }
+
+    WdfSpinLockAcquire(log->Lock);
+    do {
+        if (log->Tail - log->Head < QUEUE_EVENT_CHARS) {
+            log->Positions[log->Tail & QUEUE_EVENT_CHAR_MASK] = Position + at;
+            log->Tail++;
+        }
+        found++;
+        at += 1 + CharScanFind2(Buffer + at + 1, Length - at - 1, eventChar, eventChar);
+    } while (at < Length);
+    WdfSpinLockRelease(log->Lock);
+
+    return found;
+}
+
+
+static
+size_t
+QueueEventCharLimit(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  size_t            Length,
+    _Out_ BOOLEAN*          Stop
+)
+/*++
+Routine Description:
+
+    Shortens a read of Length bytes from the incoming ring to end at the
+    next event character, in VCOM_READ_EVENT_CHAR mode. Stop tells whether
+    it does.
+
+    The caller must hold the FromNet read lock.
+
+--*/
+{
+    PQUEUE_EVENT_CHAR_LOG   log = &QueueContext->EventChars;
+    ULONG64                 distance;
+
+    *Stop = FALSE;
+    if (!ReadBooleanNoFence(&QueueContext->ReadToEventChar) ||
+        ReadULongNoFence(&log->Tail) == log->Head) {
+        return Length;
+    }
+
+    WdfSpinLockAcquire(log->Lock);
+    if (log->Head != log->Tail) {
+        distance = log->Positions[log->Head & QUEUE_EVENT_CHAR_MASK] - log->Out + 1;
+        if (distance <= Length) {
+            Length = (size_t)distance;
+            *Stop = TRUE;
+        }
+    }
+    WdfSpinLockRelease(log->Lock);
+
+    return Length;
+}
+
+
+static
+VOID
+QueueEventCharConsume(
+    _Inout_ PQUEUE_EVENT_CHAR_LOG Log,
+    _In_  size_t            Count
+)
+{
+    // The caller holds the ring's read lock. Positions logged meanwhile are
+    // of bytes not yet committed, so none is missed by looking unlocked.
+    Log->Out += Count;
+    if (ReadULongNoFence(&Log->Tail) == Log->Head) {
+        return;
+    }
+
+    WdfSpinLockAcquire(Log->Lock);
+    while (Log->Head != Log->Tail &&
+        Log->Positions[Log->Head & QUEUE_EVENT_CHAR_MASK] < Log->Out) {
+        Log->Head++;
+    }
+    WdfSpinLockRelease(Log->Lock);
+}
+
+
+static
+VOID
+QueueEventCharReset(
+    _Inout_ PQUEUE_EVENT_CHAR_LOG Log
+)
+{
+    // The caller holds both of the ring's locks
+    WdfSpinLockAcquire(Log->Lock);
+    Log->Head = 0;
+    Log->Tail = 0;
+    Log->In = 0;
+    Log->Out = 0;
+    WdfSpinLockRelease(Log->Lock);
+}
+
+
+static
+NTSTATUS
+QueueSetReadMode(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  ULONG             Mode
+)
+{
+    if (Mode & ~VCOM_READ_EVENT_CHAR) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (QueueContext->Shared) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    // Taken by the next read that starts or goes on; event characters
+    // already buffered were not looked for unless EV_RXFLAG was waited on
+    WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkReadLock);
+    QueueContext->ReadToEventChar = (Mode & VCOM_READ_EVENT_CHAR) != 0;
+    WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+
+    QueuePumpIncoming(QueueContext);
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+QueueGetIncomingAge(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _Out_ PVCOM_INCOMING_AGE Age
+)
+{
+    RtlZeroMemory(Age, sizeof(*Age));
+    Age->Now = QueueTimestamp();
+
+    WdfSpinLockAcquire(QueueContext->IngressLog.Lock);
+    Age->Oldest = DataMarkOldest(&QueueContext->IngressLog.Data);
+    Age->Unread = (ULONG)DataMarkUnread(&QueueContext->IngressLog.Data);
+    WdfSpinLockRelease(QueueContext->IngressLog.Lock);
+}
+
+
+static
+VOID
+QueueGetLatency(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           Reset,
+    _Out_ PVCOM_LATENCY_SNAPSHOT Snapshot
+)
+{
+    LatencyHistogramSnapshot(&QueueContext->EgressLog.Latency, Reset, &Snapshot->Outgoing);
+    LatencyHistogramSnapshot(&QueueContext->IngressLog.Latency, Reset, &Snapshot->Incoming);
+}
+
+
+static
+VOID
+QueuePublishPushCredit(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Stores the incoming ring's free space as FromNetFree in the counters,
+    where the service reads it before a push. Called with either of the
+    ring's locks held, or none when a stale value is harmless; like the
+    occupancy, the later store wins.
+
+--*/
+{
+    WriteNoFence64(&QueueContext->Counters->FromNetFree,
+        (LONG64)QueueRingGetAvailableSpace(QueueContext, FALSE));
+}
+
+
+static
+VOID
+QueueCountTransfer(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  BOOLEAN           Produced,
+    _In_  size_t            Count
+)
+/*++
+Routine Description:
+
+    Updates the performance counters after bytes went into (Produced) or
+    came out of a ring. The caller holds the ring's write lock when
+    producing and its read lock when consuming (PortCountersTransfer).
+
+--*/
+{
+    PortCountersTransfer(QueueContext->Counters, ToUser, Produced, Count,
+        QueueRingGetAvailableData(QueueContext, ToUser));
+    if (!ToUser) {
+        QueuePublishPushCredit(QueueContext);
+    }
+}
+
+
+NTSTATUS
+QueueRingWriteFromMemory(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  WDFMEMORY         Memory,
+    _In_  size_t            Offset,
+    _In_  size_t            Length,
+    _In_opt_ const DATA_FORMAT* SentFormat,
+    _Out_ size_t*           BytesWritten
+)
+/*++
+Routine Description:
+
+    Copies up to Length bytes from a request's memory object straight into
+    the free region of a ring, without staging them in an intermediate
+    buffer. Only the bytes actually copied are committed. Segment chains hand
+    out at most two segments per reservation, so this loops until the data
+    is in or the storage is full.
+
+    Each span is formatted in place while it is still in cache: SentFormat
+    first, if given, then the ring's own format, TxFormat encoding outgoing
+    bytes and RxFormat checking incoming ones. Parity errors are counted and
+    left pending for QueueSignalReceived. Pushed bytes then go through XON/XOFF
+    flow control, which takes its characters out, and what is left is
+    searched for the event character. BytesWritten counts the bytes taken
+    from Memory, those included.
+
+    The caller must hold the ring's write lock.
+
+--*/
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    RING_BUFFER_SPANS       spans;
+    const DATA_FORMAT*      format = ToUser ? &QueueContext->TxFormat : &QueueContext->RxFormat;
+    BOOLEAN                 flow;
+    BOOLEAN                 scan;
+    size_t                  copied = 0;
+    size_t                  committed = 0;
+    size_t                  parityErrors = 0;
+    ULONG                   eventChars = 0;
+    ULONG                   i;
+
+    if (SentFormat != NULL && DataFormatIsPassThrough(SentFormat)) {
+        SentFormat = NULL;
+    }
+    if (DataFormatIsPassThrough(format)) {
+        format = NULL;
+    }
+
+    // A hint; SwFlowReceive checks again under the lock
+    flow = !ToUser && QueueFlowApplies(QueueContext) &&
+        ReadBooleanNoFence(&QueueContext->SwFlow.OutX);
+
+    // Hints as well: a wait set or a read mode changed meanwhile applies
+    // from the next push
+    scan = !ToUser && (WaitMaskWanted(&QueueContext->WaitEvents, SERIAL_EV_RXFLAG) ||
+        ReadBooleanNoFence(&QueueContext->ReadToEventChar));
+
+    while (NT_SUCCESS(status) && (copied < Length)) {
+        size_t chunk = 0;       // bytes committed
+        size_t taken = 0;       // bytes of Memory they came from
+        size_t kept;
+
+        if (QueueRingReserve(QueueContext, ToUser, Length - copied, &spans) == 0) {
+            break;
+        }
+
+        for (i = 0; i < spans.Count; i++) {
+            status = WdfMemoryCopyToBuffer(Memory, Offset + copied + taken,
+                spans.Span[i].Buffer, spans.Span[i].Length);
+            if (!NT_SUCCESS(status)) {
+                Trace(TRACE_LEVEL_ERROR,
+                    "Error: WdfMemoryCopyToBuffer failed 0x%x", status);
+                break;
+            }
+            if (SentFormat != NULL) {
+                DataFormatEncode(SentFormat, spans.Span[i].Buffer, spans.Span[i].Length);
+            }
+            if (format != NULL) {
+                if (ToUser) {
+                    DataFormatEncode(format, spans.Span[i].Buffer, spans.Span[i].Length);
+                }
+                else {
+                    parityErrors += DataFormatDecode(format, spans.Span[i].Buffer, spans.Span[i].Length);
+                }
+            }
+
+            kept = spans.Span[i].Length;
+            if (flow) {
+                WdfSpinLockAcquire(QueueContext->FlowLock);
+                kept = SwFlowReceive(&QueueContext->SwFlow, spans.Span[i].Buffer, spans.Span[i].Length);
+                WdfSpinLockRelease(QueueContext->FlowLock);
+            }
+            if (scan) {
+                eventChars += QueueEventCharScan(QueueContext, spans.Span[i].Buffer, kept,
+                    QueueContext->EventChars.In + committed + chunk);
+            }
+            taken += spans.Span[i].Length;
+            chunk += kept;
+
+            // The characters taken out leave a gap before the next span;
+            // reserve again from where the data ends
+            if (kept < spans.Span[i].Length) {
+                break;
+            }
+        }
+
+        if (chunk) {
+            QueueRingCommit(QueueContext, ToUser, chunk);
+            committed += chunk;
+        }
+        copied += taken;
+    }
+
+    if (committed) {
+        QueueCountTransfer(QueueContext, ToUser, TRUE, committed);
+    }
+    if (parityErrors) {
+        InterlockedAdd(&QueueContext->ParityErrors, (LONG)parityErrors);
+        InterlockedAdd64(&QueueContext->Counters->ParityErrors, (LONG64)parityErrors);
+    }
+    if (!ToUser) {
+        QueueContext->EventChars.In += committed;
+    }
+    if (eventChars) {
+        InterlockedExchange(&QueueContext->EventCharsFound, 1);
+    }
+    // Writes are stamped by QueueWriteRequestToRing with the time they were
+    // taken; pushes count from when they land
+    if (!ToUser && committed && !QueueContext->Shared) {
+        QueueMarkStamp(&QueueContext->IngressLog, committed, QueueTimestamp());
+    }
+
+    *BytesWritten = copied;
+    if (NT_SUCCESS(status) && (copied < Length)) {
+        status = STATUS_BUFFER_OVERFLOW;
+    }
+    return status;
+}
+
+
+NTSTATUS
+QueueRingReadToMemory(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  WDFMEMORY         Memory,
+    _In_  size_t            Offset,
+    _In_  size_t            Length,
+    _Out_ size_t*           BytesCopied
+)
+/*++
+Routine Description:
+
+    Copies up to Length buffered bytes from a ring straight into a request's
+    memory object and consumes them. Only the bytes actually copied are
+    consumed.
+
+    The caller must hold the ring's read lock.
+
+--*/
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    RING_BUFFER_SPANS       spans;
+    size_t                  copied = 0;
+    ULONG                   i;
+
+    while (NT_SUCCESS(status) && (copied < Length)) {
+        size_t chunk = 0;
+
+        if (QueueRingPeek(QueueContext, ToUser, Length - copied, &spans) == 0) {
+            break;
+        }
+
+        for (i = 0; i < spans.Count; i++) {
+            status = WdfMemoryCopyFromBuffer(Memory, Offset + copied + chunk,
+                spans.Span[i].Buffer, spans.Span[i].Length);
+            if (!NT_SUCCESS(status)) {
+                Trace(TRACE_LEVEL_ERROR,
+                    "Error: WdfMemoryCopyFromBuffer failed 0x%x", status);
+                break;
+            }
+            chunk += spans.Span[i].Length;
+        }
+
+        if (chunk) {
+            QueueRingConsume(QueueContext, ToUser, chunk);
+            copied += chunk;
+        }
+    }
+
+    if (copied) {
+        QueueCountTransfer(QueueContext, ToUser, FALSE, copied);
+    }
+    if (copied && !QueueContext->Shared) {
+        QueueMarkConsume(ToUser ? &QueueContext->EgressLog : &QueueContext->IngressLog, copied);
+        if (!ToUser) {
+            QueueEventCharConsume(&QueueContext->EventChars, copied);
+        }
+    }
+
+    *BytesCopied = copied;
+    return status;
+}
+
+
+//
+// Framed GET_OUTGOING. Each application write that has bytes in the outgoing
+// ring has a record, in ring order, telling how many of its bytes went in and
+// how many have been drained. Records only count bytes, so they survive
+// elastic resizes and work the same over rings and segment chains.
+//
+
+static
+BOOLEAN
+QueueRecordHasRoom(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PREQUEST_CONTEXT  RequestContext
+)
+{
+    BOOLEAN                 room;
+
+    // A write that already has its record open just adds to it
+    WdfSpinLockAcquire(QueueContext->RecordLock);
+    room = (QueueContext->RecordTail - QueueContext->RecordHead < QUEUE_RECORD_SLOTS) ||
+        (RequestContext->Sequence != 0 &&
+            QueueContext->Records[(QueueContext->RecordTail - 1) & QUEUE_RECORD_MASK].Sequence == RequestContext->Sequence);
+    WdfSpinLockRelease(QueueContext->RecordLock);
+
+    return room;
+}
+
+
+static
+VOID
+QueueRecordAppend(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PREQUEST_CONTEXT  RequestContext,
+    _In_  size_t            Written
+)
+{
+    PQUEUE_RECORD           record = NULL;
+
+    // Called after the bytes are committed, so a drain never finds a
+    // record promising bytes that are not in the ring yet
+    WdfSpinLockAcquire(QueueContext->RecordLock);
+    if (QueueContext->RecordTail != QueueContext->RecordHead) {
+        record = &QueueContext->Records[(QueueContext->RecordTail - 1) & QUEUE_RECORD_MASK];
+        if (RequestContext->Sequence == 0 || record->Sequence != RequestContext->Sequence || record->Complete) {
+            record = NULL;
+        }
+    }
+
+    if (record == NULL) {
+        ASSERT(QueueContext->RecordTail - QueueContext->RecordHead < QUEUE_RECORD_SLOTS);
+        record = &QueueContext->Records[QueueContext->RecordTail & QUEUE_RECORD_MASK];
+        RtlZeroMemory(record, sizeof(*record));
+        record->Sequence = ++QueueContext->RecordSequence;
+        record->Timestamp = RequestContext->Timestamp;
+        RequestContext->Sequence = record->Sequence;
+        QueueContext->RecordTail++;
+    }
+
+    record->Length += (ULONG)Written;
+    record->Complete = (RequestContext->Transferred == RequestContext->Length);
+    WdfSpinLockRelease(QueueContext->RecordLock);
+}
+
+
+static
+VOID
+QueueRecordEnd(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PREQUEST_CONTEXT  RequestContext
+)
+{
+    PQUEUE_RECORD           record;
+
+    // Called for every write that finishes, under the ToUser write lock
+    if (RequestContext->Transferred < RequestContext->Length) {
+        InterlockedAddNoFence64(&QueueContext->Counters->TruncatedBytes,
+            (LONG64)(RequestContext->Length - RequestContext->Transferred));
+    }
+
+    // The write finished without all of its bytes going in (cancelled, timed
+    // out or failed). Its record is closed so the next write starts its own,
+    // and the drain reports it as truncated.
+    if (!QueueContext->Framed || RequestContext->Sequence == 0) {
+        return;
+    }
+
+    WdfSpinLockAcquire(QueueContext->RecordLock);
+    if (QueueContext->RecordTail != QueueContext->RecordHead) {
+        record = &QueueContext->Records[(QueueContext->RecordTail - 1) & QUEUE_RECORD_MASK];
+        if (record->Sequence == RequestContext->Sequence && !record->Complete) {
+            record->Complete = TRUE;
+            record->Truncated = TRUE;
+        }
+    }
+    WdfSpinLockRelease(QueueContext->RecordLock);
+}
+
+
+//
+// Baud-rate pacing. The application's side of each direction is metered:
+// writes into the outgoing ring by TxPacing, reads from the incoming ring by
+// RxPacing (see pacing.h). The rest of the port sees paced data as a ring
+// that fills or drains more slowly.
+//
+
+static
+VOID
+QueueUpdatePacing(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Sets both buckets from the port's pacing flags, baud rate and line
+    control, and lets whatever they held back go at the new rate.
+
+--*/
+{
+    PPORT_CONTEXT           portContext = QueueContext->PortContext;
+    ULONG                   baudRate = GetBaudRate(portContext);
+    ULONG                   lineControl = (ULONG)ReadNoFence((LONG*)GetLineControlRegisterPtr(portContext));
+    ULONG                   flags = QueueContext->PacingFlags;
+    ULONG64                 now = KeQueryInterruptTime();
+
+    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeWriteLock);
+    PacingBucketConfigure(&QueueContext->TxPacing,
+        (flags & VCOM_PACE_TRANSMIT) ? baudRate : 0, lineControl, now);
+    WdfSpinLockRelease(QueueContext->RingBufferToUserModeWriteLock);
+
+    WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkReadLock);
+    PacingBucketConfigure(&QueueContext->RxPacing,
+        (flags & VCOM_PACE_RECEIVE) ? baudRate : 0, lineControl, now);
+    WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+
+    QueuePumpOutgoing(QueueContext);
+    QueuePumpIncoming(QueueContext);
+}
+
+
+static
+NTSTATUS
+QueueSetPacing(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  ULONG             Flags
+)
+{
+    if (Flags & ~(VCOM_PACE_TRANSMIT | VCOM_PACE_RECEIVE)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    QueueContext->PacingFlags = Flags;
+    QueueUpdatePacing(QueueContext);
+    return STATUS_SUCCESS;
+}
+
+
+//
+// Word length and parity (see dataformat.h). Each ring's format is applied
+// by QueueRingWriteFromMemory as bytes go in, so reads and GET_OUTGOING see
+// formatted data whatever path brought it.
+//
+
+static
+VOID
+QueueUpdateDataFormat(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Sets both directions' formats from the port's word length, line control
+    and parity mode. Bytes already in the rings keep the format they went in
+    with.
+
+--*/
+{
+    PPORT_CONTEXT           portContext = QueueContext->PortContext;
+    UCHAR                   mask = ReadUCharNoFence(&portContext->ValidDataMask);
+    ULONG                   lineControl = (ULONG)ReadNoFence((LONG*)GetLineControlRegisterPtr(portContext));
+    ULONG                   flags = QueueContext->ParityFlags;
+
+    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeWriteLock);
+    DataFormatConfigure(&QueueContext->TxFormat, mask, lineControl,
+        (flags & VCOM_PARITY_GENERATE) != 0, FALSE, 0);
+    WdfSpinLockRelease(QueueContext->RingBufferToUserModeWriteLock);
+
+    WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkWriteLock);
+    DataFormatConfigure(&QueueContext->RxFormat, mask, lineControl,
+        (flags & VCOM_PARITY_CHECK) != 0, (flags & VCOM_PARITY_REPLACE) != 0,
+        QueueContext->ParityErrorChar);
+    WdfSpinLockRelease(QueueContext->RingBufferFromNetworkWriteLock);
+}
+
+
+static
+NTSTATUS
+QueueSetParityMode(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PVCOM_PARITY_MODE Mode
+)
+{
+    if (Mode->Flags & ~(VCOM_PARITY_GENERATE | VCOM_PARITY_CHECK | VCOM_PARITY_REPLACE)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    QueueContext->ParityFlags = Mode->Flags;
+    QueueContext->ParityErrorChar = Mode->ErrorChar;
+    QueueUpdateDataFormat(QueueContext);
+    return STATUS_SUCCESS;
+}
+
+
+//
+// XON/XOFF flow control (see swflow.h) between the application and the far
+// end of the service: XOFF in pushed data holds GET_OUTGOING, and the driver
+// sends its own XOFF and XON, ahead of queued data, as the incoming ring
+// fills and drains. Paired ports, whose writes already wait for the peer's
+// reads, and shared-ring ports pass the characters through as data.
+//
+
+static
+BOOLEAN
+QueueFlowApplies(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    return !QueueContext->Shared && QueueContext->Port.PeerId == VCOM_INVALID_PORT_ID;
+}
+
+
+static
+BOOLEAN
+QueueFlowHeld(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // Read unlocked: a drain that races with an XOFF may still send what it
+    // found, as a UART finishes its FIFO
+    return QueueFlowApplies(QueueContext) &&
+        SwFlowHoldReasons(&QueueContext->SwFlow) != 0;
+}
+
+
+static
+BOOLEAN
+QueueFlowSendPending(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    return QueueFlowApplies(QueueContext) &&
+        ReadBooleanNoFence(&QueueContext->SwFlow.SendPending);
+}
+
+
+static
+VOID
+QueueUpdateFlow(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Sends XOFF or XON for the incoming ring's fill level, and lets
+    GET_OUTGOING go on if a character is now waiting to be sent or the
+    transmit hold was lifted. Called with no ring lock held, after the
+    incoming ring or the flow state changed.
+
+--*/
+{
+    BOOLEAN                 held;
+    BOOLEAN                 wake;
+
+    if (!QueueFlowApplies(QueueContext)) {
+        return;
+    }
+
+    WdfSpinLockAcquire(QueueContext->FlowLock);
+    (VOID)SwFlowCheckLimits(&QueueContext->SwFlow,
+        QueueRingGetAvailableData(QueueContext, FALSE),
+        QueueRingGetAvailableSpace(QueueContext, FALSE));
+    held = SwFlowHoldReasons(&QueueContext->SwFlow) != 0;
+    wake = QueueContext->SwFlow.SendPending || (QueueContext->FlowHeld && !held);
+    QueueContext->FlowHeld = held;
+    WdfSpinLockRelease(QueueContext->FlowLock);
+
+    if (wake) {
+        QueuePumpOutgoing(QueueContext);
+        PortTableSignalReady();
+    }
+}
+
+
+static
+NTSTATUS
+QueueSetFlow(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_opt_ PSERIAL_HANDFLOW HandFlow,
+    _In_opt_ PSERIAL_CHARS  Chars
+)
+/*++
+Routine Description:
+
+    Replaces the port's SERIAL_HANDFLOW or SERIAL_CHARS, or both, if the
+    result is valid, and applies it.
+
+    As in serial.sys, DTR and RTS follow a change of their mode: on under
+    control, handshake or transmit toggle, off otherwise. A line under
+    handshake then follows the incoming ring between XoffLimit and
+    XonLimit, and writes wait for the lines the output handshake names.
+
+--*/
+{
+    PPORT_CONTEXT           portContext = QueueContext->PortContext;
+    volatile LONG*          modemControlRegister = (volatile LONG*)GetModemControlRegister(portContext);
+    SERIAL_HANDFLOW         handFlow;
+    SERIAL_CHARS            chars;
+    ULONG                   dtrMode;
+    ULONG                   rtsMode;
+    ULONG                   rxLines = 0;
+    ULONG                   handShakeLines = 0;
+    LONG                    on = 0;
+    LONG                    off = 0;
+    LONG                    before;
+    LONG                    after;
+
+    WdfSpinLockAcquire(QueueContext->FlowLock);
+    handFlow = (HandFlow != NULL) ? *HandFlow : portContext->HandFlow;
+    chars = (Chars != NULL) ? *Chars : portContext->Chars;
+    if (!SwFlowIsValid(&handFlow, &chars)) {
+        WdfSpinLockRelease(QueueContext->FlowLock);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    dtrMode = handFlow.ControlHandShake & SERIAL_DTR_MASK;
+    rtsMode = handFlow.FlowReplace & SERIAL_RTS_MASK;
+    if (dtrMode != (portContext->HandFlow.ControlHandShake & SERIAL_DTR_MASK)) {
+        if (dtrMode != 0) {
+            on |= SERIAL_MCR_DTR;
+        }
+        else {
+            off |= SERIAL_MCR_DTR;
+        }
+    }
+    if (rtsMode != (portContext->HandFlow.FlowReplace & SERIAL_RTS_MASK)) {
+        if (rtsMode != 0) {
+            on |= SERIAL_MCR_RTS;
+        }
+        else {
+            off |= SERIAL_MCR_RTS;
+        }
+    }
+
+    // Lines under handshake start on with new limits; QueueUpdateLineFlow
+    // drops them if the incoming ring is already past XoffLimit
+    if (dtrMode == SERIAL_DTR_HANDSHAKE) {
+        rxLines |= SERIAL_MCR_DTR;
+    }
+    if (rtsMode == SERIAL_RTS_HANDSHAKE) {
+        rxLines |= SERIAL_MCR_RTS;
+    }
+    if (HandFlow != NULL) {
+        on |= (LONG)rxLines;
+        LineFlowConfigure(&QueueContext->RxLines, (ULONG)handFlow.XoffLimit, (ULONG)handFlow.XonLimit);
+    }
+    QueueContext->RxLineMask = rxLines;
+
+    if (handFlow.ControlHandShake & SERIAL_CTS_HANDSHAKE) {
+        handShakeLines |= SERIAL_MSR_CTS;
+    }
+    if (handFlow.ControlHandShake & SERIAL_DSR_HANDSHAKE) {
+        handShakeLines |= SERIAL_MSR_DSR;
+    }
+    if (handFlow.ControlHandShake & SERIAL_DCD_HANDSHAKE) {
+        handShakeLines |= SERIAL_MSR_DCD;
+    }
+    QueueContext->HandShakeLines = handShakeLines;
+
+    before = InterlockedOr(modemControlRegister, on);
+    after = InterlockedAnd(modemControlRegister, ~off) & ~off;
+
+    portContext->HandFlow = handFlow;
+    portContext->Chars = chars;
+    SwFlowConfigure(&QueueContext->SwFlow, &handFlow, &chars);
+    QueueContext->EventChar = chars.EventChar;
+    WdfSpinLockRelease(QueueContext->FlowLock);
+
+    QueueUpdateFlow(QueueContext);
+    QueueUpdateLineFlow(QueueContext);
+
+    // The output handshake may hold writes back or let them go
+    QueueSetLineState(QueueContext, NULL);
+    if (before != after) {
+        QueueModemControlChanged(QueueContext);
+    }
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+QueueSetXoff(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           Xoff
+)
+{
+    // IOCTL_SERIAL_SET_XOFF and SET_XON act as if the character came in
+    WdfSpinLockAcquire(QueueContext->FlowLock);
+    QueueContext->SwFlow.XoffReceived = Xoff;
+    WdfSpinLockRelease(QueueContext->FlowLock);
+
+    QueueUpdateFlow(QueueContext);
+}
+
+
+static
+size_t
+QueueFlowTakeSend(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFMEMORY         Memory,
+    _In_  size_t            Offset,
+    _In_  size_t            Length
+)
+/*++
+Routine Description:
+
+    Puts the flow-control character waiting to be sent, if any, at the start
+    of a GET_OUTGOING buffer; in framed mode as a chunk of its own, flagged
+    VCOM_RECORD_CONTROL, padding and all. Returns the bytes used, or 0 when
+    it does not fit.
+
+    The caller must hold the ToUser read lock.
+
+--*/
+{
+    VCOM_RECORD_HEADER      header;
+    size_t                  needed = QueueContext->Framed ? RecordFrameSize(1) : 1;
+    UCHAR                   control;
+    BOOLEAN                 taken = FALSE;
+
+    if (!QueueFlowSendPending(QueueContext) || Length < needed) {
+        return 0;
+    }
+
+    WdfSpinLockAcquire(QueueContext->FlowLock);
+    taken = SwFlowTakeSend(&QueueContext->SwFlow, &control);
+    WdfSpinLockRelease(QueueContext->FlowLock);
+    if (!taken) {
+        return 0;
+    }
+
+    if (!QueueContext->Framed) {
+        (VOID)WdfMemoryCopyFromBuffer(Memory, Offset, &control, 1);
+        return 1;
+    }
+
+    RtlZeroMemory(&header, sizeof(header));
+    header.Length = 1;
+    header.Flags = VCOM_RECORD_FIRST | VCOM_RECORD_LAST | VCOM_RECORD_CONTROL;
+    header.Timestamp = QueueTimestamp();
+    (VOID)WdfMemoryCopyFromBuffer(Memory, Offset, &header, sizeof(header));
+    (VOID)WdfMemoryCopyFromBuffer(Memory, Offset + sizeof(header), &control, 1);
+    return needed;
+}
+
+
+static
+size_t
+QueuePacingAllow(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  size_t            Wanted
+)
+/*++
+Routine Description:
+
+    Caps an application write (ToUser) or read (FromNet) at the bytes its
+    bucket lets through now.
+
+    The caller must hold the lock guarding the bucket.
+
+--*/
+{
+    PPACING_BUCKET          bucket = ToUser ? &QueueContext->TxPacing : &QueueContext->RxPacing;
+
+    if (bucket->Rate == 0) {
+        return Wanted;
+    }
+    return PacingBucketAvailable(bucket, KeQueryInterruptTime(), Wanted);
+}
+
+
+static
+VOID
+QueuePacingCharge(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  size_t            Bytes,
+    _In_  BOOLEAN           HeldBack
+)
+/*++
+Routine Description:
+
+    Takes the bytes that went through out of the bucket. If the bucket held
+    the transfer back, arms the direction's timer for when the next byte may
+    go.
+
+    The caller must hold the lock guarding the bucket.
+
+--*/
+{
+    PPACING_BUCKET          bucket = ToUser ? &QueueContext->TxPacing : &QueueContext->RxPacing;
+    ULONG64                 delay;
+
+    if (bucket->Rate == 0) {
+        return;
+    }
+
+    PacingBucketConsume(bucket, Bytes);
+    if (HeldBack) {
+        delay = PacingBucketDelay(bucket) / (TIMER_WHEEL_TICK_MS * (PACING_CLOCK_HZ / 1000));
+        TimeoutEntryArm(ToUser ? &QueueContext->TxPacingTimer : &QueueContext->RxPacingTimer,
+            TimeoutEngineNow() + delay + 1);
+    }
+}
+
+
+static
+VOID
+QueueTxPacingTimerExpired(
+    _In_  PTIMER_WHEEL_ENTRY Entry
+)
+{
+    QueuePumpOutgoing((PQUEUE_CONTEXT)Entry->Context);
+}
+
+
+static
+VOID
+QueueRxPacingTimerExpired(
+    _In_  PTIMER_WHEEL_ENTRY Entry
+)
+{
+    QueuePumpIncoming((PQUEUE_CONTEXT)Entry->Context);
+}
+
+
+static
+NTSTATUS
+QueueWriteRequestToRing(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  WDFREQUEST        Request,
+    _Out_ size_t*           Written
+)
+/*++
+Routine Description:
+
+    Puts as much of the rest of a write (ToUser) or push (FromNet) into its
+    ring as fits, advancing the request's Transferred. In framed mode an
+    application write that cannot get a record, and with transmit pacing
+    one the bucket holds back, is treated like one that finds the ring full;
+    so is an application write while its output handshake holds it.
+
+    The caller must hold the ring's write lock.
+
+--*/
+{
+    PREQUEST_CONTEXT        requestContext = GetRequestContext(Request);
+    NTSTATUS                status;
+    BOOLEAN                 framed = ToUser && QueueContext->Framed;
+    size_t                  rest = requestContext->Length - requestContext->Transferred;
+    size_t                  allowed = rest;
+
+    if (framed && !QueueRecordHasRoom(QueueContext, requestContext)) {
+        *Written = 0;
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    // QueueSetLineState pumps the writes once the lines come up. A paired
+    // write lands in the peer's ring, whose handshake is not this one's.
+    if (ToUser && !requestContext->Paired && ReadULongNoFence(&QueueContext->TxHoldLines) != 0) {
+        *Written = 0;
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    if (ToUser) {
+        allowed = QueuePacingAllow(QueueContext, TRUE, rest);
+    }
+
+    status = QueueRingWriteFromMemory(QueueContext, ToUser,
+        requestContext->Memory,
+        requestContext->Transferred,
+        allowed,
+        requestContext->Paired ? &requestContext->Format : NULL,
+        Written);
+    requestContext->Transferred += *Written;
+
+    // Held back by pacing counts as full: the rest goes in as the timer lets it
+    status = PendTransferStatus(requestContext->Length, requestContext->Transferred, status);
+    if (ToUser) {
+        QueuePacingCharge(QueueContext, TRUE, *Written, allowed < rest && *Written == allowed);
+    }
+
+    if (ToUser && *Written && !QueueContext->Shared) {
+        QueueMarkStamp(&QueueContext->EgressLog, *Written, requestContext->Timestamp);
+    }
+    if (framed && *Written) {
+        QueueRecordAppend(QueueContext, requestContext, *Written);
+    }
+    return status;
+}
+
+
+static
+NTSTATUS
+QueueReadFramedToMemory(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFMEMORY         Memory,
+    _In_  size_t            Offset,
+    _In_  size_t            Length,
+    _Out_ size_t*           BytesCopied
+)
+/*++
+Routine Description:
+
+    Drains the outgoing ring as a sequence of VCOM_RECORD_HEADER-prefixed
+    chunks. A write that does not fit, or is not all in the ring yet, is
+    split across chunks that share its sequence number; FIRST and LAST mark
+    its ends (recordframe.c). Every chunk, padding included, lies within
+    Length.
+
+    The caller must hold the ToUser read lock.
+
+--*/
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    VCOM_RECORD_HEADER      header;
+    PQUEUE_RECORD           record;
+    size_t                  out = 0;
+    size_t                  pending;
+    size_t                  room;
+    size_t                  copied;
+    BOOLEAN                 wanted;
+    BOOLEAN                 last;
+
+    while (out + sizeof(header) <= Length) {
+        room = RecordFrameRoom(Length, out);
+
+        WdfSpinLockAcquire(QueueContext->RecordLock);
+        if (QueueContext->RecordHead == QueueContext->RecordTail) {
+            WdfSpinLockRelease(QueueContext->RecordLock);
+            break;
+        }
+        record = &QueueContext->Records[QueueContext->RecordHead & QUEUE_RECORD_MASK];
+        pending = record->Length - record->Consumed;
+        wanted = RecordFrameWanted(record, room);
+        WdfSpinLockRelease(QueueContext->RecordLock);
+
+        if (!wanted) {
+            break;
+        }
+
+        copied = 0;
+        if (pending) {
+            status = QueueRingReadToMemory(QueueContext, TRUE, Memory,
+                Offset + out + sizeof(header), min(pending, room), &copied);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+        }
+
+        WdfSpinLockAcquire(QueueContext->RecordLock);
+        record = &QueueContext->Records[QueueContext->RecordHead & QUEUE_RECORD_MASK];
+        last = RecordFrameChunk(record, copied, &header);
+        WdfSpinLockRelease(QueueContext->RecordLock);
+
+        // The record stays at the head until its last chunk is out, so a
+        // failed copy leaves the LAST (and TRUNCATED) for the next drain
+        status = WdfMemoryCopyFromBuffer(Memory, Offset + out, &header, sizeof(header));
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        if (last) {
+            WdfSpinLockAcquire(QueueContext->RecordLock);
+            QueueContext->RecordHead++;
+            WdfSpinLockRelease(QueueContext->RecordLock);
+        }
+
+        out += RecordFrameSize(copied);
+    }
+
+    *BytesCopied = out;
+    return status;
+}
+
+
+static
+NTSTATUS
+QueueDrainOutgoing(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFMEMORY         Memory,
+    _In_  size_t            Offset,
+    _In_  size_t            Length,
+    _Out_ size_t*           BytesCopied
+)
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    size_t                  control;
+
+    // The caller holds the ToUser read lock. XON and XOFF go out ahead of
+    // queued data, even while transmission is held.
+    control = QueueFlowTakeSend(QueueContext, Memory, Offset, Length);
+    *BytesCopied = 0;
+
+    if (!QueueFlowHeld(QueueContext) && control < Length) {
+        if (QueueContext->Framed) {
+            status = QueueReadFramedToMemory(QueueContext, Memory, Offset + control, Length - control, BytesCopied);
+        }
+        else {
+            status = QueueRingReadToMemory(QueueContext, TRUE, Memory, Offset + control, Length - control, BytesCopied);
+        }
+    }
+
+    *BytesCopied += control;
+    return status;
+}
+
+
+NTSTATUS
+QueueSetOutgoingMode(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  ULONG             Mode
+)
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    if (Mode != VCOM_OUTGOING_MODE_STREAM && Mode != VCOM_OUTGOING_MODE_FRAMED) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Records have to start with the ring, so only while no data flows
+    if (QueueContext->PortContext->Started || QueueContext->Shared) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (Mode == VCOM_OUTGOING_MODE_FRAMED && QueueContext->Records == NULL) {
+        // Kept until the queue goes away, like the shared region
+        WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+        attributes.ParentObject = QueueContext->Queue;
+        status = WdfMemoryCreate(&attributes, NonPagedPoolNx, QUEUE_RECORD_POOL_TAG,
+            QUEUE_RECORD_SLOTS * sizeof(QUEUE_RECORD), &QueueContext->RecordMem,
+            (PVOID*)&QueueContext->Records);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    if (QueueContext->Framed != (Mode == VCOM_OUTGOING_MODE_FRAMED)) {
+        QueueContext->Framed = (Mode == VCOM_OUTGOING_MODE_FRAMED);
+        QueueResetRings(QueueContext);
+    }
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+QueueSignalEvents(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  ULONG             Events
+)
+/*++
+Routine Description:
+
+    Records serial events (SERIAL_EV_*) and completes the pending
+    IOCTL_SERIAL_WAIT_ON_MASK with them. Events that arrive while no wait
+    is pending are kept, OR-ed together, for the next one. Events outside
+    the wait mask are dropped without taking the lock.
+
+--*/
+{
+    WDFREQUEST              request = NULL;
+    ULONG                   history = 0;
+
+    if (!WaitMaskWanted(&QueueContext->WaitEvents, Events)) {
+        return;
+    }
+
+    WdfSpinLockAcquire(QueueContext->EventLock);
+    if (WaitMaskRecord(&QueueContext->WaitEvents, Events) &&
+        NT_SUCCESS(WdfIoQueueRetrieveNextRequest(QueueContext->WaitMaskQueue, &request))) {
+        history = WaitMaskTake(&QueueContext->WaitEvents);
+    }
+    WdfSpinLockRelease(QueueContext->EventLock);
+
+    if (request != NULL) {
+        QueueCompleteWaitOnMask(request, history);
+    }
+}
+
+
+static
+VOID
+QueueCompleteWaitOnMask(
+    _In_  WDFREQUEST        Request,
+    _In_  ULONG             Events
+)
+{
+    NTSTATUS                status;
+
+    status = RequestCopyFromBuffer(Request, &Events, sizeof(Events));
+    WdfRequestComplete(Request, status);
+}
+
+
+static
+VOID
+QueueCheckTxEmpty(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // EV_TXEMPTY: the last byte the application wrote has been drained
+    if (!WaitMaskWanted(&QueueContext->WaitEvents, SERIAL_EV_TXEMPTY)) {
+        return;
+    }
+
+    if (QueueRingGetAvailableData(QueueContext, TRUE) == 0 && QueueContext->WritePend.Current == NULL) {
+        QueueSignalEvents(QueueContext, SERIAL_EV_TXEMPTY);
+    }
+}
+
+
+static
+VOID
+QueueNoteQueueOverrun(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // Reported by IOCTL_SERIAL_GET_COMMSTATUS. Like serial.sys, a full
+    // receive buffer is not an EV_ERR line error.
+    WdfSpinLockAcquire(QueueContext->EventLock);
+    QueueContext->LineErrors |= SERIAL_ERROR_QUEUEOVERRUN;
+    WdfSpinLockRelease(QueueContext->EventLock);
+}
+
+
+static
+VOID
+QueueSignalReceived(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Raises EV_RXCHAR for bytes just put in the incoming ring, EV_RXFLAG if
+    the event character was among them, and EV_ERR with
+    SERIAL_ERROR_PARITY if any of them failed the parity check. Then
+    brings XON/XOFF and the handshake lines up to date with the ring and
+    the characters that came in.
+
+--*/
+{
+    ULONG                   events = SERIAL_EV_RXCHAR;
+
+    if (ReadNoFence(&QueueContext->ParityErrors) != 0 &&
+        InterlockedExchange(&QueueContext->ParityErrors, 0) != 0) {
+        WdfSpinLockAcquire(QueueContext->EventLock);
+        QueueContext->LineErrors |= SERIAL_ERROR_PARITY;
+        WdfSpinLockRelease(QueueContext->EventLock);
+        events |= SERIAL_EV_ERR;
+    }
+    if (ReadNoFence(&QueueContext->EventCharsFound) != 0 &&
+        InterlockedExchange(&QueueContext->EventCharsFound, 0) != 0) {
+        events |= SERIAL_EV_RXFLAG;
+    }
+
+    QueueSignalEvents(QueueContext, events);
+    QueueUpdateFlow(QueueContext);
+    QueueUpdateLineFlow(QueueContext);
+}
+
+
+VOID
+QueueResetWaitMask(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    WDFREQUEST              request = NULL;
+
+    WdfSpinLockAcquire(QueueContext->EventLock);
+    WaitMaskReset(&QueueContext->WaitEvents);
+    QueueContext->LineErrors = 0;
+    (VOID)WdfIoQueueRetrieveNextRequest(QueueContext->WaitMaskQueue, &request);
+    WdfSpinLockRelease(QueueContext->EventLock);
+
+    if (request != NULL) {
+        WdfRequestComplete(request, STATUS_CANCELLED);
+    }
+}
+
+
+static
+VOID
+QueueSetLineState(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_opt_ PVCOM_LINE_STATE LineState
+)
+/*++
+Routine Description:
+
+    Takes the remote end's modem lines and line errors from the control
+    service or a null-modem peer and turns the changes into serial events,
+    the way a UART's modem and line status interrupts would. The lines in
+    TxLineMask come from TxLines instead. With no LineState, only those
+    and the output handshake are brought up to date.
+
+    Writes wait while a line the output handshake names is low, and are
+    pumped once none is.
+
+--*/
+{
+    ULONG                   txLines = ReadULongNoFence(&QueueContext->TxLineMask);
+    ULONG                   modemStatus;
+    ULONG                   valid;
+    ULONG                   held;
+    ULONG                   wasHeld;
+    ULONG                   errors = 0;
+    ULONG                   changed;
+    ULONG                   events = 0;
+
+    WdfSpinLockAcquire(QueueContext->EventLock);
+    if (LineState != NULL) {
+        QueueContext->RemoteModemStatus = LineState->ModemStatus & VCOM_LINE_MODEM_MASK;
+        QueueContext->LinesReported = TRUE;
+        QueueContext->LineErrors |= LineState->Errors;
+        errors = LineState->Errors;
+    }
+
+    // TxLines.Off is read unlocked: whoever moves it calls in afterwards
+    modemStatus = QueueContext->RemoteModemStatus & ~txLines;
+    if (!ReadBooleanNoFence(&QueueContext->TxLines.Off)) {
+        modemStatus |= txLines;
+    }
+    changed = QueueContext->ModemStatus ^ modemStatus;
+    QueueContext->ModemStatus = modemStatus;
+
+    // Lines nobody has reported or driven yet do not hold writes
+    valid = (QueueContext->LinesReported ? VCOM_LINE_MODEM_MASK : 0) | txLines;
+    held = ReadULongNoFence(&QueueContext->HandShakeLines) & valid & ~modemStatus;
+    wasHeld = QueueContext->TxHoldLines;
+    QueueContext->TxHoldLines = held;
+    WdfSpinLockRelease(QueueContext->EventLock);
+
+    if (changed & SERIAL_MSR_CTS) {
+        events |= SERIAL_EV_CTS;
+    }
+    if (changed & SERIAL_MSR_DSR) {
+        events |= SERIAL_EV_DSR;
+    }
+    if (changed & SERIAL_MSR_DCD) {
+        events |= SERIAL_EV_RLSD;
+    }
+    // As on a 16550, ring is signalled on the trailing edge
+    if ((changed & SERIAL_MSR_RI) && !(modemStatus & SERIAL_MSR_RI)) {
+        events |= SERIAL_EV_RING;
+    }
+    if (errors & SERIAL_ERROR_BREAK) {
+        events |= SERIAL_EV_BREAK;
+    }
+    if (errors & (SERIAL_ERROR_FRAMING | SERIAL_ERROR_OVERRUN | SERIAL_ERROR_PARITY)) {
+        events |= SERIAL_EV_ERR;
+    }
+
+    if (events) {
+        QueueSignalEvents(QueueContext, events);
+    }
+
+    if (wasHeld != 0 && held == 0) {
+        QueuePumpOutgoing(QueueContext);
+    }
+}
+
+
+static
+VOID
+QueueDriveModemLines(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  ULONG             PeerModemControl
+)
+/*++
+Routine Description:
+
+    Sets a paired port's DSR, DCD and CTS from its peer's DTR and RTS, the
+    way a null-modem cable crosses them over. RI and line errors are left
+    as they are.
+
+--*/
+{
+    VCOM_LINE_STATE         lineState = { 0 };
+
+    WdfSpinLockAcquire(QueueContext->EventLock);
+    lineState.ModemStatus = QueueContext->RemoteModemStatus & SERIAL_MSR_RI;
+    WdfSpinLockRelease(QueueContext->EventLock);
+
+    if (PeerModemControl & SERIAL_MCR_DTR) {
+        lineState.ModemStatus |= SERIAL_MSR_DSR | SERIAL_MSR_DCD;
+    }
+    if (PeerModemControl & SERIAL_MCR_RTS) {
+        lineState.ModemStatus |= SERIAL_MSR_CTS;
+    }
+    QueueSetLineState(QueueContext, &lineState);
+}
+
+
+static
+VOID
+QueueCrossModemLines(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    PQUEUE_CONTEXT          peer;
+
+    peer = PortTableAcquire(QueueContext->Port.PeerId);
+    if (peer == NULL) {
+        return;
+    }
+    QueueDriveModemLines(peer, *GetModemControlRegister(QueueContext->PortContext));
+    PortTableRelease(peer);
+}
+
+
+static
+VOID
+QueueModemControlChanged(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // The service picks DTR and RTS up with IOCTL_VCOM_GET_MODEM_CONTROL
+    // after WAIT_READY reports VCOM_READY_LINES; a null-modem peer sees them
+    // at once
+    InterlockedExchange(&QueueContext->ModemControlChanged, 1);
+    QueueCrossModemLines(QueueContext);
+    PortTableSignalReady();
+}
+
+
+//
+// Hardware flow control, emulated from the rings' fill levels. A real UART
+// drops CTS when the far end cannot take more, and the application drops
+// RTS (or DTR) when its receive buffer fills. Here the far end is the
+// control service: the lines in TxLineMask go low while the outgoing ring,
+// which it drains, is close to full, and the application's RTS or DTR under
+// handshake go low while the incoming ring, which the application reads,
+// is. Shared-ring ports move their indices without the driver seeing it
+// and are left out.
+//
+
+static
+VOID
+QueueUpdateLineFlow(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Moves the emulated lines for the rings' fill levels, and passes the
+    changes on: to the application's modem status and output handshake,
+    and to the service and a null-modem peer. Called with no ring lock
+    held, after either ring changed.
+
+--*/
+{
+    volatile LONG*          modemControlRegister;
+    ULONG                   rxLines;
+    BOOLEAN                 txChanged = FALSE;
+    BOOLEAN                 rxChanged = FALSE;
+
+    if (QueueContext->Shared ||
+        (ReadULongNoFence(&QueueContext->TxLineMask) == 0 &&
+         ReadULongNoFence(&QueueContext->RxLineMask) == 0)) {
+        return;
+    }
+
+    WdfSpinLockAcquire(QueueContext->FlowLock);
+    if (QueueContext->TxLineMask != 0) {
+        txChanged = LineFlowUpdate(&QueueContext->TxLines,
+            QueueRingGetAvailableData(QueueContext, TRUE),
+            QueueRingGetAvailableSpace(QueueContext, TRUE));
+    }
+
+    rxLines = QueueContext->RxLineMask;
+    if (rxLines != 0) {
+        rxChanged = LineFlowUpdate(&QueueContext->RxLines,
+            QueueRingGetAvailableData(QueueContext, FALSE),
+            QueueRingGetAvailableSpace(QueueContext, FALSE));
+    }
+    if (rxChanged) {
+        modemControlRegister = (volatile LONG*)GetModemControlRegister(QueueContext->PortContext);
+        if (QueueContext->RxLines.Off) {
+            InterlockedAnd(modemControlRegister, ~(LONG)rxLines);
+        }
+        else {
+            InterlockedOr(modemControlRegister, (LONG)rxLines);
+        }
+    }
+    WdfSpinLockRelease(QueueContext->FlowLock);
+
+    if (txChanged) {
+        QueueSetLineState(QueueContext, NULL);
+    }
+    if (rxChanged) {
+        QueueModemControlChanged(QueueContext);
+    }
+}
+
+
+static
+NTSTATUS
+QueueSetLineFlow(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PVCOM_LINE_FLOW   LineFlow
+)
+/*++
+Routine Description:
+
+    Hands the lines in LineFlow (CTS, DSR or DCD) over to the outgoing
+    ring's fill level, or back to IOCTL_VCOM_SET_LINE_STATE with none.
+    Limits of zero pick serial.sys-like defaults for the ring's size.
+
+--*/
+{
+    size_t                  capacity;
+    ULONG                   offLimit = LineFlow->OffLimit;
+    ULONG                   onLimit = LineFlow->OnLimit;
+
+    if (LineFlow->Lines & ~(ULONG)(SERIAL_MSR_CTS | SERIAL_MSR_DSR | SERIAL_MSR_DCD)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (QueueContext->Shared) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    WdfSpinLockAcquire(QueueContext->FlowLock);
+    capacity = QueueRingGetAvailableData(QueueContext, TRUE) + QueueRingGetAvailableSpace(QueueContext, TRUE);
+    if (offLimit == 0 && onLimit == 0) {
+        offLimit = (ULONG)(capacity / 8);
+        onLimit = (ULONG)(capacity / 2);
+    }
+    LineFlowConfigure(&QueueContext->TxLines, offLimit, onLimit);
+    QueueContext->TxLineMask = LineFlow->Lines;
+    WdfSpinLockRelease(QueueContext->FlowLock);
+
+    // Lines handed back keep the last reported state until the next report
+    QueueUpdateLineFlow(QueueContext);
+    QueueSetLineState(QueueContext, NULL);
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+QueuePairPorts(
+    _In_  WDFFILEOBJECT     FileObject,
+    _In_  PVCOM_PORT_PAIR   Pair
+)
+/*++
+Routine Description:
+
+    Handles IOCTL_VCOM_PAIR_PORTS: wires two ports into a null-modem pair,
+    or a port to itself, or undoes a port's pair. The crossed modem lines
+    are brought up to date on both ends. FileObject, the request's handle,
+    must control every port named (DeviceControlsPort).
+
+--*/
+{
+    NTSTATUS                status;
+    PQUEUE_CONTEXT          port;
+    PQUEUE_CONTEXT          peer;
+
+    port = PortTableAcquire(Pair->PortId);
+    if (port == NULL) {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+    if (!DeviceControlsPort(FileObject, port->PortContext)) {
+        PortTableRelease(port);
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (Pair->PeerId == VCOM_INVALID_PORT_ID) {
+        QueueUnpair(port);
+        PortTableRelease(port);
+        return STATUS_SUCCESS;
+    }
+
+    // For loopback this takes a second reference on the same port
+    peer = PortTableAcquire(Pair->PeerId);
+    if (peer == NULL) {
+        PortTableRelease(port);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+    if (!DeviceControlsPort(FileObject, peer->PortContext)) {
+        PortTableRelease(peer);
+        PortTableRelease(port);
+        return STATUS_ACCESS_DENIED;
+    }
+
+    status = PortTableLink(port, peer);
+    if (NT_SUCCESS(status)) {
+        QueueDriveModemLines(peer, *GetModemControlRegister(port->PortContext));
+        QueueDriveModemLines(port, *GetModemControlRegister(peer->PortContext));
+    }
+
+    PortTableRelease(peer);
+    PortTableRelease(port);
+    return status;
+}
+
+
+static
+VOID
+QueueUnpair(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Undoes the port's null-modem pair, if it has one, as if the cable were
+    pulled: writes pending across it in either direction are cancelled with
+    the bytes they got in, and the crossed lines drop on both ends.
+
+--*/
+{
+    PQUEUE_CONTEXT          peer;
+    ULONG                   peerId;
+
+    peerId = PortTableUnlink(QueueContext);
+    if (peerId == VCOM_INVALID_PORT_ID) {
+        return;
+    }
+
+    // Both ends' pended pushes are the other application's writes
+    QueueCancelPendingWrites(QueueContext, FALSE);
+    QueueDriveModemLines(QueueContext, 0);
+
+    if (peerId == QueueContext->Port.PortId) {
+        return;
+    }
+
+    peer = PortTableAcquire(peerId);
+    if (peer != NULL) {
+        QueueCancelPendingWrites(peer, FALSE);
+        QueueDriveModemLines(peer, 0);
+        PortTableRelease(peer);
+    }
+}
+
+
+static
+VOID
+QueueArmWriteTimeout(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFREQUEST        Request
+)
+{
+    SERIAL_TIMEOUTS         timeouts = QueueContext->PortContext->Timeouts;
+    ULONG64                 totalMs;
+
+    // Caller holds the ToUser write lock. The total timeout runs from when
+    // the write started going into the ring.
+    totalMs = (ULONG64)timeouts.WriteTotalTimeoutMultiplier * GetRequestContext(Request)->Length +
+        timeouts.WriteTotalTimeoutConstant;
+
+    if (totalMs == 0) {
+        QueueContext->WriteDeadline = 0;
+        TimeoutEntryCancel(&QueueContext->WriteTimer);
+        return;
+    }
+
+    QueueContext->WriteDeadline = TimeoutEngineNow() + TimeoutEngineMsToTicks(totalMs);
+    TimeoutEntryArm(&QueueContext->WriteTimer, QueueContext->WriteDeadline);
+}
+
+
+static
+VOID
+QueueWriteTimerExpired(
+    _In_  PTIMER_WHEEL_ENTRY Entry
+)
+{
+    PQUEUE_CONTEXT          queueContext = (PQUEUE_CONTEXT)Entry->Context;
+    WDFREQUEST              request;
+    size_t                  transferred;
+
+    WdfSpinLockAcquire(queueContext->RingBufferToUserModeWriteLock);
+
+    request = (WDFREQUEST)queueContext->WritePend.Current;
+    if (request == NULL || queueContext->WriteDeadline == 0) {
+        WdfSpinLockRelease(queueContext->RingBufferToUserModeWriteLock);
+        return;
+    }
+
+    // Armed for an earlier write; this one started later
+    if (TimeoutEngineNow() < queueContext->WriteDeadline) {
+        TimeoutEntryArm(Entry, queueContext->WriteDeadline);
+        WdfSpinLockRelease(queueContext->RingBufferToUserModeWriteLock);
+        return;
+    }
+
+    (VOID)PendRemove(&queueContext->WritePend, request);
+    queueContext->WriteDeadline = 0;
+    QueueRecordEnd(queueContext, GetRequestContext(request));
+    transferred = GetRequestContext(request)->Transferred;
+    if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) {
+        // EvtRequestCancelWrite is about to run and completes it
+        request = NULL;
+    }
+
+    WdfSpinLockRelease(queueContext->RingBufferToUserModeWriteLock);
+
+    if (request != NULL) {
+        TracePoint(TRACE_LEVEL_INFO, VCOM_TRACE_EVENT_WRITE_TIMEOUT, queueContext->Port.PortId, transferred, 0);
+        WdfRequestCompleteWithInformation(request, STATUS_TIMEOUT, transferred);
+    }
+
+    // Let the next write in line start
+    QueuePumpOutgoing(queueContext);
+}
+
+
+
+static
+NTSTATUS
+QueuePendTransfer(
+    _In_  PPEND_QUEUE       Self,
+    _In_  PVOID             Request,
+    _Out_ size_t*           Written
+)
+{
+    PQUEUE_CONTEXT          queueContext = (PQUEUE_CONTEXT)Self->Owner;
+
+    return QueueWriteRequestToRing(queueContext, Self == &queueContext->WritePend, (WDFREQUEST)Request, Written);
+}
+
+
+static
+ULONG
+QueuePendQueued(
+    _In_  PPEND_QUEUE       Self
+)
+{
+    PQUEUE_CONTEXT          queueContext = (PQUEUE_CONTEXT)Self->Owner;
+    ULONG                   queued = 0;
+
+    (VOID)WdfIoQueueGetState(Self == &queueContext->WritePend ? queueContext->WriteQueue : queueContext->PushQueue,
+        &queued, NULL);
+    return queued;
+}
+
+
+static
+BOOLEAN
+QueuePendDequeue(
+    _In_  PPEND_QUEUE       Self,
+    _Out_ PVOID*            Request
+)
+{
+    PQUEUE_CONTEXT          queueContext = (PQUEUE_CONTEXT)Self->Owner;
+    WDFREQUEST              request;
+
+    *Request = NULL;
+
+    // Nothing new is started once the port is stopping
+    if (!queueContext->PortContext->Started ||
+        !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+            Self == &queueContext->WritePend ? queueContext->WriteQueue : queueContext->PushQueue, &request))) {
+        return FALSE;
+    }
+    *Request = request;
+    return TRUE;
+}
+
+
+static
+NTSTATUS
+QueuePendHold(
+    _In_  PPEND_QUEUE       Self,
+    _In_  PVOID             Request
+)
+{
+    PQUEUE_CONTEXT          queueContext = (PQUEUE_CONTEXT)Self->Owner;
+    BOOLEAN                 toUser = (Self == &queueContext->WritePend);
+    NTSTATUS                status;
+
+    status = WdfRequestMarkCancelableEx((WDFREQUEST)Request, toUser ? EvtRequestCancelWrite : EvtRequestCancelPush);
+    if (NT_SUCCESS(status) && toUser) {
+        QueueArmWriteTimeout(queueContext, (WDFREQUEST)Request);
+    }
+    return status;
+}
+
+
+static
+size_t
+QueueServicePendingWrites(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser
+)
+/*++
+Routine Description:
+
+    Moves pending application writes (ToUser) or pended service pushes
+    (FromNet) into their ring, oldest first, as far as free space allows. A
+    request that fills the ring stays current with its progress recorded in
+    its request context; the next drain picks it up from there. PendService
+    makes those calls; this holds the lock around each step and completes
+    what it finishes.
+
+Return Value:
+
+    The number of bytes committed to the ring.
+
+--*/
+{
+    WDFSPINLOCK             lock = ToUser ? QueueContext->RingBufferToUserModeWriteLock : QueueContext->RingBufferFromNetworkWriteLock;
+    PPEND_QUEUE             pend = ToUser ? &QueueContext->WritePend : &QueueContext->PushPend;
+    PVOID                   request;
+    PEND_STEP               step;
+    NTSTATUS                status;
+    size_t                  written;
+    size_t                  total = 0;
+    BOOLEAN                 flagged = FALSE;
+
+    // Cheap exit for the common case. The barrier orders the caller's drain
+    // before the check; a writer that pends concurrently retries on its own.
+    KeMemoryBarrier();
+    if (PendPending(pend) == 0) {
+        return 0;
+    }
+
+    for (;;) {
+        WdfSpinLockAcquire(lock);
+
+        step = PendService(pend, &request, &status, &written);
+        total += written;
+
+        if (step == PendStepWaiting) {
+            // Ring full. In shared mode the service drains without telling
+            // us, so ask it for a doorbell and then look once more.
+            if (ToUser && QueueContext->Shared && !flagged) {
+                SharedRingSetProducerWaiting(&QueueContext->SharedToUser, TRUE);
+                flagged = TRUE;
+                WdfSpinLockRelease(lock);
+                continue;
+            }
+        }
+        if (step != PendStepFinished && step != PendStepDone) {
+            WdfSpinLockRelease(lock);
+            break;
+        }
+
+        if (ToUser) {
+            if (step == PendStepFinished) {
+                QueueContext->WriteDeadline = 0;
+                TimeoutEntryCancel(&QueueContext->WriteTimer);
+            }
+            QueueRecordEnd(QueueContext, GetRequestContext((WDFREQUEST)request));
+        }
+        if (step == PendStepFinished && WdfRequestUnmarkCancelable((WDFREQUEST)request) == STATUS_CANCELLED) {
+            // The cancel routine is about to run and completes it
+            request = NULL;
+        }
+        WdfSpinLockRelease(lock);
+
+        if (request != NULL) {
+            if (!ToUser && NT_SUCCESS(status)) {
+                QueueReturnPushCredit(QueueContext, (WDFREQUEST)request);
+            }
+            WdfRequestCompleteWithInformation((WDFREQUEST)request, status,
+                GetRequestContext((WDFREQUEST)request)->Transferred);
+        }
+    }
+
+    // FromNet callers run the incoming pump, which wakes the readers
+    if (total) {
+        if (ToUser) {
+            PortTableSignalReady();
+        }
+        else {
+            QueueSignalReceived(QueueContext);
+        }
+    }
+    return total;
+}
+
+
+static
+BOOLEAN
+QueueOutgoingReady(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Decides whether a GET_OUTGOING may complete now. Called with the ToUser
+    read lock held. A flow-control character waiting to be sent always
+    completes it, and held transmission never does. Otherwise coalescing
+    decides (CoalesceReady), arming the coalescing timer when it starts
+    holding data back. A full ring or a pending write always completes, so
+    writers never wait on the delay.
+
+--*/
+{
+    size_t                  available = QueueRingGetAvailableData(QueueContext, TRUE);
+    BOOLEAN                 ready;
+    BOOLEAN                 arm;
+
+    // XON and XOFF go at once; queued data waits while XOFF holds it
+    if (QueueFlowSendPending(QueueContext)) {
+        return TRUE;
+    }
+    if (available == 0 || QueueFlowHeld(QueueContext)) {
+        return FALSE;
+    }
+
+    if (QueueContext->Coalesce.MinBytes <= 1) {
+        return TRUE;
+    }
+
+    ready = CoalesceReady(&QueueContext->Coalesce,
+        available,
+        QueueContext->WritePend.Current != NULL || QueueRingGetAvailableSpace(QueueContext, TRUE) == 0,
+        TimeoutEngineNow(),
+        &arm);
+    if (arm) {
+        TimeoutEntryArm(&QueueContext->CoalesceTimer, QueueContext->Coalesce.Deadline);
+    }
+    return ready;
+}
+
+
+static
+VOID
+QueueOutgoingDrained(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  size_t            Available
+)
+/*++
+Routine Description:
+
+    Coalescing bookkeeping after a GET_OUTGOING drained the ring, which
+    held Available bytes. Called with the ToUser read lock held. In
+    adaptive mode the target follows the traffic, like NIC interrupt
+    moderation (CoalesceDrained).
+
+--*/
+{
+    if (QueueContext->Coalesce.MinBytes <= 1) {
+        return;
+    }
+
+    if (CoalesceDrained(&QueueContext->Coalesce,
+            Available,
+            QueueRingGetAvailableData(QueueContext, TRUE) == 0,
+            TimeoutEngineNow())) {
+        TimeoutEntryCancel(&QueueContext->CoalesceTimer);
+    }
+}
+
+
+static
+VOID
+QueueCoalesceTimerExpired(
+    _In_  PTIMER_WHEEL_ENTRY Entry
+)
+{
+    // The pump re-checks under the lock and completes what is now due
+    QueuePumpOutgoing((PQUEUE_CONTEXT)Entry->Context);
+}
+
+
+NTSTATUS
+QueueSetCoalescing(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PVCOM_COALESCE    Coalesce
+)
+{
+    NTSTATUS                status;
+
+    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeReadLock);
+    status = CoalesceSet(&QueueContext->Coalesce, Coalesce, TimeoutEngineMsToTicks(Coalesce->MaxDelayMs));
+    if (NT_SUCCESS(status)) {
+        TimeoutEntryCancel(&QueueContext->CoalesceTimer);
+    }
+    WdfSpinLockRelease(QueueContext->RingBufferToUserModeReadLock);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Whatever the old settings held back may be due now
+    QueuePumpOutgoing(QueueContext);
+    return STATUS_SUCCESS;
+}
+
+
+static
+size_t
+QueueSatisfyPendingOutgoing(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Completes pended GET_OUTGOING requests from the outgoing ring until it
+    runs dry, or until what is left is being held back for coalescing.
+
+Return Value:
+
+    The number of bytes drained.
+
+--*/
+{
+    size_t                  total = 0;
+
+    // Check how much is available to drain by any pending GET_OUTGOING IOCTL.
+    // This is only a hint, so no lock is needed.
+    if (QueueRingGetAvailableData(QueueContext, TRUE) == 0 && !QueueFlowSendPending(QueueContext)) {
+        return 0;
+    }
+
+    // Wake any pending GET_OUTGOING requests by re-dispatching them
+    for (;;) {
+        WDFREQUEST      getOutgoingRequest;
+        NTSTATUS        s;
+        BOOLEAN         ready;
+
+        WdfSpinLockAcquire(QueueContext->RingBufferToUserModeReadLock);
+        ready = QueueOutgoingReady(QueueContext);
+        WdfSpinLockRelease(QueueContext->RingBufferToUserModeReadLock);
+        if (!ready) {
+            break;
+        }
+
+        s = WdfIoQueueRetrieveNextRequest(QueueContext->OutgoingQueue, &getOutgoingRequest);
+        if (!NT_SUCCESS(s)) {
+            // No more pending requests to fulfill
+            break;
+        }
+
+        // We have a pending IOCTL. Let's try to complete it.
+        WDFMEMORY outputMemory;
+        size_t    outputBufferLength = 0;
+        size_t    bytesCopied = 0;
+        size_t    available;
+
+        s = WdfRequestRetrieveOutputMemory(getOutgoingRequest, &outputMemory);
+        if (!NT_SUCCESS(s)) {
+            // Failed to get buffer, complete with an error.
+            WdfRequestComplete(getOutgoingRequest, s);
+            continue;
+        }
+        (void)WdfMemoryGetBuffer(outputMemory, &outputBufferLength);
+
+        // Read from the ring buffer straight into the IOCTL's buffer
+        WdfSpinLockAcquire(QueueContext->RingBufferToUserModeReadLock);
+        available = QueueRingGetAvailableData(QueueContext, TRUE);
+        QueueDrainOutgoing(
+            QueueContext,
+            outputMemory,
+            0,
+            outputBufferLength,
+            &bytesCopied
+        );
+        if (bytesCopied > 0) {
+            QueueOutgoingDrained(QueueContext, available);
+        }
+        WdfSpinLockRelease(QueueContext->RingBufferToUserModeReadLock);
+
+        QueueElasticAfterRead(QueueContext, TRUE);
+
+        if (bytesCopied > 0) {
+            // We read some data, complete the request successfully.
+            WdfRequestCompleteWithInformation(getOutgoingRequest, STATUS_SUCCESS, bytesCopied);
+            total += bytesCopied;
+        }
+        else {
+            // Race condition: data was drained by another thread between our check
+            // and retrieving the request. Re-queue it.
+            s = WdfRequestForwardToIoQueue(getOutgoingRequest, QueueContext->OutgoingQueue);
+            if (!NT_SUCCESS(s)) {
+                Trace(TRACE_LEVEL_ERROR, "Forward read after PUSH failed 0x%x", s);
+                // If invalid state, complete canceled to avoid leaks
+                if (s == STATUS_WDF_REQUEST_INVALID_STATE || s == STATUS_CANCELLED) {
+                    WdfRequestComplete(getOutgoingRequest, STATUS_CANCELLED);
+                }
+                else {
+                    WdfRequestComplete(getOutgoingRequest, s);
+                }
+            }
+            // The ring is empty; retrieving again would just hand us the
+            // request we re-queued.
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static
+VOID
+QueuePumpOutgoing(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    BOOLEAN                 drained = FALSE;
+
+    // Pending writes fill the outgoing ring and pending GET_OUTGOING requests
+    // drain it; keep going for as long as draining makes room for more.
+    for (;;) {
+        (VOID)QueueServicePendingWrites(QueueContext, TRUE);
+        if (QueueSatisfyPendingOutgoing(QueueContext) == 0) {
+            break;
+        }
+        drained = TRUE;
+    }
+
+    if (drained) {
+        QueueCheckTxEmpty(QueueContext);
+    }
+
+    // Writes and drains both move the outgoing ring
+    QueueUpdateLineFlow(QueueContext);
+}
+
+
+// The port a pending read, write or push is waiting on. A request taken
+// from one of the manual queues reports that queue as its own, and a paired
+// port's write waits on its peer, not on the port its file object is bound
+// to; QueueStartWrite and EvtIoRead record the right one.
+static
+PQUEUE_CONTEXT
+QueueContextFromRequest(
+    _In_  WDFREQUEST        Request
+)
+{
+    return GetRequestContext(Request)->Port;
+}
+
+
+static
+VOID
+QueueCancelCurrentWrite(
+    _In_  WDFREQUEST        Request,
+    _In_  BOOLEAN           ToUser
+)
+{
+    PQUEUE_CONTEXT          queueContext = QueueContextFromRequest(Request);
+    PREQUEST_CONTEXT        requestContext = GetRequestContext(Request);
+    WDFSPINLOCK             lock = ToUser ? queueContext->RingBufferToUserModeWriteLock : queueContext->RingBufferFromNetworkWriteLock;
+    size_t                  written;
+
+    WdfSpinLockAcquire(lock);
+    if (PendRemove(ToUser ? &queueContext->WritePend : &queueContext->PushPend, Request)) {
+        if (ToUser) {
+            queueContext->WriteDeadline = 0;
+            TimeoutEntryCancel(&queueContext->WriteTimer);
+            QueueRecordEnd(queueContext, requestContext);
+        }
+    }
+    written = requestContext->Transferred;
+    WdfSpinLockRelease(lock);
+
+    // Report the bytes that did make it into the ring
+    WdfRequestCompleteWithInformation(Request,
+        (written == requestContext->Length) ? STATUS_SUCCESS : STATUS_CANCELLED,
+        written);
+
+    // Let the next one in line start
+    if (ToUser) {
+        QueuePumpOutgoing(queueContext);
+    }
+    else {
+        QueuePumpIncoming(queueContext);
+    }
+}
+
+
+VOID
+EvtRequestCancelWrite(
+    _In_  WDFREQUEST        Request
+)
+{
+    QueueCancelCurrentWrite(Request, TRUE);
+}
+
+
+VOID
+EvtRequestCancelPush(
+    _In_  WDFREQUEST        Request
+)
+{
+    QueueCancelCurrentWrite(Request, FALSE);
+}
+
+
+VOID
+QueueCancelPendingWrites(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser
+)
+{
+    WDFSPINLOCK             lock = ToUser ? QueueContext->RingBufferToUserModeWriteLock : QueueContext->RingBufferFromNetworkWriteLock;
+    PPEND_QUEUE             pend = ToUser ? &QueueContext->WritePend : &QueueContext->PushPend;
+    WDFREQUEST              request;
+    PQUEUE_CONTEXT          peer;
+    NTSTATUS                status;
+
+    // A paired port's application writes pend on the peer's incoming side
+    if (ToUser && QueueContext->Port.PeerId != VCOM_INVALID_PORT_ID) {
+        peer = PortTableAcquire(QueueContext->Port.PeerId);
+        if (peer != NULL) {
+            QueueCancelPendingWrites(peer, FALSE);
+            PortTableRelease(peer);
+        }
+    }
+
+    for (;;) {
+        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(ToUser ? QueueContext->WriteQueue : QueueContext->PushQueue, &request))) {
+            if (ToUser) {
+                InterlockedAddNoFence64(&QueueContext->Counters->TruncatedBytes,
+                    (LONG64)GetRequestContext(request)->Length);
+            }
+            WdfRequestComplete(request, STATUS_CANCELLED);
+        }
+
+        WdfSpinLockAcquire(lock);
+        request = (WDFREQUEST)PendTakeCurrent(pend);
+        if (ToUser) {
+            QueueContext->WriteDeadline = 0;
+            TimeoutEntryCancel(&QueueContext->WriteTimer);
+            if (request != NULL) {
+                QueueRecordEnd(QueueContext, GetRequestContext(request));
+            }
+        }
+        status = request ? WdfRequestUnmarkCancelable(request) : STATUS_SUCCESS;
+        WdfSpinLockRelease(lock);
+
+        if (request == NULL) {
+            break;
+        }
+
+        // Otherwise the cancel routine completes it
+        if (status != STATUS_CANCELLED) {
+            WdfRequestCompleteWithInformation(request, STATUS_CANCELLED,
+                GetRequestContext(request)->Transferred);
+        }
+    }
+}
+
+
+static
+VOID
+QueueStartWrite(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser,
+    _In_  WDFREQUEST        Request
+)
+/*++
+Routine Description:
+
+    Starts an application write (ToUser) or a pending-mode service push
+    (FromNet) whose request context has been filled in. A request that fits
+    completes at once. One that does not is never truncated: it stays
+    pending, with the bytes that did fit already in the ring, and finishes
+    as the ring drains. Requests behind a pending one queue up in order.
+    PendStart decides which of those happens.
+
+--*/
+{
+    WDFSPINLOCK             lock = ToUser ? QueueContext->RingBufferToUserModeWriteLock : QueueContext->RingBufferFromNetworkWriteLock;
+    WDFQUEUE                pending = ToUser ? QueueContext->WriteQueue : QueueContext->PushQueue;
+    PREQUEST_CONTEXT        requestContext = GetRequestContext(Request);
+    PEND_STEP               step;
+    NTSTATUS                status;
+    size_t                  written = 0;
+
+    requestContext->Port = QueueContext;
+
+    WdfSpinLockAcquire(lock);
+
+    step = PendStart(ToUser ? &QueueContext->WritePend : &QueueContext->PushPend, Request, &status, &written);
+    if (step == PendStepQueue) {
+        // Keep byte order: wait behind the requests already pending
+        WdfSpinLockRelease(lock);
+
+        status = WdfRequestForwardToIoQueue(Request, pending);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "Error: WdfRequestForwardToIoQueue(%s) failed 0x%x",
+                ToUser ? "WriteQueue" : "PushQueue", status);
+            WdfRequestComplete(Request, status);
+            return;
+        }
+        if (ToUser) {
+            InterlockedIncrementNoFence64(&QueueContext->Counters->WritesPended);
+        }
+    }
+    else {
+        if (step == PendStepWaiting) {
+            // Only part of it fit; the rest goes in as the ring drains
+            if (ToUser) {
+                InterlockedIncrementNoFence64(&QueueContext->Counters->WritesPended);
+            }
+            Request = NULL;
+        }
+
+        if (Request != NULL && ToUser) {
+            QueueRecordEnd(QueueContext, requestContext);
+        }
+
+        WdfSpinLockRelease(lock);
+
+        if (Request != NULL) {
+            if (!ToUser && NT_SUCCESS(status)) {
+                QueueReturnPushCredit(QueueContext, Request);
+            }
+            WdfRequestCompleteWithInformation(Request, status, written);
+        }
+
+        if (written) {
+            if (ToUser) {
+                // Outgoing data is now waiting to be drained
+                PortTableSignalReady();
+            }
+            else {
+                QueueSignalReceived(QueueContext);
+            }
+        }
+    }
+
+    // Requests ahead may have finished before this one was queued, and new
+    // data may satisfy a pending GET_OUTGOING or read.
+    if (ToUser) {
+        QueuePumpOutgoing(QueueContext);
+    }
+    else {
+        QueuePumpIncoming(QueueContext);
+    }
+}
+
+
+static
+ULONG
+QueuePushesPending(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // A snapshot; pushes being started or finished move it either way
+    return PendPending(&QueueContext->PushPend);
+}
+
+
+static
+NTSTATUS
+QueueGetPushCredit(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _Out_ PVCOM_PUSH_CREDIT Credit
+)
+{
+    if (QueueContext->Shared) {
+        // The free space is visible in the mapping itself
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    PendCreditCompute(QueueRingGetAvailableSpace(QueueContext, FALSE),
+        QueueContext->Segmented ? QueueContext->FromNetPolicy.MaxCapacity : QueueContext->FromNetCapacity,
+        QueuePushesPending(QueueContext),
+        Credit);
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+QueueReturnPushCredit(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFREQUEST        Request
+)
+/*++
+Routine Description:
+
+    Writes the credit left after a push into its output buffer, when it
+    came with one big enough, so the service knows what its next push can
+    take without an IOCTL_VCOM_GET_CREDIT. Called just before the push
+    completes, without the ring locks.
+
+--*/
+{
+    PVCOM_PUSH_CREDIT       credit;
+
+    if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(*credit), (PVOID*)&credit, NULL))) {
+        if (!NT_SUCCESS(QueueGetPushCredit(QueueContext, credit))) {
+            RtlZeroMemory(credit, sizeof(*credit));
+        }
+    }
+}
+
+
+static
+VOID
+QueueWakeCreditWaiters(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    WDFREQUEST              request;
+    NTSTATUS                status;
+
+    // Hand pended credit waits back to the default queue to be re-evaluated;
+    // the ones still short note themselves again
+    while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(QueueContext->CreditQueue, &request))) {
+        status = WdfRequestForwardToIoQueue(request, QueueContext->Queue);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "Forward credit wait failed 0x%x", status);
+            WdfRequestComplete(request, status);
+        }
+    }
+}
+
+
+static
+VOID
+QueueSetReadTimeouts(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  size_t            Length
+)
+/*++
+Routine Description:
+
+    Works out the SERIAL_TIMEOUTS behaviour of a read that is about to
+    start. Called with the FromNet read lock held.
+
+        Interval    Multiplier  Constant    Read completes
+        MAXULONG    0           0           at once, with whatever is buffered
+        MAXULONG    MAXULONG    1..MAXULONG-1
+                                            as soon as any byte is there, or
+                                            empty after Constant ms
+        other       M           C           when full, after M * Length + C ms
+                                            if that is nonzero, or after
+                                            Interval ms without a byte once
+                                            the first one is in (Interval 0
+                                            or MAXULONG: no such timeout)
+
+    A read that times out completes with STATUS_TIMEOUT and the bytes it got.
+
+--*/
+{
+    SERIAL_TIMEOUTS         timeouts = QueueContext->PortContext->Timeouts;
+    ULONG64                 totalMs;
+
+    QueueContext->ReadImmediate = FALSE;
+    QueueContext->ReadReturnOnAny = FALSE;
+    QueueContext->ReadTotalDeadline = 0;
+    QueueContext->ReadIntervalTicks = 0;
+    QueueContext->ReadLastActivity = TimeoutEngineNow();
+
+    if (timeouts.ReadIntervalTimeout == MAXULONG &&
+        timeouts.ReadTotalTimeoutMultiplier == 0 &&
+        timeouts.ReadTotalTimeoutConstant == 0) {
+        QueueContext->ReadImmediate = TRUE;
+        return;
+    }
+
+    if (timeouts.ReadIntervalTimeout == MAXULONG &&
+        timeouts.ReadTotalTimeoutMultiplier == MAXULONG &&
+        timeouts.ReadTotalTimeoutConstant != 0) {
+        // SET_TIMEOUTS has already rejected a MAXULONG constant here
+        QueueContext->ReadReturnOnAny = TRUE;
+        totalMs = timeouts.ReadTotalTimeoutConstant;
+    }
+    else {
+        if (timeouts.ReadIntervalTimeout != 0 && timeouts.ReadIntervalTimeout != MAXULONG) {
+            QueueContext->ReadIntervalTicks = TimeoutEngineMsToTicks(timeouts.ReadIntervalTimeout);
+        }
+        totalMs = (ULONG64)timeouts.ReadTotalTimeoutMultiplier * Length + timeouts.ReadTotalTimeoutConstant;
+    }
+
+    if (totalMs != 0) {
+        QueueContext->ReadTotalDeadline = QueueContext->ReadLastActivity + TimeoutEngineMsToTicks(totalMs);
+    }
+}
+
+
+static
+VOID
+QueueArmReadTimer(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  size_t            Transferred
+)
+{
+    ULONG64                 deadline = QueueContext->ReadTotalDeadline;
+    ULONG64                 interval;
+
+    // The inter-character timeout only runs once the first byte is in
+    if (QueueContext->ReadIntervalTicks != 0 && Transferred != 0) {
+        interval = QueueContext->ReadLastActivity + QueueContext->ReadIntervalTicks;
+        if (deadline == 0 || interval < deadline) {
+            deadline = interval;
+        }
+    }
+
+    if (deadline == 0) {
+        TimeoutEntryCancel(&QueueContext->ReadTimer);
+    }
+    else {
+        TimeoutEntryArm(&QueueContext->ReadTimer, deadline);
+    }
+}
+
+
+static
+BOOLEAN
+QueueReadDone(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PREQUEST_CONTEXT  RequestContext
+)
+{
+    return (RequestContext->Transferred == RequestContext->Length) ||
+        RequestContext->AtEventChar ||
+        QueueContext->ReadImmediate ||
+        (QueueContext->ReadReturnOnAny && RequestContext->Transferred != 0);
+}
+
+
+static
+VOID
+QueueCheckCreditWaiters(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    VCOM_PUSH_CREDIT        credit;
+
+    // Credit grows as the ring drains and once the last pended push is in.
+    // The waits only get to look once there is enough for the least of them.
+    if (PendCreditWaiting(&QueueContext->CreditWait) &&
+        NT_SUCCESS(QueueGetPushCredit(QueueContext, &credit)) &&
+        PendCreditWake(&QueueContext->CreditWait, &credit)) {
+        QueueWakeCreditWaiters(QueueContext);
+    }
+}
+
+
+static
+VOID
+QueueIncomingDrained(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    // Incoming space opened up: anyone waiting for credit or readiness gets
+    // to look.
+    QueueElasticAfterRead(QueueContext, FALSE);
+    QueuePublishPushCredit(QueueContext);
+    QueueCheckCreditWaiters(QueueContext);
+    QueueUpdateFlow(QueueContext);
+    QueueUpdateLineFlow(QueueContext);
+    PortTableSignalReady();
+}
+
+
+static
+size_t
+QueueServicePendingReads(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Fills pending reads from the incoming ring, oldest first. The current
+    read keeps its progress in its request context and completes once full,
+    or earlier as its timeouts allow (see QueueSetReadTimeouts).
+
+Return Value:
+
+    The number of bytes consumed from the ring.
+
+--*/
+{
+    WDFREQUEST              request;
+    PREQUEST_CONTEXT        requestContext;
+    NTSTATUS                status;
+    ULONG                   queued = 0;
+    size_t                  before;
+    size_t                  wanted;
+    size_t                  allowed;
+    size_t                  copied;
+    size_t                  total = 0;
+    BOOLEAN                 flagged = FALSE;
+    BOOLEAN                 stop;
+
+    // Cheap exit for the common case; see QueueServicePendingWrites
+    KeMemoryBarrier();
+    (VOID)WdfIoQueueGetState(QueueContext->ReadQueue, &queued, NULL);
+    if (QueueContext->CurrentRead == NULL && queued == 0) {
+        return 0;
+    }
+
+    for (;;) {
+        WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkReadLock);
+
+        request = QueueContext->CurrentRead;
+        if (request == NULL) {
+            // Nothing new is started once the port is stopping
+            if (!QueueContext->PortContext->Started ||
+                !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(QueueContext->ReadQueue, &request))) {
+                WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+                break;
+            }
+
+            status = WdfRequestMarkCancelableEx(request, EvtRequestCancelRead);
+            if (!NT_SUCCESS(status)) {
+                WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+                WdfRequestComplete(request, status);
+                continue;
+            }
+            QueueContext->CurrentRead = request;
+            QueueSetReadTimeouts(QueueContext, GetRequestContext(request)->Length);
+            QueueArmReadTimer(QueueContext, 0);
+        }
+
+        requestContext = GetRequestContext(request);
+        before = requestContext->Transferred;
+        wanted = QueueEventCharLimit(QueueContext,
+            requestContext->Length - requestContext->Transferred, &stop);
+        allowed = QueuePacingAllow(QueueContext, FALSE, wanted);
+        status = QueueRingReadToMemory(QueueContext, FALSE,
+            requestContext->Memory,
+            requestContext->Transferred,
+            allowed,
+            &copied);
+        QueuePacingCharge(QueueContext, FALSE, copied, allowed < wanted && copied == allowed);
+        requestContext->AtEventChar = stop && copied == wanted;
+        if (copied) {
+            requestContext->Transferred += copied;
+            QueueContext->ReadLastActivity = TimeoutEngineNow();
+            total += copied;
+        }
+
+        if (NT_SUCCESS(status) && !QueueReadDone(QueueContext, requestContext)) {
+            // Later bytes only move ReadLastActivity; the first one starts
+            // the inter-character timeout.
+            if (before == 0 && copied != 0) {
+                QueueArmReadTimer(QueueContext, requestContext->Transferred);
+            }
+
+            // Ring empty. In shared mode, ask the service for a doorbell and
+            // then look once more.
+            if (QueueContext->Shared && !flagged) {
+                SharedRingSetConsumerWaiting(&QueueContext->SharedFromNetwork, TRUE);
+                flagged = TRUE;
+                WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+                continue;
+            }
+            WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+            break;
+        }
+
+        // Satisfied, or failed; either way this read is finished
+        QueueContext->CurrentRead = NULL;
+        TimeoutEntryCancel(&QueueContext->ReadTimer);
+        if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) {
+            // EvtRequestCancelRead is about to run and completes it
+            request = NULL;
+        }
+        WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+
+        if (request != NULL) {
+            WdfRequestCompleteWithInformation(request, status, requestContext->Transferred);
+        }
+    }
+
+    return total;
+}
+
+
+static
+VOID
+QueuePumpIncoming(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    size_t                  consumed = 0;
+    size_t                  pushed = 0;
+    size_t                  drained;
+
+    // Pended pushes fill the incoming ring and pending reads drain it; keep
+    // going for as long as reading makes room for more.
+    for (;;) {
+        pushed += QueueServicePendingWrites(QueueContext, FALSE);
+        drained = QueueServicePendingReads(QueueContext);
+        if (drained == 0) {
+            break;
+        }
+        consumed += drained;
+    }
+
+    if (consumed) {
+        QueueIncomingDrained(QueueContext);
+    }
+    else if (pushed) {
+        QueueCheckCreditWaiters(QueueContext);
+    }
+}
+
+
+static
+VOID
+QueueReadTimerExpired(
+    _In_  PTIMER_WHEEL_ENTRY Entry
+)
+{
+    PQUEUE_CONTEXT          queueContext = (PQUEUE_CONTEXT)Entry->Context;
+    WDFREQUEST              request;
+    size_t                  transferred;
+    ULONG64                 now = TimeoutEngineNow();
+    BOOLEAN                 expired;
+
+    WdfSpinLockAcquire(queueContext->RingBufferFromNetworkReadLock);
+
+    request = queueContext->CurrentRead;
+    if (request == NULL) {
+        WdfSpinLockRelease(queueContext->RingBufferFromNetworkReadLock);
+        return;
+    }
+
+    transferred = GetRequestContext(request)->Transferred;
+    expired = (queueContext->ReadTotalDeadline != 0 && now >= queueContext->ReadTotalDeadline) ||
+        (queueContext->ReadIntervalTicks != 0 && transferred != 0 &&
+            now >= queueContext->ReadLastActivity + queueContext->ReadIntervalTicks);
+
+    if (!expired) {
+        // Bytes arrived since it was armed, or it was armed for an earlier read
+        QueueArmReadTimer(queueContext, transferred);
+        WdfSpinLockRelease(queueContext->RingBufferFromNetworkReadLock);
+        return;
+    }
+
+    queueContext->CurrentRead = NULL;
+    if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) {
+        // EvtRequestCancelRead is about to run and completes it
+        request = NULL;
+    }
+
+    WdfSpinLockRelease(queueContext->RingBufferFromNetworkReadLock);
+
+    if (request != NULL) {
+        TracePoint(TRACE_LEVEL_INFO, VCOM_TRACE_EVENT_READ_TIMEOUT, queueContext->Port.PortId, transferred, 0);
+        WdfRequestCompleteWithInformation(request, STATUS_TIMEOUT, transferred);
+    }
+
+    // Let the next read in line start
+    QueuePumpIncoming(queueContext);
+}
+
+
+VOID
+EvtRequestCancelRead(
+    _In_  WDFREQUEST        Request
+)
+{
+    PQUEUE_CONTEXT          queueContext = QueueContextFromRequest(Request);
+    PREQUEST_CONTEXT        requestContext = GetRequestContext(Request);
+    size_t                  transferred;
+
+    WdfSpinLockAcquire(queueContext->RingBufferFromNetworkReadLock);
+    if (queueContext->CurrentRead == Request) {
+        queueContext->CurrentRead = NULL;
+        TimeoutEntryCancel(&queueContext->ReadTimer);
+    }
+    transferred = requestContext->Transferred;
+    WdfSpinLockRelease(queueContext->RingBufferFromNetworkReadLock);
+
+    // Report the bytes already copied into the caller's buffer
+    WdfRequestCompleteWithInformation(Request,
+        (transferred == requestContext->Length) ? STATUS_SUCCESS : STATUS_CANCELLED,
+        transferred);
+
+    // Let the next read in line start
+    QueuePumpIncoming(queueContext);
+}
+
+
+VOID
+QueueCancelPendingReads(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+{
+    WDFREQUEST              request;
+    NTSTATUS                status;
+
+    for (;;) {
+        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(QueueContext->ReadQueue, &request))) {
+            WdfRequestComplete(request, STATUS_CANCELLED);
+        }
+
+        WdfSpinLockAcquire(QueueContext->RingBufferFromNetworkReadLock);
+        request = QueueContext->CurrentRead;
+        QueueContext->CurrentRead = NULL;
+        TimeoutEntryCancel(&QueueContext->ReadTimer);
+        status = request ? WdfRequestUnmarkCancelable(request) : STATUS_SUCCESS;
+        WdfSpinLockRelease(QueueContext->RingBufferFromNetworkReadLock);
+
+        if (request == NULL) {
+            break;
+        }
+
+        // Otherwise EvtRequestCancelRead completes it
+        if (status != STATUS_CANCELLED) {
+            WdfRequestCompleteWithInformation(request, STATUS_CANCELLED,
+                GetRequestContext(request)->Transferred);
+        }
+    }
+}
+
+
+VOID
+QueueWakeReadyWaiters(
+    _In_  PQUEUE_CONTEXT    QueueContext
+)
+/*++
+Routine Description:
+
+    Hands every pended IOCTL_VCOM_WAIT_READY on this port back to the
+    default queue, where it is evaluated again and either completes or pends
+    once more. Bumping ReadyEpoch first lets a wait that was being pended
+    concurrently notice it may have missed this wakeup.
+
+--*/
+{
+    WDFREQUEST              request;
+    NTSTATUS                status;
+
+    InterlockedIncrement(&QueueContext->ReadyEpoch);
+    (VOID)PortTableClearReadyWaiter(QueueContext);
+
+    while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(QueueContext->ReadyWaitQueue, &request))) {
+        status = WdfRequestForwardToIoQueue(request, QueueContext->Queue);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "Forward ready wait failed 0x%x", status);
+            WdfRequestComplete(request, status);
+        }
+    }
+}
+
+
+static
+ULONG
+QueuePortReadiness(
+    _In_  WDFFILEOBJECT     FileObject,
+    _In_  ULONG             PortId,
+    _In_  ULONG             Events
+)
+{
+    PQUEUE_CONTEXT          port;
+    ULONG                   ready = 0;
+
+    port = PortTableAcquire(PortId);
+    if (port == NULL) {
+        return 0;
+    }
+
+    // Only ports the caller controls are reported. Shared-ring ports signal
+    // the service through their own doorbells.
+    if (DeviceControlsPort(FileObject, port->PortContext) &&
+        port->PortContext->Started && !port->Shared) {
+        if ((Events & VCOM_READY_OUTGOING) && (QueueFlowSendPending(port) ||
+            (QueueRingGetAvailableData(port, TRUE) != 0 && !QueueFlowHeld(port)))) {
+            ready |= VCOM_READY_OUTGOING;
+        }
+        if ((Events & VCOM_READY_INCOMING) && QueueRingGetAvailableSpace(port, FALSE) != 0) {
+            ready |= VCOM_READY_INCOMING;
+        }
+        if ((Events & VCOM_READY_LINES) && ReadNoFence(&port->ModemControlChanged) != 0) {
+            ready |= VCOM_READY_LINES;
+        }
+    }
+
+    PortTableRelease(port);
+    return ready;
+}
+
+
+static
+NTSTATUS
+QueueEvaluateReadyWait(
+    _In_  WDFREQUEST        Request,
+    _Out_ size_t*           BytesReturned
+)
+/*++
+Routine Description:
+
+    Checks every port in an IOCTL_VCOM_WAIT_READY request and packs the ready
+    ones into the output. The buffer is shared with the input, so entries are
+    only written at or before the index being read. Ports the request's
+    control handle does not control never count as ready.
+
+--*/
+{
+    WDFFILEOBJECT           fileObject = WdfRequestGetFileObject(Request);
+    NTSTATUS                status;
+    PVCOM_PORT_READY        ports;
+    PVCOM_PORT_READY        out;
+    size_t                  inLen = 0;
+    size_t                  outLen = 0;
+    size_t                  count;
+    size_t                  maxOut;
+    size_t                  i;
+    size_t                  ready = 0;
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(VCOM_PORT_READY), (PVOID*)&ports, &inLen);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(VCOM_PORT_READY), (PVOID*)&out, &outLen);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    count = inLen / sizeof(VCOM_PORT_READY);
+    maxOut = outLen / sizeof(VCOM_PORT_READY);
+
+    for (i = 0; i < count && ready < maxOut; i++) {
+        ULONG portId = ports[i].PortId;
+        ULONG events = QueuePortReadiness(fileObject, portId, ports[i].Events);
+
+        if (events) {
+            out[ready].PortId = portId;
+            out[ready].Events = events;
+            ready++;
+        }
+    }
+
+    *BytesReturned = ready * sizeof(VCOM_PORT_READY);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+QueueProcessBatch(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFREQUEST        Request
+)
+/*++
+Routine Description:
+
+    Handles IOCTL_VCOM_BATCH: pushes to and drains from any number of ports
+    in one call. Entries are processed in order; a port that cannot be
+    reached, is not running or is not controlled by the request's handle
+    (DeviceControlsPort) only fails its own entry. Processing stops at the
+    first entry whose result header no longer fits in the output.
+
+Arguments:
+
+    QueueContext - The port the request was issued on.
+
+    Request - The batch request; see VCOM_BATCH_ENTRY in public.h.
+
+Return Value:
+
+    STATUS_SUCCESS with the output length as information,
+    STATUS_ACCESS_DENIED if the request was not issued on QueueContext's
+    control handle, or STATUS_INVALID_PARAMETER if an entry runs past the
+    end of the input.
+
+--*/
+{
+    WDFFILEOBJECT           fileObject = WdfRequestGetFileObject(Request);
+    NTSTATUS                status;
+    WDFMEMORY               inMem;
+    WDFMEMORY               outMem;
+    PUCHAR                  inBuf;
+    size_t                  inLen = 0;
+    size_t                  outLen = 0;
+    BATCH_CURSOR            cursor;
+
+    if (!DeviceIsControlHandle(QueueContext->PortContext, fileObject)) {
+        return STATUS_ACCESS_DENIED;
+    }
+
+    status = WdfRequestRetrieveInputMemory(Request, &inMem);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    inBuf = (PUCHAR)WdfMemoryGetBuffer(inMem, &inLen);
+
+    status = WdfRequestRetrieveOutputMemory(Request, &outMem);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    (VOID)WdfMemoryGetBuffer(outMem, &outLen);
+
+    BatchCursorInitialize(&cursor, inBuf, inLen, outLen);
+
+    for (;;) {
+        VCOM_BATCH_ENTRY entry;
+        PQUEUE_CONTEXT port;
+        size_t payloadOffset;
+        size_t payload;
+        size_t room;
+        size_t done = 0;
+        NTSTATUS entryStatus = STATUS_SUCCESS;
+
+        status = BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room);
+        if (status == STATUS_NO_MORE_ENTRIES) {
+            status = STATUS_SUCCESS;
+            break;
+        }
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "Batch entry at %Iu overruns the input", cursor.InputOffset);
+            break;
+        }
+
+        port = PortTableAcquire(entry.PortId);
+        if (port == NULL) {
+            entryStatus = STATUS_NO_SUCH_DEVICE;
+        }
+        else if (!DeviceControlsPort(fileObject, port->PortContext)) {
+            entryStatus = STATUS_ACCESS_DENIED;
+        }
+        else if (!port->PortContext->Started) {
+            entryStatus = STATUS_DEVICE_NOT_READY;
+        }
+        else if (port->Shared || (entry.Op == VCOM_BATCH_OP_PUSH && port->Port.PeerId != VCOM_INVALID_PORT_ID)) {
+            entryStatus = STATUS_INVALID_DEVICE_STATE;
+        }
+        else if (entry.Op == VCOM_BATCH_OP_PUSH) {
+            if (payload) {
+                QueueElasticBeforeWrite(port, FALSE, payload);
+
+                WdfSpinLockAcquire(port->RingBufferFromNetworkWriteLock);
+                entryStatus = QueueRingWriteFromMemory(port, FALSE, inMem,
+                    payloadOffset, PendPartialAllowance(payload, QueuePushesPending(port)), NULL, &done);
+                WdfSpinLockRelease(port->RingBufferFromNetworkWriteLock);
+
+                if (done) {
+                    QueueSignalReceived(port);
+                }
+                if (done < payload) {
+                    InterlockedExchangeAdd64(&port->FromNetPolicy.DroppedBytes, (LONG64)(payload - done));
+                    InterlockedAddNoFence64(&port->Counters->DroppedBytes, (LONG64)(payload - done));
+                    QueueNoteQueueOverrun(port);
+                }
+                // Same as PUSH_INCOMING: a partial push reports its byte count
+                if (entryStatus == STATUS_BUFFER_OVERFLOW) {
+                    entryStatus = STATUS_SUCCESS;
+                }
+            }
+            QueuePumpIncoming(port);
+        }
+        else if (entry.Op == VCOM_BATCH_OP_DRAIN) {
+            WdfSpinLockAcquire(port->RingBufferToUserModeReadLock);
+            entryStatus = QueueDrainOutgoing(port, outMem,
+                cursor.OutputOffset + sizeof(entry), room, &done);
+            WdfSpinLockRelease(port->RingBufferToUserModeReadLock);
+
+            QueueElasticAfterRead(port, TRUE);
+
+            // Room for writes waiting on this port
+            if (done) {
+                QueuePumpOutgoing(port);
+                QueueCheckTxEmpty(port);
+            }
+        }
+        else {
+            entryStatus = STATUS_INVALID_PARAMETER;
+        }
+
+        if (port) {
+            PortTableRelease(port);
+        }
+
+        entry.Length = (ULONG)done;
+        entry.Status = entryStatus;
+        status = WdfMemoryCopyFromBuffer(outMem, cursor.OutputOffset, &entry, sizeof(entry));
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        BatchCursorAdvance(&cursor, &entry, payload, done);
+    }
+
+    if (NT_SUCCESS(status)) {
+        WdfRequestSetInformation(Request, cursor.OutputOffset);
+    }
+    return status;
+}
+
+
+VOID
+EvtIoDeviceControl(
+    _In_  WDFQUEUE          Queue,
+    _In_  WDFREQUEST        Request,
+    _In_  size_t            OutputBufferLength,
+    _In_  size_t            InputBufferLength,
+    _In_  ULONG             IoControlCode
+)
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    PQUEUE_CONTEXT          queueContext = GetQueueContext(Queue);
+    PPORT_CONTEXT           portContext = queueContext->PortContext;
+
+    TracePoint(TRACE_LEVEL_INFO, VCOM_TRACE_EVENT_IOCTL, queueContext->Port.PortId,
+        IoControlCode, InputBufferLength);
+
+    switch (IoControlCode)
+    {
+    case IOCTL_SERIAL_SET_BAUD_RATE:
+    {
+        SERIAL_BAUD_RATE baudRateBuffer = { 0 };
+        status = RequestCopyToBuffer(Request, &baudRateBuffer, sizeof(baudRateBuffer));
+        if (NT_SUCCESS(status)) {
+            SetBaudRate(portContext, baudRateBuffer.BaudRate);
+            QueueUpdatePacing(queueContext);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_BAUD_RATE:
+    {
+        SERIAL_BAUD_RATE baudRateBuffer = { 0 };
+        baudRateBuffer.BaudRate = GetBaudRate(portContext);
+        status = RequestCopyFromBuffer(Request, &baudRateBuffer, sizeof(baudRateBuffer));
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_MODEM_CONTROL:
+    {
+        ULONG* modemControlRegister = GetModemControlRegister(portContext);
+        ASSERT(modemControlRegister);
+        status = RequestCopyToBuffer(Request, modemControlRegister, sizeof(ULONG));
+        if (NT_SUCCESS(status)) {
+            QueueModemControlChanged(queueContext);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_MODEM_CONTROL:
+    {
+        ULONG* modemControlRegister = GetModemControlRegister(portContext);
+        ASSERT(modemControlRegister);
+        status = RequestCopyFromBuffer(Request, modemControlRegister, sizeof(ULONG));
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_FIFO_CONTROL:
+    {
+        ULONG* fifoControlRegister = GetFifoControlRegisterPtr(portContext);
+        ASSERT(fifoControlRegister);
+        status = RequestCopyToBuffer(Request, fifoControlRegister, sizeof(ULONG));
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_LINE_CONTROL:
+    {
+        status = QueueProcessGetLineControl(queueContext, Request);
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_LINE_CONTROL:
+    {
+        status = QueueProcessSetLineControl(queueContext, Request);
+        if (NT_SUCCESS(status)) {
+            QueueUpdateDataFormat(queueContext);
+            QueueUpdatePacing(queueContext);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_TIMEOUTS:
+    {
+
+        status = RequestCopyFromBuffer(Request, (void*)&portContext->Timeouts, sizeof(portContext->Timeouts));
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_TIMEOUTS:
+    {
+        SERIAL_TIMEOUTS timeoutValues = { 0 };
+        status = RequestCopyToBuffer(Request, (void*)&timeoutValues, sizeof(timeoutValues));
+        if (NT_SUCCESS(status))
+        {
+            if ((timeoutValues.ReadIntervalTimeout == MAXULONG) &&
+                (timeoutValues.ReadTotalTimeoutMultiplier == MAXULONG) &&
+                (timeoutValues.ReadTotalTimeoutConstant == MAXULONG))
+            {
+                status = STATUS_INVALID_PARAMETER;
+            }
+        }
+        if (NT_SUCCESS(status)) {
+            SetTimeouts(portContext, timeoutValues);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_WAIT_ON_MASK:
+    {
+        WAIT_MASK_ACTION action;
+        ULONG queued = 0;
+        ULONG events = 0;
+
+        if (OutputBufferLength < sizeof(ULONG)) { status = STATUS_BUFFER_TOO_SMALL; break; }
+
+        WdfSpinLockAcquire(queueContext->EventLock);
+        (VOID)WdfIoQueueGetState(queueContext->WaitMaskQueue, &queued, NULL);
+        action = WaitMaskBeginWait(&queueContext->WaitEvents, queued != 0, &events);
+        if (action == WaitMaskReject) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else if (action == WaitMaskPend) {
+            // Pend it. Signalling takes EventLock too, so no event can slip
+            // in between the check above and the request being queued.
+            status = WdfRequestForwardToIoQueue(Request, queueContext->WaitMaskQueue);
+            if (NT_SUCCESS(status)) {
+                WdfSpinLockRelease(queueContext->EventLock);
+                return;
+            }
+            Trace(TRACE_LEVEL_ERROR, "WAIT_ON_MASK forward failed 0x%x", status);
+        }
+        WdfSpinLockRelease(queueContext->EventLock);
+
+        if (NT_SUCCESS(status)) {
+            QueueCompleteWaitOnMask(Request, events);
+            return;
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_WAIT_MASK:
+    {
+        ULONG mask = 0;
+        WDFREQUEST waiting = NULL;
+
+        status = RequestCopyToBuffer(Request, &mask, sizeof(mask));
+        if (!NT_SUCCESS(status)) break;
+
+        // A new mask completes the pending wait with no events and starts
+        // the history afresh
+        WdfSpinLockAcquire(queueContext->EventLock);
+        status = WaitMaskSet(&queueContext->WaitEvents, mask);
+        if (NT_SUCCESS(status)) {
+            (VOID)WdfIoQueueRetrieveNextRequest(queueContext->WaitMaskQueue, &waiting);
+        }
+        WdfSpinLockRelease(queueContext->EventLock);
+
+        if (waiting != NULL) {
+            QueueCompleteWaitOnMask(waiting, 0);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_WAIT_MASK:
+    {
+        ULONG mask = ReadULongNoFence(&queueContext->WaitEvents.Mask);
+        status = RequestCopyFromBuffer(Request, &mask, sizeof(mask));
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_COMMSTATUS:
+    {
+        SERIAL_STATUS serialStatus = { 0 };
+        ULONG txHold;
+
+        // Errors are reported once, as ClearCommError expects
+        WdfSpinLockAcquire(queueContext->EventLock);
+        serialStatus.Errors = queueContext->LineErrors;
+        queueContext->LineErrors = 0;
+        WdfSpinLockRelease(queueContext->EventLock);
+
+        if (QueueFlowApplies(queueContext)) {
+            WdfSpinLockAcquire(queueContext->FlowLock);
+            serialStatus.HoldReasons = SwFlowHoldReasons(&queueContext->SwFlow);
+            WdfSpinLockRelease(queueContext->FlowLock);
+        }
+        txHold = ReadULongNoFence(&queueContext->TxHoldLines);
+        if (txHold & SERIAL_MSR_CTS) {
+            serialStatus.HoldReasons |= SERIAL_TX_WAITING_FOR_CTS;
+        }
+        if (txHold & SERIAL_MSR_DSR) {
+            serialStatus.HoldReasons |= SERIAL_TX_WAITING_FOR_DSR;
+        }
+        if (txHold & SERIAL_MSR_DCD) {
+            serialStatus.HoldReasons |= SERIAL_TX_WAITING_FOR_DCD;
+        }
+
+        serialStatus.AmountInInQueue = (ULONG)QueueRingGetAvailableData(queueContext, FALSE);
+        serialStatus.AmountInOutQueue = (ULONG)QueueRingGetAvailableData(queueContext, TRUE);
+        status = RequestCopyFromBuffer(Request, &serialStatus, sizeof(serialStatus));
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_QUEUE_SIZE:
+    {
+        SERIAL_QUEUE_SIZE queueSize = { 0 };
+        status = RequestCopyToBuffer(Request, &queueSize, sizeof(queueSize));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetRingSizes(queueContext, queueSize.InSize, queueSize.OutSize);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_DTR:
+    case IOCTL_SERIAL_CLR_DTR:
+    case IOCTL_SERIAL_SET_RTS:
+    case IOCTL_SERIAL_CLR_RTS:
+    {
+        volatile LONG* modemControlRegister = (volatile LONG*)GetModemControlRegister(portContext);
+        LONG line = (IoControlCode == IOCTL_SERIAL_SET_DTR || IoControlCode == IOCTL_SERIAL_CLR_DTR) ?
+            SERIAL_MCR_DTR : SERIAL_MCR_RTS;
+
+        // As in serial.sys, a line under handshake is not the application's
+        if (ReadULongNoFence(&queueContext->RxLineMask) & (ULONG)line) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        if (IoControlCode == IOCTL_SERIAL_SET_DTR || IoControlCode == IOCTL_SERIAL_SET_RTS) {
+            InterlockedOr(modemControlRegister, line);
+        }
+        else {
+            InterlockedAnd(modemControlRegister, ~line);
+        }
+
+        // On a paired port the peer sees them as DSR/DCD and CTS
+        QueueModemControlChanged(queueContext);
+        status = STATUS_SUCCESS;
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_DTRRTS:
+    {
+        ULONG lines = *GetModemControlRegister(portContext) & (SERIAL_MCR_DTR | SERIAL_MCR_RTS);
+        status = RequestCopyFromBuffer(Request, &lines, sizeof(lines));
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_MODEMSTATUS:
+    {
+        ULONG modemStatus;
+
+        WdfSpinLockAcquire(queueContext->EventLock);
+        modemStatus = queueContext->ModemStatus;
+        WdfSpinLockRelease(queueContext->EventLock);
+        status = RequestCopyFromBuffer(Request, &modemStatus, sizeof(modemStatus));
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_XON:
+    case IOCTL_SERIAL_SET_XOFF:
+        QueueSetXoff(queueContext, IoControlCode == IOCTL_SERIAL_SET_XOFF);
+        status = STATUS_SUCCESS;
+        break;
+
+    case IOCTL_SERIAL_SET_CHARS:
+    {
+        SERIAL_CHARS chars = { 0 };
+        status = RequestCopyToBuffer(Request, &chars, sizeof(chars));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetFlow(queueContext, NULL, &chars);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_CHARS:
+    {
+        SERIAL_CHARS chars;
+        WdfSpinLockAcquire(queueContext->FlowLock);
+        chars = portContext->Chars;
+        WdfSpinLockRelease(queueContext->FlowLock);
+        status = RequestCopyFromBuffer(Request, &chars, sizeof(chars));
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_HANDFLOW:
+    {
+        SERIAL_HANDFLOW handFlow = { 0 };
+        status = RequestCopyToBuffer(Request, &handFlow, sizeof(handFlow));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetFlow(queueContext, &handFlow, NULL);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_HANDFLOW:
+    {
+        SERIAL_HANDFLOW handFlow;
+        WdfSpinLockAcquire(queueContext->FlowLock);
+        handFlow = portContext->HandFlow;
+        WdfSpinLockRelease(queueContext->FlowLock);
+        status = RequestCopyFromBuffer(Request, &handFlow, sizeof(handFlow));
+        break;
+    }
+
+    case IOCTL_SERIAL_RESET_DEVICE:
+        status = STATUS_SUCCESS;
+        break;
+    case IOCTL_VCOM_GET_OUTGOING:
+    {
+        if (!portContext->Started) { status = STATUS_DEVICE_NOT_READY; break; }
+        if (queueContext->Shared) { status = STATUS_INVALID_DEVICE_STATE; break; }
+
+        WDFMEMORY outMem;
+        size_t outLen = 0, copied = 0, available = 0;
+
+        status = WdfRequestRetrieveOutputMemory(Request, &outMem);
+        if (!NT_SUCCESS(status)) break;
+
+        (void)WdfMemoryGetBuffer(outMem, &outLen);
+        if (outLen == 0) { WdfRequestSetInformation(Request, 0); status = STATUS_SUCCESS; break; }
+        if (queueContext->Framed && outLen <= sizeof(VCOM_RECORD_HEADER)) { status = STATUS_BUFFER_TOO_SMALL; break; }
+
+        // Copy straight from ring storage into the caller's (MDL-mapped) buffer,
+        // unless what is there is being held back for coalescing
+        WdfSpinLockAcquire(queueContext->RingBufferToUserModeReadLock);
+        if (QueueOutgoingReady(queueContext)) {
+            available = QueueRingGetAvailableData(queueContext, TRUE);
+            status = QueueDrainOutgoing(queueContext,
+                outMem, 0, outLen, &copied);
+            if (copied > 0) {
+                QueueOutgoingDrained(queueContext, available);
+            }
+        }
+        WdfSpinLockRelease(queueContext->RingBufferToUserModeReadLock);
+        if (!NT_SUCCESS(status)) break;
+
+        QueueElasticAfterRead(queueContext, TRUE);
+
+        if (copied > 0) {
+            // Room for pending writes
+            QueuePumpOutgoing(queueContext);
+            QueueCheckTxEmpty(queueContext);
+
+            WdfRequestSetInformation(Request, copied);
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        // No data (or not enough yet): pend on manual OutgoingQueue
+        status = WdfRequestForwardToIoQueue(Request, queueContext->OutgoingQueue);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "GET_OUTGOING forward failed (WdfRequestForwardToIoQueue:Outgoing) 0x%x", status);
+            WdfRequestComplete(Request, status);
+            return;
+        }
+        InterlockedIncrementNoFence64(&queueContext->Counters->OutgoingPended);
+
+        // A write or the coalescing deadline may have come and gone before
+        // the request was on the queue
+        QueuePumpOutgoing(queueContext);
+        return; // don't complete here
+    }
+    case IOCTL_VCOM_PUSH_INCOMING:
+    {
+        if (!portContext->Started) { status = STATUS_DEVICE_NOT_READY; break; }
+        if (queueContext->Shared || queueContext->Port.PeerId != VCOM_INVALID_PORT_ID) { status = STATUS_INVALID_DEVICE_STATE; break; }
+
+        WDFMEMORY inMem;
+        size_t inLen = 0, wrote = 0;
+        status = WdfRequestRetrieveInputMemory(Request, &inMem);
+        if (!NT_SUCCESS(status)) break;
+
+        (void)WdfMemoryGetBuffer(inMem, &inLen);
+
+        if (inLen && queueContext->PushMode == VCOM_PUSH_MODE_PEND) {
+            PREQUEST_CONTEXT requestContext = GetRequestContext(Request);
+
+            requestContext->Memory = inMem;
+            requestContext->Length = inLen;
+            requestContext->Transferred = 0;
+
+            // Completes once all of it is in, in order with other pushes
+            QueueElasticBeforeWrite(queueContext, FALSE, inLen);
+            QueueStartWrite(queueContext, FALSE, Request);
+            return;
+        }
+
+        if (inLen) {
+            QueueElasticBeforeWrite(queueContext, FALSE, inLen);
+
+            // Copy straight from the caller's buffer into ring storage, but
+            // not ahead of pended pushes
+            WdfSpinLockAcquire(queueContext->RingBufferFromNetworkWriteLock);
+            status = QueueRingWriteFromMemory(queueContext, FALSE, inMem, 0,
+                PendPartialAllowance(inLen, QueuePushesPending(queueContext)), NULL, &wrote);
+            WdfSpinLockRelease(queueContext->RingBufferFromNetworkWriteLock);
+            if (wrote) {
+                QueueSignalReceived(queueContext);
+            }
+            if (wrote < inLen) {
+                InterlockedExchangeAdd64(&queueContext->FromNetPolicy.DroppedBytes, (LONG64)(inLen - wrote));
+                InterlockedAddNoFence64(&queueContext->Counters->DroppedBytes, (LONG64)(inLen - wrote));
+                QueueNoteQueueOverrun(queueContext);
+            }
+            // STATUS_SUCCESS if fully accepted, STATUS_BUFFER_OVERFLOW if partial
+            if (status == STATUS_BUFFER_OVERFLOW) status = STATUS_SUCCESS; // we return success + byte count
+        }
+
+        // Wake pending reads  re-dispatch to default queue so EvtIoRead can copy
+        QueuePumpIncoming(queueContext);
+
+        QueueReturnPushCredit(queueContext, Request);
+        WdfRequestSetInformation(Request, wrote);
+        break;
+    }
+
+    case IOCTL_VCOM_GET_PORT_ID:
+    {
+        ULONG portId = queueContext->Port.PortId;
+        status = RequestCopyFromBuffer(Request, &portId, sizeof(portId));
+        break;
+    }
+
+    case IOCTL_VCOM_WAIT_READY:
+    {
+        size_t returned = 0;
+        LONG epoch;
+
+        if (!DeviceIsControlHandle(portContext, WdfRequestGetFileObject(Request))) {
+            status = STATUS_ACCESS_DENIED;
+            break;
+        }
+
+        // Publish the waiter before looking, so a port that becomes ready
+        // after the evaluation below is guaranteed to wake us.
+        PortTableNoteReadyWaiter(queueContext);
+        epoch = ReadAcquire(&queueContext->ReadyEpoch);
+
+        status = QueueEvaluateReadyWait(Request, &returned);
+        if (!NT_SUCCESS(status)) break;
+
+        if (returned != 0) {
+            WdfRequestSetInformation(Request, returned);
+            break;
+        }
+
+        // Nothing ready: pend on this port's ReadyWaitQueue
+        status = WdfRequestForwardToIoQueue(Request, queueContext->ReadyWaitQueue);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "WAIT_READY forward failed 0x%x", status);
+            break;
+        }
+
+        // A wakeup that ran before the request was on the queue found
+        // nothing to hand back; do it now on its behalf.
+        if (ReadAcquire(&queueContext->ReadyEpoch) != epoch) {
+            QueueWakeReadyWaiters(queueContext);
+        }
+        return;
+    }
+
+    case IOCTL_VCOM_BATCH:
+        status = QueueProcessBatch(queueContext, Request);
+        break;
+
+    case IOCTL_VCOM_SET_PUSH_MODE:
+    {
+        PULONG mode;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), (PVOID*)&mode, NULL);
+        if (!NT_SUCCESS(status)) break;
+
+        if (*mode != VCOM_PUSH_MODE_PARTIAL && *mode != VCOM_PUSH_MODE_PEND) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        // Pushes already pended still finish as they were started
+        queueContext->PushMode = *mode;
+        break;
+    }
 
-    switch (IoControlCode)
+    case IOCTL_VCOM_SET_COALESCING:
     {
-    case IOCTL_SERIAL_SET_BAUD_RATE:
+        VCOM_COALESCE coalesce = { 0 };
+        status = RequestCopyToBuffer(Request, &coalesce, sizeof(coalesce));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetCoalescing(queueContext, &coalesce);
+        }
+        break;
+    }
+
+    case IOCTL_VCOM_SET_PACING:
     {
-        SERIAL_BAUD_RATE baudRateBuffer = { 0 };
-        status = RequestCopyToBuffer(Request, &baudRateBuffer, sizeof(baudRateBuffer));
+        ULONG flags = 0;
+        status = RequestCopyToBuffer(Request, &flags, sizeof(flags));
         if (NT_SUCCESS(status)) {
-            SetBaudRate(deviceContext, baudRateBuffer.BaudRate);
+            status = QueueSetPacing(queueContext, flags);
         }
         break;
     }
 
-    case IOCTL_SERIAL_GET_BAUD_RATE:
+    case IOCTL_VCOM_SET_PARITY_MODE:
     {
-        SERIAL_BAUD_RATE baudRateBuffer = { 0 };
-        baudRateBuffer.BaudRate = GetBaudRate(deviceContext);
-        status = RequestCopyFromBuffer(Request, &baudRateBuffer, sizeof(baudRateBuffer));
+        VCOM_PARITY_MODE mode = { 0 };
+        status = RequestCopyToBuffer(Request, &mode, sizeof(mode));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetParityMode(queueContext, &mode);
+        }
         break;
     }
 
-    case IOCTL_SERIAL_SET_MODEM_CONTROL:
+    case IOCTL_VCOM_SET_READ_MODE:
     {
-        ULONG* modemControlRegister = GetModemControlRegister(deviceContext);
-        ASSERT(modemControlRegister);
-        status = RequestCopyToBuffer(Request, modemControlRegister, sizeof(ULONG));
+        ULONG mode = 0;
+        status = RequestCopyToBuffer(Request, &mode, sizeof(mode));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetReadMode(queueContext, mode);
+        }
         break;
     }
 
-    case IOCTL_SERIAL_GET_MODEM_CONTROL:
+    case IOCTL_VCOM_SET_LINE_FLOW:
     {
-        ULONG* modemControlRegister = GetModemControlRegister(deviceContext);
-        ASSERT(modemControlRegister);
-        status = RequestCopyFromBuffer(Request, modemControlRegister, sizeof(ULONG));
+        VCOM_LINE_FLOW lineFlow = { 0 };
+        status = RequestCopyToBuffer(Request, &lineFlow, sizeof(lineFlow));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetLineFlow(queueContext, &lineFlow);
+        }
         break;
     }
 
-    case IOCTL_SERIAL_SET_FIFO_CONTROL:
+    case IOCTL_VCOM_GET_MODEM_CONTROL:
     {
-        ULONG* fifoControlRegister = GetFifoControlRegisterPtr(deviceContext);
-        ASSERT(fifoControlRegister);
-        status = RequestCopyToBuffer(Request, fifoControlRegister, sizeof(ULONG));
+        ULONG modemControl;
+
+        // Cleared first, so a change that races with the read reports again
+        InterlockedExchange(&queueContext->ModemControlChanged, 0);
+        modemControl = *GetModemControlRegister(portContext);
+        status = RequestCopyFromBuffer(Request, &modemControl, sizeof(modemControl));
         break;
     }
 
-    case IOCTL_SERIAL_GET_LINE_CONTROL:
+    case IOCTL_VCOM_SET_OUTGOING_MODE:
     {
-        status = QueueProcessGetLineControl(queueContext, Request);
+        ULONG mode = 0;
+        status = RequestCopyToBuffer(Request, &mode, sizeof(mode));
+        if (NT_SUCCESS(status)) {
+            status = QueueSetOutgoingMode(queueContext, mode);
+        }
         break;
     }
 
-    case IOCTL_SERIAL_SET_LINE_CONTROL:
+    case IOCTL_VCOM_GET_INCOMING_AGE:
     {
-        status = QueueProcessSetLineControl(queueContext, Request);
+        VCOM_INCOMING_AGE age;
+        QueueGetIncomingAge(queueContext, &age);
+        status = RequestCopyFromBuffer(Request, &age, sizeof(age));
         break;
     }
 
-    case IOCTL_SERIAL_GET_TIMEOUTS:
+    case IOCTL_VCOM_GET_LATENCY:
     {
+        PVCOM_LATENCY_SNAPSHOT snapshot;
+        PULONG flags;
+        BOOLEAN reset = FALSE;
+
+        // Read before the output overwrites it: both share the system buffer
+        if (InputBufferLength >= sizeof(ULONG)) {
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), (PVOID*)&flags, NULL);
+            if (!NT_SUCCESS(status)) break;
+            reset = (*flags & VCOM_LATENCY_RESET) != 0;
+        }
+
+        // Too big for the stack; filled in place
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*snapshot), (PVOID*)&snapshot, NULL);
+        if (!NT_SUCCESS(status)) break;
 
-        status = RequestCopyFromBuffer(Request, (void*)&deviceContext->Timeouts, sizeof(deviceContext->Timeouts));
+        QueueGetLatency(queueContext, reset, snapshot);
+        WdfRequestSetInformation(Request, sizeof(*snapshot));
         break;
     }
 
-    case IOCTL_SERIAL_SET_TIMEOUTS:
+    case IOCTL_VCOM_DRAIN_TRACE:
     {
-        SERIAL_TIMEOUTS timeoutValues = { 0 };
-        status = RequestCopyToBuffer(Request, (void*)&timeoutValues, sizeof(timeoutValues));
-        if (NT_SUCCESS(status))
-        {
-            if ((timeoutValues.ReadIntervalTimeout == MAXULONG) &&
-                (timeoutValues.ReadTotalTimeoutMultiplier == MAXULONG) &&
-                (timeoutValues.ReadTotalTimeoutConstant == MAXULONG))
-            {
-                status = STATUS_INVALID_PARAMETER;
-            }
-        }
-        if (NT_SUCCESS(status)) {
-            SetTimeouts(deviceContext, timeoutValues);
+        PVCOM_TRACE_RECORD records;
+        size_t length;
+
+        // Driver-wide, so any port's control handle will do; never a COM-side
+        // handle, whose application would take the records from the service
+        // and see other ports' traffic
+        if (!DeviceIsControlHandle(portContext, WdfRequestGetFileObject(Request))) {
+            status = STATUS_ACCESS_DENIED;
+            break;
         }
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*records), (PVOID*)&records, &length);
+        if (!NT_SUCCESS(status)) break;
+
+        length = TraceRingDrain(records, (ULONG)min(length / sizeof(*records), MAXULONG));
+        WdfRequestSetInformation(Request, length * sizeof(*records));
         break;
     }
 
-    case IOCTL_SERIAL_WAIT_ON_MASK:
+    case IOCTL_VCOM_PAIR_PORTS:
     {
-        // Forward the request to our dedicated manual queue to pend it.
-    // WDF will handle cleanup if the file handle is closed.
-        ULONG* pMask = NULL;
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &pMask, NULL);
-        // Complete the request, returning 0 events.
-        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, 0);
-        return;
+        VCOM_PORT_PAIR pair = { 0 };
+        WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+
+        if (!DeviceIsControlHandle(portContext, fileObject)) {
+            status = STATUS_ACCESS_DENIED;
+            break;
+        }
+        status = RequestCopyToBuffer(Request, &pair, sizeof(pair));
+        if (NT_SUCCESS(status)) {
+            status = QueuePairPorts(fileObject, &pair);
+        }
+        break;
     }
 
-    case IOCTL_SERIAL_SET_WAIT_MASK:
+    case IOCTL_VCOM_SET_LINE_STATE:
     {
-        // We don't track the wait mask, so we can just succeed this request.
-        status = STATUS_SUCCESS;
+        VCOM_LINE_STATE lineState = { 0 };
+        status = RequestCopyToBuffer(Request, &lineState, sizeof(lineState));
+        if (NT_SUCCESS(status)) {
+            QueueSetLineState(queueContext, &lineState);
+        }
         break;
     }
 
-    case IOCTL_SERIAL_SET_QUEUE_SIZE:
-    case IOCTL_SERIAL_SET_DTR:
-    case IOCTL_SERIAL_SET_RTS:
-    case IOCTL_SERIAL_CLR_RTS:
-    case IOCTL_SERIAL_SET_XON:
-    case IOCTL_SERIAL_SET_XOFF:
-    case IOCTL_SERIAL_SET_CHARS:
-    case IOCTL_SERIAL_GET_CHARS:
-    case IOCTL_SERIAL_GET_HANDFLOW:
-    case IOCTL_SERIAL_SET_HANDFLOW:
-    case IOCTL_SERIAL_RESET_DEVICE:
-        status = STATUS_SUCCESS;
-        break;
-    case IOCTL_VCOM_GET_OUTGOING:
+    case IOCTL_VCOM_GET_CREDIT:
     {
-        if (!deviceContext->Started) { status = STATUS_DEVICE_NOT_READY; break; }
+        VCOM_PUSH_CREDIT credit;
+        PULONG minimum = NULL;
 
-        PVOID outBuf = NULL;
-        size_t outLen = 0, copied = 0;
+        if (!portContext->Started) { status = STATUS_DEVICE_NOT_READY; break; }
 
-        status = WdfRequestRetrieveOutputBuffer(Request, 1, &outBuf, &outLen);
-        if (!NT_SUCCESS(status)) break;
-
-        if (outLen == 0) { WdfRequestSetInformation(Request, 0); status = STATUS_SUCCESS; break; }
+        // An optional minimum turns this into a wait for that much space
+        if (InputBufferLength >= sizeof(ULONG)) {
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), (PVOID*)&minimum, NULL);
+            if (!NT_SUCCESS(status)) break;
+        }
 
-        WdfSpinLockAcquire(queueContext->RingBufferToUserModeLock);
-        status = RingBufferRead(&queueContext->RingBufferToUserMode,
-            (BYTE*)outBuf, outLen, &copied);
-        WdfSpinLockRelease(queueContext->RingBufferToUserModeLock);
+        status = QueueGetPushCredit(queueContext, &credit);
         if (!NT_SUCCESS(status)) break;
 
-        if (copied > 0) {
-            WdfRequestSetInformation(Request, copied);
-            status = STATUS_SUCCESS;
+        if (minimum == NULL || PendCreditSatisfied(&credit, *minimum)) {
+            status = RequestCopyFromBuffer(Request, &credit, sizeof(credit));
             break;
         }
 
-        // No data: pend on manual OutgoingQueue
-        status = WdfRequestForwardToIoQueue(Request, queueContext->OutgoingQueue);
+        // Not enough yet: pend until EvtIoRead frees space
+        status = WdfRequestForwardToIoQueue(Request, queueContext->CreditQueue);
         if (!NT_SUCCESS(status)) {
-            Trace(TRACE_LEVEL_ERROR, "GET_OUTGOING forward failed (WdfRequestForwardToIoQueue:Outgoing) 0x%x", status);
-            WdfRequestComplete(Request, status);
+            Trace(TRACE_LEVEL_ERROR, "GET_CREDIT forward failed 0x%x", status);
+            break;
         }
-        return; // don't complete here
-    }
-    case IOCTL_VCOM_PUSH_INCOMING:
-    {
-        if (!deviceContext->Started) { status = STATUS_DEVICE_NOT_READY; break; }
-
-        WDFMEMORY inMem;
-        size_t inLen = 0, wrote = 0;
-        status = WdfRequestRetrieveInputMemory(Request, &inMem);
-        if (!NT_SUCCESS(status)) break;
 
-        BYTE* src = (BYTE*)WdfMemoryGetBuffer(inMem, &inLen);
-
-        if (src && inLen) {
-            WdfSpinLockAcquire(queueContext->RingBufferFromNetworkLock);
-            status = RingBufferWritePartial(&queueContext->RingBufferFromNetwork, src, inLen, &wrote);
-            WdfSpinLockRelease(queueContext->RingBufferFromNetworkLock);
-            // STATUS_SUCCESS if fully accepted, STATUS_BUFFER_OVERFLOW if partial
-            if (status == STATUS_BUFFER_OVERFLOW) status = STATUS_SUCCESS; // we return success + byte count
+        // Space freed before the note was made would not wake it
+        PendCreditWaitNote(&queueContext->CreditWait, *minimum);
+        KeMemoryBarrier();
+        if (NT_SUCCESS(QueueGetPushCredit(queueContext, &credit)) && PendCreditSatisfied(&credit, *minimum)) {
+            QueueWakeCreditWaiters(queueContext);
         }
+        return;
+    }
 
-        // Wake pending reads  re-dispatch to default queue so EvtIoRead can copy
-        for (;;) {
-            WDFREQUEST rd;
-            NTSTATUS s2 = WdfIoQueueRetrieveNextRequest(queueContext->ReadQueue, &rd);
-            if (!NT_SUCCESS(s2)) break;
-            s2 = WdfRequestForwardToIoQueue(rd, queueContext->Queue);
-            if (!NT_SUCCESS(s2)) {
-                Trace(TRACE_LEVEL_ERROR, "Forward read after PUSH failed 0x%x", s2);
-                WdfRequestComplete(rd, s2);
-            }
+    case IOCTL_VCOM_DOORBELL:
+    {
+        // The service published into the shared FromNetwork ring while an
+        // application read was pending, or drained the shared ToUser ring
+        // while an application write was.
+        if (!queueContext->Shared) { status = STATUS_INVALID_DEVICE_STATE; break; }
+
+        SharedRingSetConsumerWaiting(&queueContext->SharedFromNetwork, FALSE);
+        if (QueueRingGetAvailableData(queueContext, FALSE)) {
+            QueueSignalEvents(queueContext, SERIAL_EV_RXCHAR);
         }
+        QueuePumpIncoming(queueContext);
 
-        WdfRequestSetInformation(Request, wrote);
+        SharedRingSetProducerWaiting(&queueContext->SharedToUser, FALSE);
+        QueuePumpOutgoing(queueContext);
+        QueueCheckTxEmpty(queueContext);
+        status = STATUS_SUCCESS;
         break;
     }
     
@@ -398,36 +5326,54 @@ EvtIoDeviceControl(
 
         KdPrint(("VCOM: I/O Queues started.\n"));
     {
-        deviceContext->Started = TRUE;
-        WdfSpinLockAcquire(queueContext->RingBufferToUserModeLock);
-        RingBufferReset(&queueContext->RingBufferToUserMode);
-        WdfSpinLockRelease(queueContext->RingBufferToUserModeLock);
-
-        WdfSpinLockAcquire(queueContext->RingBufferFromNetworkLock);
-        RingBufferReset(&queueContext->RingBufferFromNetwork);
-        WdfSpinLockRelease(queueContext->RingBufferFromNetworkLock);
+        portContext->Started = TRUE;
+        QueueResetRings(queueContext);
+        InterlockedIncrementNoFence64(&queueContext->Counters->Starts);
 
         status = STATUS_SUCCESS;
         break;
     }
+    case IOCTL_VCOM_GET_RING_STATS:
+    {
+        VCOM_QUEUE_STATS stats;
+        status = QueueGetRingStats(queueContext, &stats);
+        if (NT_SUCCESS(status)) {
+            status = RequestCopyFromBuffer(Request, &stats, sizeof(stats));
+        }
+        break;
+    }
     case IOCTL_VCOM_STOP:
     {
         WDFREQUEST req;
 
         KdPrint(("VCOM: IOCTL_VCOM_STOP received. Draining queues.\n"));
         // Close the gate so new operations see device stopped
-        deviceContext->Started = FALSE;
+        portContext->Started = FALSE;
+        InterlockedIncrementNoFence64(&queueContext->Counters->Stops);
 
-        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(queueContext->ReadQueue, &req))) {
-            KdPrint(("VCOM: Completing pending read request during STOP.\n"));
-            WdfRequestComplete(req, STATUS_CANCELLED);
-        }
+        KdPrint(("VCOM: Completing pending read requests during STOP.\n"));
+        QueueCancelPendingReads(queueContext);
 
         while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(queueContext->OutgoingQueue, &req))) {
             KdPrint(("VCOM: Completing pending outgoing request during STOP.\n"));
             WdfRequestComplete(req, STATUS_CANCELLED);
         }
 
+        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(queueContext->ReadyWaitQueue, &req))) {
+            WdfRequestComplete(req, STATUS_CANCELLED);
+        }
+
+        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(queueContext->CreditQueue, &req))) {
+            WdfRequestComplete(req, STATUS_CANCELLED);
+        }
+
+        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(queueContext->WaitMaskQueue, &req))) {
+            WdfRequestComplete(req, STATUS_CANCELLED);
+        }
+
+        QueueCancelPendingWrites(queueContext, TRUE);
+        QueueCancelPendingWrites(queueContext, FALSE);
+
         status = STATUS_SUCCESS; 
         KdPrint(("VCOM: IOCTL_VCOM_STOP Finished.\n"));
         break;
@@ -447,125 +5393,120 @@ EvtIoWrite(
     _In_  WDFREQUEST        Request,
     _In_  size_t            Length
 )
+/*++
+Routine Description:
+
+    Puts an application's write into the outgoing ring. A write that does
+    not fit is not truncated: it stays pending, with the bytes that did fit
+    already in the ring, and finishes as GET_OUTGOING drains. Writes behind
+    a pending one queue up in order.
+
+    On a paired port the write goes straight into the peer's incoming ring
+    instead and pends there, the same way, until the peer's reads drain it.
+
+--*/
 {
     NTSTATUS                status;
     PQUEUE_CONTEXT          queueContext = GetQueueContext(Queue);
+    PREQUEST_CONTEXT        requestContext = GetRequestContext(Request);
+    PQUEUE_CONTEXT          peer;
     WDFMEMORY               memory;
-    size_t                  availableData = 0;
 
-    Trace(TRACE_LEVEL_INFO, "EvtIoWrite 0x%p", Request);
+    TracePoint(TRACE_LEVEL_INFO, VCOM_TRACE_EVENT_WRITE, queueContext->Port.PortId, Length, 0);
     
-    if (!queueContext->DeviceContext->Started) {
+    if (!queueContext->PortContext->Started) {
         WdfRequestComplete(Request, STATUS_DEVICE_NOT_READY);
         return;
 
     }
 
-    status = WdfRequestRetrieveInputMemory(Request, &memory);
-    if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR, "Error: WdfRequestRetrieveInputMemory failed 0x%x", status);
-        WdfRequestComplete(Request, status);
+    if (Length == 0) {
+        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, 0);
         return;
     }
 
-    // Funnel bytes into the OUTGOING ring (to be drained by user-mode via IOCTL_VCOM_GET_OUTGOING)
-    status = QueueProcessWriteBytes(
-        queueContext,
-        (PUCHAR)WdfMemoryGetBuffer(memory, NULL),
-        Length);
+    status = WdfRequestRetrieveInputMemory(Request, &memory);
     if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "Error: WdfRequestRetrieveInputMemory failed 0x%x", status);
         WdfRequestComplete(Request, status);
         return;
     }
 
-    WdfRequestCompleteWithInformation(Request, status, Length);
-
-    // Check how much is available to drain by any pending GET_OUTGOING IOCTL
-    WdfSpinLockAcquire(queueContext->RingBufferToUserModeLock);
-    RingBufferGetAvailableData(&queueContext->RingBufferToUserMode, &availableData);
-    WdfSpinLockRelease(queueContext->RingBufferToUserModeLock);
-
-    if (availableData == 0) {
-        return;
-    }
-
-    // Wake any pending GET_OUTGOING requests by re-dispatching them
-    // Satisfy pending GET_OUTGOING
-    for (;;) {
-        WDFREQUEST      getOutgoingRequest;
-        NTSTATUS        s;
-
-        s = WdfIoQueueRetrieveNextRequest(queueContext->OutgoingQueue, &getOutgoingRequest);
-        if (!NT_SUCCESS(s)) {
-            // No more pending requests to fulfill
-            break;
+    requestContext->Memory = memory;
+    requestContext->Length = Length;
+    requestContext->Transferred = 0;
+    requestContext->Sequence = 0;
+    requestContext->Timestamp = QueueTimestamp();
+
+    if (queueContext->Port.PeerId != VCOM_INVALID_PORT_ID) {
+        peer = PortTableAcquire(queueContext->Port.PeerId);
+        if (peer != NULL) {
+            // Unpaired meanwhile if the peer no longer points back here
+            if (peer->Port.PeerId == queueContext->Port.PortId) {
+                // Formatted as this port would send it, then as the peer
+                // receives it
+                WdfSpinLockAcquire(queueContext->RingBufferToUserModeWriteLock);
+                requestContext->Format = queueContext->TxFormat;
+                WdfSpinLockRelease(queueContext->RingBufferToUserModeWriteLock);
+                requestContext->Paired = TRUE;
+
+                QueueElasticBeforeWrite(peer, FALSE, Length);
+                QueueStartWrite(peer, FALSE, Request);
+                Request = NULL;
+            }
+            PortTableRelease(peer);
         }
-
-        // We have a pending IOCTL. Let's try to complete it.
-        PVOID   outputBuffer = NULL;
-        size_t  outputBufferLength = 0;
-        size_t  bytesCopied = 0;
-
-        s = WdfRequestRetrieveOutputBuffer(getOutgoingRequest, 1, &outputBuffer, &outputBufferLength);
-        if (!NT_SUCCESS(s)) {
-            // Failed to get buffer, complete with an error.
-            WdfRequestComplete(getOutgoingRequest, s);
-            continue;
+        if (Request == NULL) {
+            return;
         }
+    }
 
-        // Read from the ring buffer into the IOCTL's buffer
-        WdfSpinLockAcquire(queueContext->RingBufferToUserModeLock);
-        RingBufferRead(
-            &queueContext->RingBufferToUserMode,
-            (BYTE*)outputBuffer,
-            outputBufferLength,
-            &bytesCopied
-        );
-        WdfSpinLockRelease(queueContext->RingBufferToUserModeLock);
+    // Make room first if this write would push the ring past its high watermark
+    QueueElasticBeforeWrite(queueContext, TRUE, Length);
 
-        if (bytesCopied > 0) {
-            // We read some data, complete the request successfully.
-            WdfRequestCompleteWithInformation(getOutgoingRequest, STATUS_SUCCESS, bytesCopied);
-        }
-        else {
-            // Race condition: data was drained by another thread between our check
-            // and retrieving the request. Re-queue it.
-            s = WdfRequestForwardToIoQueue(getOutgoingRequest, queueContext->OutgoingQueue);
-            if (!NT_SUCCESS(s)) {
-                Trace(TRACE_LEVEL_ERROR, "Forward read after PUSH failed 0x%x", s);
-                // If invalid state, complete canceled to avoid leaks
-                if (s == STATUS_WDF_REQUEST_INVALID_STATE || s == STATUS_CANCELLED) {
-                    WdfRequestComplete(getOutgoingRequest, STATUS_CANCELLED);
-                }
-                else {
-                    WdfRequestComplete(getOutgoingRequest, s);
-                }
-            }
-        }
-    }
+    // Funnel bytes into the OUTGOING ring (to be drained by user-mode via IOCTL_VCOM_GET_OUTGOING)
+    QueueStartWrite(queueContext, TRUE, Request);
 }
 
-
 VOID
 EvtIoRead(
     _In_  WDFQUEUE          Queue,
     _In_  WDFREQUEST        Request,
     _In_  size_t            Length
 )
+/*++
+Routine Description:
+
+    Fills an application's read from the incoming ring. What is buffered is
+    copied at once; a read that is not yet satisfied under the port's
+    SERIAL_TIMEOUTS becomes the current read and is completed as more data
+    is pushed or when its timeout expires. Reads behind it queue up in order.
+
+--*/
 {
     NTSTATUS                status;
     PQUEUE_CONTEXT          queueContext = GetQueueContext(Queue);
+    PREQUEST_CONTEXT        requestContext = GetRequestContext(Request);
     WDFMEMORY               memory;
+    ULONG                   queued = 0;
+    size_t                  limit;
+    size_t                  allowed;
     size_t                  bytesCopied = 0;
+    BOOLEAN                 stop;
 
-    Trace(TRACE_LEVEL_INFO, "EvtIoRead 0x%p", Request);
+    TracePoint(TRACE_LEVEL_INFO, VCOM_TRACE_EVENT_READ, queueContext->Port.PortId, Length, 0);
 
-    if (!queueContext->DeviceContext->Started) {
+    if (!queueContext->PortContext->Started) {
         WdfRequestComplete(Request, STATUS_DEVICE_NOT_READY);
         return;
         
     }
 
+    if (Length == 0) {
+        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, 0);
+        return;
+    }
+
     status = WdfRequestRetrieveOutputMemory(Request, &memory);
     if (!NT_SUCCESS(status)) {
         Trace(TRACE_LEVEL_ERROR, "Error: WdfRequestRetrieveOutputMemory failed 0x%x", status);
@@ -573,30 +5514,70 @@ EvtIoRead(
         return;
     }
 
+    requestContext->Port = queueContext;
+    requestContext->Memory = memory;
+    requestContext->Length = Length;
+    requestContext->Transferred = 0;
+    requestContext->AtEventChar = FALSE;
+
+    WdfSpinLockAcquire(queueContext->RingBufferFromNetworkReadLock);
+
+    (VOID)WdfIoQueueGetState(queueContext->ReadQueue, &queued, NULL);
+    if (queueContext->CurrentRead != NULL || queued != 0) {
+        // Keep read order: wait behind the reads already pending
+        WdfSpinLockRelease(queueContext->RingBufferFromNetworkReadLock);
+
+        status = WdfRequestForwardToIoQueue(Request, queueContext->ReadQueue);
+        if (!NT_SUCCESS(status)) {
+            Trace(TRACE_LEVEL_ERROR, "Error: WdfRequestForwardToIoQueue(Read Queue) failed 0x%x", status);
+            WdfRequestComplete(Request, status);
+            return;
+        }
+        InterlockedIncrementNoFence64(&queueContext->Counters->ReadsPended);
+
+        // The reads ahead may have finished before this one was queued
+        QueuePumpIncoming(queueContext);
+        return;
+    }
+
+    QueueSetReadTimeouts(queueContext, Length);
+
     // Read from the INCOMING ring (filled via IOCTL_VCOM_PUSH_INCOMING)
-    WdfSpinLockAcquire(queueContext->RingBufferFromNetworkLock);
-    status = RingBufferRead(&queueContext->RingBufferFromNetwork,
-        (BYTE*)WdfMemoryGetBuffer(memory, NULL),
-        Length,
+    limit = QueueEventCharLimit(queueContext, Length, &stop);
+    allowed = QueuePacingAllow(queueContext, FALSE, limit);
+    status = QueueRingReadToMemory(queueContext, FALSE,
+        memory,
+        0,
+        allowed,
         &bytesCopied);
-    WdfSpinLockRelease(queueContext->RingBufferFromNetworkLock);
+    QueuePacingCharge(queueContext, FALSE, bytesCopied, allowed < limit && bytesCopied == allowed);
+    requestContext->Transferred = bytesCopied;
+    requestContext->AtEventChar = stop && bytesCopied == limit;
 
-    if (!NT_SUCCESS(status)) {
-        WdfRequestComplete(Request, status);
-        return;
+    if (NT_SUCCESS(status) && !QueueReadDone(queueContext, requestContext)) {
+        // Not satisfied yet: it becomes the current read
+        status = WdfRequestMarkCancelableEx(Request, EvtRequestCancelRead);
+        if (NT_SUCCESS(status)) {
+            queueContext->CurrentRead = Request;
+            QueueArmReadTimer(queueContext, bytesCopied);
+            InterlockedIncrementNoFence64(&queueContext->Counters->ReadsPended);
+            Request = NULL;
+        }
     }
 
-    if (bytesCopied > 0) {
+    WdfSpinLockRelease(queueContext->RingBufferFromNetworkReadLock);
+
+    if (Request != NULL) {
         WdfRequestCompleteWithInformation(Request, status, bytesCopied);
-        return;
     }
 
-    // No data: pend this read until PUSH_INCOMING arrives
-    status = WdfRequestForwardToIoQueue(Request, queueContext->ReadQueue);
-    if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR, "Error: WdfRequestForwardToIoQueue(Read Queue) failed 0x%x", status);
-        WdfRequestComplete(Request, status);
+    if (bytesCopied > 0) {
+        QueueIncomingDrained(queueContext);
     }
+
+    // Pended pushes can use the room. In shared mode this also asks the
+    // service for a doorbell if the read is still waiting.
+    QueuePumpIncoming(queueContext);
 }
 
 VOID
@@ -606,73 +5587,6 @@ EvtIoCanceledOnQueue(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request)
     WdfRequestComplete(Request, STATUS_CANCELLED);
 }
 
-NTSTATUS
-QueueProcessWriteBytes(
-    _In_  PQUEUE_CONTEXT    QueueContext,
-    _In_reads_bytes_(Length) PUCHAR Characters,
-    _In_  size_t            Length
-)
-/*++
-Routine Description:
-
-    This function takes the data from an application's write request and
-    places it into the outgoing ring buffer. This buffer is then drained
-    by the user-mode client application via the IOCTL_VCOM_GET_OUTGOING
-    request, effectively creating a pipe from the virtual serial port to
-    the client application.
-
-Arguments:
-
-    QueueContext - A pointer to the queue's context space.
-
-    Characters - A pointer to the buffer containing the data to be written.
-
-    Length - The number of bytes to write from the Characters buffer.
-
-Return Value:
-
-    STATUS_SUCCESS if the data was written successfully.
-    An appropriate NTSTATUS error code otherwise.
-
---*/
-{
-    NTSTATUS status;
-    size_t   bytesWritten = 0;
-
-    // If there's nothing to write, we're done.
-    if (Length == 0) {
-        return STATUS_SUCCESS;
-    }
-
-    // Acquire the lock to ensure exclusive access to the ring buffer.
-    WdfSpinLockAcquire(QueueContext->RingBufferToUserModeLock);
-
-    // Write the entire block of data from the application to the outgoing ring buffer.
-    // We use RingBufferWritePartial here as it will accept as much data as it can
-    // without overflowing, which is safer. The number of bytes actually written
-    // is returned in bytesWritten.
-    status = RingBufferWritePartial(
-        &QueueContext->RingBufferToUserMode,
-        Characters,
-        Length,
-        &bytesWritten
-    );
-
-    // Release the lock.
-    WdfSpinLockRelease(QueueContext->RingBufferToUserModeLock);
-
-    // For this driver's logic, even a partial write is not an error condition
-    // from the perspective of the calling function (EvtIoWrite), so we
-    // normalize the status to success. The EvtIoWrite function will complete
-    // the original request with the actual number of bytes written.
-    if (status == STATUS_BUFFER_OVERFLOW) {
-        status = STATUS_SUCCESS;
-    }
-
-    return status;
-}
-
-
 NTSTATUS
 QueueProcessGetLineControl(
     _In_  PQUEUE_CONTEXT    QueueContext,
@@ -680,13 +5594,13 @@ QueueProcessGetLineControl(
 )
 {
     NTSTATUS                status;
-    PDEVICE_CONTEXT         deviceContext;
+    PPORT_CONTEXT           portContext;
     SERIAL_LINE_CONTROL     lineControl = { 0 };
     ULONG                   lineControlSnapshot;
     ULONG* lineControlRegister;
 
-    deviceContext = QueueContext->DeviceContext;
-    lineControlRegister = GetLineControlRegisterPtr(deviceContext);
+    portContext = QueueContext->PortContext;
+    lineControlRegister = GetLineControlRegisterPtr(portContext);
 
     ASSERT(lineControlRegister);
 
@@ -723,7 +5637,7 @@ QueueProcessSetLineControl(
 )
 {
     NTSTATUS                status;
-    PDEVICE_CONTEXT         deviceContext;
+    PPORT_CONTEXT           portContext;
     SERIAL_LINE_CONTROL     lineControl = { 0 };
     ULONG* lineControlRegister;
     UCHAR                   lineControlData = 0;
@@ -734,8 +5648,8 @@ QueueProcessSetLineControl(
     ULONG                   lineControlPrevious;
     ULONG                   i;
 
-    deviceContext = QueueContext->DeviceContext;
-    lineControlRegister = GetLineControlRegisterPtr(deviceContext);
+    portContext = QueueContext->PortContext;
+    lineControlRegister = GetLineControlRegisterPtr(portContext);
 
     ASSERT(lineControlRegister);
 
@@ -744,10 +5658,10 @@ QueueProcessSetLineControl(
     if (NT_SUCCESS(status)) {
         switch (lineControl.WordLength)
         {
-        case 5: lineControlData = SERIAL_5_DATA; SetValidDataMask(deviceContext, 0x1f); break;
-        case 6: lineControlData = SERIAL_6_DATA; SetValidDataMask(deviceContext, 0x3f); break;
-        case 7: lineControlData = SERIAL_7_DATA; SetValidDataMask(deviceContext, 0x7f); break;
-        case 8: lineControlData = SERIAL_8_DATA; SetValidDataMask(deviceContext, 0xff); break;
+        case 5: lineControlData = SERIAL_5_DATA; SetValidDataMask(portContext, 0x1f); break;
+        case 6: lineControlData = SERIAL_6_DATA; SetValidDataMask(portContext, 0x3f); break;
+        case 7: lineControlData = SERIAL_7_DATA; SetValidDataMask(portContext, 0x7f); break;
+        case 8: lineControlData = SERIAL_8_DATA; SetValidDataMask(portContext, 0xff); break;
         default: status = STATUS_INVALID_PARAMETER; break;
         }
     }
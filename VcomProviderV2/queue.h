@@ -1,62 +1,364 @@
 #pragma once
 
-#define DATA_BUFFER_SIZE 1024
-
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 #endif
 
 #define MAXULONG 0xffffffff
 
+// Timing of one ring's data (marklog.h), and Latency collecting how long
+// each mark's bytes stayed. Lock nests inside both of the ring's locks.
+typedef struct _QUEUE_MARK_LOG {
+    WDFSPINLOCK     Lock;
+    DATA_MARK_LOG   Data;
+    LATENCY_HISTOGRAM Latency;           // not cleared by resets
+} QUEUE_MARK_LOG, * PQUEUE_MARK_LOG;
+
+#define QUEUE_EVENT_CHARS       64      // power of two
+#define QUEUE_EVENT_CHAR_MASK   (QUEUE_EVENT_CHARS - 1)
+
+// Where the event characters in the incoming ring are, as running counts of
+// bytes put in it: Positions[Head] through Positions[Tail - 1], oldest
+// first. In moves under the ring's write lock and Out under its read lock;
+// Lock, which nests inside both, guards the rest. The reader checks Tail
+// unlocked first, so the common case takes no lock.
+typedef struct _QUEUE_EVENT_CHAR_LOG {
+    WDFSPINLOCK     Lock;
+    ULONG64         Positions[QUEUE_EVENT_CHARS];
+    ULONG           Head;
+    volatile ULONG  Tail;
+    ULONG64         In;                  // bytes put in since the last reset
+    ULONG64         Out;                 // of those, bytes taken out
+} QUEUE_EVENT_CHAR_LOG, * PQUEUE_EVENT_CHAR_LOG;
+
 typedef struct _QUEUE_CONTEXT {
     // ===== Outgoing: App -> Service (drained by IOCTL_VCOM_GET_OUTGOING)
-    RING_BUFFER     RingBufferToUserMode;
-    WDFSPINLOCK     RingBufferToUserModeLock;
+    // The rings are single-producer/single-consumer; the write lock only
+    // serializes producers and the read lock only serializes consumers, so
+    // EvtIoWrite and the GET_OUTGOING drain never contend with each other.
+    RING_BUFFER_P2  RingBufferToUserMode;
+    WDFSPINLOCK     RingBufferToUserModeWriteLock;   // EvtIoWrite
+    WDFSPINLOCK     RingBufferToUserModeReadLock;    // IOCTL_VCOM_GET_OUTGOING
 
     // Backing storage owned by KMDF (nonpaged)
     PUCHAR          ToUserBuffer;
     WDFMEMORY       ToUserMem;
     SIZE_T          ToUserCapacity;
+    QUEUE_RING_POLICY ToUserPolicy;
 
     // ===== Incoming: Service -> App (filled by IOCTL_VCOM_PUSH_INCOMING)
-    RING_BUFFER     RingBufferFromNetwork;
-    WDFSPINLOCK     RingBufferFromNetworkLock;
+    RING_BUFFER_P2  RingBufferFromNetwork;
+    WDFSPINLOCK     RingBufferFromNetworkWriteLock;  // IOCTL_VCOM_PUSH_INCOMING
+    WDFSPINLOCK     RingBufferFromNetworkReadLock;   // EvtIoRead
 
     // Backing storage owned by KMDF (nonpaged)
     PUCHAR          FromNetBuffer;
     WDFMEMORY       FromNetMem;
     SIZE_T          FromNetCapacity;
+    QUEUE_RING_POLICY FromNetPolicy;
+
+    // Segmented ports keep both directions in pooled segment chains instead
+    // of the contiguous rings above (same locks, same SPSC rules). The
+    // elastic policy does not apply; MaxCapacity only bounds the chain.
+    BOOLEAN         Segmented;
+    SEG_BUFFER      SegToUserMode;
+    SEG_BUFFER      SegFromNetwork;
+
+    // Shared-memory mode (IOCTL_VCOM_MAP_RINGS): while Shared is set, both
+    // directions live in a region mapped into the control service and take
+    // precedence over the storage above. Flipped only with all four locks
+    // held. The region is allocated on first map and kept until the queue
+    // goes away, so lock-free hints never touch freed memory. Mapping and
+    // unmapping run one at a time under SharedMapping; a thread waiting
+    // for it sleeps on SharedMappingDone, set as it is let go.
+    BOOLEAN         Shared;
+    volatile LONG   SharedMapping;
+    KEVENT          SharedMappingDone;
+    SHARED_RING     SharedToUser;        // driver produces
+    SHARED_RING     SharedFromNetwork;   // driver consumes
+    PVCOM_SHARED_HEADER SharedHeader;    // system address of SharedMdl's pages
+    SIZE_T          SharedSize;
+    PMDL            SharedMdl;           // whole pages of their own
+    PVOID           SharedUserVa;        // valid in SharedProcess only
+    PEPROCESS       SharedProcess;       // referenced while mapped
+    PKEVENT         SharedToUserEvent;   // referenced while mapped
+    PKEVENT         SharedFromNetEvent;
+
+    // Driver-wide port table entry (porttable.c): PortId, rundown, the
+    // null-modem peer (IOCTL_VCOM_PAIR_PORTS) and the readiness waiter hint.
+    // Writes read Port.PeerId unlocked and look the peer up by id, so a
+    // pair undone meanwhile just sends them down the normal path.
+    PORT_SLOT       Port;
+
+    // Pended IOCTL_VCOM_WAIT_READY requests. ReadyEpoch counts wakeups so a
+    // wait that raced with one can tell it must re-evaluate.
+    WDFQUEUE        ReadyWaitQueue;
+    volatile LONG   ReadyEpoch;
 
     // Manual queue for blocking GET_OUTGOING IOCTLs
     WDFQUEUE        OutgoingQueue;
 
+    // GET_OUTGOING coalescing (IOCTL_VCOM_SET_COALESCING, coalesce.h),
+    // guarded by the ToUser read lock. CoalesceTimer fires at its deadline.
+    COALESCE_STATE  Coalesce;
+    TIMER_WHEEL_ENTRY CoalesceTimer;
+
+    // Framed GET_OUTGOING (IOCTL_VCOM_SET_OUTGOING_MODE). Records[RecordHead]
+    // through Records[RecordTail - 1] describe the writes with bytes in the
+    // outgoing ring, oldest first. RecordLock nests inside both ToUser locks.
+    // The array is allocated on first use and kept until the queue goes away.
+    BOOLEAN         Framed;
+    WDFSPINLOCK     RecordLock;
+    WDFMEMORY       RecordMem;
+    PQUEUE_RECORD   Records;
+    ULONG           RecordHead;
+    ULONG           RecordTail;
+    ULONG64         RecordSequence;      // last sequence number handed out
+
+    // When the bytes in each ring went in, for IOCTL_VCOM_GET_INCOMING_AGE
+    // and IOCTL_VCOM_GET_LATENCY. Not kept in shared-ring mode.
+    QUEUE_MARK_LOG  EgressLog;           // outgoing ring, stamped by writes
+    QUEUE_MARK_LOG  IngressLog;          // incoming ring, stamped by pushes
+
+    // SERIAL_CHARS.EventChar in bytes entering the incoming ring: found
+    // while the application waits for EV_RXFLAG or reads to it
+    // (IOCTL_VCOM_SET_READ_MODE), both read unlocked as hints. EventChars
+    // keeps where they are and EventCharsFound that some came in and are
+    // not yet reported. Bytes the service writes straight into a shared ring
+    // are not scanned.
+    volatile UCHAR  EventChar;
+    volatile BOOLEAN ReadToEventChar;
+    volatile LONG   EventCharsFound;
+    QUEUE_EVENT_CHAR_LOG EventChars;
+
+    // Writes that did not fit in the outgoing ring. WritePend.Current is the
+    // one being filled in as GET_OUTGOING drains (cancelable, guarded by the
+    // ToUser write lock); writes behind it wait in WriteQueue, in order.
+    PEND_QUEUE      WritePend;
+    WDFQUEUE        WriteQueue;
+
+    // The same for IOCTL_VCOM_PUSH_INCOMING in VCOM_PUSH_MODE_PEND, or for
+    // the peer's application writes on a paired port, filled in as EvtIoRead
+    // drains (guarded by the FromNet write lock). CreditQueue
+    // holds IOCTL_VCOM_GET_CREDIT requests waiting for free space, and
+    // CreditWait the least of them any waits for.
+    ULONG           PushMode;
+    PEND_QUEUE      PushPend;
+    WDFQUEUE        PushQueue;
+    WDFQUEUE        CreditQueue;
+    PEND_CREDIT_WAIT CreditWait;
+
     // Standard queues
     WDFQUEUE        Queue;           // Default parallel queue
-    WDFQUEUE        ReadQueue;       // Manual queue for pending reads
+    WDFQUEUE        ReadQueue;       // Manual queue for reads waiting behind CurrentRead
 
+    // The read being filled as data arrives (cancelable, guarded by the
+    // FromNet read lock)
+    WDFREQUEST      CurrentRead;
 
-    PDEVICE_CONTEXT DeviceContext;   // Back-reference to device context
+    // SERIAL_TIMEOUTS state for CurrentRead and the current write, computed when
+    // each becomes current and guarded by the same lock. Times are timeout
+    // engine ticks; a deadline of 0 means none. The timers may fire early
+    // (byte arrivals do not re-arm them), and then just re-arm.
+    TIMER_WHEEL_ENTRY ReadTimer;
+    ULONG64         ReadTotalDeadline;
+    ULONG64         ReadIntervalTicks;   // 0: no inter-character timeout
+    ULONG64         ReadLastActivity;    // tick of the last byte read
+    BOOLEAN         ReadReturnOnAny;     // MAXULONG/MAXULONG/constant
+    BOOLEAN         ReadImmediate;       // MAXULONG/0/0
+    TIMER_WHEEL_ENTRY WriteTimer;
+    ULONG64         WriteDeadline;
+
+    // Serial events (guarded by EventLock). At most one
+    // IOCTL_SERIAL_WAIT_ON_MASK is pended in WaitMaskQueue; events seen while
+    // none is collect in WaitEvents (waitmask.h). RemoteModemStatus and LineErrors are
+    // the remote end's state as last reported by IOCTL_VCOM_SET_LINE_STATE
+    // (or a null-modem peer). ModemStatus is what the application sees: the
+    // remote lines, with those in TxLineMask driven by TxLines instead.
+    // TxHoldLines are the lines HandShakeLines has writes wait for that are
+    // now low; lines count only once reported or driven.
+    WDFSPINLOCK     EventLock;
+    WDFQUEUE        WaitMaskQueue;
+    WAIT_MASK_STATE WaitEvents;
+    ULONG           ModemStatus;         // SERIAL_MSR_*
+    ULONG           RemoteModemStatus;
+    BOOLEAN         LinesReported;
+    volatile ULONG  TxHoldLines;         // SERIAL_MSR_*, read unlocked by writes
+    ULONG           LineErrors;          // SERIAL_ERROR_*, cleared by GET_COMMSTATUS
+
+    // Baud-rate pacing (IOCTL_VCOM_SET_PACING). TxPacing meters application
+    // writes into the outgoing ring under the ToUser write lock; RxPacing
+    // meters application reads from the incoming ring under the FromNet read
+    // lock. A bucket with no rate lets everything through. A side held back
+    // by its bucket arms its timer, which pumps it again once the next byte
+    // may go.
+    ULONG           PacingFlags;         // VCOM_PACE_*
+    PACING_BUCKET   TxPacing;
+    PACING_BUCKET   RxPacing;
+    TIMER_WHEEL_ENTRY TxPacingTimer;
+    TIMER_WHEEL_ENTRY RxPacingTimer;
+
+    // Word length and parity (dataformat.h), from the line control and
+    // IOCTL_VCOM_SET_PARITY_MODE. TxFormat is applied to application writes
+    // as they enter the outgoing ring, under the ToUser write lock; RxFormat
+    // to incoming bytes as they enter the incoming ring, under the FromNet
+    // write lock. Bytes the service writes straight into a shared ring are
+    // not formatted. ParityErrors counts failed checks not yet reported as
+    // SERIAL_EV_ERR.
+    ULONG           ParityFlags;         // VCOM_PARITY_*
+    UCHAR           ParityErrorChar;
+    DATA_FORMAT     TxFormat;
+    DATA_FORMAT     RxFormat;
+    volatile LONG   ParityErrors;
+
+    // XON/XOFF flow control (swflow.h), set from the port's HandFlow and
+    // Chars, which FlowLock also guards. FlowLock nests inside every ring
+    // lock. Pushes feed SwFlow under the FromNet write lock; GET_OUTGOING
+    // reads its hold and pending character unlocked as hints and takes the
+    // character under the ToUser read lock. FlowHeld is the hold as
+    // QueueUpdateFlow last saw it, so it can tell when XON lifts it.
+    WDFSPINLOCK     FlowLock;
+    SW_FLOW         SwFlow;
+    BOOLEAN         FlowHeld;
+
+    // Hardware flow control emulated from ring fill levels (lineflow.h),
+    // guarded by FlowLock. TxLines drives the application's lines in
+    // TxLineMask (IOCTL_VCOM_SET_LINE_FLOW) from the outgoing ring; RxLines
+    // drives its RTS or DTR, in RxLineMask, from the incoming ring under
+    // SERIAL_RTS_HANDSHAKE or SERIAL_DTR_HANDSHAKE. The masks and
+    // HandShakeLines are read unlocked as hints; whoever changes them brings
+    // the lines up to date afterwards. ModemControlChanged stays set from a
+    // change of DTR or RTS until the service reads them.
+    LINE_FLOW       TxLines;
+    LINE_FLOW       RxLines;
+    volatile ULONG  TxLineMask;          // SERIAL_MSR_CTS/DSR/DCD
+    volatile ULONG  RxLineMask;          // SERIAL_MCR_RTS/DTR
+    volatile ULONG  HandShakeLines;      // SERIAL_MSR_* writes wait for
+    volatile LONG   ModemControlChanged;
+
+    // Performance counters (VCOM_PORT_COUNTERS). Counters points into the
+    // named page when the port has one and at CounterFallback otherwise, so
+    // the hot paths never check. Byte counts, occupancy and high-water marks
+    // are only written under the ring lock of their side; the rest with
+    // interlocked adds.
+    COUNTER_PAGE    CounterPage;
+    PVCOM_PORT_COUNTERS Counters;
+    VCOM_PORT_COUNTERS CounterFallback;
+
+    PPORT_CONTEXT   PortContext;     // Back-reference, holding a reference on the port object
 
 } QUEUE_CONTEXT, * PQUEUE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, GetQueueContext);
 
+// Every request carries this (see DeviceCreate); reads, writes and pended
+// pushes use it to remember how far they got across several ring updates.
+typedef struct _REQUEST_CONTEXT {
+    PQUEUE_CONTEXT  Port;           // the port whose ring it is waiting on
+    WDFMEMORY       Memory;
+    size_t          Length;
+    size_t          Transferred;
+    ULONG64         Sequence;       // framed writes: record number, 0 until the first byte is in
+    ULONG64         Timestamp;      // framed writes: when EvtIoWrite took it
+    BOOLEAN         Paired;         // a write bound for the peer's incoming ring
+    DATA_FORMAT     Format;         // paired writes: the writer's TxFormat
+    BOOLEAN         AtEventChar;    // reads: the last byte in is the event character
+} REQUEST_CONTEXT, * PREQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, GetRequestContext);
+
 // Queue event handlers
 EVT_WDF_IO_QUEUE_IO_READ           EvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE          EvtIoWrite;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE EvtIoCanceledOnQueue;
+EVT_WDF_REQUEST_CANCEL             EvtRequestCancelWrite;
+EVT_WDF_REQUEST_CANCEL             EvtRequestCancelPush;
+EVT_WDF_REQUEST_CANCEL             EvtRequestCancelRead;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP     EvtQueueCleanup;
 
 // Queue management
-NTSTATUS QueueCreate(_In_ PDEVICE_CONTEXT DeviceContext);
+NTSTATUS QueueCreate(_In_ PPORT_CONTEXT PortContext);
 
-// Data processing helpers
-NTSTATUS QueueProcessWriteBytes(
-    _In_  PQUEUE_CONTEXT QueueContext,
-    _In_reads_bytes_(Length) PUCHAR Characters,
-    _In_  size_t Length
+// Deletes the port's queues, for a port with no handles open. Its timers
+// and its PortId are shut down first, so nothing reaches it meanwhile.
+VOID QueueDestroy(_In_ PQUEUE_CONTEXT QueueContext);
+VOID QueueResetRings(_In_ PQUEUE_CONTEXT QueueContext);
+
+// Resizes the rings in place, keeping buffered bytes. A size of 0 leaves that
+// ring alone. InSize is the application's receive side (RingBufferFromNetwork)
+// and OutSize its transmit side (RingBufferToUserMode), as in SERIAL_QUEUE_SIZE.
+NTSTATUS QueueSetRingSizes(
+    _In_ PQUEUE_CONTEXT QueueContext,
+    _In_ size_t         InSize,
+    _In_ size_t         OutSize
+);
+
+// Shared-memory mode. Map must run in the control service's context (see
+// VcomEvtIoInCallerContext); Unmap is called when the control handle closes.
+NTSTATUS QueueMapSharedRings(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFREQUEST        Request
 );
 
+VOID QueueUnmapSharedRings(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+// Completes the current and queued reads with STATUS_CANCELLED and the bytes
+// they got
+VOID QueueCancelPendingReads(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+// Completes every pended application write (ToUser) or service push
+// (FromNet) with STATUS_CANCELLED and the bytes it got in. On a paired port
+// the application's writes pended on the peer are included.
+VOID QueueCancelPendingWrites(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  BOOLEAN           ToUser
+);
+
+// Applies IOCTL_VCOM_SET_COALESCING settings; all zero turns coalescing off
+NTSTATUS QueueSetCoalescing(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  PVCOM_COALESCE    Coalesce
+);
+
+// Switches GET_OUTGOING between a byte stream and framed records; only while
+// the port is stopped
+NTSTATUS QueueSetOutgoingMode(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  ULONG             Mode
+);
+
+// Raises SERIAL_EV_* events on the port (see IOCTL_SERIAL_WAIT_ON_MASK)
+VOID QueueSignalEvents(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  ULONG             Events
+);
+
+// Clears the wait mask and event state, cancelling a pending wait
+VOID QueueResetWaitMask(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+// Hands this port's pended readiness waits back for re-evaluation
+VOID QueueWakeReadyWaiters(
+    _In_  PQUEUE_CONTEXT    QueueContext
+);
+
+NTSTATUS QueueProcessBatch(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _In_  WDFREQUEST        Request
+);
+
+NTSTATUS QueueGetRingStats(
+    _In_  PQUEUE_CONTEXT    QueueContext,
+    _Out_ PVCOM_QUEUE_STATS Stats
+);
+
+// Data processing helpers
 NTSTATUS QueueProcessGetLineControl(
     _In_  PQUEUE_CONTEXT QueueContext,
     _In_  WDFREQUEST     Request
@@ -78,4 +380,27 @@ NTSTATUS RequestCopyToBuffer(
     _In_ WDFREQUEST Request,
     _In_ PVOID      DestinationBuffer,
     _In_ size_t     NumBytesToCopyTo
+);
+
+// Zero-copy transfers between request memory and ring storage. ToUser picks
+// the direction; the port's storage kind (ring or segments) is handled here.
+// Writes apply the ring's data format; SentFormat, if given, is applied
+// first, as the sending end of a null-modem pair would.
+NTSTATUS QueueRingWriteFromMemory(
+    _In_  PQUEUE_CONTEXT QueueContext,
+    _In_  BOOLEAN   ToUser,
+    _In_  WDFMEMORY Memory,
+    _In_  size_t    Offset,
+    _In_  size_t    Length,
+    _In_opt_ const DATA_FORMAT* SentFormat,
+    _Out_ size_t*   BytesWritten
+);
+
+NTSTATUS QueueRingReadToMemory(
+    _In_  PQUEUE_CONTEXT QueueContext,
+    _In_  BOOLEAN   ToUser,
+    _In_  WDFMEMORY Memory,
+    _In_  size_t    Offset,
+    _In_  size_t    Length,
+    _Out_ size_t*   BytesCopied
 );
\ No newline at end of file
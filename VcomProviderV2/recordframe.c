@@ -0,0 +1,62 @@
+/*++
+
+Module Name:
+
+    recordframe.c
+
+Abstract:
+
+    Chunking of framed GET_OUTGOING records
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "recordframe.h"
+
+BOOLEAN
+RecordFrameWanted(
+    _In_  PQUEUE_RECORD       Record,
+    _In_  size_t              Room
+)
+{
+    ULONG pending = Record->Length - Record->Consumed;
+
+    if (pending == 0) {
+        return Record->Complete;
+    }
+    return Room != 0;
+}
+
+BOOLEAN
+RecordFrameChunk(
+    _Inout_ PQUEUE_RECORD     Record,
+    _In_  size_t              Copied,
+    _Out_ PVCOM_RECORD_HEADER Header
+)
+{
+    RtlZeroMemory(Header, sizeof(*Header));
+    Header->Length = (ULONG)Copied;
+    Header->Sequence = Record->Sequence;
+    Header->Timestamp = Record->Timestamp;
+    if (Record->Consumed == 0) {
+        Header->Flags |= VCOM_RECORD_FIRST;
+    }
+
+    Record->Consumed += (ULONG)Copied;
+
+    // Complete is read here, after the copy: the write may have finished
+    // meanwhile
+    if (Record->Complete && Record->Consumed == Record->Length) {
+        Header->Flags |= VCOM_RECORD_LAST;
+        if (Record->Truncated) {
+            Header->Flags |= VCOM_RECORD_TRUNCATED;
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
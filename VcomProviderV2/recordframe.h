@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+    recordframe.h
+
+Abstract:
+
+    Framed GET_OUTGOING (VCOM_RECORD_HEADER in public.h): the record kept
+    for each application write with bytes in the outgoing ring, and how a
+    drain cuts it into chunks that fit the output. The queue keeps the
+    records in a ring under its RecordLock and moves the bytes
+    (QueueReadFramedToMemory).
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // One application write's bytes in the outgoing ring
+    typedef struct _QUEUE_RECORD {
+        ULONG64         Sequence;
+        ULONG           Length;         // bytes of the write put in the ring so far
+        ULONG           Consumed;       // bytes of it drained so far
+        BOOLEAN         Complete;       // no more bytes will be added
+        BOOLEAN         Truncated;      // the write ended before all of it went in
+        ULONG64         Timestamp;      // when EvtIoWrite took the write
+    } QUEUE_RECORD, * PQUEUE_RECORD;
+
+#define QUEUE_RECORD_SLOTS      256     // power of two
+#define QUEUE_RECORD_MASK       (QUEUE_RECORD_SLOTS - 1)
+
+    // Bytes a chunk with Payload bytes takes in the output, header and
+    // padding included: where the next chunk starts
+    __forceinline size_t RecordFrameSize(
+        _In_  size_t              Payload
+    )
+    {
+        return sizeof(VCOM_RECORD_HEADER) + VCOM_RECORD_ALIGN(Payload);
+    }
+
+    // Payload room for a chunk whose header goes at Out in an output of
+    // Length bytes, rounded down so the padded payload still fits. The
+    // caller checks that the header itself fits.
+    __forceinline size_t RecordFrameRoom(
+        _In_  size_t              Length,
+        _In_  size_t              Out
+    )
+    {
+        return (Length - Out - sizeof(VCOM_RECORD_HEADER)) & ~(size_t)7;
+    }
+
+    // Whether Record gives a chunk now, with Room bytes for its payload. Not
+    // while the rest of the write is still to come, nor when it has bytes
+    // and there is no room; a truncated write whose bytes are all drained
+    // still gets a last, empty chunk.
+    BOOLEAN
+        RecordFrameWanted(
+            _In_  PQUEUE_RECORD       Record,
+            _In_  size_t              Room
+        );
+
+    // Fills Header for a chunk of the next Copied bytes of Record and counts
+    // them as drained. TRUE if it is the write's last chunk, in which case
+    // the caller moves past the record once the header is out.
+    BOOLEAN
+        RecordFrameChunk(
+            _Inout_ PQUEUE_RECORD     Record,
+            _In_  size_t              Copied,
+            _Out_ PVCOM_RECORD_HEADER Header
+        );
+
+#ifdef __cplusplus
+}
+#endif
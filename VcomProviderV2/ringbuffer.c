@@ -11,7 +11,7 @@ Module Name:
 
 Abstract:
 
-    DISPATCH_LEVEL-safe ring buffer with optional partial writes
+    DISPATCH_LEVEL-safe power-of-two ring buffer
 
 Environment:
 
@@ -19,171 +19,183 @@ Environment:
 
 --*/
 
-#include "common.h"
+#include "platform.h"
+#include "ringbuffer.h"
+
+//
+// Power-of-two ring with free-running counters
+//
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-VOID
-RingBufferInitialize(
-    _Inout_ PRING_BUFFER      Self,
-    _In_reads_bytes_(BufferSize)
+NTSTATUS
+RingBufferP2Initialize(
+    _Inout_ PRING_BUFFER_P2   Self,
+    _In_reads_bytes_(Capacity)
     BYTE* Buffer,
-    _In_  size_t              BufferSize
+    _In_  size_t              Capacity
 )
 {
-    Self->Size = BufferSize;
+    if ((Buffer == NULL) || !RING_BUFFER_P2_IS_VALID_CAPACITY(Capacity)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory(Self, sizeof(*Self));
     Self->Base = Buffer;
-    Self->End = Buffer + BufferSize;
-    Self->Head = Buffer;
-    Self->Tail = Buffer;
+    Self->Capacity = Capacity;
+    return STATUS_SUCCESS;
 }
 
-_IRQL_requires_max_(DISPATCH_LEVEL)
-VOID
-RingBufferGetAvailableSpace(
-    _In_  PRING_BUFFER      Self,
-    _Out_ size_t* AvailableSpace
+static
+size_t
+RingBufferP2FillSpans(
+    _In_  PRING_BUFFER_P2     Self,
+    _In_  ULONG64             Counter,
+    _In_  size_t              Length,
+    _Out_ PRING_BUFFER_SPANS  Spans
 )
 {
-    BYTE* headSnapshot = NULL;
-    BYTE* tailSnapshot = NULL;
-    BYTE* tailPlusOne = NULL;
+    size_t offset;
+    size_t firstChunk;
 
-    ASSERT(AvailableSpace);
+    RtlZeroMemory(Spans, sizeof(*Spans));
 
-    headSnapshot = Self->Head;
-    tailSnapshot = Self->Tail;
+    if (Length == 0) {
+        return 0;
+    }
 
-    // Distinguish empty vs full by keeping one byte always unused.
-    tailPlusOne = ((tailSnapshot + 1) == Self->End) ? Self->Base : (tailSnapshot + 1);
+    offset = (size_t)Counter & (Self->Capacity - 1);
+    firstChunk = Self->Capacity - offset;
 
-    if (tailPlusOne == headSnapshot) {
-        *AvailableSpace = 0; // full
-    }
-    else if (tailSnapshot == headSnapshot) {
-        *AvailableSpace = Self->Size - 1; // empty
-    }
-    else if (tailSnapshot > headSnapshot) {
-        *AvailableSpace = Self->Size - (tailSnapshot - headSnapshot) - 1; // contiguous
+    Spans->Span[0].Buffer = Self->Base + offset;
+    if (firstChunk >= Length) {
+        Spans->Span[0].Length = Length;
+        Spans->Count = 1;
     }
     else {
-        *AvailableSpace = (headSnapshot - tailSnapshot) - 1; // wrapped
+        Spans->Span[0].Length = firstChunk;
+        Spans->Span[1].Buffer = Self->Base;
+        Spans->Span[1].Length = Length - firstChunk;
+        Spans->Count = 2;
     }
+
+    Spans->Total = Length;
+    return Length;
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-VOID
-RingBufferGetAvailableData(
-    _In_  PRING_BUFFER      Self,
-    _Out_ size_t* AvailableData
+size_t
+RingBufferP2Reserve(
+    _In_  PRING_BUFFER_P2     Self,
+    _In_  size_t              MaxSize,
+    _Out_ PRING_BUFFER_SPANS  Spans
 )
 {
-    size_t availableSpace = 0;
-    ASSERT(AvailableData);
-    RingBufferGetAvailableSpace(Self, &availableSpace);
-    *AvailableData = Self->Size - availableSpace - 1; // one byte always unused
+    ULONG64 writeCount;
+    size_t  space;
+
+    ASSERT(Spans);
+
+    writeCount = ReadULong64NoFence(&Self->WriteCount);
+    space = Self->Capacity - (size_t)(writeCount - ReadULong64Acquire(&Self->ReadCount));
+
+    return RingBufferP2FillSpans(Self, writeCount, (space < MaxSize) ? space : MaxSize, Spans);
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS
-RingBufferWritePartial(
-    _Inout_ PRING_BUFFER      Self,
-    _In_reads_bytes_(DataSize)
-    const BYTE* Data,
-    _In_  size_t              DataSize,
-    _Out_ size_t* BytesWritten
+VOID
+RingBufferP2Commit(
+    _Inout_ PRING_BUFFER_P2   Self,
+    _In_  size_t              Count
 )
 {
-    size_t availableSpace;
-    size_t bytesToCopy;
-    size_t spaceFromCurrToEnd;
-
-    if (BytesWritten) *BytesWritten = 0;
+    ULONG64 writeCount = ReadULong64NoFence(&Self->WriteCount);
 
-    ASSERT(Data && (0 != DataSize));
+    ASSERT((writeCount + Count) - ReadULong64NoFence(&Self->ReadCount) <= Self->Capacity);
 
-    if ((Self == NULL) || (Self->Tail >= Self->End) || (Self->Base == NULL)) {
-        return STATUS_INTERNAL_ERROR;
-    }
+    // Publish: everything written through the reserved spans becomes visible
+    // to the consumer no later than the new WriteCount.
+    WriteULong64Release(&Self->WriteCount, writeCount + Count);
+}
 
-    RingBufferGetAvailableSpace(Self, &availableSpace);
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+RingBufferP2Peek(
+    _In_  PRING_BUFFER_P2     Self,
+    _In_  size_t              MaxSize,
+    _Out_ PRING_BUFFER_SPANS  Spans
+)
+{
+    ULONG64 readCount;
+    size_t  available;
 
-    bytesToCopy = (availableSpace < DataSize) ? availableSpace : DataSize;
+    ASSERT(Spans);
 
-    if (bytesToCopy) {
-        if ((Self->Tail + bytesToCopy) > Self->End) {
-            // Two-step copy (wraps)
-            spaceFromCurrToEnd = (size_t)(Self->End - Self->Tail);
-            RtlCopyMemory(Self->Tail, Data, spaceFromCurrToEnd);
-            Data += spaceFromCurrToEnd;
-            bytesToCopy -= spaceFromCurrToEnd;
-            RtlCopyMemory(Self->Base, Data, bytesToCopy);
-            Self->Tail = Self->Base + bytesToCopy; // wrapped position
-        }
-        else {
-            // Single-step copy
-            RtlCopyMemory(Self->Tail, Data, bytesToCopy);
-            Self->Tail += bytesToCopy;
-            if (Self->Tail == Self->End) {
-                Self->Tail = Self->Base; // wrap exactly at end
-            }
-        }
-        ASSERT(Self->Tail < Self->End);
-    }
+    readCount = ReadULong64NoFence(&Self->ReadCount);
+    available = (size_t)(ReadULong64Acquire(&Self->WriteCount) - readCount);
 
-    if (BytesWritten) *BytesWritten = bytesToCopy + 0; // number accepted
-    return (bytesToCopy == DataSize) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+    return RingBufferP2FillSpans(Self, readCount, (available < MaxSize) ? available : MaxSize, Spans);
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS
-RingBufferRead(
-    _Inout_ PRING_BUFFER      Self,
-    _Out_writes_bytes_to_(DataSize, *BytesCopied)
-    BYTE* Data,
-    _In_  size_t              DataSize,
-    _Out_ size_t* BytesCopied
+VOID
+RingBufferP2Consume(
+    _Inout_ PRING_BUFFER_P2   Self,
+    _In_  size_t              Count
 )
 {
-    size_t availableData;
-    size_t dataFromCurrToEnd;
-
-    ASSERT(Data && (DataSize != 0));
+    ULONG64 readCount = ReadULong64NoFence(&Self->ReadCount);
 
-    if ((Self == NULL) || (Self->Head >= Self->End) || (Self->Base == NULL)) {
-        return STATUS_INTERNAL_ERROR;
-    }
+    ASSERT(readCount + Count <= ReadULong64NoFence(&Self->WriteCount));
 
-    RingBufferGetAvailableData(Self, &availableData);
+    // Hand the slots back to the producer only after we are done with them.
+    WriteULong64Release(&Self->ReadCount, readCount + Count);
+}
 
-    if (availableData == 0) {
-        if (BytesCopied) *BytesCopied = 0;
-        return STATUS_SUCCESS;
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+RingBufferP2Migrate(
+    _Inout_ PRING_BUFFER_P2   Self,
+    _In_reads_bytes_(NewCapacity)
+    BYTE* NewBuffer,
+    _In_  size_t              NewCapacity
+)
+{
+    RING_BUFFER_SPANS spans;
+    ULONG64 counter;
+    size_t  occupancy;
+    size_t  offset;
+    size_t  firstChunk;
+    ULONG   i;
+
+    if ((NewBuffer == NULL) || !RING_BUFFER_P2_IS_VALID_CAPACITY(NewCapacity)) {
+        return STATUS_INVALID_PARAMETER;
     }
 
-    if (DataSize > availableData) {
-        DataSize = availableData;
+    counter = ReadULong64NoFence(&Self->ReadCount);
+    occupancy = (size_t)(ReadULong64NoFence(&Self->WriteCount) - counter);
+    if (occupancy > NewCapacity) {
+        return STATUS_BUFFER_TOO_SMALL;
     }
 
-    if (BytesCopied) *BytesCopied = DataSize;
+    // Each byte keeps its counter, so it lands at counter & (NewCapacity - 1)
+    // in the new storage; that may wrap at a different point than before.
+    RingBufferP2Peek(Self, occupancy, &spans);
 
-    if ((Self->Head + DataSize) > Self->End) {
-        // Two-step copy (wraps)
-        dataFromCurrToEnd = (size_t)(Self->End - Self->Head);
-        RtlCopyMemory(Data, Self->Head, dataFromCurrToEnd);
-        Data += dataFromCurrToEnd;
-        DataSize -= dataFromCurrToEnd;
-        RtlCopyMemory(Data, Self->Base, DataSize);
-        Self->Head = Self->Base + DataSize;
-    }
-    else {
-        // Single-step copy
-        RtlCopyMemory(Data, Self->Head, DataSize);
-        Self->Head += DataSize;
-        if (Self->Head == Self->End) {
-            Self->Head = Self->Base;
+    for (i = 0; i < spans.Count; i++) {
+        offset = (size_t)counter & (NewCapacity - 1);
+        firstChunk = NewCapacity - offset;
+        if (firstChunk >= spans.Span[i].Length) {
+            RtlCopyMemory(NewBuffer + offset, spans.Span[i].Buffer, spans.Span[i].Length);
+        }
+        else {
+            RtlCopyMemory(NewBuffer + offset, spans.Span[i].Buffer, firstChunk);
+            RtlCopyMemory(NewBuffer, spans.Span[i].Buffer + firstChunk,
+                spans.Span[i].Length - firstChunk);
         }
+        counter += spans.Span[i].Length;
     }
 
-    ASSERT(Self->Head < Self->End);
+    Self->Base = NewBuffer;
+    Self->Capacity = NewCapacity;
     return STATUS_SUCCESS;
 }
@@ -18,89 +18,168 @@ Module Name:
 extern "C" {
 #endif
 
-    typedef struct _RING_BUFFER
+    //
+    // Power-of-two ring with free-running 64-bit counters.
+    //
+    // WriteCount and ReadCount only ever increase. Occupancy is their
+    // difference and a byte's slot is its counter masked with Capacity - 1, so
+    // the whole buffer is usable and no sentinel byte is needed. The counters
+    // double as running totals of bytes produced and consumed.
+    //
+    // The ring has a single producer and a single consumer. The producer owns
+    // WriteCount and the consumer owns ReadCount; each publishes its own
+    // counter with release semantics and reads the other one with acquire
+    // semantics, so one writer and one reader may run concurrently without a
+    // shared lock. Callers must still serialize producers among themselves and
+    // consumers among themselves.
+    //
+
+#define RING_BUFFER_P2_IS_VALID_CAPACITY(_capacity_)  \
+    (((_capacity_) != 0) && ((((_capacity_) - 1) & (_capacity_)) == 0))
+
+#define RING_BUFFER_CACHE_LINE  64
+
+    typedef struct _RING_BUFFER_P2
     {
-        // Total storage size in bytes (includes one sentinel byte left unused)
-        size_t Size;
-
         // Base address of the backing storage (nonpaged)
         BYTE* Base;
 
-        // One byte past the end of the buffer (Base + Size)
-        BYTE* End;
+        // Storage size in bytes; always a power of two
+        size_t Capacity;
+
+        UCHAR Reserved0[RING_BUFFER_CACHE_LINE - sizeof(BYTE*) - sizeof(size_t)];
 
-        // Read cursor
-        BYTE* Head;
+        // Total bytes ever written (producer-owned)
+        volatile ULONG64 WriteCount;
 
-        // Write cursor
-        BYTE* Tail;
+        UCHAR Reserved1[RING_BUFFER_CACHE_LINE - sizeof(ULONG64)];
 
-    } RING_BUFFER, * PRING_BUFFER;
+        // Total bytes ever read (consumer-owned)
+        volatile ULONG64 ReadCount;
+
+    } RING_BUFFER_P2, * PRING_BUFFER_P2;
 
     _IRQL_requires_max_(DISPATCH_LEVEL)
-        VOID
-        RingBufferInitialize(
-            _Inout_ PRING_BUFFER      Self,
-            _In_reads_bytes_(BufferSize)
-            _When_(BufferSize > 0, _Notnull_)
+        NTSTATUS
+        RingBufferP2Initialize(
+            _Inout_ PRING_BUFFER_P2   Self,
+            _In_reads_bytes_(Capacity)
             BYTE* Buffer,
-            _In_  size_t              BufferSize
+            _In_  size_t              Capacity
         );
 
-    // New: report how many bytes were accepted; returns STATUS_SUCCESS if fully written,
-    // STATUS_BUFFER_OVERFLOW if truncated (BytesWritten < DataSize).
     _IRQL_requires_max_(DISPATCH_LEVEL)
-        NTSTATUS
-        RingBufferWritePartial(
-            _Inout_ PRING_BUFFER      Self,
-            _In_reads_bytes_(DataSize)
-            const BYTE* Data,
-            _In_  size_t              DataSize,
-            _Out_ size_t* BytesWritten
-        );
+        __forceinline size_t RingBufferP2Occupancy(
+            _In_ const RING_BUFFER_P2* Self)
+    {
+        ULONG64 readCount;
+        ULONG64 writeCount;
+
+        // Snapshot the consumer first: WriteCount can only be >= the ReadCount
+        // observed before it. A third-party observer can still see the producer
+        // run ahead of a stale ReadCount, hence the clamp.
+        readCount = ReadULong64Acquire(&Self->ReadCount);
+        writeCount = ReadULong64Acquire(&Self->WriteCount);
+
+        return ((writeCount - readCount) > Self->Capacity) ? Self->Capacity : (size_t)(writeCount - readCount);
+    }
 
     _IRQL_requires_max_(DISPATCH_LEVEL)
-        NTSTATUS
-        RingBufferRead(
-            _Inout_ PRING_BUFFER      Self,
-            _Out_writes_bytes_to_(DataSize, *BytesCopied)
-            _When_(DataSize > 0, _Notnull_)
-            BYTE* Data,
-            _In_  size_t              DataSize,
-            _Out_ size_t* BytesCopied
+        __forceinline VOID RingBufferP2GetAvailableData(
+            _In_  PRING_BUFFER_P2   Self,
+            _Out_ size_t* AvailableData)
+    {
+        *AvailableData = RingBufferP2Occupancy(Self);
+    }
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        __forceinline VOID RingBufferP2GetAvailableSpace(
+            _In_  PRING_BUFFER_P2   Self,
+            _Out_ size_t* AvailableSpace)
+    {
+        *AvailableSpace = Self->Capacity - RingBufferP2Occupancy(Self);
+    }
+
+    //
+    // Zero-copy access. A region of the ring is described by up to two
+    // contiguous spans (the second one is used only when the region wraps).
+    //
+    // Producer: RingBufferP2Reserve returns free space, the caller fills it in
+    // place and then publishes any prefix of it with RingBufferP2Commit.
+    // Consumer: RingBufferP2Peek returns buffered data without consuming it,
+    // the caller inspects or copies it and then releases any prefix of it with
+    // RingBufferP2Consume.
+    //
+    // Spans stay valid until the matching commit/consume; producers and
+    // consumers are serialized as described above.
+    //
+
+    typedef struct _RING_BUFFER_SPAN
+    {
+        BYTE*  Buffer;
+        size_t Length;
+    } RING_BUFFER_SPAN, * PRING_BUFFER_SPAN;
+
+    typedef struct _RING_BUFFER_SPANS
+    {
+        ULONG            Count;     // 0, 1 or 2
+        size_t           Total;     // Span[0].Length + Span[1].Length
+        RING_BUFFER_SPAN Span[2];
+    } RING_BUFFER_SPANS, * PRING_BUFFER_SPANS;
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        RingBufferP2Reserve(
+            _In_  PRING_BUFFER_P2     Self,
+            _In_  size_t              MaxSize,
+            _Out_ PRING_BUFFER_SPANS  Spans
         );
 
     _IRQL_requires_max_(DISPATCH_LEVEL)
         VOID
-        RingBufferGetAvailableSpace(
-            _In_  PRING_BUFFER      Self,
-            _Out_ size_t* AvailableSpace
+        RingBufferP2Commit(
+            _Inout_ PRING_BUFFER_P2   Self,
+            _In_  size_t              Count
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        RingBufferP2Peek(
+            _In_  PRING_BUFFER_P2     Self,
+            _In_  size_t              MaxSize,
+            _Out_ PRING_BUFFER_SPANS  Spans
         );
 
     _IRQL_requires_max_(DISPATCH_LEVEL)
         VOID
-        RingBufferGetAvailableData(
-            _In_  PRING_BUFFER      Self,
-            _Out_ size_t* AvailableData
+        RingBufferP2Consume(
+            _Inout_ PRING_BUFFER_P2   Self,
+            _In_  size_t              Count
         );
 
-    // Helpers
+    // Moves the buffered bytes into new storage of a different power-of-two
+    // size. Both counters are preserved, so running totals (and anything keyed
+    // by them) stay valid. Fails with STATUS_BUFFER_TOO_SMALL if the buffered
+    // bytes would not fit. Requires exclusive access to both sides of the ring.
     _IRQL_requires_max_(DISPATCH_LEVEL)
-        __forceinline size_t RingBufferCapacity(_In_ const PRING_BUFFER Self)
-    {
-        // Effective data capacity (we keep one byte unused to disambiguate empty/full)
-        return (Self && Self->Size) ? (Self->Size - 1) : 0;
-    }
+        NTSTATUS
+        RingBufferP2Migrate(
+            _Inout_ PRING_BUFFER_P2   Self,
+            _In_reads_bytes_(NewCapacity)
+            BYTE* NewBuffer,
+            _In_  size_t              NewCapacity
+        );
 
+    // Discards any buffered data and restarts both running totals at zero.
+    // Requires exclusive access to both sides of the ring.
     _IRQL_requires_max_(DISPATCH_LEVEL)
-        __forceinline VOID RingBufferReset(_Inout_ PRING_BUFFER Self)
+        __forceinline VOID RingBufferP2Reset(_Inout_ PRING_BUFFER_P2 Self)
     {
         if (!Self) return;
-        Self->Head = Self->Base;
-        Self->Tail = Self->Base;
+        WriteULong64NoFence(&Self->WriteCount, 0);
+        WriteULong64NoFence(&Self->ReadCount, 0);
     }
 
-    
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
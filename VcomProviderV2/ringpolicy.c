@@ -0,0 +1,118 @@
+/*++
+
+Module Name:
+
+    ringpolicy.c
+
+Abstract:
+
+    Elastic ring sizing decisions
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "ringpolicy.h"
+
+// Bytes of a ring of Capacity that Percent of it comes to
+static
+size_t
+RingPolicyWatermark(
+    _In_  size_t              Capacity,
+    _In_  ULONG               Percent
+)
+{
+    return (Capacity * Percent) / 100;
+}
+
+size_t
+RingPolicyRoundSize(
+    _In_  size_t              RequestedSize
+)
+{
+    size_t size = MIN_DATA_BUFFER_SIZE;
+
+    if (RequestedSize >= MAX_DATA_BUFFER_SIZE) {
+        return MAX_DATA_BUFFER_SIZE;
+    }
+
+    while (size < RequestedSize) {
+        size <<= 1;
+    }
+    return size;
+}
+
+size_t
+RingPolicyGrowTarget(
+    _In_  PQUEUE_RING_POLICY  Policy,
+    _In_  size_t              Capacity,
+    _In_  size_t              Needed
+)
+{
+    size_t target;
+
+    if (Needed <= RingPolicyWatermark(Capacity, QUEUE_RING_HIGH_WATERMARK_PCT) ||
+        Capacity >= Policy->MaxCapacity) {
+        return 0;
+    }
+
+    // Grow in steps, but far enough that this write lands below the watermark
+    target = Capacity << 1;
+    while (RingPolicyWatermark(target, QUEUE_RING_HIGH_WATERMARK_PCT) < Needed &&
+           target < Policy->MaxCapacity) {
+        target <<= 1;
+    }
+    return min(target, Policy->MaxCapacity);
+}
+
+BOOLEAN
+RingPolicySampleRead(
+    _Inout_ PQUEUE_RING_POLICY Policy,
+    _In_  size_t              Capacity,
+    _In_  size_t              Occupancy
+)
+{
+    if (Capacity <= Policy->MinCapacity ||
+        Occupancy >= RingPolicyWatermark(Capacity, QUEUE_RING_LOW_WATERMARK_PCT)) {
+        Policy->LowSamples = 0;
+        return FALSE;
+    }
+
+    if (++Policy->LowSamples < QUEUE_RING_SHRINK_SAMPLES) {
+        return FALSE;
+    }
+    Policy->LowSamples = 0;
+    return TRUE;
+}
+
+size_t
+RingPolicyShrinkTarget(
+    _In_  PQUEUE_RING_POLICY  Policy,
+    _In_  size_t              Capacity
+)
+{
+    size_t target = max(Capacity >> 1, Policy->MinCapacity);
+
+    return (target < Capacity) ? target : 0;
+}
+
+BOOLEAN
+RingPolicyTryBeginResize(
+    _Inout_ PQUEUE_RING_POLICY Policy
+)
+{
+    return InterlockedCompareExchange(&Policy->Resizing, 1, 0) == 0;
+}
+
+VOID
+RingPolicyEndResize(
+    _Inout_ PQUEUE_RING_POLICY Policy
+)
+{
+    InterlockedExchange(&Policy->Resizing, 0);
+    KeSetEvent(&Policy->ResizeDone, IO_NO_INCREMENT, FALSE);
+}
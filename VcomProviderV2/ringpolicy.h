@@ -0,0 +1,105 @@
+/*++
+
+Module Name:
+
+    ringpolicy.h
+
+Abstract:
+
+    Elastic sizing of the contiguous rings: whether a write should grow a
+    ring and to what, and when a run of quiet reads should shrink it. The
+    decisions are arithmetic on a ring's capacity and occupancy and the
+    QUEUE_RING_POLICY kept for it; the queue does the reallocation
+    (QueueResizeRing) and serializes it with the Resizing flag. Letting go
+    of the flag sets ResizeDone, which an explicit resize waiting for it
+    sleeps on.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Default per-direction ring size. The rings index with a mask, so ring sizes
+// are always powers of two; requested sizes are rounded up and clamped to
+// [MIN_DATA_BUFFER_SIZE, MAX_DATA_BUFFER_SIZE].
+#define DATA_BUFFER_SIZE        1024
+#define MIN_DATA_BUFFER_SIZE    64
+#define MAX_DATA_BUFFER_SIZE    (4 * 1024 * 1024)
+
+C_ASSERT(RING_BUFFER_P2_IS_VALID_CAPACITY(DATA_BUFFER_SIZE));
+C_ASSERT(RING_BUFFER_P2_IS_VALID_CAPACITY(MIN_DATA_BUFFER_SIZE));
+C_ASSERT(RING_BUFFER_P2_IS_VALID_CAPACITY(MAX_DATA_BUFFER_SIZE));
+
+// Elastic sizing. A ring doubles when a write would take it past the high
+// watermark, and halves after QUEUE_RING_SHRINK_SAMPLES consecutive reads
+// leave it below the low watermark. It never shrinks below its configured
+// size, never grows past the port's maximum, and all rings together stay
+// within QUEUE_GLOBAL_RING_BUDGET.
+#define DEFAULT_MAX_QUEUE_SIZE          (64 * 1024)
+#define QUEUE_RING_HIGH_WATERMARK_PCT   75
+#define QUEUE_RING_LOW_WATERMARK_PCT    12
+#define QUEUE_RING_SHRINK_SAMPLES       256
+#define QUEUE_GLOBAL_RING_BUDGET        (64 * 1024 * 1024)
+
+    typedef struct _QUEUE_RING_POLICY {
+        SIZE_T          MinCapacity;    // shrink floor
+        SIZE_T          MaxCapacity;    // grow ceiling
+        volatile LONG   Resizing;       // one resize at a time
+        KEVENT          ResizeDone;     // auto-reset, set as Resizing is let go
+        ULONG           LowSamples;     // consecutive low-occupancy reads (heuristic, unlocked)
+        volatile LONG   GrowCount;
+        volatile LONG   ShrinkCount;
+        volatile LONG64 DroppedBytes;
+    } QUEUE_RING_POLICY, * PQUEUE_RING_POLICY;
+
+    // RequestedSize rounded up to a ring size
+    size_t
+        RingPolicyRoundSize(
+            _In_  size_t              RequestedSize
+        );
+
+    // The size a ring of Capacity should grow to before a write leaves
+    // Needed bytes in it: enough doublings that Needed sits at or below the
+    // high watermark, capped at MaxCapacity. 0 if it should not grow.
+    size_t
+        RingPolicyGrowTarget(
+            _In_  PQUEUE_RING_POLICY  Policy,
+            _In_  size_t              Capacity,
+            _In_  size_t              Needed
+        );
+
+    // Counts a read that left Occupancy bytes in a ring of Capacity. TRUE
+    // once QUEUE_RING_SHRINK_SAMPLES reads in a row have left it below the
+    // low watermark; the count then starts over.
+    BOOLEAN
+        RingPolicySampleRead(
+            _Inout_ PQUEUE_RING_POLICY Policy,
+            _In_  size_t              Capacity,
+            _In_  size_t              Occupancy
+        );
+
+    // Half of Capacity, but not below MinCapacity. 0 if it cannot shrink.
+    size_t
+        RingPolicyShrinkTarget(
+            _In_  PQUEUE_RING_POLICY  Policy,
+            _In_  size_t              Capacity
+        );
+
+    // Takes the Resizing flag if no other resize holds it
+    BOOLEAN
+        RingPolicyTryBeginResize(
+            _Inout_ PQUEUE_RING_POLICY Policy
+        );
+
+    // Lets go of the Resizing flag and wakes a resize waiting for it
+    VOID
+        RingPolicyEndResize(
+            _Inout_ PQUEUE_RING_POLICY Policy
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,426 @@
+/*++
+
+Module Name:
+
+    segbuffer.c
+
+Abstract:
+
+    Segmented byte queue backed by a driver-wide segment pool
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "segbuffer.h"
+
+// Freed segments go back to a lookaside list shared by every queue, so a
+// burst on one port can reuse memory released by another without a trip to
+// the pool allocator.
+static LOOKASIDE_LIST_EX    SegBufferLookaside;
+static BOOLEAN              SegBufferPoolReady = FALSE;
+static size_t               SegBufferPoolBudget = 0;
+static volatile LONG64      SegBufferPoolBytes = 0;
+
+NTSTATUS
+SegBufferPoolInitialize(
+    _In_  size_t              Budget
+)
+{
+    NTSTATUS status;
+
+    status = ExInitializeLookasideListEx(&SegBufferLookaside,
+        NULL,
+        NULL,
+        NonPagedPoolNx,
+        0,
+        sizeof(SEG_BUFFER_SEGMENT),
+        SEG_BUFFER_POOL_TAG,
+        0);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    SegBufferPoolBudget = Budget;
+    SegBufferPoolReady = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID
+SegBufferPoolUninitialize(
+    VOID
+)
+{
+    if (!SegBufferPoolReady) {
+        return;
+    }
+
+    ASSERT(SegBufferPoolBytes == 0);
+
+    ExDeleteLookasideListEx(&SegBufferLookaside);
+    SegBufferPoolReady = FALSE;
+}
+
+size_t
+SegBufferPoolGetBytesInUse(
+    VOID
+)
+{
+    return (size_t)SegBufferPoolBytes;
+}
+
+static
+PSEG_BUFFER_SEGMENT
+SegBufferAllocateSegment(
+    _Inout_ PSEG_BUFFER       Self
+)
+{
+    PSEG_BUFFER_SEGMENT segment;
+
+    if (!SegBufferPoolReady) {
+        return NULL;
+    }
+
+    if ((size_t)InterlockedExchangeAdd64(&SegBufferPoolBytes, SEG_BUFFER_SEGMENT_SIZE) +
+            SEG_BUFFER_SEGMENT_SIZE > SegBufferPoolBudget) {
+        InterlockedExchangeAdd64(&SegBufferPoolBytes, -(LONG64)SEG_BUFFER_SEGMENT_SIZE);
+        return NULL;
+    }
+
+    segment = (PSEG_BUFFER_SEGMENT)ExAllocateFromLookasideListEx(&SegBufferLookaside);
+    if (segment == NULL) {
+        InterlockedExchangeAdd64(&SegBufferPoolBytes, -(LONG64)SEG_BUFFER_SEGMENT_SIZE);
+        return NULL;
+    }
+
+    segment->Next = NULL;
+    InterlockedIncrement(&Self->Segments);
+    return segment;
+}
+
+static
+VOID
+SegBufferFreeSegment(
+    _Inout_ PSEG_BUFFER       Self,
+    _In_  PSEG_BUFFER_SEGMENT Segment
+)
+{
+    ExFreeToLookasideListEx(&SegBufferLookaside, Segment);
+    InterlockedExchangeAdd64(&SegBufferPoolBytes, -(LONG64)SEG_BUFFER_SEGMENT_SIZE);
+    InterlockedDecrement(&Self->Segments);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+SegBufferInitialize(
+    _Out_ PSEG_BUFFER         Self,
+    _In_  size_t              Limit
+)
+{
+    PSEG_BUFFER_SEGMENT segment;
+
+    RtlZeroMemory(Self, sizeof(*Self));
+    Self->Limit = Limit;
+
+    // Always keep one segment so an empty queue needs no allocation to
+    // accept its first bytes.
+    segment = SegBufferAllocateSegment(Self);
+    if (segment == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Self->Head = segment;
+    Self->Tail = segment;
+    return STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SegBufferUninitialize(
+    _Inout_ PSEG_BUFFER       Self
+)
+{
+    PSEG_BUFFER_SEGMENT segment = Self->Head;
+    PSEG_BUFFER_SEGMENT next;
+
+    while (segment != NULL) {
+        next = segment->Next;
+        SegBufferFreeSegment(Self, segment);
+        segment = next;
+    }
+
+    Self->Head = NULL;
+    Self->Tail = NULL;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SegBufferReset(
+    _Inout_ PSEG_BUFFER       Self
+)
+{
+    PSEG_BUFFER_SEGMENT segment;
+    PSEG_BUFFER_SEGMENT next;
+
+    if (Self->Head == NULL) {
+        return;
+    }
+
+    // Anything after the head, including segments reserved but never
+    // committed, goes back to the pool.
+    segment = Self->Head->Next;
+    while (segment != NULL) {
+        next = segment->Next;
+        SegBufferFreeSegment(Self, segment);
+        segment = next;
+    }
+
+    Self->Head->Next = NULL;
+    Self->Tail = Self->Head;
+    Self->HeadOffset = 0;
+    Self->TailOffset = 0;
+    WriteULong64NoFence(&Self->WriteCount, 0);
+    WriteULong64NoFence(&Self->ReadCount, 0);
+}
+
+static
+PSEG_BUFFER_SEGMENT
+SegBufferNextForWrite(
+    _Inout_ PSEG_BUFFER       Self,
+    _Inout_ PSEG_BUFFER_SEGMENT Segment
+)
+{
+    // Producer only. The link becomes visible to the consumer through the
+    // release store of the WriteCount that first covers the new segment.
+    if (Segment->Next == NULL) {
+        Segment->Next = SegBufferAllocateSegment(Self);
+    }
+    return Segment->Next;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+SegBufferReserve(
+    _Inout_ PSEG_BUFFER       Self,
+    _In_  size_t              MaxSize,
+    _Out_ PRING_BUFFER_SPANS  Spans
+)
+{
+    PSEG_BUFFER_SEGMENT segment;
+    size_t  offset;
+    size_t  space;
+    size_t  length;
+
+    ASSERT(Spans);
+
+    RtlZeroMemory(Spans, sizeof(*Spans));
+
+    SegBufferGetAvailableSpace(Self, &space);
+    length = (space < MaxSize) ? space : MaxSize;
+    if (length == 0) {
+        return 0;
+    }
+
+    segment = Self->Tail;
+    offset = Self->TailOffset;
+    if (offset == SEG_BUFFER_SEGMENT_DATA) {
+        segment = SegBufferNextForWrite(Self, segment);
+        if (segment == NULL) {
+            return 0;
+        }
+        offset = 0;
+    }
+
+    Spans->Span[0].Buffer = segment->Data + offset;
+    Spans->Span[0].Length = min(length, SEG_BUFFER_SEGMENT_DATA - offset);
+    Spans->Count = 1;
+    length -= Spans->Span[0].Length;
+
+    if (length != 0) {
+        segment = SegBufferNextForWrite(Self, segment);
+        if (segment != NULL) {
+            Spans->Span[1].Buffer = segment->Data;
+            Spans->Span[1].Length = min(length, SEG_BUFFER_SEGMENT_DATA);
+            Spans->Count = 2;
+        }
+    }
+
+    Spans->Total = Spans->Span[0].Length + Spans->Span[1].Length;
+    return Spans->Total;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SegBufferCommit(
+    _Inout_ PSEG_BUFFER       Self,
+    _In_  size_t              Count
+)
+{
+    PSEG_BUFFER_SEGMENT segment = Self->Tail;
+    size_t  offset = Self->TailOffset;
+    size_t  remaining = Count;
+    size_t  chunk;
+
+    while (remaining != 0) {
+        if (offset == SEG_BUFFER_SEGMENT_DATA) {
+            segment = segment->Next;
+            offset = 0;
+            ASSERT(segment != NULL);
+        }
+        chunk = min(remaining, SEG_BUFFER_SEGMENT_DATA - offset);
+        offset += chunk;
+        remaining -= chunk;
+    }
+
+    Self->Tail = segment;
+    Self->TailOffset = offset;
+
+    // Publish the bytes and any segments linked to hold them
+    WriteULong64Release(&Self->WriteCount, ReadULong64NoFence(&Self->WriteCount) + Count);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+SegBufferPeek(
+    _In_  PSEG_BUFFER         Self,
+    _In_  size_t              MaxSize,
+    _Out_ PRING_BUFFER_SPANS  Spans
+)
+{
+    PSEG_BUFFER_SEGMENT segment;
+    ULONG64 readCount;
+    size_t  offset;
+    size_t  length;
+
+    ASSERT(Spans);
+
+    RtlZeroMemory(Spans, sizeof(*Spans));
+
+    readCount = ReadULong64NoFence(&Self->ReadCount);
+    length = (size_t)(ReadULong64Acquire(&Self->WriteCount) - readCount);
+    if (length > MaxSize) {
+        length = MaxSize;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    segment = Self->Head;
+    offset = Self->HeadOffset;
+    if (offset == SEG_BUFFER_SEGMENT_DATA) {
+        // Data exists past this segment, so the producer has linked the next
+        segment = segment->Next;
+        offset = 0;
+    }
+
+    Spans->Span[0].Buffer = segment->Data + offset;
+    Spans->Span[0].Length = min(length, SEG_BUFFER_SEGMENT_DATA - offset);
+    Spans->Count = 1;
+    length -= Spans->Span[0].Length;
+
+    if (length != 0) {
+        segment = segment->Next;
+        Spans->Span[1].Buffer = segment->Data;
+        Spans->Span[1].Length = min(length, SEG_BUFFER_SEGMENT_DATA);
+        Spans->Count = 2;
+    }
+
+    Spans->Total = Spans->Span[0].Length + Spans->Span[1].Length;
+    return Spans->Total;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SegBufferConsume(
+    _Inout_ PSEG_BUFFER       Self,
+    _In_  size_t              Count
+)
+{
+    PSEG_BUFFER_SEGMENT segment = Self->Head;
+    PSEG_BUFFER_SEGMENT next;
+    size_t  offset = Self->HeadOffset;
+    size_t  remaining = Count;
+    size_t  chunk;
+
+    ASSERT(ReadULong64NoFence(&Self->ReadCount) + Count <= ReadULong64NoFence(&Self->WriteCount));
+
+    while (remaining != 0) {
+        if (offset == SEG_BUFFER_SEGMENT_DATA) {
+            // Fully read, and the producer is already past it
+            next = segment->Next;
+            SegBufferFreeSegment(Self, segment);
+            segment = next;
+            offset = 0;
+        }
+        chunk = min(remaining, SEG_BUFFER_SEGMENT_DATA - offset);
+        offset += chunk;
+        remaining -= chunk;
+    }
+
+    Self->Head = segment;
+    Self->HeadOffset = offset;
+
+    WriteULong64Release(&Self->ReadCount, ReadULong64NoFence(&Self->ReadCount) + Count);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+SegBufferWrite(
+    _Inout_ PSEG_BUFFER       Self,
+    _In_reads_bytes_(DataSize)
+    const BYTE* Data,
+    _In_  size_t              DataSize,
+    _Out_ size_t*             BytesWritten
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t  written = 0;
+    ULONG   i;
+
+    while (written < DataSize) {
+        if (SegBufferReserve(Self, DataSize - written, &spans) == 0) {
+            break;
+        }
+        for (i = 0; i < spans.Count; i++) {
+            RtlCopyMemory(spans.Span[i].Buffer, Data + written, spans.Span[i].Length);
+            written += spans.Span[i].Length;
+        }
+        SegBufferCommit(Self, spans.Total);
+    }
+
+    *BytesWritten = written;
+    return (written == DataSize) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+SegBufferRead(
+    _Inout_ PSEG_BUFFER       Self,
+    _Out_writes_bytes_to_(DataSize, *BytesRead)
+    BYTE* Data,
+    _In_  size_t              DataSize,
+    _Out_ size_t*             BytesRead
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t  read = 0;
+    ULONG   i;
+
+    while (read < DataSize) {
+        if (SegBufferPeek(Self, DataSize - read, &spans) == 0) {
+            break;
+        }
+        for (i = 0; i < spans.Count; i++) {
+            RtlCopyMemory(Data + read, spans.Span[i].Buffer, spans.Span[i].Length);
+            read += spans.Span[i].Length;
+        }
+        SegBufferConsume(Self, spans.Total);
+    }
+
+    *BytesRead = read;
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,214 @@
+/*++
+
+Module Name:
+
+    segbuffer.h
+
+Abstract:
+
+    Segmented byte queue. Data is kept in a singly linked chain of fixed-size
+    segments drawn from a driver-wide pool, so a queue only holds as much
+    memory as it has data buffered (plus one segment), instead of a
+    worst-case contiguous allocation.
+
+    Concurrency follows RING_BUFFER_P2: one producer and one consumer, each
+    serialized by the caller. The producer owns Tail/TailOffset/WriteCount,
+    the consumer owns Head/HeadOffset/ReadCount, and each side publishes its
+    counter with release semantics. A segment is linked before the
+    WriteCount that covers it is published, and is returned to the pool only
+    once the consumer has moved past it.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SEG_BUFFER_SEGMENT_SIZE 4096
+#define SEG_BUFFER_POOL_TAG     'gSoV'
+
+    typedef struct _SEG_BUFFER_SEGMENT
+    {
+        struct _SEG_BUFFER_SEGMENT* Next;
+        BYTE Data[SEG_BUFFER_SEGMENT_SIZE - sizeof(PVOID)];
+    } SEG_BUFFER_SEGMENT, * PSEG_BUFFER_SEGMENT;
+
+#define SEG_BUFFER_SEGMENT_DATA  RTL_FIELD_SIZE(SEG_BUFFER_SEGMENT, Data)
+
+    C_ASSERT(sizeof(SEG_BUFFER_SEGMENT) == SEG_BUFFER_SEGMENT_SIZE);
+
+    typedef struct _SEG_BUFFER
+    {
+        // Most bytes the queue will hold; writes beyond it are truncated
+        size_t Limit;
+
+        // Segments currently owned by this queue
+        volatile LONG Segments;
+
+        UCHAR Reserved0[RING_BUFFER_CACHE_LINE - sizeof(size_t) - sizeof(LONG)];
+
+        // Producer side: next byte is written at Tail->Data[TailOffset]
+        PSEG_BUFFER_SEGMENT Tail;
+        size_t TailOffset;
+        volatile ULONG64 WriteCount;
+
+        UCHAR Reserved1[RING_BUFFER_CACHE_LINE - 2 * sizeof(PVOID) - sizeof(ULONG64)];
+
+        // Consumer side: next byte is read from Head->Data[HeadOffset]
+        PSEG_BUFFER_SEGMENT Head;
+        size_t HeadOffset;
+        volatile ULONG64 ReadCount;
+
+    } SEG_BUFFER, * PSEG_BUFFER;
+
+    //
+    // Driver-wide segment pool. Initialize once in DriverEntry; every queue
+    // draws from and returns to it. Allocations past Budget bytes fail, which
+    // the queues see as a full buffer.
+    //
+
+    NTSTATUS
+        SegBufferPoolInitialize(
+            _In_  size_t              Budget
+        );
+
+    VOID
+        SegBufferPoolUninitialize(
+            VOID
+        );
+
+    // Bytes of segment storage currently handed out across all queues
+    size_t
+        SegBufferPoolGetBytesInUse(
+            VOID
+        );
+
+    //
+    // Queue lifetime
+    //
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        NTSTATUS
+        SegBufferInitialize(
+            _Out_ PSEG_BUFFER         Self,
+            _In_  size_t              Limit
+        );
+
+    // Returns every segment to the pool. Requires exclusive access.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SegBufferUninitialize(
+            _Inout_ PSEG_BUFFER       Self
+        );
+
+    // Discards buffered data, keeps one segment and restarts both running
+    // totals at zero. Requires exclusive access.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SegBufferReset(
+            _Inout_ PSEG_BUFFER       Self
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        __forceinline VOID SegBufferSetLimit(
+            _Inout_ PSEG_BUFFER       Self,
+            _In_  size_t              Limit
+        )
+    {
+        Self->Limit = Limit;
+    }
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        __forceinline size_t SegBufferGetAllocatedBytes(
+            _In_  PSEG_BUFFER         Self
+        )
+    {
+        return (size_t)Self->Segments * SEG_BUFFER_SEGMENT_SIZE;
+    }
+
+    //
+    // Same contract as the RING_BUFFER_P2 equivalents.
+    //
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        __forceinline VOID SegBufferGetAvailableData(
+            _In_  PSEG_BUFFER         Self,
+            _Out_ size_t*             AvailableData
+        )
+    {
+        ULONG64 readCount = ReadULong64Acquire(&Self->ReadCount);
+        *AvailableData = (size_t)(ReadULong64Acquire(&Self->WriteCount) - readCount);
+    }
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        __forceinline VOID SegBufferGetAvailableSpace(
+            _In_  PSEG_BUFFER         Self,
+            _Out_ size_t*             AvailableSpace
+        )
+    {
+        size_t occupancy;
+
+        SegBufferGetAvailableData(Self, &occupancy);
+        *AvailableSpace = (occupancy < Self->Limit) ? Self->Limit - occupancy : 0;
+    }
+
+    // Returns STATUS_SUCCESS if fully written, STATUS_BUFFER_OVERFLOW if
+    // truncated by the limit or by the pool running dry.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        NTSTATUS
+        SegBufferWrite(
+            _Inout_ PSEG_BUFFER       Self,
+            _In_reads_bytes_(DataSize)
+            const BYTE* Data,
+            _In_  size_t              DataSize,
+            _Out_ size_t*             BytesWritten
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        NTSTATUS
+        SegBufferRead(
+            _Inout_ PSEG_BUFFER       Self,
+            _Out_writes_bytes_to_(DataSize, *BytesRead)
+            BYTE* Data,
+            _In_  size_t              DataSize,
+            _Out_ size_t*             BytesRead
+        );
+
+    // Spans cover at most two segments per call; callers that need more loop.
+    // Reserve may link a fresh segment onto the chain, which stays there for
+    // later writes if it is not committed.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        SegBufferReserve(
+            _Inout_ PSEG_BUFFER       Self,
+            _In_  size_t              MaxSize,
+            _Out_ PRING_BUFFER_SPANS  Spans
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SegBufferCommit(
+            _Inout_ PSEG_BUFFER       Self,
+            _In_  size_t              Count
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        SegBufferPeek(
+            _In_  PSEG_BUFFER         Self,
+            _In_  size_t              MaxSize,
+            _Out_ PRING_BUFFER_SPANS  Spans
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SegBufferConsume(
+            _Inout_ PSEG_BUFFER       Self,
+            _In_  size_t              Count
+        );
+
+#ifdef __cplusplus
+}
+#endif
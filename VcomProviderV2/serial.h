@@ -43,13 +43,39 @@ Abstract:
 #define SERIAL_SPACE_PARITY ((UCHAR)0x38)
 #define SERIAL_PARITY_MASK  ((UCHAR)0x38)
 
+//
+// These masks define access to the modem status register.
+//
+#define SERIAL_MSR_DCTS     0x01
+#define SERIAL_MSR_DDSR     0x02
+#define SERIAL_MSR_TERI     0x04
+#define SERIAL_MSR_DDCD     0x08
+#define SERIAL_MSR_CTS      0x10
+#define SERIAL_MSR_DSR      0x20
+#define SERIAL_MSR_RI       0x40
+#define SERIAL_MSR_DCD      0x80
+
+//
+// These masks define access to the modem control register.
+//
+#define SERIAL_MCR_DTR      0x01
+#define SERIAL_MCR_RTS      0x02
+
+//
+// Default xon/xoff characters.
+//
+#define SERIAL_DEF_XON      0x11
+#define SERIAL_DEF_XOFF     0x13
+
 #ifdef _KERNEL_MODE
 
 #include <ntddser.h>
 
 #else
 
+#ifndef VCOM_HOST_BUILD
 #include <winioctl.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -112,6 +138,73 @@ typedef struct _SERIAL_TIMEOUTS {
     ULONG WriteTotalTimeoutConstant;
 } SERIAL_TIMEOUTS, * PSERIAL_TIMEOUTS;
 
+typedef struct _SERIAL_QUEUE_SIZE {
+    ULONG InSize;
+    ULONG OutSize;
+} SERIAL_QUEUE_SIZE, * PSERIAL_QUEUE_SIZE;
+
+#define SERIAL_EV_RXCHAR           0x0001
+#define SERIAL_EV_RXFLAG           0x0002
+#define SERIAL_EV_TXEMPTY          0x0004
+#define SERIAL_EV_CTS              0x0008
+#define SERIAL_EV_DSR              0x0010
+#define SERIAL_EV_RLSD             0x0020
+#define SERIAL_EV_BREAK            0x0040
+#define SERIAL_EV_ERR              0x0080
+#define SERIAL_EV_RING             0x0100
+
+#define SERIAL_ERROR_BREAK         0x00000001
+#define SERIAL_ERROR_FRAMING       0x00000002
+#define SERIAL_ERROR_OVERRUN       0x00000004
+#define SERIAL_ERROR_QUEUEOVERRUN  0x00000008
+#define SERIAL_ERROR_PARITY        0x00000010
+
+typedef struct _SERIAL_CHARS {
+    UCHAR EofChar;
+    UCHAR ErrorChar;
+    UCHAR BreakChar;
+    UCHAR EventChar;
+    UCHAR XonChar;
+    UCHAR XoffChar;
+} SERIAL_CHARS, * PSERIAL_CHARS;
+
+typedef struct _SERIAL_HANDFLOW {
+    ULONG ControlHandShake;
+    ULONG FlowReplace;
+    LONG  XonLimit;
+    LONG  XoffLimit;
+} SERIAL_HANDFLOW, * PSERIAL_HANDFLOW;
+
+#define SERIAL_DTR_MASK           ((ULONG)0x03)
+#define SERIAL_DTR_CONTROL        ((ULONG)0x01)
+#define SERIAL_DTR_HANDSHAKE      ((ULONG)0x02)
+#define SERIAL_CTS_HANDSHAKE      ((ULONG)0x08)
+#define SERIAL_DSR_HANDSHAKE      ((ULONG)0x10)
+#define SERIAL_DCD_HANDSHAKE      ((ULONG)0x20)
+#define SERIAL_OUT_HANDSHAKEMASK  ((ULONG)0x38)
+#define SERIAL_DSR_SENSITIVITY    ((ULONG)0x40)
+#define SERIAL_ERROR_ABORT        ((ULONG)0x80000000)
+#define SERIAL_CONTROL_INVALID    ((ULONG)0x7fffff84)
+#define SERIAL_AUTO_TRANSMIT      ((ULONG)0x01)
+#define SERIAL_AUTO_RECEIVE       ((ULONG)0x02)
+#define SERIAL_ERROR_CHAR         ((ULONG)0x04)
+#define SERIAL_NULL_STRIPPING     ((ULONG)0x08)
+#define SERIAL_BREAK_CHAR         ((ULONG)0x10)
+#define SERIAL_RTS_MASK           ((ULONG)0xc0)
+#define SERIAL_RTS_CONTROL        ((ULONG)0x40)
+#define SERIAL_RTS_HANDSHAKE      ((ULONG)0x80)
+#define SERIAL_TRANSMIT_TOGGLE    ((ULONG)0xc0)
+#define SERIAL_XOFF_CONTINUE      ((ULONG)0x80000000)
+#define SERIAL_FLOW_INVALID       ((ULONG)0x7fffff20)
+
+#define SERIAL_TX_WAITING_FOR_CTS      ((ULONG)0x00000001)
+#define SERIAL_TX_WAITING_FOR_DSR      ((ULONG)0x00000002)
+#define SERIAL_TX_WAITING_FOR_DCD      ((ULONG)0x00000004)
+#define SERIAL_TX_WAITING_FOR_XON      ((ULONG)0x00000008)
+#define SERIAL_TX_WAITING_XOFF_SENT    ((ULONG)0x00000010)
+#define SERIAL_TX_WAITING_ON_BREAK     ((ULONG)0x00000020)
+#define SERIAL_RX_WAITING_FOR_DSR      ((ULONG)0x00000040)
+
 #define STOP_BIT_1      0
 #define STOP_BITS_1_5   1
 #define STOP_BITS_2     2
@@ -0,0 +1,196 @@
+/*++
+
+Module Name:
+
+    sharedring.c
+
+Abstract:
+
+    Driver side of the rings shared with the control service
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "ringbuffer.h"
+#include "sharedring.h"
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SharedRingInitialize(
+    _Out_ PSHARED_RING        Self,
+    _Inout_ PVCOM_SHARED_RING_CONTROL Control,
+    _In_  BYTE*               Base,
+    _In_  size_t              Capacity,
+    _In_  BOOLEAN             DriverProduces,
+    _In_opt_ PKEVENT          PeerEvent
+)
+{
+    ASSERT(RING_BUFFER_P2_IS_VALID_CAPACITY(Capacity));
+
+    RtlZeroMemory(Control, sizeof(*Control));
+
+    Self->Control = Control;
+    Self->Base = Base;
+    Self->Capacity = Capacity;
+    Self->DriverProduces = DriverProduces;
+    Self->Index = 0;
+    Self->PeerEvent = PeerEvent;
+}
+
+static
+size_t
+SharedRingOccupancy(
+    _In_  PSHARED_RING        Self
+)
+{
+    ULONG64 peer;
+    ULONG64 occupancy;
+
+    // The peer's index is read once; a value that is behind us or more than
+    // a ring ahead is bogus and leaves the ring looking full to the driver
+    // producer and empty to the driver consumer.
+    if (Self->DriverProduces) {
+        peer = ReadULong64Acquire(&Self->Control->ConsumerIndex);
+        occupancy = Self->Index - peer;
+        return (occupancy > Self->Capacity) ? Self->Capacity : (size_t)occupancy;
+    }
+
+    peer = ReadULong64Acquire(&Self->Control->ProducerIndex);
+    occupancy = peer - Self->Index;
+    return (occupancy > Self->Capacity) ? 0 : (size_t)occupancy;
+}
+
+static
+size_t
+SharedRingFillSpans(
+    _In_  PSHARED_RING        Self,
+    _In_  size_t              Length,
+    _Out_ PRING_BUFFER_SPANS  Spans
+)
+{
+    size_t offset;
+    size_t firstChunk;
+
+    RtlZeroMemory(Spans, sizeof(*Spans));
+
+    if (Length == 0) {
+        return 0;
+    }
+
+    offset = (size_t)Self->Index & (Self->Capacity - 1);
+    firstChunk = Self->Capacity - offset;
+
+    Spans->Span[0].Buffer = Self->Base + offset;
+    if (firstChunk >= Length) {
+        Spans->Span[0].Length = Length;
+        Spans->Count = 1;
+    }
+    else {
+        Spans->Span[0].Length = firstChunk;
+        Spans->Span[1].Buffer = Self->Base;
+        Spans->Span[1].Length = Length - firstChunk;
+        Spans->Count = 2;
+    }
+
+    Spans->Total = Length;
+    return Length;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+SharedRingGetAvailableData(
+    _In_  PSHARED_RING        Self
+)
+{
+    return SharedRingOccupancy(Self);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+SharedRingReserve(
+    _In_  PSHARED_RING        Self,
+    _In_  size_t              MaxSize,
+    _Out_ PRING_BUFFER_SPANS  Spans
+)
+{
+    size_t space;
+
+    ASSERT(Self->DriverProduces);
+
+    space = Self->Capacity - SharedRingOccupancy(Self);
+    return SharedRingFillSpans(Self, (space < MaxSize) ? space : MaxSize, Spans);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SharedRingCommit(
+    _Inout_ PSHARED_RING      Self,
+    _In_  size_t              Count
+)
+{
+    ASSERT(Self->DriverProduces);
+
+    Self->Index += Count;
+    WriteULong64Release(&Self->Control->ProducerIndex, Self->Index);
+
+    // Order the index store before the flag load (see public.h)
+    KeMemoryBarrier();
+    if (Self->PeerEvent && ReadNoFence(&Self->Control->ConsumerWaiting)) {
+        KeSetEvent(Self->PeerEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+SharedRingPeek(
+    _In_  PSHARED_RING        Self,
+    _In_  size_t              MaxSize,
+    _Out_ PRING_BUFFER_SPANS  Spans
+)
+{
+    size_t available;
+
+    ASSERT(!Self->DriverProduces);
+
+    available = SharedRingOccupancy(Self);
+    return SharedRingFillSpans(Self, (available < MaxSize) ? available : MaxSize, Spans);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SharedRingConsume(
+    _Inout_ PSHARED_RING      Self,
+    _In_  size_t              Count
+)
+{
+    ASSERT(!Self->DriverProduces);
+
+    Self->Index += Count;
+    WriteULong64Release(&Self->Control->ConsumerIndex, Self->Index);
+
+    KeMemoryBarrier();
+    if (Self->PeerEvent && ReadNoFence(&Self->Control->ProducerWaiting)) {
+        KeSetEvent(Self->PeerEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SharedRingDiscard(
+    _Inout_ PSHARED_RING      Self
+)
+{
+    size_t available;
+
+    ASSERT(!Self->DriverProduces);
+
+    available = SharedRingOccupancy(Self);
+    if (available) {
+        SharedRingConsume(Self, available);
+    }
+}
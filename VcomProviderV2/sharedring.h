@@ -0,0 +1,126 @@
+/*++
+
+Module Name:
+
+    sharedring.h
+
+Abstract:
+
+    Driver side of a VCOM_SHARED_RING_CONTROL ring (see public.h). The
+    control block and data area live in memory that is also mapped into the
+    control service, so nothing read from them is trusted: the driver keeps
+    its own index, Base and Capacity privately, and an out-of-range peer
+    index is treated as an empty (or full) ring rather than followed.
+
+    The span contract matches RING_BUFFER_P2; the caller serializes the
+    driver's side of each ring.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _SHARED_RING
+    {
+        // Control block inside the shared mapping; the peer can write it
+        PVCOM_SHARED_RING_CONTROL Control;
+
+        // Data area (kernel address) and its power-of-two size
+        BYTE* Base;
+        size_t Capacity;
+
+        // TRUE if the driver is this ring's producer, FALSE if its consumer
+        BOOLEAN DriverProduces;
+
+        // The driver's own index; the copy in Control is output only
+        ULONG64 Index;
+
+        // Signaled when the peer has flagged itself as waiting on us
+        PKEVENT PeerEvent;
+
+    } SHARED_RING, * PSHARED_RING;
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SharedRingInitialize(
+            _Out_ PSHARED_RING        Self,
+            _Inout_ PVCOM_SHARED_RING_CONTROL Control,
+            _In_  BYTE*               Base,
+            _In_  size_t              Capacity,
+            _In_  BOOLEAN             DriverProduces,
+            _In_opt_ PKEVENT          PeerEvent
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        SharedRingGetAvailableData(
+            _In_  PSHARED_RING        Self
+        );
+
+    // Driver as producer
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        SharedRingReserve(
+            _In_  PSHARED_RING        Self,
+            _In_  size_t              MaxSize,
+            _Out_ PRING_BUFFER_SPANS  Spans
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SharedRingCommit(
+            _Inout_ PSHARED_RING      Self,
+            _In_  size_t              Count
+        );
+
+    // Driver as consumer
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        SharedRingPeek(
+            _In_  PSHARED_RING        Self,
+            _In_  size_t              MaxSize,
+            _Out_ PRING_BUFFER_SPANS  Spans
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SharedRingConsume(
+            _Inout_ PSHARED_RING      Self,
+            _In_  size_t              Count
+        );
+
+    // Consumer only: drops everything the producer has published so far
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        SharedRingDiscard(
+            _Inout_ PSHARED_RING      Self
+        );
+
+    // Consumer only: tells the producer whether a doorbell is wanted on the
+    // next publish. Full barrier, so a re-check of the ring after setting it
+    // cannot miss data published before the producer saw the flag.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        __forceinline VOID SharedRingSetConsumerWaiting(
+            _Inout_ PSHARED_RING      Self,
+            _In_  BOOLEAN             Waiting
+        )
+    {
+        InterlockedExchange(&Self->Control->ConsumerWaiting, Waiting ? 1 : 0);
+    }
+
+    // Producer only: the same for a producer blocked on a full ring
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        __forceinline VOID SharedRingSetProducerWaiting(
+            _Inout_ PSHARED_RING      Self,
+            _In_  BOOLEAN             Waiting
+        )
+    {
+        InterlockedExchange(&Self->Control->ProducerWaiting, Waiting ? 1 : 0);
+    }
+
+#ifdef __cplusplus
+}
+#endif
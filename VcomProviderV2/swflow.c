@@ -0,0 +1,162 @@
+/*++
+
+Module Name:
+
+    swflow.c
+
+Abstract:
+
+    XON/XOFF software flow control
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "charscan.h"
+#include "swflow.h"
+
+static
+VOID
+SwFlowQueueSend(
+    _Inout_ PSW_FLOW          Self,
+    _In_  UCHAR               Char
+)
+{
+    Self->SendChar = Char;
+    Self->SendPending = TRUE;
+}
+
+BOOLEAN
+SwFlowIsValid(
+    _In_  const SERIAL_HANDFLOW* HandFlow,
+    _In_  const SERIAL_CHARS*    Chars
+)
+{
+    if ((HandFlow->ControlHandShake & SERIAL_CONTROL_INVALID) ||
+        (HandFlow->FlowReplace & SERIAL_FLOW_INVALID) ||
+        (HandFlow->ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_MASK ||
+        HandFlow->XonLimit < 0 || HandFlow->XoffLimit < 0) {
+        return FALSE;
+    }
+
+    // Either character would stand for both
+    if ((HandFlow->FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE)) &&
+        Chars->XonChar == Chars->XoffChar) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+VOID
+SwFlowConfigure(
+    _Inout_ PSW_FLOW          Self,
+    _In_  const SERIAL_HANDFLOW* HandFlow,
+    _In_  const SERIAL_CHARS*    Chars
+)
+{
+    Self->XonChar = Chars->XonChar;
+    Self->XoffChar = Chars->XoffChar;
+    Self->OutX = (HandFlow->FlowReplace & SERIAL_AUTO_TRANSMIT) != 0;
+    Self->InX = (HandFlow->FlowReplace & SERIAL_AUTO_RECEIVE) != 0;
+    Self->XoffContinue = (HandFlow->FlowReplace & SERIAL_XOFF_CONTINUE) != 0;
+    Self->XonLimit = (ULONG)HandFlow->XonLimit;
+    Self->XoffLimit = (ULONG)HandFlow->XoffLimit;
+
+    if (!Self->OutX) {
+        Self->XoffReceived = FALSE;
+    }
+    if (!Self->InX && Self->XoffSent) {
+        Self->XoffSent = FALSE;
+        SwFlowQueueSend(Self, Self->XonChar);
+    }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+size_t
+SwFlowReceive(
+    _Inout_ PSW_FLOW          Self,
+    _Inout_updates_(Length) PUCHAR Buffer,
+    _In_  size_t              Length
+)
+{
+    size_t in;
+    size_t out;
+    size_t run;
+
+    if (!Self->OutX) {
+        return Length;
+    }
+
+    // Nothing moves until the first control character
+    in = CharScanFind2(Buffer, Length, Self->XonChar, Self->XoffChar);
+    out = in;
+
+    while (in < Length) {
+        Self->XoffReceived = (Buffer[in] == Self->XoffChar);
+        in++;
+
+        run = CharScanFind2(Buffer + in, Length - in, Self->XonChar, Self->XoffChar);
+        RtlMoveMemory(Buffer + out, Buffer + in, run);
+        in += run;
+        out += run;
+    }
+    return out;
+}
+
+BOOLEAN
+SwFlowCheckLimits(
+    _Inout_ PSW_FLOW          Self,
+    _In_  size_t              Buffered,
+    _In_  size_t              Free
+)
+{
+    if (!Self->InX) {
+        return FALSE;
+    }
+
+    if (!Self->XoffSent && Free <= Self->XoffLimit) {
+        Self->XoffSent = TRUE;
+        SwFlowQueueSend(Self, Self->XoffChar);
+        return TRUE;
+    }
+    if (Self->XoffSent && Buffered <= Self->XonLimit) {
+        Self->XoffSent = FALSE;
+        SwFlowQueueSend(Self, Self->XonChar);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+BOOLEAN
+SwFlowTakeSend(
+    _Inout_ PSW_FLOW          Self,
+    _Out_ PUCHAR              Char
+)
+{
+    *Char = Self->SendChar;
+    if (!Self->SendPending) {
+        return FALSE;
+    }
+    Self->SendPending = FALSE;
+    return TRUE;
+}
+
+ULONG
+SwFlowHoldReasons(
+    _In_  const SW_FLOW*      Self
+)
+{
+    ULONG reasons = 0;
+
+    if (Self->XoffReceived) {
+        reasons |= SERIAL_TX_WAITING_FOR_XON;
+    }
+    if (Self->XoffSent && !Self->XoffContinue) {
+        reasons |= SERIAL_TX_WAITING_XOFF_SENT;
+    }
+    return reasons;
+}
@@ -0,0 +1,107 @@
+/*++
+
+Module Name:
+
+    swflow.h
+
+Abstract:
+
+    XON/XOFF software flow control, as SERIAL_HANDFLOW and SERIAL_CHARS
+    configure it:
+
+    - SERIAL_AUTO_TRANSMIT: XOFF in incoming data holds transmission until
+      XON. Both characters are taken out of the data.
+    - SERIAL_AUTO_RECEIVE: XOFF is sent once XoffLimit or fewer bytes of the
+      receive buffer are free, and XON once XonLimit or fewer are buffered.
+      Unless SERIAL_XOFF_CONTINUE is set, transmission holds between the two.
+
+    Characters to send are handed out one at a time, ahead of queued data,
+    as a UART sends them. A newer one replaces one not yet taken, so the far
+    end always ends up with the latest state.
+
+    The state machine takes no locks and keeps all its state in the SW_FLOW
+    passed in, so it runs the same in a host build. The caller serializes
+    all calls on one SW_FLOW.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _SW_FLOW
+    {
+        // From SERIAL_HANDFLOW and SERIAL_CHARS
+        UCHAR   XonChar;
+        UCHAR   XoffChar;
+        BOOLEAN OutX;            // SERIAL_AUTO_TRANSMIT
+        BOOLEAN InX;             // SERIAL_AUTO_RECEIVE
+        BOOLEAN XoffContinue;    // SERIAL_XOFF_CONTINUE
+        ULONG   XonLimit;
+        ULONG   XoffLimit;
+
+        // XOFF received (or IOCTL_SERIAL_SET_XOFF): transmission holds
+        BOOLEAN XoffReceived;
+
+        // XOFF sent: XON is owed once the receive buffer drains
+        BOOLEAN XoffSent;
+
+        // SendChar waits to be taken by SwFlowTakeSend
+        BOOLEAN SendPending;
+        UCHAR   SendChar;
+
+    } SW_FLOW, * PSW_FLOW;
+
+    // Checks a SERIAL_HANDFLOW and SERIAL_CHARS pair the way serial.sys does
+    BOOLEAN
+        SwFlowIsValid(
+            _In_  const SERIAL_HANDFLOW* HandFlow,
+            _In_  const SERIAL_CHARS*    Chars
+        );
+
+    // Applies new settings, keeping the state. Turning AUTO_TRANSMIT off
+    // releases a hold; turning AUTO_RECEIVE off sends the XON still owed.
+    VOID
+        SwFlowConfigure(
+            _Inout_ PSW_FLOW          Self,
+            _In_  const SERIAL_HANDFLOW* HandFlow,
+            _In_  const SERIAL_CHARS*    Chars
+        );
+
+    // With AUTO_TRANSMIT, acts on the XON and XOFF characters in Buffer and
+    // moves the rest of the bytes down over them. Returns the bytes left.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        size_t
+        SwFlowReceive(
+            _Inout_ PSW_FLOW          Self,
+            _Inout_updates_(Length) PUCHAR Buffer,
+            _In_  size_t              Length
+        );
+
+    // With AUTO_RECEIVE, sends XOFF or XON for a receive buffer that holds
+    // Buffered bytes and has Free more room. TRUE if one was queued.
+    BOOLEAN
+        SwFlowCheckLimits(
+            _Inout_ PSW_FLOW          Self,
+            _In_  size_t              Buffered,
+            _In_  size_t              Free
+        );
+
+    // Takes the character waiting to be sent, if any
+    BOOLEAN
+        SwFlowTakeSend(
+            _Inout_ PSW_FLOW          Self,
+            _Out_ PUCHAR              Char
+        );
+
+    // Why transmission is held, as SERIAL_STATUS.HoldReasons; 0 if it is not
+    ULONG
+        SwFlowHoldReasons(
+            _In_  const SW_FLOW*      Self
+        );
+
+#ifdef __cplusplus
+}
+#endif
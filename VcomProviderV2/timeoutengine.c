@@ -0,0 +1,200 @@
+/*++
+
+Module Name:
+
+    timeoutengine.c
+
+Abstract:
+
+    Driver-wide timeout engine
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "common.h"
+
+// Expired entries handed out per pass of the engine's DPC
+#define TIMEOUT_ENGINE_BATCH    32
+
+static KSPIN_LOCK           TimeoutEngineLock;
+static TIMER_WHEEL          TimeoutEngineWheel;
+static KTIMER               TimeoutEngineTimer;
+static KDPC                 TimeoutEngineDpc;
+static BOOLEAN              TimeoutEngineRunning = FALSE;
+static BOOLEAN              TimeoutEngineReady = FALSE;
+
+static KDEFERRED_ROUTINE TimeoutEngineDpcRoutine;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG64
+TimeoutEngineNow(
+    VOID
+)
+{
+    // Interrupt time is in 100ns units and keeps counting across sleep
+    return KeQueryInterruptTime() / (TIMER_WHEEL_TICK_MS * 10000ULL);
+}
+
+static
+VOID
+TimeoutEngineStartTimer(
+    VOID
+)
+{
+    LARGE_INTEGER dueTime;
+
+    // Caller holds TimeoutEngineLock
+    if (TimeoutEngineRunning) {
+        return;
+    }
+
+    dueTime.QuadPart = -(LONGLONG)TIMER_WHEEL_TICK_MS * 10000;
+    KeSetTimerEx(&TimeoutEngineTimer, dueTime, TIMER_WHEEL_TICK_MS, &TimeoutEngineDpc);
+    TimeoutEngineRunning = TRUE;
+}
+
+static
+VOID
+TimeoutEngineDpcRoutine(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+)
+{
+    PTIMER_WHEEL_ENTRY expired[TIMEOUT_ENGINE_BATCH];
+    ULONG64 now = TimeoutEngineNow();
+    ULONG count;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    do {
+        KeAcquireSpinLockAtDpcLevel(&TimeoutEngineLock);
+
+        count = TimerWheelAdvance(&TimeoutEngineWheel, now, expired, TIMEOUT_ENGINE_BATCH);
+        for (i = 0; i < count; i++) {
+            // TimeoutEntryShutdown waits for this to drop back to zero
+            InterlockedExchange(&expired[i]->Firing, 1);
+        }
+
+        // Idle wheel: stop ticking until something is armed again
+        if (count == 0 && TimeoutEngineWheel.Count == 0 && TimeoutEngineRunning) {
+            KeCancelTimer(&TimeoutEngineTimer);
+            TimeoutEngineRunning = FALSE;
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&TimeoutEngineLock);
+
+        for (i = 0; i < count; i++) {
+            expired[i]->Callback(expired[i]);
+            InterlockedExchange(&expired[i]->Firing, 0);
+        }
+    } while (count == TIMEOUT_ENGINE_BATCH);
+}
+
+NTSTATUS
+TimeoutEngineInitialize(
+    VOID
+)
+{
+    KeInitializeSpinLock(&TimeoutEngineLock);
+    TimerWheelInitialize(&TimeoutEngineWheel, TimeoutEngineNow());
+    KeInitializeTimerEx(&TimeoutEngineTimer, NotificationTimer);
+    KeInitializeDpc(&TimeoutEngineDpc, TimeoutEngineDpcRoutine, NULL);
+    TimeoutEngineReady = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID
+TimeoutEngineUninitialize(
+    VOID
+)
+{
+    if (!TimeoutEngineReady) {
+        return;
+    }
+
+    // Every port has shut its entries down by now
+    ASSERT(TimeoutEngineWheel.Count == 0);
+
+    KeCancelTimer(&TimeoutEngineTimer);
+    KeFlushQueuedDpcs();
+    TimeoutEngineReady = FALSE;
+}
+
+VOID
+TimeoutEntryInitialize(
+    _Out_ PTIMER_WHEEL_ENTRY  Entry,
+    _In_  PTIMER_WHEEL_CALLBACK Callback,
+    _In_opt_ PVOID            Context
+)
+{
+    RtlZeroMemory(Entry, sizeof(*Entry));
+    InitializeListHead(&Entry->Link);
+    Entry->Callback = Callback;
+    Entry->Context = Context;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+TimeoutEntryArm(
+    _Inout_ PTIMER_WHEEL_ENTRY Entry,
+    _In_  ULONG64             Deadline
+)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&TimeoutEngineLock, &irql);
+    if (!Entry->Disabled) {
+        TimerWheelInsert(&TimeoutEngineWheel, Entry, Deadline);
+        TimeoutEngineStartTimer();
+    }
+    KeReleaseSpinLock(&TimeoutEngineLock, irql);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+TimeoutEntryCancel(
+    _Inout_ PTIMER_WHEEL_ENTRY Entry
+)
+{
+    KIRQL irql;
+
+    // Unlocked hint: the owner serializes arming and cancelling its entry,
+    // and the DPC only ever moves it from armed to not armed.
+    if (!Entry->Armed) {
+        return;
+    }
+
+    KeAcquireSpinLock(&TimeoutEngineLock, &irql);
+    TimerWheelRemove(&TimeoutEngineWheel, Entry);
+    KeReleaseSpinLock(&TimeoutEngineLock, irql);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+TimeoutEntryShutdown(
+    _Inout_ PTIMER_WHEEL_ENTRY Entry
+)
+{
+    KIRQL irql;
+    LARGE_INTEGER interval;
+
+    KeAcquireSpinLock(&TimeoutEngineLock, &irql);
+    Entry->Disabled = TRUE;
+    TimerWheelRemove(&TimeoutEngineWheel, Entry);
+    KeReleaseSpinLock(&TimeoutEngineLock, irql);
+
+    // A callback collected just before we took the lock may still be running
+    interval.QuadPart = -10000;     // 1ms
+    while (ReadAcquire(&Entry->Firing) != 0) {
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+}
@@ -0,0 +1,79 @@
+/*++
+
+Module Name:
+
+    timeoutengine.h
+
+Abstract:
+
+    Driver-wide timeout engine: one timer wheel (timerwheel.h) under a spin
+    lock, advanced by a single periodic kernel timer that only runs while
+    some entry is armed. Ticks are TIMER_WHEEL_TICK_MS of interrupt time.
+    Callbacks run at DISPATCH_LEVEL without any engine lock held, and may
+    re-arm their own entry.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    NTSTATUS
+        TimeoutEngineInitialize(
+            VOID
+        );
+
+    VOID
+        TimeoutEngineUninitialize(
+            VOID
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        ULONG64
+        TimeoutEngineNow(
+            VOID
+        );
+
+    // Converts a timeout in milliseconds to ticks, rounding up, plus one so
+    // that at least that much time passes whatever the phase of the tick.
+    __forceinline ULONG64 TimeoutEngineMsToTicks(
+        _In_  ULONG64             Milliseconds
+    )
+    {
+        return (Milliseconds + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS + 1;
+    }
+
+    VOID
+        TimeoutEntryInitialize(
+            _Out_ PTIMER_WHEEL_ENTRY  Entry,
+            _In_  PTIMER_WHEEL_CALLBACK Callback,
+            _In_opt_ PVOID            Context
+        );
+
+    // Arms Entry to fire at the given tick, replacing any earlier deadline
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        TimeoutEntryArm(
+            _Inout_ PTIMER_WHEEL_ENTRY Entry,
+            _In_  ULONG64             Deadline
+        );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        VOID
+        TimeoutEntryCancel(
+            _Inout_ PTIMER_WHEEL_ENTRY Entry
+        );
+
+    // Cancels Entry for good and waits out a callback already running, so
+    // the memory holding it can be freed afterwards.
+    _IRQL_requires_(PASSIVE_LEVEL)
+        VOID
+        TimeoutEntryShutdown(
+            _Inout_ PTIMER_WHEEL_ENTRY Entry
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,116 @@
+/*++
+
+Module Name:
+
+    timerwheel.c
+
+Abstract:
+
+    Hashed timer wheel
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "timerwheel.h"
+
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+
+VOID
+TimerWheelInitialize(
+    _Out_ PTIMER_WHEEL        Self,
+    _In_  ULONG64             Now
+)
+{
+    ULONG i;
+
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        InitializeListHead(&Self->Slots[i]);
+    }
+    Self->Current = Now;
+    Self->Count = 0;
+}
+
+VOID
+TimerWheelInsert(
+    _Inout_ PTIMER_WHEEL      Self,
+    _Inout_ PTIMER_WHEEL_ENTRY Entry,
+    _In_  ULONG64             Deadline
+)
+{
+    if (Entry->Armed) {
+        TimerWheelRemove(Self, Entry);
+    }
+
+    // The bucket for Current has already been looked at
+    if (Deadline <= Self->Current) {
+        Deadline = Self->Current + 1;
+    }
+
+    Entry->Deadline = Deadline;
+    InsertTailList(&Self->Slots[Deadline & TIMER_WHEEL_MASK], &Entry->Link);
+    Entry->Armed = TRUE;
+    Self->Count++;
+}
+
+VOID
+TimerWheelRemove(
+    _Inout_ PTIMER_WHEEL      Self,
+    _Inout_ PTIMER_WHEEL_ENTRY Entry
+)
+{
+    if (!Entry->Armed) {
+        return;
+    }
+
+    RemoveEntryList(&Entry->Link);
+    Entry->Armed = FALSE;
+    Self->Count--;
+}
+
+ULONG
+TimerWheelAdvance(
+    _Inout_ PTIMER_WHEEL      Self,
+    _In_  ULONG64             Now,
+    _Out_writes_to_(MaxExpired, return) PTIMER_WHEEL_ENTRY* Expired,
+    _In_  ULONG               MaxExpired
+)
+{
+    ULONG count = 0;
+
+    // After a long gap, one pass over every bucket finds everything due.
+    // A Now behind Current finds nothing.
+    if (Now > Self->Current + TIMER_WHEEL_SLOTS) {
+        Self->Current = Now - TIMER_WHEEL_SLOTS;
+    }
+
+    while (Self->Current < Now) {
+        PLIST_ENTRY slot = &Self->Slots[(Self->Current + 1) & TIMER_WHEEL_MASK];
+        PLIST_ENTRY link = slot->Flink;
+
+        while (link != slot) {
+            PTIMER_WHEEL_ENTRY entry = CONTAINING_RECORD(link, TIMER_WHEEL_ENTRY, Link);
+            link = link->Flink;
+
+            // Entries a turn or more away share the bucket; leave them
+            if (entry->Deadline > Now) {
+                continue;
+            }
+
+            if (count == MaxExpired) {
+                // This bucket is looked at again on the next call
+                return count;
+            }
+
+            TimerWheelRemove(Self, entry);
+            Expired[count++] = entry;
+        }
+
+        Self->Current++;
+    }
+
+    return count;
+}
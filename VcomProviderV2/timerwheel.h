@@ -0,0 +1,110 @@
+/*++
+
+Module Name:
+
+    timerwheel.h
+
+Abstract:
+
+    Hashed timer wheel. Entries hash into TIMER_WHEEL_SLOTS buckets by their
+    deadline tick, so arming and cancelling are O(1) and each tick only
+    looks at one bucket, however many entries are armed. Deadlines further
+    out than one turn of the wheel stay in their bucket until the turn in
+    which they fall due.
+
+    The wheel only deals in abstract ticks and takes no locks, so the host
+    tests drive it with a simulated clock. The driver-wide timeout engine
+    (timeoutengine.h) runs one wheel off a periodic kernel timer.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMER_WHEEL_SLOTS       256     // power of two
+#define TIMER_WHEEL_TICK_MS     10
+
+    C_ASSERT((TIMER_WHEEL_SLOTS & (TIMER_WHEEL_SLOTS - 1)) == 0);
+
+    typedef struct _TIMER_WHEEL_ENTRY TIMER_WHEEL_ENTRY, * PTIMER_WHEEL_ENTRY;
+
+    typedef VOID TIMER_WHEEL_CALLBACK(
+        _In_  PTIMER_WHEEL_ENTRY  Entry
+    );
+    typedef TIMER_WHEEL_CALLBACK* PTIMER_WHEEL_CALLBACK;
+
+    struct _TIMER_WHEEL_ENTRY
+    {
+        LIST_ENTRY Link;
+
+        // Tick at or after which the entry expires
+        ULONG64 Deadline;
+
+        // TRUE while linked into a slot
+        BOOLEAN Armed;
+
+        // Timeout engine only: set once the owner is going away, after which
+        // the entry is never armed again
+        BOOLEAN Disabled;
+
+        // Timeout engine only: nonzero while Callback runs
+        volatile LONG Firing;
+
+        PTIMER_WHEEL_CALLBACK Callback;
+        PVOID Context;
+    };
+
+    typedef struct _TIMER_WHEEL
+    {
+        LIST_ENTRY Slots[TIMER_WHEEL_SLOTS];
+
+        // Every tick up to and including this one has been processed
+        ULONG64 Current;
+
+        // Entries currently armed
+        ULONG Count;
+
+    } TIMER_WHEEL, * PTIMER_WHEEL;
+
+    //
+    // The wheel. The caller serializes all calls on one wheel.
+    //
+
+    VOID
+        TimerWheelInitialize(
+            _Out_ PTIMER_WHEEL        Self,
+            _In_  ULONG64             Now
+        );
+
+    // Arms (or re-arms) Entry. A deadline that has already passed expires on
+    // the next advance.
+    VOID
+        TimerWheelInsert(
+            _Inout_ PTIMER_WHEEL      Self,
+            _Inout_ PTIMER_WHEEL_ENTRY Entry,
+            _In_  ULONG64             Deadline
+        );
+
+    VOID
+        TimerWheelRemove(
+            _Inout_ PTIMER_WHEEL      Self,
+            _Inout_ PTIMER_WHEEL_ENTRY Entry
+        );
+
+    // Unlinks up to MaxExpired entries due at or before Now and returns them
+    // in Expired. Returns how many were unlinked; when that is MaxExpired,
+    // call again with the same Now to collect the rest.
+    ULONG
+        TimerWheelAdvance(
+            _Inout_ PTIMER_WHEEL      Self,
+            _In_  ULONG64             Now,
+            _Out_writes_to_(MaxExpired, return) PTIMER_WHEEL_ENTRY* Expired,
+            _In_  ULONG               MaxExpired
+        );
+
+#ifdef __cplusplus
+}
+#endif
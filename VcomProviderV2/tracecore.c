@@ -0,0 +1,121 @@
+/*++
+
+Module Name:
+
+    tracecore.c
+
+Abstract:
+
+    Lock-free binary trace ring and its drain
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "tracecore.h"
+
+VOID
+TraceRingPut(
+    _Inout_ PTRACE_RING       Ring,
+    _In_  const VCOM_TRACE_RECORD* Record
+)
+{
+    PTRACE_SLOT slot;
+    LONG64 index;
+    LONG64 sequence;
+
+    index = InterlockedIncrementNoFence64(&Ring->Next) - 1;
+    slot = &Ring->Slots[index & TRACE_RING_MASK];
+
+    // Claim the slot by marking it torn (full barrier). If another writer
+    // has it, or a later lap already took it, this record is dropped; the
+    // drain finds the wrong sequence there and counts it lost.
+    do {
+        sequence = ReadNoFence64(&slot->Sequence);
+        if ((sequence == 0 && index >= TRACE_RING_SLOTS) || sequence > index) {
+            return;
+        }
+    } while (InterlockedCompareExchange64(&slot->Sequence, 0, sequence) != sequence);
+
+    slot->Record = *Record;
+    WriteRelease64(&slot->Sequence, index + 1);
+}
+
+ULONG
+TraceRingCollect(
+    _Inout_updates_(RingCount) PTRACE_RING Rings,
+    _In_  ULONG               RingCount,
+    _In_  ULONG64             Now,
+    _Out_writes_to_(MaxRecords, return) PVCOM_TRACE_RECORD Records,
+    _In_  ULONG               MaxRecords
+)
+{
+    PTRACE_RING ring;
+    PTRACE_SLOT slot;
+    LONG64 next;
+    LONG64 sequence;
+    ULONG64 lost = 0;
+    ULONG count = 0;
+    ULONG i;
+
+    if (MaxRecords == 0) {
+        return 0;
+    }
+
+    // One slot is kept back for the lost-records report
+    MaxRecords--;
+
+    for (i = 0; i < RingCount && count < MaxRecords; i++) {
+        ring = &Rings[i];
+        next = ReadAcquire64(&ring->Next);
+
+        // Lapped: what the writers have gone past is gone
+        if (next - ring->Drained > TRACE_RING_SLOTS) {
+            lost += (ULONG64)(next - TRACE_RING_SLOTS - ring->Drained);
+            ring->Drained = next - TRACE_RING_SLOTS;
+        }
+
+        while (ring->Drained < next && count < MaxRecords) {
+            slot = &ring->Slots[ring->Drained & TRACE_RING_MASK];
+
+            sequence = ReadAcquire64(&slot->Sequence);
+            if (sequence == 0) {
+                // Still being written; pick it up next time
+                break;
+            }
+
+            if (sequence == ring->Drained + 1) {
+                Records[count] = slot->Record;
+
+                // A writer that lapped us meanwhile has reset the sequence
+                KeMemoryBarrier();
+                if (ReadNoFence64(&slot->Sequence) == sequence) {
+                    count++;
+                }
+                else {
+                    lost++;
+                }
+            }
+            else {
+                lost++;
+            }
+            ring->Drained++;
+        }
+    }
+
+    if (lost != 0) {
+        RtlZeroMemory(&Records[count], sizeof(Records[count]));
+        Records[count].Timestamp = Now;
+        Records[count].EventId = VCOM_TRACE_EVENT_LOST;
+        Records[count].Level = DPFLTR_ERROR_LEVEL;
+        Records[count].PortId = VCOM_INVALID_PORT_ID;
+        Records[count].Args[0] = lost;
+        count++;
+    }
+
+    return count;
+}
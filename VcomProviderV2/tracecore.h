@@ -0,0 +1,66 @@
+/*++
+
+Module Name:
+
+    tracecore.h
+
+Abstract:
+
+    One processor's binary trace ring: fixed-size VCOM_TRACE_RECORD slots,
+    written with no lock and overwritten oldest first, and the drain that
+    hands out the complete ones and counts what was lost to lapping or
+    torn slots. tracering.c keeps a ring per processor and serializes the
+    drains.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_RING_SLOTS        256     // per processor, power of two
+#define TRACE_RING_MASK         (TRACE_RING_SLOTS - 1)
+
+    C_ASSERT((TRACE_RING_SLOTS & (TRACE_RING_SLOTS - 1)) == 0);
+
+    // Sequence is 0 while a record is being written and its index + 1 once
+    // it is complete, so the drain can tell a finished record from a torn one
+    typedef struct _TRACE_SLOT {
+        volatile LONG64         Sequence;
+        VCOM_TRACE_RECORD       Record;
+    } TRACE_SLOT, * PTRACE_SLOT;
+
+    typedef struct DECLSPEC_CACHEALIGN _TRACE_RING {
+        volatile LONG64         Next;       // slots handed out so far
+        LONG64                  Drained;    // drain side only
+        TRACE_SLOT              Slots[TRACE_RING_SLOTS];
+    } TRACE_RING, * PTRACE_RING;
+
+    // Takes the next slot and copies Record into it. Any number of writers
+    // at once; one that is preempted part way leaves a torn slot, which the
+    // drain skips until it is finished or lapped.
+    VOID
+        TraceRingPut(
+            _Inout_ PTRACE_RING       Ring,
+            _In_  const VCOM_TRACE_RECORD* Record
+        );
+
+    // Moves up to MaxRecords of the oldest undrained records of RingCount
+    // rings into Records, one ring after another. Records overwritten before
+    // they could be drained are reported by a trailing
+    // VCOM_TRACE_EVENT_LOST record stamped Now, which one of MaxRecords is
+    // kept for. Drains must not run concurrently.
+    ULONG
+        TraceRingCollect(
+            _Inout_updates_(RingCount) PTRACE_RING Rings,
+            _In_  ULONG               RingCount,
+            _In_  ULONG64             Now,
+            _Out_writes_to_(MaxRecords, return) PVCOM_TRACE_RECORD Records,
+            _In_  ULONG               MaxRecords
+        );
+
+#ifdef __cplusplus
+}
+#endif
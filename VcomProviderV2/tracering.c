@@ -0,0 +1,114 @@
+/*++
+
+Module Name:
+
+    tracering.c
+
+Abstract:
+
+    Per-processor binary trace rings
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "common.h"
+
+#define TRACE_RING_POOL_TAG     'rToV'
+
+// The rings themselves are tracecore.c's; drains are serialized here
+static PTRACE_RING          TraceRings = NULL;
+static ULONG                TraceRingCount = 0;
+static KSPIN_LOCK           TraceRingDrainLock;
+
+NTSTATUS
+TraceRingInitialize(
+    VOID
+)
+{
+    PTRACE_RING rings;
+    ULONG count;
+
+    KeInitializeSpinLock(&TraceRingDrainLock);
+
+    count = min(KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS), TRACE_RING_MAX_RINGS);
+    rings = (PTRACE_RING)ExAllocatePool2(POOL_FLAG_NON_PAGED, count * sizeof(TRACE_RING), TRACE_RING_POOL_TAG);
+    if (rings == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Publishing the rings is a full barrier, so writers see the count too
+    TraceRingCount = count;
+    InterlockedExchangePointer((PVOID volatile*)&TraceRings, rings);
+    return STATUS_SUCCESS;
+}
+
+VOID
+TraceRingUninitialize(
+    VOID
+)
+{
+    PTRACE_RING rings;
+
+    // Every device is gone by now, so nothing records any more
+    rings = (PTRACE_RING)InterlockedExchangePointer((PVOID volatile*)&TraceRings, NULL);
+    if (rings != NULL) {
+        ExFreePoolWithTag(rings, TRACE_RING_POOL_TAG);
+    }
+}
+
+_IRQL_requires_max_(HIGH_LEVEL)
+VOID
+TraceRingWrite(
+    _In_  USHORT              Level,
+    _In_  USHORT              EventId,
+    _In_  ULONG               PortId,
+    _In_  ULONG64             Arg0,
+    _In_  ULONG64             Arg1
+)
+{
+    VCOM_TRACE_RECORD record;
+    ULONG processor;
+
+    if (TraceRings == NULL) {
+        return;
+    }
+
+    // The thread may move to another processor from here on. It then just
+    // writes into a ring that is not its own; the slot it takes is still
+    // its alone.
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    record.Timestamp = KeQueryInterruptTime();
+    record.EventId = EventId;
+    record.Level = Level;
+    record.Processor = processor;
+    record.PortId = PortId;
+    record.Reserved = 0;
+    record.Args[0] = Arg0;
+    record.Args[1] = Arg1;
+
+    TraceRingPut(&TraceRings[processor % TraceRingCount], &record);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+TraceRingDrain(
+    _Out_writes_to_(MaxRecords, return) PVCOM_TRACE_RECORD Records,
+    _In_  ULONG               MaxRecords
+)
+{
+    ULONG count;
+    KIRQL irql;
+
+    if (TraceRings == NULL) {
+        return 0;
+    }
+
+    KeAcquireSpinLock(&TraceRingDrainLock, &irql);
+    count = TraceRingCollect(TraceRings, TraceRingCount, KeQueryInterruptTime(), Records, MaxRecords);
+    KeReleaseSpinLock(&TraceRingDrainLock, irql);
+    return count;
+}
@@ -0,0 +1,60 @@
+/*++
+
+Module Name:
+
+    tracering.h
+
+Abstract:
+
+    Driver-wide binary trace ring. Each processor has its own ring of
+    fixed-size VCOM_TRACE_RECORDs (tracecore.h); recording an event copies
+    its ID and arguments into the ring of the processor it runs on, with no
+    lock and no formatting. The oldest records are overwritten when a ring
+    is full. IOCTL_VCOM_DRAIN_TRACE hands the records out to the control
+    service, which formats them (tools/vcomtrace).
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_RING_MAX_RINGS    64      // processors beyond this share rings
+
+    // Not finding the rings is not an error: events are then dropped
+    NTSTATUS
+        TraceRingInitialize(
+            VOID
+        );
+
+    VOID
+        TraceRingUninitialize(
+            VOID
+        );
+
+    _IRQL_requires_max_(HIGH_LEVEL)
+        VOID
+        TraceRingWrite(
+            _In_  USHORT              Level,
+            _In_  USHORT              EventId,
+            _In_  ULONG               PortId,
+            _In_  ULONG64             Arg0,
+            _In_  ULONG64             Arg1
+        );
+
+    // Moves up to MaxRecords of the oldest undrained records into Records,
+    // one processor's ring after another, and returns how many. Records
+    // overwritten before they could be drained are reported by a trailing
+    // VCOM_TRACE_EVENT_LOST record.
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+        ULONG
+        TraceRingDrain(
+            _Out_writes_to_(MaxRecords, return) PVCOM_TRACE_RECORD Records,
+            _In_  ULONG               MaxRecords
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+
+    waitmask.c
+
+Abstract:
+
+    Serial event wait mask and history
+
+Environment:
+
+    Kernel-mode
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "waitmask.h"
+
+BOOLEAN
+WaitMaskRecord(
+    _Inout_ PWAIT_MASK_STATE  Self,
+    _In_  ULONG               Events
+)
+{
+    Events &= Self->Mask;
+    Self->History |= Events;
+    return Events != 0;
+}
+
+ULONG
+WaitMaskTake(
+    _Inout_ PWAIT_MASK_STATE  Self
+)
+{
+    ULONG events = Self->History;
+
+    Self->History = 0;
+    return events;
+}
+
+WAIT_MASK_ACTION
+WaitMaskBeginWait(
+    _Inout_ PWAIT_MASK_STATE  Self,
+    _In_  BOOLEAN             WaitPending,
+    _Out_ PULONG              Events
+)
+{
+    *Events = 0;
+
+    // As serial.sys
+    if (Self->Mask == 0 || WaitPending) {
+        return WaitMaskReject;
+    }
+
+    // Coalesced events from while nobody was waiting
+    if (Self->History != 0) {
+        *Events = WaitMaskTake(Self);
+        return WaitMaskComplete;
+    }
+    return WaitMaskPend;
+}
+
+NTSTATUS
+WaitMaskSet(
+    _Inout_ PWAIT_MASK_STATE  Self,
+    _In_  ULONG               Mask
+)
+{
+    if (Mask & ~VCOM_SUPPORTED_EVENTS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WriteULongNoFence(&Self->Mask, Mask);
+    Self->History = 0;
+    return STATUS_SUCCESS;
+}
+
+VOID
+WaitMaskReset(
+    _Out_ PWAIT_MASK_STATE    Self
+)
+{
+    WriteULongNoFence(&Self->Mask, 0);
+    Self->History = 0;
+}
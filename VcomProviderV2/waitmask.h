@@ -0,0 +1,81 @@
+/*++
+
+Module Name:
+
+    waitmask.h
+
+Abstract:
+
+    IOCTL_SERIAL_SET_WAIT_MASK / WAIT_ON_MASK state: the mask, and the
+    events that arrived while no wait was pending, OR-ed together for the
+    next one. The queue keeps the pended request itself (WaitMaskQueue) and
+    calls these under its EventLock.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _WAIT_MASK_STATE {
+        volatile ULONG  Mask;           // SERIAL_EV_*, read unlocked as a hint
+        ULONG           History;        // events seen with no wait pending
+    } WAIT_MASK_STATE, * PWAIT_MASK_STATE;
+
+    typedef enum _WAIT_MASK_ACTION {
+        WaitMaskReject,                 // no mask, or a wait already pending
+        WaitMaskComplete,               // complete now with the events returned
+        WaitMaskPend                    // pend until an event arrives
+    } WAIT_MASK_ACTION;
+
+    // Unlocked hint: whether any of Events is in the mask at all
+    __forceinline BOOLEAN WaitMaskWanted(
+        _In_  PWAIT_MASK_STATE    Self,
+        _In_  ULONG               Events
+    )
+    {
+        return (ReadULongNoFence(&Self->Mask) & Events) != 0;
+    }
+
+    // Adds the masked part of Events to the history. TRUE if there was any,
+    // in which case a pending wait should be completed with WaitMaskTake.
+    BOOLEAN
+        WaitMaskRecord(
+            _Inout_ PWAIT_MASK_STATE  Self,
+            _In_  ULONG               Events
+        );
+
+    // The events collected so far; the history starts over
+    ULONG
+        WaitMaskTake(
+            _Inout_ PWAIT_MASK_STATE  Self
+        );
+
+    // What to do with a WAIT_ON_MASK, WaitPending being whether one is
+    // already pended. Events is set for WaitMaskComplete.
+    WAIT_MASK_ACTION
+        WaitMaskBeginWait(
+            _Inout_ PWAIT_MASK_STATE  Self,
+            _In_  BOOLEAN             WaitPending,
+            _Out_ PULONG              Events
+        );
+
+    // SET_WAIT_MASK. The history starts over, and the caller completes a
+    // pending wait with no events. STATUS_INVALID_PARAMETER for events the
+    // port does not raise (VCOM_SUPPORTED_EVENTS).
+    NTSTATUS
+        WaitMaskSet(
+            _Inout_ PWAIT_MASK_STATE  Self,
+            _In_  ULONG               Mask
+        );
+
+    VOID
+        WaitMaskReset(
+            _Out_ PWAIT_MASK_STATE    Self
+        );
+
+#ifdef __cplusplus
+}
+#endif
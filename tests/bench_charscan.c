@@ -0,0 +1,115 @@
+/*++
+
+Module Name:
+
+    bench_charscan.c
+
+Abstract:
+
+    Throughput of the special-character search (charscan.c) over data that
+    holds neither character, the case it has to keep at full speed, at span
+    lengths from a small write to a full ring's worth. Alongside, a byte at
+    a time loop kept from being vectorized by the compiler, as the baseline,
+    and the C library's memchr for one character.
+
+--*/
+
+#include "platform.h"
+#include "charscan.h"
+#include "testing.h"
+
+#define BENCH_BUFFER    (64 * 1024)
+
+static UCHAR BenchData[BENCH_BUFFER];
+
+static __attribute__((__noinline__, __optimize__("no-tree-vectorize"))) size_t
+ScalarFind2(
+    const UCHAR* Buffer,
+    size_t Length,
+    UCHAR A,
+    UCHAR B
+)
+{
+    size_t i;
+
+    for (i = 0; i < Length; i++) {
+        if (Buffer[i] == A || Buffer[i] == B) {
+            break;
+        }
+    }
+    return i;
+}
+
+typedef enum _BENCH_SCAN {
+    BenchFind2,
+    BenchFind1,
+    BenchScalar,
+    BenchMemchr
+} BENCH_SCAN;
+
+// MB/s of one search over Total bytes in spans of Length
+static double
+BenchScan(
+    BENCH_SCAN Scan,
+    size_t Length,
+    ULONG64 Total
+)
+{
+    volatile size_t sink = 0;
+    ULONG64 done = 0;
+    size_t offset = 0;
+    double start = TestNow();
+
+    while (done < Total) {
+        const UCHAR* span = BenchData + offset;
+
+        switch (Scan) {
+        case BenchFind2:
+            sink += CharScanFind2(span, Length, '\n', 0x13);
+            break;
+        case BenchFind1:
+            sink += CharScanFind2(span, Length, '\n', '\n');
+            break;
+        case BenchScalar:
+            sink += ScalarFind2(span, Length, '\n', 0x13);
+            break;
+        default:
+            sink += (size_t)(memchr(span, '\n', Length) != NULL);
+            break;
+        }
+        done += Length;
+        offset = (offset + Length < BENCH_BUFFER - Length) ? offset + Length : 0;
+    }
+    (VOID)sink;
+    return (double)Total / (TestNow() - start) / (1024 * 1024);
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static const size_t lengths[] = { 16, 64, 512, 4096, BENCH_BUFFER / 2 };
+    ULONG64 total = TestQuick(argc, argv) ? (4ULL << 20) : (1ULL << 30);
+    unsigned long long seed = 0xA54FF53A5F1D36F1ULL;
+    size_t i;
+
+    for (i = 0; i < BENCH_BUFFER; i++) {
+        do {
+            BenchData[i] = (UCHAR)TestRandom(&seed);
+        } while (BenchData[i] == '\n' || BenchData[i] == 0x13);
+    }
+
+    printf("%llu MB per run, no matches\n", (unsigned long long)(total >> 20));
+    for (i = 0; i < RTL_NUMBER_OF(lengths); i++) {
+        double find2 = BenchScan(BenchFind2, lengths[i], total);
+        double find1 = BenchScan(BenchFind1, lengths[i], total);
+        double scalar = BenchScan(BenchScalar, lengths[i], total);
+        double libc = BenchScan(BenchMemchr, lengths[i], total);
+
+        printf("  %6zu bytes: two chars %8.0f MB/s (scalar %6.0f, %5.1fx), one char %8.0f MB/s (memchr %8.0f)\n",
+            lengths[i], find2, scalar, find2 / scalar, find1, libc);
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*++
+
+Module Name:
+
+    bench_coalesce.c
+
+Abstract:
+
+    GET_OUTGOING coalescing (coalesce.c) against several write patterns on
+    a simulated millisecond clock, reporting service wakeups per kilobyte
+    and the average time a byte waited in the ring. The service always has
+    a GET_OUTGOING pended and takes everything buffered when it completes.
+    The driver looks after each write and when the coalescing timer goes
+    off, which is on a timer wheel tick.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "coalesce.h"
+#include "timerwheel.h"
+#include "testing.h"
+
+#define BENCH_CAPACITY  (64 * 1024)
+
+typedef struct _PATTERN {
+    const char* Name;
+    ULONG       EveryMs;        // a write this often
+    ULONG       Bytes;          // of this many bytes
+} PATTERN;
+
+typedef struct _SETTING {
+    const char* Name;
+    ULONG       MinBytes;
+    ULONG       MaxDelayMs;
+    ULONG       Flags;
+} SETTING;
+
+typedef struct _RESULT {
+    ULONG64     Bytes;
+    ULONG64     Wakeups;
+    double      WaitMs;         // summed over bytes
+    ULONG64     WorstMs;
+} RESULT;
+
+static VOID
+Run(
+    const PATTERN* Pattern,
+    const SETTING* Setting,
+    ULONG64 DurationMs,
+    RESULT* Result
+)
+{
+    COALESCE_STATE state;
+    VCOM_COALESCE settings;
+    ULONG64 buffered = 0;
+    ULONG64 arrivalSum = 0;     // arrival times of the buffered bytes, summed
+    ULONG64 oldest = 0;
+    ULONG64 timer = 0;          // tick the timer is armed for, 0 if none
+    ULONG64 ms;
+
+    RtlZeroMemory(&state, sizeof(state));
+    RtlZeroMemory(Result, sizeof(*Result));
+    settings.MinBytes = Setting->MinBytes;
+    settings.MaxDelayMs = Setting->MaxDelayMs;
+    settings.Flags = Setting->Flags;
+    (VOID)CoalesceSet(&state, &settings,
+        (Setting->MaxDelayMs + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS + 1);
+
+    for (ms = 1; ms <= DurationMs; ms++) {
+        ULONG64 now = ms / TIMER_WHEEL_TICK_MS;
+        BOOLEAN look = FALSE;
+        BOOLEAN arm;
+
+        if (ms % Pattern->EveryMs == 0) {
+            if (buffered == 0) {
+                oldest = ms;
+            }
+            buffered += Pattern->Bytes;
+            arrivalSum += (ULONG64)Pattern->Bytes * ms;
+            Result->Bytes += Pattern->Bytes;
+            look = TRUE;
+        }
+        if (timer != 0 && ms % TIMER_WHEEL_TICK_MS == 0 && now >= timer) {
+            timer = 0;
+            look = TRUE;
+        }
+        if (!look || buffered == 0) {
+            continue;
+        }
+
+        if (!CoalesceReady(&state, (size_t)buffered, buffered >= BENCH_CAPACITY, now, &arm)) {
+            if (arm) {
+                timer = state.Deadline;
+            }
+            continue;
+        }
+
+        Result->Wakeups++;
+        Result->WaitMs += (double)(buffered * ms - arrivalSum);
+        Result->WorstMs = max(Result->WorstMs, ms - oldest);
+        if (CoalesceDrained(&state, (size_t)buffered, TRUE, now)) {
+            timer = 0;
+        }
+        buffered = 0;
+        arrivalSum = 0;
+    }
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static const PATTERN patterns[] = {
+        { "1 byte every ms",      1,    1 },
+        { "1 byte every 50 ms",   50,   1 },
+        { "16 bytes every 2 ms",  2,    16 },
+        { "4 KB every 100 ms",    100,  4096 },
+    };
+    static const SETTING settings[] = {
+        { "off",                  0,    0,  0 },
+        { "256 B / 20 ms",        256,  20, 0 },
+        { "256 B / 20 ms adapt",  256,  20, VCOM_COALESCE_ADAPTIVE },
+    };
+    ULONG64 duration = TestQuick(argc, argv) ? 10000 : 600000;
+    RESULT result;
+    ULONG i;
+    ULONG j;
+
+    printf("%llu s simulated per run\n", (unsigned long long)(duration / 1000));
+    for (i = 0; i < RTL_NUMBER_OF(patterns); i++) {
+        printf("  %s\n", patterns[i].Name);
+        for (j = 0; j < RTL_NUMBER_OF(settings); j++) {
+            Run(&patterns[i], &settings[j], duration, &result);
+            printf("    %-20s %9.2f wakeups/KB, %7.2f ms average wait, %4llu ms worst\n",
+                settings[j].Name,
+                (double)result.Wakeups * 1024 / (double)result.Bytes,
+                result.WaitMs / (double)result.Bytes,
+                (unsigned long long)result.WorstMs);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*++
+
+Module Name:
+
+    bench_dataformat.c
+
+Abstract:
+
+    Throughput of the word-length and parity kernels (dataformat.c) on
+    7E1, the format this is mostly for, and masking alone on 7N1, at span
+    lengths from a single small write to a full ring's worth. Alongside,
+    the byte-at-a-time loop the kernels fall back to, kept from being
+    vectorized by the compiler, as the baseline.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "dataformat.h"
+#include "testing.h"
+
+#define BENCH_BUFFER    (64 * 1024)
+
+static UCHAR BenchData[BENCH_BUFFER];
+
+static UCHAR
+ScalarParityBit(
+    const DATA_FORMAT* Self,
+    UCHAR Data
+)
+{
+    Data ^= Data >> 4;
+    Data ^= Data >> 2;
+    Data ^= Data >> 1;
+    return (UCHAR)((Data & Self->ParityUse) ^ Self->ParityXor);
+}
+
+static __attribute__((__noinline__, __optimize__("no-tree-vectorize"))) VOID
+ScalarEncode(
+    const DATA_FORMAT* Self,
+    PUCHAR Buffer,
+    size_t Length
+)
+{
+    size_t i;
+    UCHAR data;
+
+    for (i = 0; i < Length; i++) {
+        data = Buffer[i] & Self->Mask;
+        if (Self->Parity) {
+            data |= (UCHAR)(ScalarParityBit(Self, data) << Self->Shift);
+        }
+        Buffer[i] = data;
+    }
+}
+
+static __attribute__((__noinline__, __optimize__("no-tree-vectorize"))) size_t
+ScalarDecode(
+    const DATA_FORMAT* Self,
+    PUCHAR Buffer,
+    size_t Length
+)
+{
+    size_t i;
+    size_t failed = 0;
+    UCHAR data;
+
+    for (i = 0; i < Length; i++) {
+        data = Buffer[i] & Self->Mask;
+        if (Self->Parity && ((Buffer[i] >> Self->Shift) & 1) != ScalarParityBit(Self, data)) {
+            failed++;
+            if (Self->Replace) {
+                data = Self->ErrorChar;
+            }
+        }
+        Buffer[i] = data;
+    }
+    return failed;
+}
+
+typedef enum _BENCH_KERNEL {
+    BenchEncode,
+    BenchDecode,
+    BenchScalarEncode,
+    BenchScalarDecode
+} BENCH_KERNEL;
+
+// MB/s of one kernel over Total bytes in spans of Length
+static double
+BenchKernel(
+    const DATA_FORMAT* Format,
+    BENCH_KERNEL Kernel,
+    size_t Length,
+    ULONG64 Total
+)
+{
+    volatile size_t sink = 0;
+    ULONG64 done = 0;
+    size_t offset = 0;
+    double start = TestNow();
+
+    while (done < Total) {
+        PUCHAR span = BenchData + offset;
+
+        switch (Kernel) {
+        case BenchEncode:
+            DataFormatEncode(Format, span, Length);
+            break;
+        case BenchDecode:
+            sink += DataFormatDecode(Format, span, Length);
+            break;
+        case BenchScalarEncode:
+            ScalarEncode(Format, span, Length);
+            break;
+        default:
+            sink += ScalarDecode(Format, span, Length);
+            break;
+        }
+        done += Length;
+        offset = (offset + Length < BENCH_BUFFER - Length) ? offset + Length : 0;
+    }
+    (VOID)sink;
+    return (double)Total / (TestNow() - start) / (1024 * 1024);
+}
+
+static VOID
+BenchFormat(
+    const char* Name,
+    const DATA_FORMAT* Format,
+    ULONG64 Total
+)
+{
+    static const size_t lengths[] = { 16, 64, 512, 4096, BENCH_BUFFER / 2 };
+    ULONG i;
+
+    printf("%s\n", Name);
+    for (i = 0; i < RTL_NUMBER_OF(lengths); i++) {
+        double encode = BenchKernel(Format, BenchEncode, lengths[i], Total);
+        double scalarEncode = BenchKernel(Format, BenchScalarEncode, lengths[i], Total);
+        double decode = BenchKernel(Format, BenchDecode, lengths[i], Total);
+        double scalarDecode = BenchKernel(Format, BenchScalarDecode, lengths[i], Total);
+
+        printf("  %6zu bytes: encode %8.0f MB/s (scalar %6.0f, %5.1fx), decode %8.0f MB/s (scalar %6.0f, %5.1fx)\n",
+            lengths[i], encode, scalarEncode, encode / scalarEncode,
+            decode, scalarDecode, decode / scalarDecode);
+    }
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    ULONG64 total = TestQuick(argc, argv) ? (4ULL << 20) : (1ULL << 30);
+    unsigned long long seed = 0x3C6EF372FE94F82BULL;
+    DATA_FORMAT format;
+    size_t i;
+
+    DataFormatInitialize();
+    for (i = 0; i < sizeof(BenchData); i++) {
+        BenchData[i] = (UCHAR)TestRandom(&seed);
+    }
+    printf("%llu MB per run, AVX2 %s\n", (unsigned long long)(total >> 20),
+        __builtin_cpu_supports("avx2") ? "present" : "not present");
+
+    DataFormatConfigure(&format, 0x7F, SERIAL_7_DATA | SERIAL_EVEN_PARITY, TRUE, TRUE, '?');
+    BenchFormat("7E1, parity generated and checked, bad bytes replaced", &format, total);
+    DataFormatConfigure(&format, 0x7F, SERIAL_7_DATA | SERIAL_NONE_PARITY, FALSE, FALSE, 0);
+    BenchFormat("7N1, mask only", &format, total);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*++
+
+Module Name:
+
+    bench_latencyhist.c
+
+Abstract:
+
+    Cost of recording into the latency histogram (latencyhist.c), for
+    values spread over a few buckets and over the whole range, on one
+    thread and with several threads recording into the same histogram, as
+    ports on different processors would into a shared one. Alongside, the
+    cost of a snapshot with reset.
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "public.h"
+#include "latencyhist.h"
+#include "testing.h"
+
+#define BENCH_VALUES    4096            // power of two
+
+typedef struct _BENCH {
+    LATENCY_HISTOGRAM*  Histogram;
+    const ULONG64*      Values;
+    ULONG64             Records;
+} BENCH;
+
+static LATENCY_HISTOGRAM BenchHistogram;
+static ULONG64 NarrowValues[BENCH_VALUES];
+static ULONG64 WideValues[BENCH_VALUES];
+
+static void*
+BenchRecorder(
+    void* Context
+)
+{
+    BENCH* bench = (BENCH*)Context;
+    ULONG64 i;
+
+    for (i = 0; i < bench->Records; i++) {
+        LatencyHistogramRecord(bench->Histogram, bench->Values[i & (BENCH_VALUES - 1)]);
+    }
+    return NULL;
+}
+
+// Nanoseconds per record, each of Threads threads doing Records of them
+static double
+BenchRecord(
+    const ULONG64* Values,
+    ULONG Threads,
+    ULONG64 Records
+)
+{
+    pthread_t threads[4];
+    BENCH bench;
+    double start;
+    ULONG i;
+
+    bench.Histogram = &BenchHistogram;
+    bench.Values = Values;
+    bench.Records = Records;
+
+    start = TestNow();
+    for (i = 0; i < Threads; i++) {
+        pthread_create(&threads[i], NULL, BenchRecorder, &bench);
+    }
+    for (i = 0; i < Threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return (TestNow() - start) * 1e9 / (double)(Records * Threads);
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static VCOM_LATENCY_HISTOGRAM snapshot;
+    unsigned long long seed = 0x94D049BB133111EBULL;
+    ULONG64 records = TestQuick(argc, argv) ? 100000 : 50000000;
+    ULONG snapshots = TestQuick(argc, argv) ? 1000 : 1000000;
+    double start;
+    ULONG threads;
+    ULONG i;
+
+    // Around 10-20 us, as for bytes drained promptly; and anything up to the
+    // end of the range
+    for (i = 0; i < BENCH_VALUES; i++) {
+        NarrowValues[i] = 100 + TestRandom(&seed) % 100;
+        WideValues[i] = TestRandom(&seed) >> (64 - VCOM_LATENCY_RANGE_BITS - 1 + TestRandom(&seed) % VCOM_LATENCY_RANGE_BITS);
+    }
+
+    printf("%llu records per thread\n", (unsigned long long)records);
+    for (threads = 1; threads <= 4; threads *= 2) {
+        printf("  %u thread(s): narrow %6.2f ns/record, wide %6.2f ns/record\n",
+            threads,
+            BenchRecord(NarrowValues, threads, records),
+            BenchRecord(WideValues, threads, records));
+    }
+
+    start = TestNow();
+    for (i = 0; i < snapshots; i++) {
+        LatencyHistogramSnapshot(&BenchHistogram, TRUE, &snapshot);
+    }
+    printf("  snapshot with reset: %.1f ns\n", (TestNow() - start) * 1e9 / snapshots);
+    return 0;
+}
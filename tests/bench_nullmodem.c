@@ -0,0 +1,211 @@
+/*++
+
+Module Name:
+
+    bench_nullmodem.c
+
+Abstract:
+
+    What pairing two ports in the driver saves over a loop through the
+    control service. A message from application A to application B takes:
+
+    - through the service: A's write into A's outgoing ring, GET_OUTGOING
+      copying it out to the service, PUSH_INCOMING copying it into B's
+      incoming ring and B's read; four copies and four calls into the
+      driver;
+    - paired: A's write straight into B's incoming ring and B's read; two
+      copies and two calls. Loopback is the same path on one port.
+
+    Each call into the driver is stood in for by one system call. The steps
+    run on one thread, so the times are the work on the path and leave out
+    the wakeups between the processes, which only widen the gap.
+
+--*/
+
+#include <sys/syscall.h>
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "testing.h"
+
+#define BENCH_CAPACITY      (64 * 1024)
+
+typedef struct _SIM_PORT {
+    RING_BUFFER_P2      ToUser;         // written by the application
+    RING_BUFFER_P2      FromNetwork;    // read by the application
+    struct _SIM_PORT*   Peer;           // NULL when not paired
+    BYTE                ToUserStorage[BENCH_CAPACITY];
+    BYTE                FromNetworkStorage[BENCH_CAPACITY];
+} SIM_PORT;
+
+static volatile ULONG64 BenchCalls;
+
+static VOID
+DriverCall(
+    VOID
+)
+{
+    (VOID)syscall(SYS_getppid);
+    BenchCalls++;
+}
+
+static size_t
+RingPut(
+    PRING_BUFFER_P2 Ring,
+    const BYTE* Data,
+    size_t Length
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t got = RingBufferP2Reserve(Ring, Length, &spans);
+
+    RtlCopyMemory(spans.Span[0].Buffer, Data, spans.Span[0].Length);
+    if (spans.Count == 2) {
+        RtlCopyMemory(spans.Span[1].Buffer, Data + spans.Span[0].Length, spans.Span[1].Length);
+    }
+    RingBufferP2Commit(Ring, got);
+    return got;
+}
+
+static size_t
+RingTake(
+    PRING_BUFFER_P2 Ring,
+    BYTE* Data,
+    size_t Length
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t got = RingBufferP2Peek(Ring, Length, &spans);
+
+    RtlCopyMemory(Data, spans.Span[0].Buffer, spans.Span[0].Length);
+    if (spans.Count == 2) {
+        RtlCopyMemory(Data + spans.Span[0].Length, spans.Span[1].Buffer, spans.Span[1].Length);
+    }
+    RingBufferP2Consume(Ring, got);
+    return got;
+}
+
+static size_t
+AppWrite(
+    SIM_PORT* Port,
+    const BYTE* Data,
+    size_t Length
+)
+{
+    DriverCall();
+    if (Port->Peer != NULL) {
+        return RingPut(&Port->Peer->FromNetwork, Data, Length);
+    }
+    return RingPut(&Port->ToUser, Data, Length);
+}
+
+static size_t
+AppRead(
+    SIM_PORT* Port,
+    BYTE* Data,
+    size_t Length
+)
+{
+    DriverCall();
+    return RingTake(&Port->FromNetwork, Data, Length);
+}
+
+// The service's loop for one message: GET_OUTGOING on A, PUSH_INCOMING on B
+static VOID
+ServiceForward(
+    SIM_PORT* From,
+    SIM_PORT* To,
+    BYTE* Buffer,
+    size_t Length
+)
+{
+    size_t got;
+
+    DriverCall();
+    got = RingTake(&From->ToUser, Buffer, Length);
+    DriverCall();
+    (VOID)RingPut(&To->FromNetwork, Buffer, got);
+}
+
+typedef enum _SIM_PATH {
+    SimService,
+    SimPaired,
+    SimLoopback
+} SIM_PATH;
+
+// Nanoseconds per message of Size bytes from A to B
+static double
+BenchPath(
+    SIM_PATH Path,
+    size_t Size,
+    ULONG64 Messages,
+    ULONG64* CallsPerMessage
+)
+{
+    static SIM_PORT a;
+    static SIM_PORT b;
+    static BYTE message[4096];
+    static BYTE service[4096];
+    static BYTE received[4096];
+    SIM_PORT* to = (Path == SimLoopback) ? &a : &b;
+    ULONG64 calls = BenchCalls;
+    ULONG64 bad = 0;
+    ULONG64 i;
+    double start;
+    double elapsed;
+
+    RingBufferP2Initialize(&a.ToUser, a.ToUserStorage, BENCH_CAPACITY);
+    RingBufferP2Initialize(&a.FromNetwork, a.FromNetworkStorage, BENCH_CAPACITY);
+    RingBufferP2Initialize(&b.ToUser, b.ToUserStorage, BENCH_CAPACITY);
+    RingBufferP2Initialize(&b.FromNetwork, b.FromNetworkStorage, BENCH_CAPACITY);
+    a.Peer = (Path == SimService) ? NULL : to;
+    b.Peer = (Path == SimService) ? NULL : &a;
+    RtlFillMemory(message, sizeof(message), 0x3C);
+
+    start = TestNow();
+    for (i = 0; i < Messages; i++) {
+        message[0] = (BYTE)i;
+        (VOID)AppWrite(&a, message, Size);
+        if (Path == SimService) {
+            ServiceForward(&a, to, service, Size);
+        }
+        bad += (AppRead(to, received, Size) != Size || received[0] != (BYTE)i);
+    }
+    elapsed = TestNow() - start;
+
+    if (bad != 0) {
+        printf("  %llu messages arrived wrong\n", (unsigned long long)bad);
+        exit(1);
+    }
+    *CallsPerMessage = (BenchCalls - calls) / Messages;
+    return elapsed * 1e9 / (double)Messages;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static const size_t sizes[] = { 1, 64, 1024, 4096 };
+    static const char* names[] = { "service", "paired", "loopback" };
+    ULONG64 messages = TestQuick(argc, argv) ? 20000 : 1000000;
+    ULONG64 calls;
+    double ns[3];
+    ULONG path;
+    ULONG i;
+
+    printf("%llu messages per run, one system call per driver call\n",
+        (unsigned long long)messages);
+    for (i = 0; i < RTL_NUMBER_OF(sizes); i++) {
+        for (path = SimService; path <= SimLoopback; path++) {
+            ns[path] = BenchPath((SIM_PATH)path, sizes[i], messages, &calls);
+            printf("  %4zu bytes, %-8s: %8.0f ns per message, %8.1f MB/s, %llu driver calls\n",
+                sizes[i], names[path], ns[path],
+                (double)sizes[i] * 1e9 / ns[path] / (1024 * 1024), (unsigned long long)calls);
+        }
+        printf("  %4zu bytes, paired takes %.0f%% of the service loop's time\n",
+            sizes[i], 100.0 * ns[SimPaired] / ns[SimService]);
+    }
+    return 0;
+}
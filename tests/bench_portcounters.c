@@ -0,0 +1,120 @@
+/*++
+
+Module Name:
+
+    bench_portcounters.c
+
+Abstract:
+
+    What the performance counters add to the ring hot paths. One thread
+    writes a chunk into the power-of-two ring and reads it back, as a write
+    followed by a GET_OUTGOING would, with no counters, with the byte
+    counts, occupancy and high-water mark updated on both sides
+    (PortCountersTransfer), and with an interlocked pended count on top.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "ringbuffer.h"
+#include "portcounters.h"
+#include "testing.h"
+
+#define BENCH_CAPACITY      4096
+
+typedef enum _BENCH_MODE {
+    BenchNone,
+    BenchTransfer,
+    BenchTransferAndPended,
+    BenchModes
+} BENCH_MODE;
+
+static const char* BenchModeNames[BenchModes] = {
+    "no counters",
+    "transfer counters",
+    "+ interlocked count",
+};
+
+static BYTE BenchSource[BENCH_CAPACITY];
+static BYTE BenchSink[BENCH_CAPACITY];
+
+// Nanoseconds per write-and-read of Chunk bytes
+static double
+BenchRun(
+    BENCH_MODE Mode,
+    size_t Chunk,
+    ULONG64 Rounds
+)
+{
+    static RING_BUFFER_P2 ring;
+    static BYTE storage[BENCH_CAPACITY];
+    static VCOM_PORT_COUNTERS counters;
+    RING_BUFFER_SPANS spans;
+    ULONG64 round;
+    double start;
+    size_t got;
+    ULONG i;
+
+    RingBufferP2Initialize(&ring, storage, BENCH_CAPACITY);
+    PortCountersInitialize(&counters, 1);
+
+    start = TestNow();
+    for (round = 0; round < Rounds; round++) {
+        got = RingBufferP2Reserve(&ring, Chunk, &spans);
+        for (i = 0; i < spans.Count; i++) {
+            RtlCopyMemory(spans.Span[i].Buffer, BenchSource, spans.Span[i].Length);
+        }
+        RingBufferP2Commit(&ring, got);
+        if (Mode >= BenchTransfer) {
+            PortCountersTransfer(&counters, TRUE, TRUE, got, RingBufferP2Occupancy(&ring));
+        }
+        if (Mode >= BenchTransferAndPended) {
+            InterlockedIncrementNoFence64(&counters.WritesPended);
+        }
+
+        got = RingBufferP2Peek(&ring, Chunk, &spans);
+        for (i = 0; i < spans.Count; i++) {
+            RtlCopyMemory(BenchSink, spans.Span[i].Buffer, spans.Span[i].Length);
+        }
+        RingBufferP2Consume(&ring, got);
+        if (Mode >= BenchTransfer) {
+            PortCountersTransfer(&counters, TRUE, FALSE, got, RingBufferP2Occupancy(&ring));
+        }
+        if (Mode >= BenchTransferAndPended) {
+            InterlockedIncrementNoFence64(&counters.OutgoingPended);
+        }
+    }
+
+    // Keep the work from being thrown away
+    if (counters.BytesWritten != counters.BytesDrained || BenchSink[0] != BenchSource[0]) {
+        printf("  counters disagree\n");
+    }
+    return (TestNow() - start) * 1e9 / (double)Rounds;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static const size_t chunks[] = { 1, 16, 256, 4096 };
+    ULONG64 rounds = TestQuick(argc, argv) ? 100000 : 20000000;
+    double base;
+    double ns;
+    ULONG i;
+    ULONG mode;
+
+    RtlFillMemory(BenchSource, sizeof(BenchSource), 0x3C);
+    printf("%llu write/read rounds per run\n", (unsigned long long)rounds);
+    for (i = 0; i < RTL_NUMBER_OF(chunks); i++) {
+        printf("  chunk %4zu\n", chunks[i]);
+        base = BenchRun(BenchNone, chunks[i], rounds);
+        printf("    %-22s %7.2f ns\n", BenchModeNames[BenchNone], base);
+        for (mode = BenchTransfer; mode < BenchModes; mode++) {
+            ns = BenchRun((BENCH_MODE)mode, chunks[i], rounds);
+            printf("    %-22s %7.2f ns (%+.2f ns)\n", BenchModeNames[mode], ns, ns - base);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*++
+
+Module Name:
+
+    bench_ringbuffer.c
+
+Abstract:
+
+    Throughput of the power-of-two ring.
+
+    - Two threads: one producer and one consumer move a stream through it
+      in fixed-size chunks with memcpy, the way the queue's request paths
+      do, with no lock between the two sides.
+    - One thread, against the pointer-based ring the driver used before:
+      write a chunk, ask for the occupancy, read the chunk back, in a ring
+      of DATA_BUFFER_SIZE, where the bookkeeping rather than the copy
+      dominates.
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "testing.h"
+
+#define BENCH_CAPACITY      (64 * 1024)
+
+typedef struct _BENCH {
+    RING_BUFFER_P2  Ring;
+    BYTE*           Storage;
+    size_t          Chunk;
+    ULONG64         Total;
+} BENCH;
+
+static void*
+BenchProducer(
+    void* Context
+)
+{
+    BENCH* bench = (BENCH*)Context;
+    RING_BUFFER_SPANS spans;
+    BYTE source[4096];
+    ULONG64 done = 0;
+    size_t got;
+
+    RtlFillMemory(source, sizeof(source), 0x5A);
+    while (done < bench->Total) {
+        got = RingBufferP2Reserve(&bench->Ring, bench->Chunk, &spans);
+        if (got == 0) {
+            sched_yield();
+            continue;
+        }
+        RtlCopyMemory(spans.Span[0].Buffer, source, spans.Span[0].Length);
+        if (spans.Count == 2) {
+            RtlCopyMemory(spans.Span[1].Buffer, source + spans.Span[0].Length, spans.Span[1].Length);
+        }
+        RingBufferP2Commit(&bench->Ring, got);
+        done += got;
+    }
+    return NULL;
+}
+
+static void*
+BenchConsumer(
+    void* Context
+)
+{
+    BENCH* bench = (BENCH*)Context;
+    RING_BUFFER_SPANS spans;
+    BYTE sink[4096];
+    ULONG64 done = 0;
+    size_t got;
+
+    while (done < bench->Total) {
+        got = RingBufferP2Peek(&bench->Ring, bench->Chunk, &spans);
+        if (got == 0) {
+            sched_yield();
+            continue;
+        }
+        RtlCopyMemory(sink, spans.Span[0].Buffer, spans.Span[0].Length);
+        if (spans.Count == 2) {
+            RtlCopyMemory(sink + spans.Span[0].Length, spans.Span[1].Buffer, spans.Span[1].Length);
+        }
+        RingBufferP2Consume(&bench->Ring, got);
+        done += got;
+    }
+    return NULL;
+}
+
+static double
+BenchRun(
+    size_t Chunk,
+    ULONG64 Total
+)
+{
+    static BENCH bench;
+    pthread_t producer;
+    pthread_t consumer;
+    double start;
+    double elapsed;
+
+    bench.Storage = (BYTE*)malloc(BENCH_CAPACITY);
+    if (bench.Storage == NULL) {
+        return 0;
+    }
+    RingBufferP2Initialize(&bench.Ring, bench.Storage, BENCH_CAPACITY);
+    bench.Chunk = Chunk;
+    bench.Total = Total;
+
+    start = TestNow();
+    pthread_create(&consumer, NULL, BenchConsumer, &bench);
+    pthread_create(&producer, NULL, BenchProducer, &bench);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    elapsed = TestNow() - start;
+
+    free(bench.Storage);
+    return (double)Total / elapsed / (1024 * 1024);
+}
+
+//
+// The pointer-based ring, as the driver had it before the counter ring: a
+// four-way space test, a sentinel byte, and a second space test behind
+// every occupancy query
+//
+
+#define LAYOUT_CAPACITY     1024
+
+typedef struct _PTR_RING {
+    size_t  Size;
+    BYTE*   Base;
+    BYTE*   End;
+    BYTE*   Head;
+    BYTE*   Tail;
+} PTR_RING;
+
+static size_t
+PtrRingSpace(
+    PTR_RING* Self
+)
+{
+    BYTE* head = Self->Head;
+    BYTE* tail = Self->Tail;
+    BYTE* tailPlusOne = ((tail + 1) == Self->End) ? Self->Base : (tail + 1);
+
+    if (tailPlusOne == head) {
+        return 0;
+    }
+    if (tail == head) {
+        return Self->Size - 1;
+    }
+    if (tail > head) {
+        return Self->Size - (size_t)(tail - head) - 1;
+    }
+    return (size_t)(head - tail) - 1;
+}
+
+static size_t
+PtrRingData(
+    PTR_RING* Self
+)
+{
+    return Self->Size - PtrRingSpace(Self) - 1;
+}
+
+static size_t
+PtrRingWrite(
+    PTR_RING* Self,
+    const BYTE* Data,
+    size_t Length
+)
+{
+    size_t count = min(PtrRingSpace(Self), Length);
+    size_t first;
+
+    if ((Self->Tail + count) > Self->End) {
+        first = (size_t)(Self->End - Self->Tail);
+        RtlCopyMemory(Self->Tail, Data, first);
+        RtlCopyMemory(Self->Base, Data + first, count - first);
+        Self->Tail = Self->Base + (count - first);
+    }
+    else {
+        RtlCopyMemory(Self->Tail, Data, count);
+        Self->Tail += count;
+        if (Self->Tail == Self->End) {
+            Self->Tail = Self->Base;
+        }
+    }
+    return count;
+}
+
+static size_t
+PtrRingRead(
+    PTR_RING* Self,
+    BYTE* Data,
+    size_t Length
+)
+{
+    size_t count = min(PtrRingData(Self), Length);
+    size_t first;
+
+    if ((Self->Head + count) > Self->End) {
+        first = (size_t)(Self->End - Self->Head);
+        RtlCopyMemory(Data, Self->Head, first);
+        RtlCopyMemory(Data + first, Self->Base, count - first);
+        Self->Head = Self->Base + (count - first);
+    }
+    else {
+        RtlCopyMemory(Data, Self->Head, count);
+        Self->Head += count;
+        if (Self->Head == Self->End) {
+            Self->Head = Self->Base;
+        }
+    }
+    return count;
+}
+
+static size_t
+P2RingWrite(
+    PRING_BUFFER_P2 Self,
+    const BYTE* Data,
+    size_t Length
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t count = RingBufferP2Reserve(Self, Length, &spans);
+
+    RtlCopyMemory(spans.Span[0].Buffer, Data, spans.Span[0].Length);
+    if (spans.Count == 2) {
+        RtlCopyMemory(spans.Span[1].Buffer, Data + spans.Span[0].Length, spans.Span[1].Length);
+    }
+    RingBufferP2Commit(Self, count);
+    return count;
+}
+
+static size_t
+P2RingRead(
+    PRING_BUFFER_P2 Self,
+    BYTE* Data,
+    size_t Length
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t count = RingBufferP2Peek(Self, Length, &spans);
+
+    RtlCopyMemory(Data, spans.Span[0].Buffer, spans.Span[0].Length);
+    if (spans.Count == 2) {
+        RtlCopyMemory(Data + spans.Span[0].Length, spans.Span[1].Buffer, spans.Span[1].Length);
+    }
+    RingBufferP2Consume(Self, count);
+    return count;
+}
+
+static volatile size_t BenchSink;
+
+static VOID
+BenchLayouts(
+    size_t Chunk,
+    ULONG64 Total
+)
+{
+    static BYTE ptrStorage[LAYOUT_CAPACITY];
+    static BYTE p2Storage[LAYOUT_CAPACITY];
+    static RING_BUFFER_P2 p2;
+    BYTE data[LAYOUT_CAPACITY];
+    PTR_RING ptr;
+    ULONG64 done;
+    size_t occupancy;
+    double start;
+    double ptrRate;
+    double p2Rate;
+
+    RtlFillMemory(data, sizeof(data), 0x3C);
+
+    // Both start a few bytes in, so some chunks straddle the end
+    ptr.Size = LAYOUT_CAPACITY;
+    ptr.Base = ptr.Head = ptr.Tail = ptrStorage;
+    ptr.End = ptrStorage + LAYOUT_CAPACITY;
+    (VOID)PtrRingWrite(&ptr, data, 3);
+
+    start = TestNow();
+    for (done = 0; done < Total; done += Chunk) {
+        (VOID)PtrRingWrite(&ptr, data, Chunk);
+        BenchSink = PtrRingData(&ptr);
+        (VOID)PtrRingRead(&ptr, data, Chunk);
+    }
+    ptrRate = (double)Total / (TestNow() - start) / (1024 * 1024);
+
+    RingBufferP2Initialize(&p2, p2Storage, LAYOUT_CAPACITY);
+    (VOID)P2RingWrite(&p2, data, 3);
+
+    start = TestNow();
+    for (done = 0; done < Total; done += Chunk) {
+        (VOID)P2RingWrite(&p2, data, Chunk);
+        RingBufferP2GetAvailableData(&p2, &occupancy);
+        BenchSink = occupancy;
+        (VOID)P2RingRead(&p2, data, Chunk);
+    }
+    p2Rate = (double)Total / (TestNow() - start) / (1024 * 1024);
+
+    printf("  chunk %5zu: pointer %8.1f MB/s, power-of-two %8.1f MB/s (%.2fx)\n",
+        Chunk, ptrRate, p2Rate, p2Rate / ptrRate);
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static const size_t chunks[] = { 64, 512, 4096 };
+    static const size_t layoutChunks[] = { 1, 16, 64, 256 };
+    ULONG64 total = TestQuick(argc, argv) ? (4ULL << 20) : (1ULL << 30);
+    ULONG i;
+
+    printf("SPSC ring, %u-byte capacity, %llu MB per run\n",
+        BENCH_CAPACITY, (unsigned long long)(total >> 20));
+    for (i = 0; i < RTL_NUMBER_OF(chunks); i++) {
+        printf("  chunk %5zu: %8.1f MB/s\n", chunks[i], BenchRun(chunks[i], total));
+    }
+
+    printf("Single thread, %u-byte rings, %llu MB per run\n",
+        LAYOUT_CAPACITY, (unsigned long long)(total >> 20));
+    for (i = 0; i < RTL_NUMBER_OF(layoutChunks); i++) {
+        BenchLayouts(layoutChunks[i], total);
+    }
+    return 0;
+}
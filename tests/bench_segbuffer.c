@@ -0,0 +1,152 @@
+/*++
+
+Module Name:
+
+    bench_segbuffer.c
+
+Abstract:
+
+    The segment chain against the contiguous ring it replaces when a port is
+    segmented. One thread keeps BENCH_BACKLOG bytes queued and moves a
+    stream through each structure in fixed-size chunks, copying in and out
+    the way the queue's request paths do, so the chain keeps linking fresh
+    segments at the tail and returning them to the pool at the head.
+    Alongside the rate it reports the memory each held for that backlog.
+
+--*/
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "segbuffer.h"
+#include "testing.h"
+
+#define BENCH_CAPACITY      (64 * 1024)
+#define BENCH_BACKLOG       (16 * 1024)
+
+static BYTE BenchData[4096];
+
+static VOID
+CopyIn(
+    PRING_BUFFER_SPANS Spans
+)
+{
+    ULONG i;
+    size_t done = 0;
+
+    for (i = 0; i < Spans->Count; i++) {
+        RtlCopyMemory(Spans->Span[i].Buffer, BenchData + done, Spans->Span[i].Length);
+        done += Spans->Span[i].Length;
+    }
+}
+
+static VOID
+CopyOut(
+    PRING_BUFFER_SPANS Spans
+)
+{
+    ULONG i;
+    size_t done = 0;
+
+    for (i = 0; i < Spans->Count; i++) {
+        RtlCopyMemory(BenchData + done, Spans->Span[i].Buffer, Spans->Span[i].Length);
+        done += Spans->Span[i].Length;
+    }
+}
+
+static double
+BenchRing(
+    size_t Chunk,
+    ULONG64 Total
+)
+{
+    static BYTE storage[BENCH_CAPACITY];
+    RING_BUFFER_P2 ring;
+    RING_BUFFER_SPANS spans;
+    ULONG64 done;
+    size_t got;
+    double start;
+
+    RingBufferP2Initialize(&ring, storage, BENCH_CAPACITY);
+    for (done = 0; done < BENCH_BACKLOG; done += got) {
+        got = RingBufferP2Reserve(&ring, Chunk, &spans);
+        CopyIn(&spans);
+        RingBufferP2Commit(&ring, got);
+    }
+
+    start = TestNow();
+    for (done = 0; done < Total; done += Chunk) {
+        got = RingBufferP2Reserve(&ring, Chunk, &spans);
+        CopyIn(&spans);
+        RingBufferP2Commit(&ring, got);
+
+        got = RingBufferP2Peek(&ring, Chunk, &spans);
+        CopyOut(&spans);
+        RingBufferP2Consume(&ring, got);
+    }
+    return (double)Total / (TestNow() - start) / (1024 * 1024);
+}
+
+static double
+BenchChain(
+    size_t Chunk,
+    ULONG64 Total,
+    size_t* Held
+)
+{
+    SEG_BUFFER queue;
+    RING_BUFFER_SPANS spans;
+    ULONG64 done;
+    size_t got;
+    double start;
+    double rate;
+
+    SegBufferPoolInitialize(2 * BENCH_CAPACITY);
+    SegBufferInitialize(&queue, BENCH_CAPACITY);
+    for (done = 0; done < BENCH_BACKLOG; done += got) {
+        got = SegBufferReserve(&queue, Chunk, &spans);
+        CopyIn(&spans);
+        SegBufferCommit(&queue, got);
+    }
+
+    start = TestNow();
+    for (done = 0; done < Total; done += Chunk) {
+        got = SegBufferReserve(&queue, Chunk, &spans);
+        CopyIn(&spans);
+        SegBufferCommit(&queue, got);
+
+        got = SegBufferPeek(&queue, Chunk, &spans);
+        CopyOut(&spans);
+        SegBufferConsume(&queue, got);
+    }
+    rate = (double)Total / (TestNow() - start) / (1024 * 1024);
+
+    *Held = SegBufferGetAllocatedBytes(&queue);
+    SegBufferUninitialize(&queue);
+    SegBufferPoolUninitialize();
+    return rate;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static const size_t chunks[] = { 16, 64, 512, 4096 };
+    ULONG64 total = TestQuick(argc, argv) ? (4ULL << 20) : (1ULL << 30);
+    double ringRate;
+    double chainRate;
+    size_t held = 0;
+    ULONG i;
+
+    printf("%u bytes queued, %llu MB per run\n",
+        BENCH_BACKLOG, (unsigned long long)(total >> 20));
+    for (i = 0; i < RTL_NUMBER_OF(chunks); i++) {
+        ringRate = BenchRing(chunks[i], total);
+        chainRate = BenchChain(chunks[i], total, &held);
+        printf("  chunk %5zu: ring %8.1f MB/s, segments %8.1f MB/s (%.2fx)\n",
+            chunks[i], ringRate, chainRate, chainRate / ringRate);
+    }
+    printf("Memory held: ring %u bytes, segments %zu bytes\n", BENCH_CAPACITY, held);
+    return 0;
+}
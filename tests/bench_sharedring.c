@@ -0,0 +1,272 @@
+/*++
+
+Module Name:
+
+    bench_sharedring.c
+
+Abstract:
+
+    Two processes moving a stream through the shared rings, the parent as
+    the driver (sharedring.c) and the child as the service (sharedpeer.h),
+    in fixed-size chunks with a copy on each side. Alongside the rate it
+    reports how often either side had to block, which is how often an event
+    or the doorbell had to be set instead of suppressed.
+
+--*/
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "platform.h"
+#include "public.h"
+#include "ringbuffer.h"
+#include "sharedring.h"
+#include "testing.h"
+#include "sharedpeer.h"
+
+#define BENCH_CAPACITY      (64 * 1024)
+
+typedef struct _REGION {
+    VCOM_SHARED_HEADER  Header;
+    BYTE                ToUser[BENCH_CAPACITY];
+    BYTE                FromNetwork[BENCH_CAPACITY];
+    KEVENT              ToUserEvent;
+    KEVENT              FromNetworkEvent;
+    KEVENT              Doorbell;
+    ULONG64             DriverWaits;
+    ULONG64             ServiceWaits;
+} REGION;
+
+static BYTE BenchData[16384];
+
+static VOID
+CopyIn(
+    PRING_BUFFER_SPANS Spans
+)
+{
+    ULONG i;
+    size_t done = 0;
+
+    for (i = 0; i < Spans->Count; i++) {
+        RtlCopyMemory(Spans->Span[i].Buffer, BenchData + done, Spans->Span[i].Length);
+        done += Spans->Span[i].Length;
+    }
+}
+
+static VOID
+CopyOut(
+    PRING_BUFFER_SPANS Spans
+)
+{
+    ULONG i;
+    size_t done = 0;
+
+    for (i = 0; i < Spans->Count; i++) {
+        RtlCopyMemory(BenchData + done, Spans->Span[i].Buffer, Spans->Span[i].Length);
+        done += Spans->Span[i].Length;
+    }
+}
+
+static VOID
+DriverSend(
+    PSHARED_RING Ring,
+    REGION* Region,
+    size_t Chunk,
+    ULONG64 Total
+)
+{
+    RING_BUFFER_SPANS spans;
+    ULONG64 done = 0;
+    size_t got;
+
+    while (done < Total) {
+        got = SharedRingReserve(Ring, Chunk, &spans);
+        if (got == 0) {
+            SharedRingSetProducerWaiting(Ring, TRUE);
+            if (SharedRingReserve(Ring, 1, &spans) == 0) {
+                Region->DriverWaits++;
+                (VOID)PeerWait(&Region->Doorbell, 1000);
+            }
+            SharedRingSetProducerWaiting(Ring, FALSE);
+            continue;
+        }
+        CopyIn(&spans);
+        SharedRingCommit(Ring, got);
+        done += got;
+    }
+}
+
+static VOID
+DriverReceive(
+    PSHARED_RING Ring,
+    REGION* Region,
+    size_t Chunk,
+    ULONG64 Total
+)
+{
+    RING_BUFFER_SPANS spans;
+    ULONG64 done = 0;
+    size_t got;
+
+    while (done < Total) {
+        got = SharedRingPeek(Ring, Chunk, &spans);
+        if (got == 0) {
+            SharedRingSetConsumerWaiting(Ring, TRUE);
+            if (SharedRingPeek(Ring, 1, &spans) == 0) {
+                Region->DriverWaits++;
+                (VOID)PeerWait(&Region->Doorbell, 1000);
+            }
+            SharedRingSetConsumerWaiting(Ring, FALSE);
+            continue;
+        }
+        CopyOut(&spans);
+        SharedRingConsume(Ring, got);
+        done += got;
+    }
+}
+
+static VOID
+ServiceReceive(
+    PPEER_RING Ring,
+    REGION* Region,
+    size_t Chunk,
+    ULONG64 Total
+)
+{
+    RING_BUFFER_SPANS spans;
+    ULONG64 done = 0;
+    size_t got;
+
+    while (done < Total) {
+        got = PeerRingPeek(Ring, Chunk, &spans);
+        if (got == 0) {
+            InterlockedExchange(&Ring->Control->ConsumerWaiting, 1);
+            if (PeerRingPeek(Ring, 1, &spans) == 0) {
+                Region->ServiceWaits++;
+                (VOID)PeerWait(&Region->ToUserEvent, 1000);
+            }
+            InterlockedExchange(&Ring->Control->ConsumerWaiting, 0);
+            continue;
+        }
+        CopyOut(&spans);
+        PeerRingConsume(Ring, got);
+        done += got;
+    }
+}
+
+static VOID
+ServiceSend(
+    PPEER_RING Ring,
+    REGION* Region,
+    size_t Chunk,
+    ULONG64 Total
+)
+{
+    RING_BUFFER_SPANS spans;
+    ULONG64 done = 0;
+    size_t got;
+
+    while (done < Total) {
+        got = PeerRingReserve(Ring, Chunk, &spans);
+        if (got == 0) {
+            InterlockedExchange(&Ring->Control->ProducerWaiting, 1);
+            if (PeerRingReserve(Ring, 1, &spans) == 0) {
+                Region->ServiceWaits++;
+                (VOID)PeerWait(&Region->FromNetworkEvent, 1000);
+            }
+            InterlockedExchange(&Ring->Control->ProducerWaiting, 0);
+            continue;
+        }
+        CopyIn(&spans);
+        PeerRingCommit(Ring, got);
+        done += got;
+    }
+}
+
+// One direction, one chunk size; returns MB/s as the driver saw it
+static double
+BenchDirection(
+    BOOLEAN ToUser,
+    size_t Chunk,
+    ULONG64 Total,
+    ULONG64* DriverWaits,
+    ULONG64* ServiceWaits
+)
+{
+    REGION* region;
+    SHARED_RING toUser;
+    SHARED_RING fromNet;
+    PEER_RING peerToUser;
+    PEER_RING peerFromNet;
+    double start;
+    double rate;
+    pid_t child;
+
+    region = (REGION*)mmap(NULL, sizeof(REGION), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return 0;
+    }
+    RtlZeroMemory(region, sizeof(*region));
+
+    SharedRingInitialize(&toUser, &region->Header.ToUser, region->ToUser,
+        BENCH_CAPACITY, TRUE, &region->ToUserEvent);
+    SharedRingInitialize(&fromNet, &region->Header.FromNetwork, region->FromNetwork,
+        BENCH_CAPACITY, FALSE, &region->FromNetworkEvent);
+    PeerRingInitialize(&peerToUser, &region->Header.ToUser, region->ToUser,
+        BENCH_CAPACITY, &region->Doorbell);
+    PeerRingInitialize(&peerFromNet, &region->Header.FromNetwork, region->FromNetwork,
+        BENCH_CAPACITY, &region->Doorbell);
+
+    start = TestNow();
+    child = fork();
+    if (child == 0) {
+        if (ToUser) {
+            ServiceReceive(&peerToUser, region, Chunk, Total);
+        }
+        else {
+            ServiceSend(&peerFromNet, region, Chunk, Total);
+        }
+        _exit(0);
+    }
+
+    if (ToUser) {
+        DriverSend(&toUser, region, Chunk, Total);
+    }
+    else {
+        DriverReceive(&fromNet, region, Chunk, Total);
+    }
+    waitpid(child, NULL, 0);
+    rate = (double)Total / (TestNow() - start) / (1024 * 1024);
+
+    *DriverWaits = region->DriverWaits;
+    *ServiceWaits = region->ServiceWaits;
+    munmap(region, sizeof(*region));
+    return rate;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    static const size_t chunks[] = { 64, 512, 4096, 16384 };
+    ULONG64 total = TestQuick(argc, argv) ? (8ULL << 20) : (1ULL << 30);
+    ULONG64 driverWaits;
+    ULONG64 serviceWaits;
+    double rate;
+    ULONG i;
+
+    printf("%u byte rings, %llu MB per run\n",
+        BENCH_CAPACITY, (unsigned long long)(total >> 20));
+    for (i = 0; i < RTL_NUMBER_OF(chunks); i++) {
+        rate = BenchDirection(TRUE, chunks[i], total, &driverWaits, &serviceWaits);
+        printf("  to service,   chunk %5zu: %8.1f MB/s, driver blocked %llu, service blocked %llu\n",
+            chunks[i], rate, (unsigned long long)driverWaits, (unsigned long long)serviceWaits);
+        rate = BenchDirection(FALSE, chunks[i], total, &driverWaits, &serviceWaits);
+        printf("  from service, chunk %5zu: %8.1f MB/s, driver blocked %llu, service blocked %llu\n",
+            chunks[i], rate, (unsigned long long)driverWaits, (unsigned long long)serviceWaits);
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*++
+
+Module Name:
+
+    sharedpeer.h
+
+Abstract:
+
+    The control service's side of the shared rings, as public.h describes
+    it, for the host tests and benchmarks to run against sharedring.c: the
+    service produces into FromNetwork and consumes from ToUser, and kicks
+    the driver through a doorbell event where the real service would issue
+    IOCTL_VCOM_DOORBELL.
+
+    Events are the host KEVENTs from platform.h; PeerWait is the waiting
+    half, with a timeout so a lost wakeup shows up as a count instead of a
+    hang.
+
+--*/
+
+#pragma once
+
+#include <errno.h>
+#include <time.h>
+
+typedef struct _PEER_RING {
+    PVCOM_SHARED_RING_CONTROL Control;
+    BYTE*   Base;
+    size_t  Capacity;
+    ULONG64 Index;          // the service's own index
+    PKEVENT Doorbell;       // kicks the driver
+} PEER_RING, * PPEER_RING;
+
+static inline VOID
+PeerRingInitialize(
+    PPEER_RING Self,
+    PVCOM_SHARED_RING_CONTROL Control,
+    BYTE* Base,
+    size_t Capacity,
+    PKEVENT Doorbell
+)
+{
+    Self->Control = Control;
+    Self->Base = Base;
+    Self->Capacity = Capacity;
+    Self->Index = 0;
+    Self->Doorbell = Doorbell;
+}
+
+static inline size_t
+PeerRingFillSpans(
+    PPEER_RING Self,
+    size_t Length,
+    PRING_BUFFER_SPANS Spans
+)
+{
+    size_t offset = (size_t)Self->Index & (Self->Capacity - 1);
+    size_t first = Self->Capacity - offset;
+
+    RtlZeroMemory(Spans, sizeof(*Spans));
+    if (Length == 0) {
+        return 0;
+    }
+    Spans->Span[0].Buffer = Self->Base + offset;
+    Spans->Span[0].Length = min(Length, first);
+    Spans->Count = 1;
+    if (Length > first) {
+        Spans->Span[1].Buffer = Self->Base;
+        Spans->Span[1].Length = Length - first;
+        Spans->Count = 2;
+    }
+    Spans->Total = Length;
+    return Length;
+}
+
+// Service as consumer (ToUser)
+static inline size_t
+PeerRingPeek(
+    PPEER_RING Self,
+    size_t MaxSize,
+    PRING_BUFFER_SPANS Spans
+)
+{
+    size_t available = (size_t)(ReadULong64Acquire(&Self->Control->ProducerIndex) - Self->Index);
+
+    return PeerRingFillSpans(Self, min(available, MaxSize), Spans);
+}
+
+static inline VOID
+PeerRingConsume(
+    PPEER_RING Self,
+    size_t Count
+)
+{
+    Self->Index += Count;
+    WriteULong64Release(&Self->Control->ConsumerIndex, Self->Index);
+    KeMemoryBarrier();
+    if (ReadNoFence(&Self->Control->ProducerWaiting)) {
+        KeSetEvent(Self->Doorbell, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+// Service as producer (FromNetwork)
+static inline size_t
+PeerRingReserve(
+    PPEER_RING Self,
+    size_t MaxSize,
+    PRING_BUFFER_SPANS Spans
+)
+{
+    size_t space = Self->Capacity -
+        (size_t)(Self->Index - ReadULong64Acquire(&Self->Control->ConsumerIndex));
+
+    return PeerRingFillSpans(Self, min(space, MaxSize), Spans);
+}
+
+static inline VOID
+PeerRingCommit(
+    PPEER_RING Self,
+    size_t Count
+)
+{
+    Self->Index += Count;
+    WriteULong64Release(&Self->Control->ProducerIndex, Self->Index);
+    KeMemoryBarrier();
+    if (ReadNoFence(&Self->Control->ConsumerWaiting)) {
+        KeSetEvent(Self->Doorbell, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+// Waits up to TimeoutMs for Event and resets it. FALSE on a timeout.
+static inline BOOLEAN
+PeerWait(
+    PKEVENT Event,
+    ULONG TimeoutMs
+)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = TimeoutMs / 1000;
+    timeout.tv_nsec = (long)(TimeoutMs % 1000) * 1000000;
+
+    while (__atomic_exchange_n(&Event->Signaled, 0, __ATOMIC_SEQ_CST) == 0) {
+        if (syscall(SYS_futex, &Event->Signaled, FUTEX_WAIT, 0, &timeout, NULL, 0) != 0 &&
+            errno == ETIMEDOUT) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
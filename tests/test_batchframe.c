@@ -0,0 +1,289 @@
+/*++
+
+Module Name:
+
+    test_batchframe.c
+
+Abstract:
+
+    Tests for the IOCTL_VCOM_BATCH framing (batchframe.c), and a simulation
+    of a service draining many ports, comparing one GET_OUTGOING per port
+    with a WAIT_READY and a BATCH per round.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "batchframe.h"
+#include "testing.h"
+
+#define ENTRY   sizeof(VCOM_BATCH_ENTRY)
+
+// Appends an entry, and Length bytes of payload for a PUSH, to Buffer
+static size_t
+PutEntry(
+    UCHAR* Buffer,
+    size_t Offset,
+    ULONG PortId,
+    USHORT Op,
+    ULONG Length,
+    BOOLEAN Pad
+)
+{
+    VCOM_BATCH_ENTRY entry;
+
+    RtlZeroMemory(&entry, sizeof(entry));
+    entry.PortId = PortId;
+    entry.Op = Op;
+    entry.Length = Length;
+    RtlCopyMemory(Buffer + Offset, &entry, sizeof(entry));
+    Offset += sizeof(entry);
+
+    if (Op == VCOM_BATCH_OP_PUSH) {
+        RtlFillMemory(Buffer + Offset, Length, (UCHAR)PortId);
+        Offset += Pad ? VCOM_BATCH_ALIGN(Length) : Length;
+    }
+    return Offset;
+}
+
+static VOID
+TestMixedEntries(
+    VOID
+)
+{
+    UCHAR input[256];
+    BATCH_CURSOR cursor;
+    VCOM_BATCH_ENTRY entry;
+    size_t payloadOffset;
+    size_t payload;
+    size_t room;
+    size_t length = 0;
+
+    length = PutEntry(input, length, 1, VCOM_BATCH_OP_PUSH, 5, TRUE);
+    length = PutEntry(input, length, 2, VCOM_BATCH_OP_DRAIN, 100, TRUE);
+    length = PutEntry(input, length, 3, VCOM_BATCH_OP_PUSH, 0, TRUE);
+    length = PutEntry(input, length, 4, 77, 1000, TRUE);
+    CHECK_EQ(length, 4 * ENTRY + 8);
+
+    BatchCursorInitialize(&cursor, input, length, 1024);
+
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_SUCCESS);
+    CHECK_EQ(entry.PortId, 1);
+    CHECK_EQ(payloadOffset, ENTRY);
+    CHECK_EQ(payload, 5);
+    CHECK_EQ(room, 0);
+    CHECK_EQ(input[payloadOffset + 4], 1);
+    BatchCursorAdvance(&cursor, &entry, payload, 5);
+    CHECK_EQ(cursor.InputOffset, ENTRY + 8);
+    CHECK_EQ(cursor.OutputOffset, ENTRY);
+
+    // A drain is limited by what it asked for, and its bytes follow its header
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_SUCCESS);
+    CHECK_EQ(entry.Op, VCOM_BATCH_OP_DRAIN);
+    CHECK_EQ(payload, 0);
+    CHECK_EQ(room, 100);
+    BatchCursorAdvance(&cursor, &entry, payload, 61);
+    CHECK_EQ(cursor.OutputOffset, 2 * ENTRY + 64);
+
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_SUCCESS);
+    CHECK_EQ(payload, 0);
+    BatchCursorAdvance(&cursor, &entry, payload, 0);
+
+    // An unknown op moves on by its header alone
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_SUCCESS);
+    CHECK_EQ(entry.Op, 77);
+    CHECK_EQ(payload, 0);
+    CHECK_EQ(room, 0);
+    BatchCursorAdvance(&cursor, &entry, payload, 0);
+
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_NO_MORE_ENTRIES);
+    CHECK_EQ(cursor.InputOffset, length);
+    CHECK_EQ(cursor.OutputOffset, 4 * ENTRY + 64);
+}
+
+static VOID
+TestInputBounds(
+    VOID
+)
+{
+    UCHAR input[256];
+    BATCH_CURSOR cursor;
+    VCOM_BATCH_ENTRY entry;
+    size_t payloadOffset;
+    size_t payload;
+    size_t room;
+    size_t length;
+
+    // A last payload without its padding is accepted, and ends the batch
+    length = PutEntry(input, 0, 1, VCOM_BATCH_OP_PUSH, 5, FALSE);
+    BatchCursorInitialize(&cursor, input, length, 1024);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_SUCCESS);
+    BatchCursorAdvance(&cursor, &entry, payload, payload);
+    CHECK_EQ(cursor.InputOffset, length);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_NO_MORE_ENTRIES);
+
+    // A payload one byte past the end is refused
+    length = PutEntry(input, 0, 1, VCOM_BATCH_OP_PUSH, 5, FALSE);
+    BatchCursorInitialize(&cursor, input, length - 1, 1024);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_INVALID_PARAMETER);
+
+    // As is a length near the top of the range
+    (VOID)PutEntry(input, 0, 1, VCOM_BATCH_OP_DRAIN, 0, FALSE);
+    ((PVCOM_BATCH_ENTRY)input)->Op = VCOM_BATCH_OP_PUSH;
+    ((PVCOM_BATCH_ENTRY)input)->Length = 0xFFFFFFFF;
+    BatchCursorInitialize(&cursor, input, ENTRY + 16, 1024);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_INVALID_PARAMETER);
+
+    // A partial header is not an entry
+    BatchCursorInitialize(&cursor, input, ENTRY - 1, 1024);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_NO_MORE_ENTRIES);
+}
+
+// Drained bytes are padded in the output, so the room offered is whole
+// alignment units: the output offset never passes the output length, and
+// the next entry stops cleanly rather than working from a wrapped remainder
+static VOID
+TestOutputBounds(
+    VOID
+)
+{
+    UCHAR input[256];
+    BATCH_CURSOR cursor;
+    VCOM_BATCH_ENTRY entry;
+    size_t payloadOffset;
+    size_t payload;
+    size_t room;
+    size_t length = 0;
+
+    length = PutEntry(input, length, 1, VCOM_BATCH_OP_DRAIN, 100, TRUE);
+    length = PutEntry(input, length, 2, VCOM_BATCH_OP_DRAIN, 100, TRUE);
+    length = PutEntry(input, length, 3, VCOM_BATCH_OP_DRAIN, 100, TRUE);
+
+    BatchCursorInitialize(&cursor, input, length, 2 * ENTRY + 13);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_SUCCESS);
+    CHECK_EQ(room, ENTRY + 8);
+    BatchCursorAdvance(&cursor, &entry, payload, room);
+    CHECK_EQ(cursor.OutputOffset, 2 * ENTRY + 8);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_NO_MORE_ENTRIES);
+
+    // Five bytes after the header: a header fits but no drained bytes do
+    BatchCursorInitialize(&cursor, input, length, ENTRY + 5);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_SUCCESS);
+    CHECK_EQ(room, 0);
+    BatchCursorAdvance(&cursor, &entry, payload, room);
+    CHECK_EQ(cursor.OutputOffset, ENTRY);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_NO_MORE_ENTRIES);
+
+    // No room for a result header: nothing is processed
+    BatchCursorInitialize(&cursor, input, length, ENTRY - 1);
+    CHECK_EQ(BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room), STATUS_NO_MORE_ENTRIES);
+    CHECK_EQ(cursor.InputOffset, 0);
+}
+
+//
+// Many ports with intermittent outgoing data. The per-port service keeps a
+// GET_OUTGOING pended on each port and reissues it after each completion;
+// the batching service waits with WAIT_READY and then drains every ready
+// port with one BATCH, as far as its output buffer allows.
+//
+
+#define SIM_PORTS           256
+#define SIM_ROUNDS          20000
+#define SIM_ACTIVE_CHANCE   16          // one port in this many gets data each round
+#define SIM_GET_OUTGOING    4096        // GET_OUTGOING buffer size
+#define SIM_BATCH_OUTPUT    (64 * 1024) // BATCH output buffer size
+
+static VOID
+TestIoctlsPerByte(
+    VOID
+)
+{
+    static size_t perPort[SIM_PORTS];
+    static size_t batched[SIM_PORTS];
+    static UCHAR input[SIM_PORTS * ENTRY];
+    unsigned long long seed = 0x13198A2E03707344ULL;
+    ULONG64 offered = 0;
+    ULONG64 perPortBytes = 0;
+    ULONG64 perPortIoctls = 0;
+    ULONG64 batchBytes = 0;
+    ULONG64 batchIoctls = 0;
+    BATCH_CURSOR cursor;
+    VCOM_BATCH_ENTRY entry;
+    size_t payloadOffset;
+    size_t payload;
+    size_t room;
+    size_t length;
+    size_t arrived;
+    size_t done;
+    ULONG round;
+    ULONG p;
+
+    for (round = 0; round < SIM_ROUNDS; round++) {
+        for (p = 0; p < SIM_PORTS; p++) {
+            if (TestRandom(&seed) % SIM_ACTIVE_CHANCE == 0) {
+                arrived = (size_t)(TestRandom(&seed) % 512) + 1;
+                perPort[p] += arrived;
+                batched[p] += arrived;
+                offered += arrived;
+            }
+        }
+
+        // One completion per port with data
+        for (p = 0; p < SIM_PORTS; p++) {
+            if (perPort[p] != 0) {
+                done = min(perPort[p], (size_t)SIM_GET_OUTGOING);
+                perPort[p] -= done;
+                perPortBytes += done;
+                perPortIoctls++;
+            }
+        }
+
+        // The ready set, then one batch of drains over it
+        length = 0;
+        for (p = 0; p < SIM_PORTS; p++) {
+            if (batched[p] != 0) {
+                length = PutEntry(input, length, p, VCOM_BATCH_OP_DRAIN, SIM_GET_OUTGOING, TRUE);
+            }
+        }
+        if (length == 0) {
+            continue;
+        }
+        batchIoctls += 2;
+
+        BatchCursorInitialize(&cursor, input, length, SIM_BATCH_OUTPUT);
+        while (BatchCursorNext(&cursor, &entry, &payloadOffset, &payload, &room) == STATUS_SUCCESS) {
+            done = min(batched[entry.PortId], room);
+            batched[entry.PortId] -= done;
+            batchBytes += done;
+            BatchCursorAdvance(&cursor, &entry, payload, done);
+            CHECK(cursor.OutputOffset <= SIM_BATCH_OUTPUT);
+        }
+    }
+
+    for (p = 0; p < SIM_PORTS; p++) {
+        perPortBytes += perPort[p];
+        batchBytes += batched[p];
+    }
+
+    printf("  per port: %llu IOCTLs, %.1f bytes per IOCTL\n",
+        (unsigned long long)perPortIoctls, (double)perPortBytes / (double)perPortIoctls);
+    printf("  batched:  %llu IOCTLs, %.1f bytes per IOCTL\n",
+        (unsigned long long)batchIoctls, (double)batchBytes / (double)batchIoctls);
+
+    // Every byte is drained exactly once either way
+    CHECK_EQ(perPortBytes, offered);
+    CHECK_EQ(batchBytes, offered);
+    CHECK(batchIoctls * 4 < perPortIoctls);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestMixedEntries);
+    RUN_TEST(TestInputBounds);
+    RUN_TEST(TestOutputBounds);
+    RUN_TEST(TestIoctlsPerByte);
+    return TestResult();
+}
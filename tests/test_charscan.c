@@ -0,0 +1,191 @@
+/*++
+
+Module Name:
+
+    test_charscan.c
+
+Abstract:
+
+    Tests for the special-character search (charscan.c) against a byte at
+    a time loop: every length across the 64-byte rounds, the 16-byte loop
+    and the tail, at every alignment, with a hit at every position and
+    none, one character or two, and matches just past the end that must
+    not be seen.
+
+--*/
+
+#include "platform.h"
+#include "charscan.h"
+#include "testing.h"
+
+#define MAX_LENGTH  300
+#define OFFSETS     32
+#define GUARD       64
+
+static size_t
+ReferenceFind2(
+    const UCHAR* Buffer,
+    size_t Length,
+    UCHAR A,
+    UCHAR B
+)
+{
+    size_t i;
+
+    for (i = 0; i < Length; i++) {
+        if (Buffer[i] == A || Buffer[i] == B) {
+            return i;
+        }
+    }
+    return Length;
+}
+
+// Fills with bytes that are neither character, A and B included in the
+// guard past the end so a scan that overruns finds them
+static VOID
+Fill(
+    PUCHAR Buffer,
+    size_t Length,
+    UCHAR A,
+    UCHAR B,
+    unsigned long long* Seed
+)
+{
+    size_t i;
+
+    for (i = 0; i < Length; i++) {
+        do {
+            Buffer[i] = (UCHAR)TestRandom(Seed);
+        } while (Buffer[i] == A || Buffer[i] == B);
+    }
+    for (i = 0; i < GUARD; i++) {
+        Buffer[Length + i] = (i & 1) ? B : A;
+    }
+}
+
+static VOID
+TestNoMatch(
+    VOID
+)
+{
+    static UCHAR buffer[OFFSETS + MAX_LENGTH + GUARD];
+    unsigned long long seed = 0x6A09E667F3BCC908ULL;
+    size_t offset;
+    size_t length;
+
+    for (offset = 0; offset < OFFSETS; offset++) {
+        for (length = 0; length <= MAX_LENGTH; length++) {
+            PUCHAR data = buffer + offset;
+
+            Fill(data, length, '\n', 0x13, &seed);
+            CHECK_EQ(CharScanFind2(data, length, '\n', 0x13), length);
+            CHECK_EQ(CharScanFind2(data, length, '\n', '\n'), length);
+        }
+    }
+}
+
+// One hit at each position, as A, as B, and with A == B
+static VOID
+TestEveryPosition(
+    VOID
+)
+{
+    static UCHAR buffer[OFFSETS + MAX_LENGTH + GUARD];
+    unsigned long long seed = 0xBB67AE8584CAA73BULL;
+    size_t offset;
+    size_t length;
+    size_t at;
+
+    for (offset = 0; offset < OFFSETS; offset++) {
+        for (length = 1; length <= MAX_LENGTH; length++) {
+            PUCHAR data = buffer + offset;
+
+            Fill(data, length, 0x11, 0x13, &seed);
+            for (at = 0; at < length; at++) {
+                UCHAR saved = data[at];
+
+                data[at] = 0x11;
+                CHECK_EQ(CharScanFind2(data, length, 0x11, 0x13), at);
+                CHECK_EQ(CharScanFind2(data, length, 0x11, 0x11), at);
+                CHECK_EQ(CharScanFind2(data, length, 0x13, 0x13), length);
+                data[at] = 0x13;
+                CHECK_EQ(CharScanFind2(data, length, 0x11, 0x13), at);
+                CHECK_EQ(CharScanFind2(data, length, 0x13, 0x11), at);
+                data[at] = saved;
+            }
+        }
+    }
+}
+
+// Characters with the top bit set, and 0, compare as bytes, not as signed
+static VOID
+TestByteValues(
+    VOID
+)
+{
+    UCHAR data[200];
+    ULONG value;
+    size_t at;
+
+    for (value = 0; value < 256; value++) {
+        RtlFillMemory(data, sizeof(data), (UCHAR)(value + 1));
+        for (at = 0; at < sizeof(data); at += 37) {
+            data[at] = (UCHAR)value;
+            CHECK_EQ(CharScanFind2(data, sizeof(data), (UCHAR)value, (UCHAR)value), at);
+            CHECK_EQ(CharScanFind2(data, at, (UCHAR)value, (UCHAR)value), at);
+            data[at] = (UCHAR)(value + 1);
+        }
+    }
+}
+
+//
+// Random buffers with random numbers of hits, the first of which may land
+// in any of the 64-byte rounds, the 16-byte loop or the tail
+//
+
+#define RANDOM_ROUNDS   200000
+
+static VOID
+TestRandomized(
+    VOID
+)
+{
+    static UCHAR buffer[OFFSETS + MAX_LENGTH + GUARD];
+    unsigned long long seed = 0x3C6EF372FE94F82BULL;
+    ULONG64 found = 0;
+    ULONG round;
+
+    for (round = 0; round < RANDOM_ROUNDS; round++) {
+        size_t offset = (size_t)(TestRandom(&seed) % OFFSETS);
+        size_t length = (size_t)(TestRandom(&seed) % (MAX_LENGTH + 1));
+        UCHAR a = (UCHAR)TestRandom(&seed);
+        UCHAR b = (TestRandom(&seed) % 4 == 0) ? a : (UCHAR)TestRandom(&seed);
+        ULONG hits = (ULONG)(TestRandom(&seed) % 4);
+        PUCHAR data = buffer + offset;
+        size_t expect;
+
+        Fill(data, length, a, b, &seed);
+        while (length != 0 && hits-- != 0) {
+            data[TestRandom(&seed) % length] = (TestRandom(&seed) & 1) ? a : b;
+        }
+
+        expect = ReferenceFind2(data, length, a, b);
+        found += (expect < length);
+        CHECK_EQ(CharScanFind2(data, length, a, b), expect);
+    }
+
+    printf("  %llu of %u buffers had a hit\n", (unsigned long long)found, RANDOM_ROUNDS);
+    CHECK(found > RANDOM_ROUNDS / 2);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestNoMatch);
+    RUN_TEST(TestEveryPosition);
+    RUN_TEST(TestByteValues);
+    RUN_TEST(TestRandomized);
+    return TestResult();
+}
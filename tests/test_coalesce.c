@@ -0,0 +1,192 @@
+/*++
+
+Module Name:
+
+    test_coalesce.c
+
+Abstract:
+
+    Tests for GET_OUTGOING coalescing (coalesce.c): the settings it takes,
+    when held bytes complete, and how the adaptive target moves.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "coalesce.h"
+#include "timerwheel.h"
+#include "testing.h"
+
+static VOID
+Configure(
+    PCOALESCE_STATE State,
+    ULONG MinBytes,
+    ULONG DelayTicks,
+    ULONG Flags
+)
+{
+    VCOM_COALESCE settings;
+
+    settings.MinBytes = MinBytes;
+    settings.MaxDelayMs = DelayTicks * TIMER_WHEEL_TICK_MS;
+    settings.Flags = Flags;
+    RtlZeroMemory(State, sizeof(*State));
+    CHECK_EQ(CoalesceSet(State, &settings, DelayTicks), STATUS_SUCCESS);
+}
+
+static VOID
+TestSettings(
+    VOID
+)
+{
+    COALESCE_STATE state;
+    VCOM_COALESCE settings = { 0 };
+
+    RtlZeroMemory(&state, sizeof(state));
+
+    // Off is all zero, and MinBytes of 1 is off too
+    CHECK_EQ(CoalesceSet(&state, &settings, 0), STATUS_SUCCESS);
+    CHECK_EQ(state.Target, 1);
+    settings.MinBytes = 1;
+    CHECK_EQ(CoalesceSet(&state, &settings, 0), STATUS_SUCCESS);
+
+    // Holding bytes needs a deadline, and only known flags are taken
+    settings.MinBytes = 64;
+    CHECK_EQ(CoalesceSet(&state, &settings, 0), STATUS_INVALID_PARAMETER);
+    settings.MaxDelayMs = 5;
+    settings.Flags = 0x10;
+    CHECK_EQ(CoalesceSet(&state, &settings, 2), STATUS_INVALID_PARAMETER);
+    CHECK_EQ(state.MinBytes, 1);
+
+    settings.Flags = VCOM_COALESCE_ADAPTIVE;
+    state.Deadline = 99;
+    CHECK_EQ(CoalesceSet(&state, &settings, 2), STATUS_SUCCESS);
+    CHECK_EQ(state.MinBytes, 64);
+    CHECK_EQ(state.Target, 64);
+    CHECK_EQ(state.DelayTicks, 2);
+    CHECK(state.Adaptive);
+    CHECK_EQ(state.Deadline, 0);
+}
+
+static VOID
+TestOff(
+    VOID
+)
+{
+    COALESCE_STATE state;
+    BOOLEAN arm = TRUE;
+
+    Configure(&state, 0, 0, 0);
+    CHECK(CoalesceReady(&state, 1, FALSE, 100, &arm));
+    CHECK(!arm);
+    CHECK(!CoalesceDrained(&state, 1, TRUE, 100));
+    CHECK_EQ(state.Deadline, 0);
+
+    // Adaptive with nothing to coalesce stays off
+    Configure(&state, 1, 0, VCOM_COALESCE_ADAPTIVE);
+    CHECK(CoalesceReady(&state, 1, FALSE, 100, &arm));
+    CHECK(!CoalesceDrained(&state, 1, TRUE, 100));
+    CHECK_EQ(state.Target, 1);
+}
+
+static VOID
+TestTargetAndDeadline(
+    VOID
+)
+{
+    COALESCE_STATE state;
+    BOOLEAN arm;
+
+    Configure(&state, 64, 3, 0);
+
+    // Enough bytes go at once, without a deadline
+    CHECK(CoalesceReady(&state, 64, FALSE, 10, &arm));
+    CHECK(!arm);
+    CHECK(CoalesceReady(&state, 1000, FALSE, 10, &arm));
+    CHECK_EQ(state.Deadline, 0);
+
+    // Fewer are held; the first look stamps the deadline and arms once
+    CHECK(!CoalesceReady(&state, 1, FALSE, 10, &arm));
+    CHECK(arm);
+    CHECK_EQ(state.Deadline, 13);
+    CHECK(!CoalesceReady(&state, 20, FALSE, 12, &arm));
+    CHECK(!arm);
+    CHECK_EQ(state.Deadline, 13);
+    CHECK(CoalesceReady(&state, 20, FALSE, 13, &arm));
+    CHECK(!arm);
+
+    // Draining part keeps the deadline for what is left
+    CHECK(!CoalesceDrained(&state, 20, FALSE, 13));
+    CHECK_EQ(state.Deadline, 13);
+    CHECK(CoalesceReady(&state, 5, FALSE, 13, &arm));
+    CHECK(CoalesceDrained(&state, 5, TRUE, 13));
+    CHECK_EQ(state.Deadline, 0);
+    CHECK(!CoalesceDrained(&state, 5, TRUE, 13));
+
+    // Not adaptive: the target never moves
+    CHECK_EQ(state.Target, 64);
+
+    // A full ring or a blocked writer completes whatever the target
+    CHECK(CoalesceReady(&state, 1, TRUE, 20, &arm));
+    CHECK(!arm);
+    CHECK_EQ(state.Deadline, 0);
+}
+
+static VOID
+TestAdaptive(
+    VOID
+)
+{
+    COALESCE_STATE state;
+    BOOLEAN arm;
+
+    Configure(&state, 64, 2, VCOM_COALESCE_ADAPTIVE);
+
+    // Sparse traffic: the deadline goes off with 3 bytes, so 3 is the target
+    CHECK(!CoalesceReady(&state, 3, FALSE, 100, &arm));
+    CHECK(CoalesceReady(&state, 3, FALSE, 102, &arm));
+    CHECK(CoalesceDrained(&state, 3, TRUE, 102));
+    CHECK_EQ(state.Target, 3);
+
+    // ...and 3 bytes now go without waiting
+    CHECK(CoalesceReady(&state, 3, FALSE, 103, &arm));
+    CHECK(!arm);
+    CHECK(!CoalesceDrained(&state, 3, TRUE, 103));
+    CHECK_EQ(state.Target, 3);
+
+    // Bursts that overshoot double it back up, capped at MinBytes
+    CHECK(CoalesceReady(&state, 10, FALSE, 104, &arm));
+    CHECK(!CoalesceDrained(&state, 10, TRUE, 104));
+    CHECK_EQ(state.Target, 6);
+    CHECK(!CoalesceDrained(&state, 500, TRUE, 104));
+    CHECK_EQ(state.Target, 12);
+    CHECK(!CoalesceDrained(&state, 500, TRUE, 104));
+    CHECK(!CoalesceDrained(&state, 500, TRUE, 104));
+    CHECK(!CoalesceDrained(&state, 500, TRUE, 104));
+    CHECK_EQ(state.Target, 64);
+    CHECK(!CoalesceDrained(&state, 500, TRUE, 104));
+    CHECK_EQ(state.Target, 64);
+
+    // A deadline with nothing much built up floors the target at 1
+    CHECK(!CoalesceReady(&state, 1, FALSE, 200, &arm));
+    CHECK(CoalesceDrained(&state, 0, TRUE, 202));
+    CHECK_EQ(state.Target, 1);
+
+    // Doubling near the top of the range does not wrap
+    Configure(&state, 0xFFFFFFF0, 2, VCOM_COALESCE_ADAPTIVE);
+    state.Target = 0x90000000;
+    CHECK(!CoalesceDrained(&state, 0xA0000000, TRUE, 1));
+    CHECK_EQ(state.Target, 0xFFFFFFF0);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestSettings);
+    RUN_TEST(TestOff);
+    RUN_TEST(TestTargetAndDeadline);
+    RUN_TEST(TestAdaptive);
+    return TestResult();
+}
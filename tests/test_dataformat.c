@@ -0,0 +1,276 @@
+/*++
+
+Module Name:
+
+    test_dataformat.c
+
+Abstract:
+
+    Tests for the word-length and parity kernels (dataformat.c) against a
+    byte-at-a-time reference, for every word length and parity, at every
+    length up to past DATA_FORMAT_AVX2_MIN and at every alignment, so the
+    scalar tails under 16 and 32 bytes, the SSE2 kernels and (on a processor
+    that has it) the AVX2 kernels are all compared.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "dataformat.h"
+#include "testing.h"
+
+#define MAX_LENGTH      (DATA_FORMAT_AVX2_MIN + 100)
+
+static const ULONG Parities[] = {
+    SERIAL_NONE_PARITY, SERIAL_ODD_PARITY, SERIAL_EVEN_PARITY,
+    SERIAL_MARK_PARITY, SERIAL_SPACE_PARITY
+};
+
+static const UCHAR Masks[] = { 0x1F, 0x3F, 0x7F, 0xFF };
+
+static UCHAR
+RefParityBit(
+    ULONG Parity,
+    UCHAR Data
+)
+{
+    switch (Parity) {
+    case SERIAL_ODD_PARITY:     return (UCHAR)!__builtin_parity(Data);
+    case SERIAL_EVEN_PARITY:    return (UCHAR)__builtin_parity(Data);
+    case SERIAL_MARK_PARITY:    return 1;
+    default:                    return 0;
+    }
+}
+
+static VOID
+RefEncode(
+    ULONG Bits,
+    ULONG Parity,
+    PUCHAR Buffer,
+    size_t Length
+)
+{
+    UCHAR mask = (UCHAR)((1U << Bits) - 1);
+    size_t i;
+
+    for (i = 0; i < Length; i++) {
+        UCHAR data = Buffer[i] & mask;
+
+        if (Bits < 8 && Parity != SERIAL_NONE_PARITY) {
+            data |= (UCHAR)(RefParityBit(Parity, data) << Bits);
+        }
+        Buffer[i] = data;
+    }
+}
+
+static size_t
+RefDecode(
+    ULONG Bits,
+    ULONG Parity,
+    BOOLEAN Replace,
+    UCHAR ErrorChar,
+    PUCHAR Buffer,
+    size_t Length
+)
+{
+    UCHAR mask = (UCHAR)((1U << Bits) - 1);
+    size_t failed = 0;
+    size_t i;
+
+    for (i = 0; i < Length; i++) {
+        UCHAR data = Buffer[i] & mask;
+
+        if (Bits < 8 && Parity != SERIAL_NONE_PARITY &&
+            ((Buffer[i] >> Bits) & 1) != RefParityBit(Parity, data)) {
+            failed++;
+            if (Replace) {
+                data = ErrorChar;
+            }
+        }
+        Buffer[i] = data;
+    }
+    return failed;
+}
+
+static VOID
+TestConfigure(
+    VOID
+)
+{
+    DATA_FORMAT format;
+
+    DataFormatConfigure(&format, 0x7F, SERIAL_7_DATA | SERIAL_EVEN_PARITY, TRUE, TRUE, '?');
+    CHECK_EQ(format.Mask, 0x7F);
+    CHECK_EQ(format.Shift, 7);
+    CHECK(format.Parity);
+    CHECK(format.Replace);
+    CHECK(!DataFormatIsPassThrough(&format));
+
+    // No parity bit: nothing to check, so nothing to replace
+    DataFormatConfigure(&format, 0x7F, SERIAL_7_DATA | SERIAL_NONE_PARITY, TRUE, TRUE, '?');
+    CHECK(!format.Parity);
+    CHECK(!format.Replace);
+
+    // No room for one in an 8-bit word
+    DataFormatConfigure(&format, 0xFF, SERIAL_8_DATA | SERIAL_ODD_PARITY, TRUE, FALSE, 0);
+    CHECK(!format.Parity);
+    CHECK(DataFormatIsPassThrough(&format));
+
+    // Parity not asked for
+    DataFormatConfigure(&format, 0x3F, SERIAL_6_DATA | SERIAL_MARK_PARITY, FALSE, TRUE, 0);
+    CHECK(!format.Parity);
+    CHECK(!DataFormatIsPassThrough(&format));
+}
+
+static VOID
+TestKnownBytes(
+    VOID
+)
+{
+    DATA_FORMAT format;
+    UCHAR buffer[4];
+
+    // 'A' is 0x41, two bits set: even parity 0, odd 1
+    DataFormatConfigure(&format, 0x7F, SERIAL_7_DATA | SERIAL_ODD_PARITY, TRUE, FALSE, 0);
+    buffer[0] = 'A';
+    buffer[1] = 'C';
+    buffer[2] = 0xC1;
+    DataFormatEncode(&format, buffer, 3);
+    CHECK_EQ(buffer[0], 0xC1);
+    CHECK_EQ(buffer[1], 0x43);
+    CHECK_EQ(buffer[2], 0xC1);
+
+    buffer[0] = 0xC1;
+    buffer[1] = 0x41;
+    buffer[2] = 0xC3;
+    buffer[3] = 0x43;
+    format.Replace = TRUE;
+    format.ErrorChar = '?';
+    CHECK_EQ(DataFormatDecode(&format, buffer, 4), 2);
+    CHECK_EQ(buffer[0], 'A');
+    CHECK_EQ(buffer[1], '?');
+    CHECK_EQ(buffer[2], '?');
+    CHECK_EQ(buffer[3], 'C');
+}
+
+//
+// Every length from 0 to MAX_LENGTH, at offsets 0 to 31 of a buffer with
+// guard bytes around it, for each word length, parity and Replace setting
+//
+
+static VOID
+TestMatchesReference(
+    VOID
+)
+{
+    static UCHAR source[MAX_LENGTH + 64];
+    static UCHAR actual[MAX_LENGTH + 64];
+    static UCHAR expected[MAX_LENGTH + 64];
+    unsigned long long seed = 0x6A09E667F3BCC908ULL;
+    ULONG64 compared = 0;
+    ULONG64 mismatched = 0;
+    ULONG64 miscounted = 0;
+    ULONG64 guards = 0;
+    ULONG bits;
+    ULONG parity;
+    ULONG replace;
+    size_t length;
+    size_t offset;
+    size_t i;
+
+    printf("  AVX2 %s\n", __builtin_cpu_supports("avx2") ? "present" : "not present, not compared");
+    DataFormatInitialize();
+
+    for (i = 0; i < sizeof(source); i++) {
+        source[i] = (UCHAR)TestRandom(&seed);
+    }
+
+    for (bits = 5; bits <= 8; bits++) {
+        for (parity = 0; parity < RTL_NUMBER_OF(Parities); parity++) {
+            for (replace = 0; replace < 2; replace++) {
+                DATA_FORMAT format;
+
+                DataFormatConfigure(&format, Masks[bits - 5], (bits - 5) | Parities[parity],
+                    TRUE, (BOOLEAN)replace, 0xA5);
+
+                for (length = 0; length <= MAX_LENGTH; length += (length < 80) ? 1 : 7) {
+                    for (offset = 0; offset < 32; offset += (length < 80) ? 1 : 5) {
+                        size_t failed;
+                        size_t wantFailed;
+
+                        RtlCopyMemory(actual, source, sizeof(actual));
+                        RtlCopyMemory(expected, source, sizeof(expected));
+                        DataFormatEncode(&format, actual + offset, length);
+                        RefEncode(bits, Parities[parity], expected + offset, length);
+                        mismatched += (memcmp(actual, expected, sizeof(actual)) != 0);
+
+                        // Decode the raw bytes, which have random parity bits
+                        RtlCopyMemory(actual, source, sizeof(actual));
+                        RtlCopyMemory(expected, source, sizeof(expected));
+                        failed = DataFormatDecode(&format, actual + offset, length);
+                        wantFailed = RefDecode(bits, Parities[parity], (BOOLEAN)replace, 0xA5,
+                            expected + offset, length);
+                        mismatched += (memcmp(actual, expected, sizeof(actual)) != 0);
+                        miscounted += (failed != wantFailed);
+
+                        // Nothing outside the span is touched
+                        guards += (offset != 0 && actual[offset - 1] != source[offset - 1]);
+                        guards += (actual[offset + length] != source[offset + length]);
+                        compared++;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("  %llu spans compared\n", (unsigned long long)compared);
+    CHECK_EQ(mismatched, 0);
+    CHECK_EQ(miscounted, 0);
+    CHECK_EQ(guards, 0);
+}
+
+// Encoding and then decoding gives back the masked data with no errors;
+// flipping a bit of a word is caught
+static VOID
+TestRoundTrip(
+    VOID
+)
+{
+    static UCHAR data[4096];
+    static UCHAR wire[4096];
+    unsigned long long seed = 0xBB67AE8584CAA73BULL;
+    DATA_FORMAT format;
+    size_t i;
+
+    DataFormatConfigure(&format, 0x7F, SERIAL_7_DATA | SERIAL_EVEN_PARITY, TRUE, FALSE, 0);
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (UCHAR)TestRandom(&seed);
+    }
+    RtlCopyMemory(wire, data, sizeof(wire));
+    DataFormatEncode(&format, wire, sizeof(wire));
+    CHECK_EQ(DataFormatDecode(&format, wire, sizeof(wire)), 0);
+    for (i = 0; i < sizeof(data); i++) {
+        if (wire[i] != (data[i] & 0x7F)) {
+            break;
+        }
+    }
+    CHECK_EQ(i, sizeof(data));
+
+    DataFormatEncode(&format, wire, sizeof(wire));
+    for (i = 0; i < sizeof(wire); i += 97) {
+        wire[i] ^= (UCHAR)(1 << (i % 8));
+    }
+    CHECK_EQ(DataFormatDecode(&format, wire, sizeof(wire)), (sizeof(wire) + 96) / 97);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestConfigure);
+    RUN_TEST(TestKnownBytes);
+    RUN_TEST(TestMatchesReference);
+    RUN_TEST(TestRoundTrip);
+    return TestResult();
+}
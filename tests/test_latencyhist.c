@@ -0,0 +1,184 @@
+/*++
+
+Module Name:
+
+    test_latencyhist.c
+
+Abstract:
+
+    Tests for the log-linear latency histogram (latencyhist.c): bucket
+    bounds against VCOM_LATENCY_BUCKET_LOW, bucket widths, snapshots, and
+    resets racing with recorders on other threads.
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "public.h"
+#include "latencyhist.h"
+#include "testing.h"
+
+static VOID
+TestBucketBounds(
+    VOID
+)
+{
+    ULONG64 low;
+    ULONG64 next;
+    ULONG64 wrongLow = 0;
+    ULONG64 wrongHigh = 0;
+    ULONG64 tooWide = 0;
+    ULONG i;
+
+    CHECK_EQ(LatencyHistogramBucket(0), 0);
+    CHECK_EQ(VCOM_LATENCY_BUCKET_LOW(0), 0);
+
+    // Each bucket starts at its published low bound and ends just before
+    // the next one's
+    for (i = 0; i + 1 < VCOM_LATENCY_BUCKETS; i++) {
+        low = VCOM_LATENCY_BUCKET_LOW(i);
+        next = VCOM_LATENCY_BUCKET_LOW(i + 1);
+        wrongLow += LatencyHistogramBucket(low) != i;
+        wrongHigh += LatencyHistogramBucket(next - 1) != i;
+
+        // No wider than 1/SUB_BUCKETS of where it starts, past the exact ones
+        if (low >= 2 * VCOM_LATENCY_SUB_BUCKETS) {
+            tooWide += (next - low) * VCOM_LATENCY_SUB_BUCKETS > low;
+        }
+        else {
+            tooWide += next - low != 1;
+        }
+    }
+    CHECK_EQ(wrongLow, 0);
+    CHECK_EQ(wrongHigh, 0);
+    CHECK_EQ(tooWide, 0);
+
+    // The last bucket runs to the end of the range and takes what is past it
+    CHECK_EQ(LatencyHistogramBucket(VCOM_LATENCY_BUCKET_LOW(VCOM_LATENCY_BUCKETS - 1)), VCOM_LATENCY_BUCKETS - 1);
+    CHECK_EQ(LatencyHistogramBucket((1ULL << VCOM_LATENCY_RANGE_BITS) - 1), VCOM_LATENCY_BUCKETS - 1);
+    CHECK_EQ(LatencyHistogramBucket(1ULL << VCOM_LATENCY_RANGE_BITS), VCOM_LATENCY_BUCKETS - 1);
+    CHECK_EQ(LatencyHistogramBucket(~0ULL), VCOM_LATENCY_BUCKETS - 1);
+}
+
+static VOID
+TestMonotonic(
+    VOID
+)
+{
+    unsigned long long seed = 0xD1B54A32D192ED03ULL;
+    ULONG64 backwards = 0;
+    ULONG64 value = 0;
+    ULONG previous = 0;
+    ULONG bucket;
+    ULONG i;
+
+    // Random steps up through the whole range never move to a lower bucket
+    for (i = 0; i < 1000000 && value < (1ULL << (VCOM_LATENCY_RANGE_BITS + 1)); i++) {
+        value += 1 + (TestRandom(&seed) % (value / 64 + 2));
+        bucket = LatencyHistogramBucket(value);
+        backwards += bucket < previous;
+        previous = bucket;
+    }
+    CHECK_EQ(backwards, 0);
+    CHECK_EQ(previous, VCOM_LATENCY_BUCKETS - 1);
+}
+
+static VOID
+TestSnapshot(
+    VOID
+)
+{
+    static LATENCY_HISTOGRAM histogram;
+    static VCOM_LATENCY_HISTOGRAM snapshot;
+
+    RtlZeroMemory(&histogram, sizeof(histogram));
+    LatencyHistogramRecord(&histogram, 3);
+    LatencyHistogramRecord(&histogram, 3);
+    LatencyHistogramRecord(&histogram, 1000);
+    LatencyHistogramRecord(&histogram, 1ULL << 50);
+
+    LatencyHistogramSnapshot(&histogram, FALSE, &snapshot);
+    CHECK_EQ(snapshot.Samples, 4);
+    CHECK_EQ(snapshot.Counts[3], 2);
+    CHECK_EQ(snapshot.Counts[LatencyHistogramBucket(1000)], 1);
+    CHECK_EQ(snapshot.Counts[VCOM_LATENCY_BUCKETS - 1], 1);
+
+    // Without a reset the counts stay; with one they are handed over once
+    LatencyHistogramSnapshot(&histogram, TRUE, &snapshot);
+    CHECK_EQ(snapshot.Samples, 4);
+    LatencyHistogramSnapshot(&histogram, FALSE, &snapshot);
+    CHECK_EQ(snapshot.Samples, 0);
+}
+
+//
+// Recorders on two threads while a third snapshots with reset: every
+// sample must turn up in exactly one snapshot.
+//
+
+#define RACE_RECORDS    2000000
+
+typedef struct _RACE {
+    LATENCY_HISTOGRAM   Histogram;
+} RACE;
+
+static RACE Race;
+
+static void*
+RaceRecorder(
+    void* Context
+)
+{
+    unsigned long long seed = (unsigned long long)(ULONG_PTR)Context;
+    ULONG i;
+
+    for (i = 0; i < RACE_RECORDS; i++) {
+        LatencyHistogramRecord(&Race.Histogram, TestRandom(&seed) % 100000);
+    }
+    return NULL;
+}
+
+static VOID
+TestResetRace(
+    VOID
+)
+{
+    static VCOM_LATENCY_HISTOGRAM snapshot;
+    pthread_t recorders[2];
+    ULONG64 total = 0;
+    ULONG64 snapshots = 0;
+    ULONG i;
+
+    RtlZeroMemory(&Race, sizeof(Race));
+    pthread_create(&recorders[0], NULL, RaceRecorder, (void*)(ULONG_PTR)0x1234567);
+    pthread_create(&recorders[1], NULL, RaceRecorder, (void*)(ULONG_PTR)0x7654321);
+
+    // Snapshot until both are done; pthread_join is not a poll, so count
+    // until the totals show they are
+    while (total < 2ULL * RACE_RECORDS) {
+        LatencyHistogramSnapshot(&Race.Histogram, TRUE, &snapshot);
+        total += snapshot.Samples;
+        snapshots++;
+        sched_yield();
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(recorders[i], NULL);
+    }
+    LatencyHistogramSnapshot(&Race.Histogram, TRUE, &snapshot);
+    total += snapshot.Samples;
+
+    printf("  %llu snapshots\n", (unsigned long long)snapshots);
+    CHECK_EQ(total, 2ULL * RACE_RECORDS);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestBucketBounds);
+    RUN_TEST(TestMonotonic);
+    RUN_TEST(TestSnapshot);
+    RUN_TEST(TestResetRace);
+    return TestResult();
+}
@@ -0,0 +1,189 @@
+/*++
+
+Module Name:
+
+    test_lineflow.c
+
+Abstract:
+
+    Tests for the ring-driven flow-control lines (lineflow.c): the
+    watermarks, the hysteresis between them, limits that overlap, and a
+    simulated sender that reacts to the line late, filling and draining a
+    ring at random rates.
+
+--*/
+
+#include "platform.h"
+#include "lineflow.h"
+#include "testing.h"
+
+#define RING    1024
+
+static VOID
+TestWatermarks(
+    VOID
+)
+{
+    LINE_FLOW line;
+
+    LineFlowConfigure(&line, 128, 256);
+    CHECK(!line.Off);
+
+    // Filling: nothing changes until OffLimit bytes or fewer are free
+    CHECK(!LineFlowUpdate(&line, 0, RING));
+    CHECK(!LineFlowUpdate(&line, RING - 129, 129));
+    CHECK(!line.Off);
+    CHECK(LineFlowUpdate(&line, RING - 128, 128));
+    CHECK(line.Off);
+    CHECK(!LineFlowUpdate(&line, RING, 0));
+
+    // Draining: the line stays off all the way down to OnLimit
+    CHECK(!LineFlowUpdate(&line, RING - 129, 129));
+    CHECK(!LineFlowUpdate(&line, 512, 512));
+    CHECK(!LineFlowUpdate(&line, 257, RING - 257));
+    CHECK(line.Off);
+    CHECK(LineFlowUpdate(&line, 256, RING - 256));
+    CHECK(!line.Off);
+    CHECK(!LineFlowUpdate(&line, 0, RING));
+
+    // Filling again is back to the off watermark, not the on one
+    CHECK(!LineFlowUpdate(&line, 512, 512));
+    CHECK(!line.Off);
+
+    // Configuring turns the line on, whatever the ring holds
+    CHECK(LineFlowUpdate(&line, RING, 0));
+    LineFlowConfigure(&line, 128, 256);
+    CHECK(!line.Off);
+    CHECK(LineFlowUpdate(&line, RING, 0));
+}
+
+// Limits that overlap, on a ring small enough that both hold at once: off
+// wins, and the line does not chatter between updates with the same level
+static VOID
+TestOverlap(
+    VOID
+)
+{
+    LINE_FLOW line;
+
+    LineFlowConfigure(&line, 600, 600);
+    CHECK(LineFlowUpdate(&line, 500, 524));
+    CHECK(line.Off);
+    CHECK(!LineFlowUpdate(&line, 500, 524));
+    CHECK(line.Off);
+    CHECK(!LineFlowUpdate(&line, 424, 600));
+    CHECK(LineFlowUpdate(&line, 423, 601));
+    CHECK(!line.Off);
+    CHECK(!LineFlowUpdate(&line, 423, 601));
+
+    // Limits of zero: off only when full, on only when empty
+    LineFlowConfigure(&line, 0, 0);
+    CHECK(!LineFlowUpdate(&line, RING - 1, 1));
+    CHECK(LineFlowUpdate(&line, RING, 0));
+    CHECK(!LineFlowUpdate(&line, 1, RING - 1));
+    CHECK(LineFlowUpdate(&line, 0, RING));
+}
+
+//
+// A sender that keeps going for up to LAG bytes after the line goes off,
+// as the far end of a UART does, into a ring drained at a random rate.
+// With OffLimit covering the lag and one more write the ring must never
+// overflow. After each update the line must be where the watermarks put
+// it, and it may only change at a watermark.
+//
+
+#define LAG             64
+#define MAX_WRITE       24
+#define OFF_LIMIT       (LAG + MAX_WRITE)
+#define ON_LIMIT        256
+#define RANDOM_STEPS    1000000
+
+static ULONG64 Misplaced;
+
+static BOOLEAN
+Update(
+    PLINE_FLOW Line,
+    size_t Buffered
+)
+{
+    size_t free = RING - Buffered;
+    BOOLEAN changed = LineFlowUpdate(Line, Buffered, free);
+
+    if (changed) {
+        Misplaced += Line->Off ? (free > OFF_LIMIT) : (Buffered > ON_LIMIT);
+    }
+    Misplaced += !Line->Off && free <= OFF_LIMIT;
+    Misplaced += Line->Off && Buffered <= ON_LIMIT && free > OFF_LIMIT;
+    return changed;
+}
+
+static VOID
+TestRandomized(
+    VOID
+)
+{
+    unsigned long long seed = 0x1F83D9ABFB41BD6BULL;
+    LINE_FLOW line;
+    size_t buffered = 0;
+    ULONG lag = 0;
+    ULONG64 changes = 0;
+    ULONG64 overflows = 0;
+    ULONG64 sent = 0;
+    ULONG readRate = 1;
+    ULONG step;
+
+    LineFlowConfigure(&line, OFF_LIMIT, ON_LIMIT);
+
+    for (step = 0; step < RANDOM_STEPS; step++) {
+        ULONG64 r = TestRandom(&seed);
+        size_t in;
+        size_t out;
+
+        // The reader stalls, keeps up, or races ahead, for a while at a time
+        if (step % 2048 == 0) {
+            static const ULONG rates[] = { 1, 8, 26, 64 };
+
+            readRate = rates[TestRandom(&seed) % RTL_NUMBER_OF(rates)];
+        }
+        in = (size_t)(r % (MAX_WRITE + 1));
+        out = (size_t)((r >> 16) % readRate);
+
+        if (line.Off) {
+            in = min(in, (size_t)lag);
+            lag -= (ULONG)in;
+        }
+        if (buffered + in > RING) {
+            overflows++;
+            in = RING - buffered;
+        }
+        buffered += in;
+        sent += in;
+        if (Update(&line, buffered)) {
+            lag = LAG;
+            changes++;
+        }
+
+        buffered -= min(out, buffered);
+        if (Update(&line, buffered)) {
+            lag = LAG;
+            changes++;
+        }
+    }
+
+    printf("  %llu bytes through, line changed %llu times\n",
+        (unsigned long long)sent, (unsigned long long)changes);
+    CHECK(changes > 1000);
+    CHECK_EQ(overflows, 0);
+    CHECK_EQ(Misplaced, 0);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestWatermarks);
+    RUN_TEST(TestOverlap);
+    RUN_TEST(TestRandomized);
+    return TestResult();
+}
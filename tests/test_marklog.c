@@ -0,0 +1,193 @@
+/*++
+
+Module Name:
+
+    test_marklog.c
+
+Abstract:
+
+    Tests for the data timing marks (marklog.c): a mark per write, later
+    pieces extending it, folding when the marks run out, and a randomized
+    run against a per-byte model through many wraps of the mark array,
+    with reads that end part way through a write.
+
+--*/
+
+#include "platform.h"
+#include "marklog.h"
+#include "testing.h"
+
+static VOID
+TestStampAndRetire(
+    VOID
+)
+{
+    static DATA_MARK_LOG log;
+    ULONG64 stamped;
+
+    DataMarkReset(&log);
+    CHECK_EQ(DataMarkOldest(&log), 0);
+    CHECK(!DataMarkRetire(&log, &stamped));
+
+    // Nothing to stamp leaves no mark
+    DataMarkStamp(&log, 0, 5);
+    CHECK_EQ(log.Tail, 0);
+
+    DataMarkStamp(&log, 10, 100);
+    DataMarkStamp(&log, 5, 100);        // the rest of the same write
+    DataMarkStamp(&log, 20, 200);
+    CHECK_EQ(log.Tail - log.Head, 2);
+    CHECK_EQ(DataMarkUnread(&log), 35);
+    CHECK_EQ(DataMarkOldest(&log), 100);
+
+    // A read part way through the first write retires nothing
+    DataMarkConsume(&log, 14);
+    CHECK(!DataMarkRetire(&log, &stamped));
+    CHECK_EQ(DataMarkOldest(&log), 100);
+
+    // One more byte finishes it, and the age moves to the next write
+    DataMarkConsume(&log, 1);
+    CHECK(DataMarkRetire(&log, &stamped));
+    CHECK_EQ(stamped, 100);
+    CHECK(!DataMarkRetire(&log, &stamped));
+    CHECK_EQ(DataMarkOldest(&log), 200);
+    CHECK_EQ(DataMarkUnread(&log), 20);
+
+    DataMarkConsume(&log, 20);
+    CHECK(DataMarkRetire(&log, &stamped));
+    CHECK_EQ(stamped, 200);
+    CHECK_EQ(DataMarkOldest(&log), 0);
+    CHECK_EQ(DataMarkUnread(&log), 0);
+}
+
+static VOID
+TestFold(
+    VOID
+)
+{
+    static DATA_MARK_LOG log;
+    ULONG64 stamped;
+    ULONG64 newest = 0;
+    ULONG64 retired = 0;
+    ULONG i;
+
+    DataMarkReset(&log);
+    for (i = 0; i < DATA_MARKS + 10; i++) {
+        DataMarkStamp(&log, 1, 1000 + i);
+    }
+
+    // The last writes fold into the newest mark, which keeps its own time
+    CHECK_EQ(log.Tail - log.Head, DATA_MARKS);
+    CHECK_EQ(log.Marks[(log.Tail - 1) & DATA_MARK_MASK].Timestamp, 1000 + DATA_MARKS - 1);
+    CHECK_EQ(log.Marks[(log.Tail - 1) & DATA_MARK_MASK].End, DATA_MARKS + 10);
+
+    DataMarkConsume(&log, DATA_MARKS + 10);
+    while (DataMarkRetire(&log, &stamped)) {
+        newest = stamped;
+        retired++;
+    }
+    CHECK_EQ(retired, DATA_MARKS);
+    CHECK_EQ(newest, 1000 + DATA_MARKS - 1);
+
+    // A reset starts the byte counts over
+    DataMarkStamp(&log, 3, 5000);
+    DataMarkReset(&log);
+    CHECK_EQ(DataMarkUnread(&log), 0);
+    CHECK_EQ(DataMarkOldest(&log), 0);
+    DataMarkStamp(&log, 3, 6000);
+    CHECK_EQ(log.Marks[0].End, 3);
+}
+
+//
+// Random writes of random sizes with increasing times, some in pieces,
+// and reads of random sizes. The model keeps every byte's time; the marks
+// must give the oldest unread byte's time exactly while none have folded,
+// and never a later one when they have.
+//
+
+#define RANDOM_BYTES    (1 << 20)
+#define RANDOM_STEPS    400000
+
+static VOID
+TestRandomized(
+    VOID
+)
+{
+    static DATA_MARK_LOG log;
+    static ULONG64 byteTime[RANDOM_BYTES];  // by running count, mod RANDOM_BYTES
+    unsigned long long seed = 0x2545F4914F6CDD1DULL;
+    ULONG64 in = 0;
+    ULONG64 out = 0;
+    ULONG64 now = 1;
+    ULONG64 writeTime = 0;                  // time of the write going in pieces
+    ULONG64 retired = 0;
+    ULONG64 exact = 0;
+    ULONG64 later = 0;
+    ULONG64 wrong = 0;
+    ULONG64 stamped;
+    ULONG step;
+    ULONG i;
+
+    DataMarkReset(&log);
+
+    for (step = 0; step < RANDOM_STEPS; step++) {
+        ULONG action = (ULONG)(TestRandom(&seed) % 8);
+
+        if (action < 4 && in - out < RANDOM_BYTES / 2) {
+            ULONG count = (ULONG)(TestRandom(&seed) % 200) + 1;
+
+            // Now and then the next piece of the last write, which keeps
+            // its time; otherwise a new write
+            if (writeTime == 0 || TestRandom(&seed) % 4 != 0) {
+                writeTime = ++now;
+            }
+            for (i = 0; i < count; i++) {
+                byteTime[(in + i) % RANDOM_BYTES] = writeTime;
+            }
+            in += count;
+            DataMarkStamp(&log, count, writeTime);
+        }
+        else if (in != out) {
+            ULONG64 count = TestRandom(&seed) % (in - out) + 1;
+
+            out += count;
+            DataMarkConsume(&log, (size_t)count);
+            while (DataMarkRetire(&log, &stamped)) {
+                // A retired mark's bytes are all gone, and went in no earlier
+                // than the last of them
+                wrong += stamped > byteTime[(out - 1) % RANDOM_BYTES];
+                retired++;
+            }
+        }
+
+        CHECK_EQ(DataMarkUnread(&log), in - out);
+        if (in == out) {
+            wrong += DataMarkOldest(&log) != 0;
+        }
+        else if (log.Tail - log.Head < DATA_MARKS) {
+            wrong += DataMarkOldest(&log) != byteTime[out % RANDOM_BYTES];
+            exact++;
+        }
+        else {
+            later += DataMarkOldest(&log) > byteTime[out % RANDOM_BYTES];
+        }
+    }
+
+    printf("  %llu marks retired, %llu wraps of the mark array, %llu exact ages\n",
+        (unsigned long long)retired, (unsigned long long)(log.Tail / DATA_MARKS),
+        (unsigned long long)exact);
+    CHECK(log.Tail / DATA_MARKS > 100);
+    CHECK_EQ(wrong, 0);
+    CHECK_EQ(later, 0);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestStampAndRetire);
+    RUN_TEST(TestFold);
+    RUN_TEST(TestRandomized);
+    return TestResult();
+}
@@ -0,0 +1,259 @@
+/*++
+
+Module Name:
+
+    test_pacing.c
+
+Abstract:
+
+    Tests for the baud-rate token bucket (pacing.c) against a simulated
+    clock: frame lengths, refill and the delay to the next byte, long idle
+    stretches, and a port kept busy by a timer at the wheel's tick, the way
+    the queue drives it, holding the configured rate.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "timerwheel.h"
+#include "pacing.h"
+#include "testing.h"
+
+#define TICK_UNITS      (TIMER_WHEEL_TICK_MS * (PACING_CLOCK_HZ / 1000))
+#define LINE_8N1        (SERIAL_8_DATA | SERIAL_NONE_PARITY)
+
+static VOID
+TestFrameHalfBits(
+    VOID
+)
+{
+    CHECK_EQ(PacingFrameHalfBits(SERIAL_8_DATA | SERIAL_NONE_PARITY), 20);
+    CHECK_EQ(PacingFrameHalfBits(SERIAL_7_DATA | SERIAL_EVEN_PARITY), 20);
+    CHECK_EQ(PacingFrameHalfBits(SERIAL_8_DATA | SERIAL_ODD_PARITY | SERIAL_STOP_MASK), 24);
+    CHECK_EQ(PacingFrameHalfBits(SERIAL_6_DATA | SERIAL_NONE_PARITY | SERIAL_STOP_MASK), 18);
+
+    // 1.5 stop bits with 5 data bits
+    CHECK_EQ(PacingFrameHalfBits(SERIAL_5_DATA | SERIAL_NONE_PARITY | SERIAL_STOP_MASK), 15);
+    CHECK_EQ(PacingFrameHalfBits(SERIAL_5_DATA | SERIAL_MARK_PARITY), 16);
+}
+
+static VOID
+TestBurst(
+    VOID
+)
+{
+    PACING_BUCKET bucket;
+
+    // At 9600 8N1 two ticks' worth is 19 bytes, more than the FIFO
+    PacingBucketConfigure(&bucket, 9600, LINE_8N1, 1000);
+    CHECK_EQ(bucket.Rate, 19200);
+    CHECK_EQ(bucket.ByteCost, 20 * PACING_CLOCK_HZ);
+    CHECK_EQ(PacingBucketAvailable(&bucket, 1000, 1000), 19);
+    CHECK_EQ(PacingBucketAvailable(&bucket, 1000, 5), 5);
+    CHECK_EQ(PacingBucketDelay(&bucket), 0);
+
+    // At 300 the FIFO is the larger
+    PacingBucketConfigure(&bucket, 300, LINE_8N1, 1000);
+    CHECK_EQ(PacingBucketAvailable(&bucket, 1000, 1000), PACING_FIFO_BYTES);
+
+    // Spent, and nothing more at the same time
+    PacingBucketConsume(&bucket, PACING_FIFO_BYTES);
+    CHECK_EQ(PacingBucketAvailable(&bucket, 1000, 1000), 0);
+    PacingBucketConsume(&bucket, 5);
+    CHECK_EQ(bucket.Tokens, 0);
+}
+
+static VOID
+TestDelay(
+    VOID
+)
+{
+    PACING_BUCKET bucket;
+    ULONG64 now = 5000;
+    ULONG64 delay;
+
+    PacingBucketConfigure(&bucket, 9600, LINE_8N1, now);
+    PacingBucketConsume(&bucket, PacingBucketAvailable(&bucket, now, 1000));
+    CHECK(bucket.Tokens < bucket.ByteCost);
+
+    // What the last byte left over counts toward the next, rounded up
+    delay = PacingBucketDelay(&bucket);
+    CHECK_EQ(delay, (bucket.ByteCost - bucket.Tokens + bucket.Rate - 1) / bucket.Rate);
+    CHECK_EQ(PacingBucketAvailable(&bucket, now + delay - 1, 1000), 0);
+    CHECK(PacingBucketDelay(&bucket) >= 1);
+    CHECK_EQ(PacingBucketAvailable(&bucket, now + delay, 1000), 1);
+    CHECK_EQ(PacingBucketDelay(&bucket), 0);
+
+    // A clock that reads behind the bucket adds nothing
+    PacingBucketConsume(&bucket, 1);
+    CHECK_EQ(PacingBucketAvailable(&bucket, now, 1000), 0);
+    CHECK_EQ(bucket.Last, now + delay);
+
+    // A byte from empty is 20 half-bits at 19200 a second, 1041.67us
+    bucket.Tokens = 0;
+    CHECK_EQ(PacingBucketDelay(&bucket), 10417);
+
+    // Partly refilled tokens count toward it
+    CHECK_EQ(PacingBucketAvailable(&bucket, now + delay + 5000, 1000), 0);
+    CHECK_EQ(PacingBucketDelay(&bucket), 5417);
+}
+
+static VOID
+TestOffAndIdle(
+    VOID
+)
+{
+    PACING_BUCKET bucket;
+
+    // Baud rate 0 lets everything through
+    PacingBucketConfigure(&bucket, 0, LINE_8N1, 0);
+    CHECK_EQ(PacingBucketAvailable(&bucket, 0, 123456), 123456);
+    PacingBucketConsume(&bucket, 123456);
+    CHECK_EQ(PacingBucketDelay(&bucket), 0);
+    CHECK_EQ(PacingBucketAvailable(&bucket, 0, 123456), 123456);
+
+    // The fastest rate after the longest idle stops at a full bucket
+    PacingBucketConfigure(&bucket, MAXULONG, SERIAL_5_DATA, 0);
+    PacingBucketConsume(&bucket, PacingBucketAvailable(&bucket, 0, MAXULONG));
+    CHECK(bucket.Tokens < bucket.ByteCost);
+    (VOID)PacingBucketAvailable(&bucket, ~0ULL >> 1, 0);
+    CHECK_EQ(bucket.Tokens, bucket.Capacity);
+}
+
+//
+// A writer that always has more, let through by a timer the way
+// QueuePacingCharge arms one: when bytes are held back, for the whole ticks
+// until the next byte plus one
+//
+
+static ULONG64
+RunPaced(
+    ULONG BaudRate,
+    ULONG LineControl,
+    ULONG64 Duration,
+    ULONG64* Bound
+)
+{
+    PACING_BUCKET bucket;
+    ULONG64 tick = 0;
+    ULONG64 sent = 0;
+    ULONG64 end = Duration / TICK_UNITS;
+    size_t allowed;
+
+    PacingBucketConfigure(&bucket, BaudRate, LineControl, 0);
+
+    while (tick <= end) {
+        allowed = PacingBucketAvailable(&bucket, tick * TICK_UNITS, 4096);
+        PacingBucketConsume(&bucket, allowed);
+        sent += allowed;
+
+        // Never ahead of the line, burst aside
+        if (sent > (bucket.Capacity + tick * TICK_UNITS * bucket.Rate) / bucket.ByteCost) {
+            *Bound = 0;
+            return sent;
+        }
+        tick += PacingBucketDelay(&bucket) / TICK_UNITS + 1;
+    }
+
+    *Bound = bucket.Capacity / bucket.ByteCost;
+    return sent;
+}
+
+static VOID
+TestSustainedRate(
+    VOID
+)
+{
+    static const struct {
+        ULONG BaudRate;
+        ULONG LineControl;
+    } cases[] = {
+        { 110, SERIAL_7_DATA | SERIAL_EVEN_PARITY | SERIAL_STOP_MASK },
+        { 300, LINE_8N1 },
+        { 9600, LINE_8N1 },
+        { 19200, SERIAL_5_DATA | SERIAL_STOP_MASK },
+        { 115200, LINE_8N1 },
+        { 921600, SERIAL_8_DATA | SERIAL_ODD_PARITY },
+        { 3000000, LINE_8N1 },
+    };
+    ULONG64 duration = 600 * PACING_CLOCK_HZ;
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(cases); i++) {
+        ULONG halfBits = PacingFrameHalfBits(cases[i].LineControl);
+        double expected = (double)duration / PACING_CLOCK_HZ * 2.0 * cases[i].BaudRate / halfBits;
+        ULONG64 bound;
+        ULONG64 sent = RunPaced(cases[i].BaudRate, cases[i].LineControl, duration, &bound);
+
+        printf("  %7u baud, %u half-bits: %llu bytes in 600 s, %.4f of the line\n",
+            cases[i].BaudRate, halfBits, (unsigned long long)sent, (double)sent / expected);
+        CHECK(bound != 0);
+        CHECK((double)sent >= expected * 0.999);
+        CHECK((double)sent <= expected + (double)bound + 1);
+    }
+}
+
+//
+// Random demand and clock steps, from single clock units to long idles.
+// Over any run the bytes let through stay within a burst of the line rate,
+// and a writer that keeps asking gets the line's worth.
+//
+
+static VOID
+TestRandomized(
+    VOID
+)
+{
+    PACING_BUCKET bucket;
+    unsigned long long seed = 0xC2B2AE3D27D4EB4FULL;
+    ULONG64 now = 0;
+    ULONG64 sent = 0;
+    ULONG64 ahead = 0;
+    ULONG step;
+
+    PacingBucketConfigure(&bucket, 57600, SERIAL_8_DATA | SERIAL_EVEN_PARITY, 0);
+
+    for (step = 0; step < 1000000; step++) {
+        size_t wanted = (size_t)(TestRandom(&seed) % 64);
+        size_t allowed;
+
+        switch (TestRandom(&seed) % 4) {
+        case 0:
+            now += TestRandom(&seed) % 10;
+            break;
+        case 1:
+            now += TestRandom(&seed) % TICK_UNITS;
+            break;
+        case 2:
+            now += PacingBucketDelay(&bucket);
+            break;
+        default:
+            break;
+        }
+
+        allowed = PacingBucketAvailable(&bucket, now, wanted);
+        CHECK(allowed <= wanted);
+        allowed = (size_t)(TestRandom(&seed) % (allowed + 1));
+        PacingBucketConsume(&bucket, allowed);
+        sent += allowed;
+        ahead += (sent > (bucket.Capacity + now * bucket.Rate) / bucket.ByteCost);
+    }
+
+    printf("  %llu bytes over %.1f simulated s\n",
+        (unsigned long long)sent, (double)now / PACING_CLOCK_HZ);
+    CHECK_EQ(ahead, 0);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestFrameHalfBits);
+    RUN_TEST(TestBurst);
+    RUN_TEST(TestDelay);
+    RUN_TEST(TestOffAndIdle);
+    RUN_TEST(TestSustainedRate);
+    RUN_TEST(TestRandomized);
+    return TestResult();
+}
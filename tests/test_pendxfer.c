@@ -0,0 +1,846 @@
+/*++
+
+Module Name:
+
+    test_pendxfer.c
+
+Abstract:
+
+    Tests for pended writes and pushes (pendxfer.c). The PEND_QUEUE runs
+    over a ring and a FIFO of its own, standing in for queue.c's, through
+    writes that span many drains, requests cancelled before and after they
+    start, a stopping port, and a push producer against a slower reader.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "ringbuffer.h"
+#include "pendxfer.h"
+#include "testing.h"
+
+static VOID
+TestTransferStatus(
+    VOID
+)
+{
+    CHECK_EQ(PendTransferStatus(10, 10, STATUS_SUCCESS), STATUS_SUCCESS);
+    CHECK_EQ(PendTransferStatus(10, 4, STATUS_BUFFER_OVERFLOW), STATUS_BUFFER_OVERFLOW);
+
+    // The ring took everything offered, but pacing offered only part
+    CHECK_EQ(PendTransferStatus(10, 4, STATUS_SUCCESS), STATUS_BUFFER_OVERFLOW);
+
+    // The last bytes filling the ring exactly still finish the request
+    CHECK_EQ(PendTransferStatus(10, 10, STATUS_BUFFER_OVERFLOW), STATUS_SUCCESS);
+    CHECK_EQ(PendTransferStatus(0, 0, STATUS_SUCCESS), STATUS_SUCCESS);
+
+    CHECK_EQ(PendTransferStatus(10, 4, STATUS_INVALID_PARAMETER), STATUS_INVALID_PARAMETER);
+}
+
+static VOID
+TestCredit(
+    VOID
+)
+{
+    VCOM_PUSH_CREDIT credit;
+
+    CHECK_EQ(PendCount(FALSE, 0), 0);
+    CHECK_EQ(PendCount(TRUE, 0), 1);
+    CHECK_EQ(PendCount(TRUE, 3), 4);
+
+    PendCreditCompute(300, 1024, 0, &credit);
+    CHECK_EQ(credit.FreeBytes, 300);
+    CHECK_EQ(credit.Capacity, 1024);
+    CHECK_EQ(credit.PushesPending, 0);
+    CHECK(PendCreditSatisfied(&credit, 0));
+    CHECK(PendCreditSatisfied(&credit, 300));
+    CHECK(!PendCreditSatisfied(&credit, 301));
+
+    // Free space behind pended pushes is theirs, not the caller's
+    PendCreditCompute(300, 1024, 2, &credit);
+    CHECK_EQ(credit.FreeBytes, 0);
+    CHECK_EQ(credit.PushesPending, 2);
+    CHECK(!PendCreditSatisfied(&credit, 1));
+    CHECK(PendCreditSatisfied(&credit, 0));
+
+    // A minimum beyond the ring waits only for an empty one
+    PendCreditCompute(1024, 1024, 0, &credit);
+    CHECK(PendCreditSatisfied(&credit, 1000000));
+    PendCreditCompute(1023, 1024, 0, &credit);
+    CHECK(!PendCreditSatisfied(&credit, 1000000));
+
+    CHECK_EQ(PendPartialAllowance(500, 0), 500);
+    CHECK_EQ(PendPartialAllowance(500, 1), 0);
+}
+
+static VOID
+TestCreditWait(
+    VOID
+)
+{
+    PEND_CREDIT_WAIT wait;
+    VCOM_PUSH_CREDIT credit;
+
+    PendCreditWaitInitialize(&wait);
+    CHECK(!PendCreditWaiting(&wait));
+    PendCreditCompute(1024, 1024, 0, &credit);
+    CHECK(!PendCreditWake(&wait, &credit));
+
+    // The least minimum decides, in whatever order they arrive
+    PendCreditWaitNote(&wait, 500);
+    PendCreditWaitNote(&wait, 200);
+    PendCreditWaitNote(&wait, 800);
+    CHECK(PendCreditWaiting(&wait));
+    PendCreditCompute(199, 1024, 0, &credit);
+    CHECK(!PendCreditWake(&wait, &credit));
+    CHECK(PendCreditWaiting(&wait));
+
+    // Pended pushes own the space there is
+    PendCreditCompute(600, 1024, 1, &credit);
+    CHECK(!PendCreditWake(&wait, &credit));
+
+    PendCreditCompute(200, 1024, 0, &credit);
+    CHECK(PendCreditWake(&wait, &credit));
+    CHECK(!PendCreditWaiting(&wait));
+    CHECK(!PendCreditWake(&wait, &credit));
+
+    // A minimum beyond the ring, even the largest, waits for an empty one
+    PendCreditWaitNote(&wait, MAXULONG);
+    CHECK(PendCreditWaiting(&wait));
+    PendCreditCompute(1023, 1024, 0, &credit);
+    CHECK(!PendCreditWake(&wait, &credit));
+    PendCreditCompute(1024, 1024, 0, &credit);
+    CHECK(PendCreditWake(&wait, &credit));
+}
+
+//
+// GET_CREDIT waiters and drains taking their steps in random interleavings,
+// in the order queue.c takes them. A GET_CREDIT checks the credit and
+// queues its request; the same thread then notes its minimum and checks
+// once more, while the request may already have been handed back and be
+// evaluated afresh. A drain frees space, asks PendCreditWake, and hands
+// every queued request back. A push takes space away. Once everything has
+// run its course, no request may be left queued whose minimum the ring
+// satisfies.
+//
+
+#define WAIT_ACTORS     6
+#define WAIT_RING       1000
+#define WAIT_ROUNDS     20000
+
+typedef struct _WAIT_REQUEST {
+    ULONG       Minimum;
+    BOOLEAN     Dispatched;     // about to be evaluated
+    BOOLEAN     Queued;         // on the credit queue
+    ULONG       Notes;          // threads that queued it and are yet to note
+    ULONG       Rechecks;       // threads that noted and are yet to check again
+} WAIT_REQUEST;
+
+typedef struct _WAIT_MODEL {
+    PEND_CREDIT_WAIT Wait;
+    size_t          Free;
+    WAIT_REQUEST    Request[WAIT_ACTORS];
+    ULONG           DrainStep;      // 0 idle, 1 asks PendCreditWake, 2 hands back
+    ULONG64         Wakes;
+    ULONG64         Satisfied;
+} WAIT_MODEL;
+
+static BOOLEAN
+WaitSatisfied(
+    WAIT_MODEL* Model,
+    ULONG Minimum
+)
+{
+    VCOM_PUSH_CREDIT credit;
+
+    PendCreditCompute(Model->Free, WAIT_RING, 0, &credit);
+    return PendCreditSatisfied(&credit, Minimum);
+}
+
+// QueueWakeCreditWaiters
+static VOID
+WaitHandBack(
+    WAIT_MODEL* Model
+)
+{
+    ULONG i;
+
+    Model->Wakes++;
+    for (i = 0; i < WAIT_ACTORS; i++) {
+        if (Model->Request[i].Queued) {
+            Model->Request[i].Queued = FALSE;
+            Model->Request[i].Dispatched = TRUE;
+        }
+    }
+}
+
+// One step of one of the threads working on request i; FALSE if none has
+// one left
+static BOOLEAN
+WaitStepWaiter(
+    WAIT_MODEL* Model,
+    ULONG i,
+    ULONG64 Choice
+)
+{
+    WAIT_REQUEST* request = &Model->Request[i];
+
+    if (request->Dispatched && (Choice % 3 == 0 || request->Notes + request->Rechecks == 0)) {
+        request->Dispatched = FALSE;
+        if (WaitSatisfied(Model, request->Minimum)) {
+            Model->Satisfied++;
+        }
+        else {
+            request->Queued = TRUE;
+            request->Notes++;
+        }
+    }
+    else if (request->Notes != 0 && (Choice % 3 == 1 || request->Rechecks == 0)) {
+        PendCreditWaitNote(&Model->Wait, request->Minimum);
+        request->Notes--;
+        request->Rechecks++;
+    }
+    else if (request->Rechecks != 0) {
+        request->Rechecks--;
+        if (WaitSatisfied(Model, request->Minimum)) {
+            WaitHandBack(Model);
+        }
+    }
+    else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOLEAN
+WaitStepDrain(
+    WAIT_MODEL* Model,
+    size_t Amount
+)
+{
+    VCOM_PUSH_CREDIT credit;
+
+    switch (Model->DrainStep) {
+    case 0:
+        if (Amount == 0) {
+            return FALSE;
+        }
+        Model->Free = min(Model->Free + Amount, (size_t)WAIT_RING);
+        Model->DrainStep = 1;
+        break;
+    case 1:
+        PendCreditCompute(Model->Free, WAIT_RING, 0, &credit);
+        Model->DrainStep = PendCreditWake(&Model->Wait, &credit) ? 2 : 0;
+        break;
+    default:
+        WaitHandBack(Model);
+        Model->DrainStep = 0;
+        break;
+    }
+    return TRUE;
+}
+
+static VOID
+TestCreditWaitRandomized(
+    VOID
+)
+{
+    static WAIT_MODEL model;
+    unsigned long long seed = 0x9B05688C2B3E6C1FULL;
+    ULONG64 lost = 0;
+    ULONG64 satisfied = 0;
+    ULONG64 wakes = 0;
+    ULONG round;
+    ULONG i;
+
+    for (round = 0; round < WAIT_ROUNDS; round++) {
+        ULONG steps = 1 + (ULONG)(TestRandom(&seed) % 200);
+        BOOLEAN busy = TRUE;
+
+        RtlZeroMemory(&model, sizeof(model));
+        PendCreditWaitInitialize(&model.Wait);
+        model.Free = (size_t)(TestRandom(&seed) % (WAIT_RING + 1));
+        for (i = 0; i < WAIT_ACTORS; i++) {
+            model.Request[i].Minimum = (ULONG)(TestRandom(&seed) % (WAIT_RING + 200));
+            model.Request[i].Dispatched = TRUE;
+        }
+
+        while (steps-- != 0) {
+            ULONG64 r = TestRandom(&seed);
+            ULONG actor = (ULONG)(r % (WAIT_ACTORS + 2));
+
+            if (actor < WAIT_ACTORS) {
+                (VOID)WaitStepWaiter(&model, actor, r >> 8);
+            }
+            else if (actor == WAIT_ACTORS) {
+                (VOID)WaitStepDrain(&model, (size_t)(1 + (r >> 8) % 300));
+            }
+            else if (model.DrainStep == 0) {
+                // A push, between drains
+                model.Free -= min(model.Free, (size_t)((r >> 8) % 200));
+            }
+        }
+
+        // Let every step under way finish, with no more space freed
+        while (busy) {
+            busy = WaitStepDrain(&model, 0);
+            for (i = 0; i < WAIT_ACTORS; i++) {
+                busy |= WaitStepWaiter(&model, i, TestRandom(&seed));
+            }
+        }
+
+        for (i = 0; i < WAIT_ACTORS; i++) {
+            lost += (model.Request[i].Queued && WaitSatisfied(&model, model.Request[i].Minimum));
+        }
+        satisfied += model.Satisfied;
+        wakes += model.Wakes;
+    }
+
+    printf("  %llu waits satisfied, %llu wakes, over %u rounds\n",
+        (unsigned long long)satisfied, (unsigned long long)wakes, WAIT_ROUNDS);
+    CHECK(wakes > WAIT_ROUNDS);
+    CHECK_EQ(lost, 0);
+}
+
+//
+// The owner's side of a PEND_QUEUE, as queue.c is: a ring, a FIFO of
+// waiting requests, and completion. Request i carries stream bytes from
+// its Base on, so the reader can tell whose bytes it sees and in what
+// order. The queueing decisions are pendxfer.c's own.
+//
+
+#define SIM_CAPACITY    1024
+#define SIM_MAX_PENDING 64
+
+typedef struct _SIM_REQUEST {
+    ULONG64     Base;
+    size_t      Length;
+    size_t      Transferred;
+    NTSTATUS    Status;
+    BOOLEAN     Done;
+    BOOLEAN     Held;
+    BOOLEAN     Cancelled;      // while queued: holding it fails
+} SIM_REQUEST;
+
+typedef struct _SIM {
+    PEND_QUEUE      Pend;
+    RING_BUFFER_P2  Ring;
+    BYTE            Storage[SIM_CAPACITY];
+    SIM_REQUEST*    Queue[SIM_MAX_PENDING];
+    ULONG           Head;
+    ULONG           Queued;
+    BOOLEAN         Stopped;        // nothing new starts, as on a stopping port
+    ULONG           Completions;
+    SIM_REQUEST*    Completed[SIM_MAX_PENDING];
+    ULONG64         ReadCounter;    // next stream byte the reader expects
+    ULONG64         Mismatches;
+} SIM;
+
+// QueueWriteRequestToRing: as much of the rest as fits, up to Allowed
+static NTSTATUS
+SimWriteToRing(
+    SIM* Sim,
+    SIM_REQUEST* Request,
+    size_t Allowed,
+    size_t* Written
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t rest = Request->Length - Request->Transferred;
+    size_t got;
+    size_t i;
+    ULONG s;
+
+    got = RingBufferP2Reserve(&Sim->Ring, min(rest, Allowed), &spans);
+    for (s = 0; s < spans.Count; s++) {
+        for (i = 0; i < spans.Span[s].Length; i++) {
+            spans.Span[s].Buffer[i] = TestStreamByte(Request->Base + Request->Transferred++);
+        }
+    }
+    RingBufferP2Commit(&Sim->Ring, got);
+    *Written = got;
+
+    return PendTransferStatus(Request->Length, Request->Transferred,
+        (got < min(rest, Allowed)) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS);
+}
+
+static NTSTATUS
+SimTransfer(
+    PPEND_QUEUE Self,
+    PVOID Request,
+    size_t* Written
+)
+{
+    return SimWriteToRing((SIM*)Self->Owner, (SIM_REQUEST*)Request, (size_t)-1, Written);
+}
+
+static ULONG
+SimQueued(
+    PPEND_QUEUE Self
+)
+{
+    return ((SIM*)Self->Owner)->Queued;
+}
+
+static BOOLEAN
+SimDequeue(
+    PPEND_QUEUE Self,
+    PVOID* Request
+)
+{
+    SIM* sim = (SIM*)Self->Owner;
+
+    if (sim->Stopped || sim->Queued == 0) {
+        return FALSE;
+    }
+    *Request = sim->Queue[sim->Head++ % SIM_MAX_PENDING];
+    sim->Queued--;
+    return TRUE;
+}
+
+static NTSTATUS
+SimHold(
+    PPEND_QUEUE Self,
+    PVOID Request
+)
+{
+    SIM_REQUEST* request = (SIM_REQUEST*)Request;
+
+    if (request->Cancelled) {
+        return STATUS_CANCELLED;
+    }
+    request->Held = TRUE;
+    return STATUS_SUCCESS;
+}
+
+static const PEND_QUEUE_OPS SimOps = { SimTransfer, SimQueued, SimDequeue, SimHold };
+
+static VOID
+SimInitialize(
+    SIM* Sim
+)
+{
+    RtlZeroMemory(Sim, sizeof(*Sim));
+    RingBufferP2Initialize(&Sim->Ring, Sim->Storage, SIM_CAPACITY);
+    PendInitialize(&Sim->Pend, &SimOps, Sim);
+}
+
+static VOID
+SimComplete(
+    SIM* Sim,
+    SIM_REQUEST* Request,
+    NTSTATUS Status
+)
+{
+    Request->Status = Status;
+    Request->Done = TRUE;
+    Request->Held = FALSE;
+    Sim->Completed[Sim->Completions++ % SIM_MAX_PENDING] = Request;
+}
+
+// QueueStartWrite
+static PEND_STEP
+SimStart(
+    SIM* Sim,
+    SIM_REQUEST* Request
+)
+{
+    PEND_STEP step;
+    NTSTATUS status;
+    size_t written;
+
+    step = PendStart(&Sim->Pend, Request, &status, &written);
+    if (step == PendStepQueue) {
+        CHECK_EQ(written, 0);
+        Sim->Queue[(Sim->Head + Sim->Queued++) % SIM_MAX_PENDING] = Request;
+    }
+    else if (step == PendStepDone) {
+        SimComplete(Sim, Request, status);
+    }
+    else {
+        CHECK_EQ(step, PendStepWaiting);
+        CHECK(Sim->Pend.Current == Request);
+    }
+    return step;
+}
+
+// QueueServicePendingWrites, after every drain
+static size_t
+SimService(
+    SIM* Sim
+)
+{
+    PVOID request;
+    PEND_STEP step;
+    NTSTATUS status;
+    size_t written;
+    size_t total = 0;
+
+    for (;;) {
+        step = PendService(&Sim->Pend, &request, &status, &written);
+        total += written;
+        if (step != PendStepFinished && step != PendStepDone) {
+            CHECK(request == NULL);
+            return total;
+        }
+        CHECK(request != NULL);
+        CHECK(Sim->Pend.Current != request);
+        CHECK_EQ(((SIM_REQUEST*)request)->Held, step == PendStepFinished);
+        SimComplete(Sim, (SIM_REQUEST*)request, status);
+    }
+}
+
+// A partial-mode push arriving now: what it gets into the ring
+static size_t
+SimPartialPush(
+    SIM* Sim,
+    SIM_REQUEST* Request
+)
+{
+    size_t written;
+
+    (VOID)SimWriteToRing(Sim, Request, PendPartialAllowance(Request->Length, PendPending(&Sim->Pend)), &written);
+    return Request->Transferred;
+}
+
+// The reader takes up to Length bytes and checks them against the stream
+static size_t
+SimRead(
+    SIM* Sim,
+    size_t Length
+)
+{
+    RING_BUFFER_SPANS spans;
+    size_t got;
+    size_t i;
+    ULONG s;
+
+    got = RingBufferP2Peek(&Sim->Ring, Length, &spans);
+    for (s = 0; s < spans.Count; s++) {
+        for (i = 0; i < spans.Span[s].Length; i++) {
+            Sim->Mismatches += (spans.Span[s].Buffer[i] != TestStreamByte(Sim->ReadCounter++));
+        }
+    }
+    RingBufferP2Consume(&Sim->Ring, got);
+    return got;
+}
+
+// Requests that fit go straight in while nothing waits; after the first
+// that does not, everything queues behind it, however small
+static VOID
+TestStartOrder(
+    VOID
+)
+{
+    static SIM sim;
+    SIM_REQUEST small = { 0, 100 };
+    SIM_REQUEST fill = { 100, SIM_CAPACITY };
+    SIM_REQUEST tiny = { 100 + SIM_CAPACITY, 1 };
+    SIM_REQUEST partial = { 0, 50 };
+
+    SimInitialize(&sim);
+    CHECK_EQ(PendPending(&sim.Pend), 0);
+    CHECK_EQ(SimService(&sim), 0);
+
+    CHECK_EQ(SimStart(&sim, &small), PendStepDone);
+    CHECK_EQ(small.Status, STATUS_SUCCESS);
+    CHECK(!small.Held);
+
+    CHECK_EQ(SimStart(&sim, &fill), PendStepWaiting);
+    CHECK_EQ(fill.Transferred, SIM_CAPACITY - 100);
+    CHECK(fill.Held);
+    CHECK_EQ(PendPending(&sim.Pend), 1);
+
+    // Room for it, but not ahead of the one waiting; nor a partial push
+    SimRead(&sim, 200);
+    CHECK_EQ(SimStart(&sim, &tiny), PendStepQueue);
+    CHECK_EQ(PendPending(&sim.Pend), 2);
+    CHECK_EQ(SimPartialPush(&sim, &partial), 0);
+
+    CHECK_EQ(SimService(&sim), 101);
+    CHECK_EQ(sim.Completions, 3);
+    CHECK(sim.Completed[1] == &fill);
+    CHECK(sim.Completed[2] == &tiny);
+    CHECK_EQ(PendPending(&sim.Pend), 0);
+
+    // With nothing waiting a partial push takes what fits
+    partial.Base = tiny.Base + 1;
+    CHECK_EQ(SimPartialPush(&sim, &partial), 50);
+    while (SimRead(&sim, 100) != 0) {
+    }
+    CHECK_EQ(sim.ReadCounter, partial.Base + 50);
+    CHECK_EQ(sim.Mismatches, 0);
+}
+
+// A request cancelled while it waited in the queue cannot be held: it is
+// finished with no bytes in, and the one behind it carries on. One that is
+// cancelled as it starts keeps the bytes that fit.
+static VOID
+TestHoldRefused(
+    VOID
+)
+{
+    static SIM sim;
+    SIM_REQUEST first = { 0, SIM_CAPACITY + 10 };
+    SIM_REQUEST cancelled = { 0, 300 };
+    SIM_REQUEST third = { SIM_CAPACITY + 10, 200 };
+    SIM_REQUEST late = { 0, 2 * SIM_CAPACITY };
+
+    SimInitialize(&sim);
+    CHECK_EQ(SimStart(&sim, &first), PendStepWaiting);
+    CHECK_EQ(SimStart(&sim, &cancelled), PendStepQueue);
+    CHECK_EQ(SimStart(&sim, &third), PendStepQueue);
+    cancelled.Cancelled = TRUE;
+
+    SimRead(&sim, 500);
+    SimService(&sim);
+    CHECK_EQ(sim.Completions, 3);
+    CHECK(sim.Completed[0] == &first);
+    CHECK(sim.Completed[1] == &cancelled);
+    CHECK_EQ(cancelled.Status, STATUS_CANCELLED);
+    CHECK_EQ(cancelled.Transferred, 0);
+    CHECK(sim.Completed[2] == &third);
+    CHECK_EQ(third.Status, STATUS_SUCCESS);
+
+    while (SimRead(&sim, 100) != 0) {
+    }
+    CHECK_EQ(sim.ReadCounter, third.Base + third.Length);
+    CHECK_EQ(sim.Mismatches, 0);
+
+    late.Base = sim.ReadCounter;
+    late.Cancelled = TRUE;
+    CHECK_EQ(SimStart(&sim, &late), PendStepDone);
+    CHECK_EQ(late.Status, STATUS_CANCELLED);
+    CHECK_EQ(late.Transferred, SIM_CAPACITY);
+    CHECK(sim.Pend.Current == NULL);
+    CHECK_EQ(PendPending(&sim.Pend), 0);
+}
+
+// A stopping port finishes the current request but starts no other; the
+// flush takes the current one away, and the queue starts again afterwards
+static VOID
+TestStopped(
+    VOID
+)
+{
+    static SIM sim;
+    SIM_REQUEST first = { 0, SIM_CAPACITY + 100 };
+    SIM_REQUEST second = { SIM_CAPACITY + 100, 100 };
+    SIM_REQUEST third = { SIM_CAPACITY + 200, 2 * SIM_CAPACITY };
+    SIM_REQUEST fourth = { 0, 10 };
+
+    SimInitialize(&sim);
+    CHECK_EQ(SimStart(&sim, &first), PendStepWaiting);
+    CHECK_EQ(SimStart(&sim, &second), PendStepQueue);
+    sim.Stopped = TRUE;
+
+    SimRead(&sim, 400);
+    CHECK_EQ(SimService(&sim), 100);
+    CHECK(first.Done);
+    CHECK(!second.Done);
+    CHECK_EQ(PendPending(&sim.Pend), 1);
+
+    sim.Stopped = FALSE;
+    CHECK_EQ(SimService(&sim), 100);
+    CHECK(second.Done);
+
+    CHECK_EQ(SimStart(&sim, &third), PendStepWaiting);
+    CHECK(PendTakeCurrent(&sim.Pend) == &third);
+    CHECK(PendTakeCurrent(&sim.Pend) == NULL);
+    CHECK_EQ(PendPending(&sim.Pend), 0);
+
+    SimRead(&sim, SIM_CAPACITY);
+    fourth.Base = third.Base + third.Transferred;
+    CHECK_EQ(SimStart(&sim, &fourth), PendStepDone);
+    while (SimRead(&sim, 100) != 0) {
+    }
+    CHECK_EQ(sim.ReadCounter, fourth.Base + fourth.Length);
+    CHECK_EQ(sim.Mismatches, 0);
+}
+
+// Writes many times the ring finish over many drains, in order and with
+// their full byte counts, and a partial push cannot cut in
+static VOID
+TestWritesAcrossDrains(
+    VOID
+)
+{
+    static SIM sim;
+    SIM_REQUEST big = { 0, 10 * SIM_CAPACITY + 37, 0, 0, FALSE };
+    SIM_REQUEST second = { 10 * SIM_CAPACITY + 37, 100, 0, 0, FALSE };
+    SIM_REQUEST third = { 10 * SIM_CAPACITY + 137, 3 * SIM_CAPACITY, 0, 0, FALSE };
+    SIM_REQUEST partial = { 0, 50, 0, 0, FALSE };
+    ULONG drains = 0;
+
+    SimInitialize(&sim);
+    SimStart(&sim, &big);
+    SimStart(&sim, &second);
+    SimStart(&sim, &third);
+    CHECK(!big.Done);
+    CHECK_EQ(big.Transferred, SIM_CAPACITY);
+    CHECK_EQ(second.Transferred, 0);
+
+    CHECK_EQ(SimPartialPush(&sim, &partial), 0);
+
+    while (!third.Done) {
+        SimRead(&sim, 100);
+        SimService(&sim);
+        drains++;
+        CHECK(drains < 1000);
+    }
+    while (SimRead(&sim, 100) != 0) {
+    }
+
+    CHECK(drains >= (ULONG)((big.Length + second.Length + third.Length - SIM_CAPACITY) / 100));
+    CHECK_EQ(sim.Completions, 3);
+    CHECK(sim.Completed[0] == &big);
+    CHECK(sim.Completed[1] == &second);
+    CHECK(sim.Completed[2] == &third);
+    CHECK_EQ(big.Status, STATUS_SUCCESS);
+    CHECK_EQ(big.Transferred, big.Length);
+    CHECK_EQ(second.Transferred, second.Length);
+    CHECK_EQ(third.Transferred, third.Length);
+    CHECK_EQ(sim.ReadCounter, third.Base + third.Length);
+    CHECK_EQ(sim.Mismatches, 0);
+}
+
+// A write cancelled part way reports the bytes already in the ring, which
+// stay there, and the next one carries on after them
+static VOID
+TestCancelPartWay(
+    VOID
+)
+{
+    static SIM sim;
+    SIM_REQUEST first = { 0, 4 * SIM_CAPACITY, 0, 0, FALSE };
+    SIM_REQUEST second = { 0, 200, 0, 0, FALSE };
+    ULONG i;
+
+    SimInitialize(&sim);
+    SimStart(&sim, &first);
+    SimStart(&sim, &second);
+    for (i = 0; i < 5; i++) {
+        SimRead(&sim, 100);
+        SimService(&sim);
+    }
+    CHECK_EQ(first.Transferred, SIM_CAPACITY + 500);
+
+    // EvtRequestCancelWrite on the current request; the one behind it is
+    // not current, so it stays where it is
+    CHECK(!PendRemove(&sim.Pend, &second));
+    CHECK(PendRemove(&sim.Pend, &first));
+    CHECK(!PendRemove(&sim.Pend, &first));
+    SimComplete(&sim, &first, STATUS_CANCELLED);
+    second.Base = first.Transferred;
+    SimService(&sim);
+
+    CHECK(first.Done);
+    CHECK_EQ(first.Status, STATUS_CANCELLED);
+    CHECK_EQ(first.Transferred, SIM_CAPACITY + 500);
+    CHECK(!second.Done);
+    while (!second.Done) {
+        SimRead(&sim, 100);
+        SimService(&sim);
+    }
+    while (SimRead(&sim, 100) != 0) {
+    }
+    CHECK_EQ(second.Transferred, 200);
+    CHECK_EQ(sim.ReadCounter, first.Transferred + 200);
+    CHECK_EQ(sim.Mismatches, 0);
+}
+
+//
+// A service in pend mode keeps SIM_OUTSTANDING pushes issued and issues
+// the next only when one completes; the reader takes less per tick than a
+// push carries. Nothing is retried: every push is issued once.
+//
+
+#define SIM_OUTSTANDING 4
+#define SIM_PUSH        700
+#define SIM_READ        300
+#define SIM_TICKS       20000
+#define SIM_WARMUP      100
+
+static VOID
+TestPushSteadyState(
+    VOID
+)
+{
+    static SIM sim;
+    static SIM_REQUEST pushes[SIM_MAX_PENDING];
+    VCOM_PUSH_CREDIT credit;
+    ULONG64 base = 0;
+    ULONG issued = 0;
+    ULONG seen = 0;
+    ULONG notFull = 0;
+    ULONG tick;
+
+    SimInitialize(&sim);
+
+    for (issued = 0; issued < SIM_OUTSTANDING; issued++) {
+        SIM_REQUEST* push = &pushes[issued % SIM_MAX_PENDING];
+
+        RtlZeroMemory(push, sizeof(*push));
+        push->Base = base;
+        push->Length = SIM_PUSH;
+        base += SIM_PUSH;
+        SimStart(&sim, push);
+    }
+
+    for (tick = 0; tick < SIM_TICKS; tick++) {
+        SimRead(&sim, SIM_READ);
+        SimService(&sim);
+
+        // One new push per completion
+        while (seen < sim.Completions) {
+            SIM_REQUEST* push = &pushes[issued++ % SIM_MAX_PENDING];
+
+            CHECK_EQ(sim.Completed[seen % SIM_MAX_PENDING]->Status, STATUS_SUCCESS);
+            CHECK_EQ(sim.Completed[seen % SIM_MAX_PENDING]->Transferred, SIM_PUSH);
+            seen++;
+
+            RtlZeroMemory(push, sizeof(*push));
+            push->Base = base;
+            push->Length = SIM_PUSH;
+            base += SIM_PUSH;
+            SimStart(&sim, push);
+        }
+
+        if (tick >= SIM_WARMUP) {
+            size_t space;
+
+            RingBufferP2GetAvailableSpace(&sim.Ring, &space);
+            notFull += (space != 0);
+
+            PendCreditCompute(space, SIM_CAPACITY, PendPending(&sim.Pend), &credit);
+            CHECK_EQ(credit.FreeBytes, 0);
+            CHECK_EQ(credit.PushesPending, SIM_OUTSTANDING);
+        }
+    }
+
+    printf("  %u pushes completed in %u ticks, %u issued in all\n", seen, SIM_TICKS, issued);
+
+    // The reader sets the pace, and the ring never sits below full
+    CHECK_EQ(issued, seen + SIM_OUTSTANDING);
+    CHECK(seen >= (ULONG)((ULONG64)SIM_TICKS * SIM_READ / SIM_PUSH) - SIM_OUTSTANDING - 2);
+    CHECK_EQ(notFull, 0);
+    CHECK_EQ(sim.Mismatches, 0);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestTransferStatus);
+    RUN_TEST(TestCredit);
+    RUN_TEST(TestCreditWait);
+    RUN_TEST(TestCreditWaitRandomized);
+    RUN_TEST(TestStartOrder);
+    RUN_TEST(TestHoldRefused);
+    RUN_TEST(TestStopped);
+    RUN_TEST(TestWritesAcrossDrains);
+    RUN_TEST(TestCancelPartWay);
+    RUN_TEST(TestPushSteadyState);
+    return TestResult();
+}
@@ -0,0 +1,170 @@
+/*++
+
+Module Name:
+
+    test_portcounters.c
+
+Abstract:
+
+    Tests for the performance counter updates (portcounters.c): which
+    counter each transfer lands in, the high-water marks, and a reader on
+    another thread never seeing a count go backwards.
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "public.h"
+#include "portcounters.h"
+#include "testing.h"
+
+static VOID
+TestInitialize(
+    VOID
+)
+{
+    VCOM_PORT_COUNTERS counters;
+
+    RtlFillMemory(&counters, sizeof(counters), 0xAB);
+    PortCountersInitialize(&counters, 17);
+    CHECK_EQ(counters.Version, VCOM_COUNTERS_VERSION);
+    CHECK_EQ(counters.Size, sizeof(counters));
+    CHECK_EQ(counters.PortId, 17);
+    CHECK_EQ(counters.BytesWritten, 0);
+    CHECK_EQ(counters.ParityErrors, 0);
+    CHECK_EQ(counters.FromNetFree, 0);
+}
+
+static VOID
+TestTransfer(
+    VOID
+)
+{
+    VCOM_PORT_COUNTERS counters;
+
+    PortCountersInitialize(&counters, 1);
+
+    // Application writes and the service draining them
+    PortCountersTransfer(&counters, TRUE, TRUE, 100, 100);
+    PortCountersTransfer(&counters, TRUE, TRUE, 50, 150);
+    PortCountersTransfer(&counters, TRUE, FALSE, 120, 30);
+    CHECK_EQ(counters.BytesWritten, 150);
+    CHECK_EQ(counters.BytesDrained, 120);
+    CHECK_EQ(counters.ToUserOccupancy, 30);
+    CHECK_EQ(counters.ToUserHighWater, 150);
+
+    // The other direction is untouched
+    CHECK_EQ(counters.BytesPushed, 0);
+    CHECK_EQ(counters.BytesRead, 0);
+    CHECK_EQ(counters.FromNetOccupancy, 0);
+    CHECK_EQ(counters.FromNetHighWater, 0);
+
+    // Pushes and reads; a consumer's occupancy never raises the high water
+    PortCountersTransfer(&counters, FALSE, TRUE, 10, 10);
+    PortCountersTransfer(&counters, FALSE, FALSE, 4, 6);
+    PortCountersTransfer(&counters, FALSE, FALSE, 0, 500);
+    CHECK_EQ(counters.BytesPushed, 10);
+    CHECK_EQ(counters.BytesRead, 4);
+    CHECK_EQ(counters.FromNetOccupancy, 500);
+    CHECK_EQ(counters.FromNetHighWater, 10);
+
+    // A lower occupancy leaves the high water where it was
+    PortCountersTransfer(&counters, FALSE, TRUE, 2, 8);
+    CHECK_EQ(counters.FromNetHighWater, 10);
+    PortCountersTransfer(&counters, FALSE, TRUE, 5, 13);
+    CHECK_EQ(counters.FromNetHighWater, 13);
+    CHECK_EQ(counters.BytesWritten, 150);
+}
+
+//
+// One thread writes the counters as the producer and consumer sides of
+// a ring would, each under its own lock; another reads them as a monitor
+// mapping the page would.
+//
+
+#define CONCURRENT_STEPS    2000000
+
+typedef struct _MONITOR {
+    VCOM_PORT_COUNTERS  Counters;
+    volatile LONG       Done;
+    ULONG64             Reads;
+    ULONG64             Backwards;
+} MONITOR;
+
+static void*
+MonitorThread(
+    void* Context
+)
+{
+    MONITOR* monitor = (MONITOR*)Context;
+    LONG64 written = 0;
+    LONG64 drained = 0;
+    LONG64 highWater = 0;
+
+    while (!ReadNoFence(&monitor->Done)) {
+        LONG64 w = ReadNoFence64(&monitor->Counters.BytesWritten);
+        LONG64 d = ReadNoFence64(&monitor->Counters.BytesDrained);
+        LONG64 h = ReadNoFence64(&monitor->Counters.ToUserHighWater);
+
+        monitor->Backwards += (w < written) + (d < drained) + (h < highWater);
+        written = w;
+        drained = d;
+        highWater = h;
+        monitor->Reads++;
+    }
+    return NULL;
+}
+
+static VOID
+TestConcurrentReader(
+    VOID
+)
+{
+    static MONITOR monitor;
+    pthread_t thread;
+    unsigned long long seed = 0x853C49E6748FEA9BULL;
+    size_t occupancy = 0;
+    size_t count;
+    ULONG64 produced = 0;
+    ULONG64 consumed = 0;
+    ULONG step;
+
+    PortCountersInitialize(&monitor.Counters, 2);
+    pthread_create(&thread, NULL, MonitorThread, &monitor);
+
+    for (step = 0; step < CONCURRENT_STEPS; step++) {
+        if (TestRandom(&seed) % 2 == 0) {
+            count = (size_t)(TestRandom(&seed) % 256);
+            occupancy += count;
+            produced += count;
+            PortCountersTransfer(&monitor.Counters, TRUE, TRUE, count, occupancy);
+        }
+        else {
+            count = (size_t)(TestRandom(&seed) % (occupancy + 1));
+            occupancy -= count;
+            consumed += count;
+            PortCountersTransfer(&monitor.Counters, TRUE, FALSE, count, occupancy);
+        }
+    }
+
+    InterlockedExchange(&monitor.Done, 1);
+    pthread_join(thread, NULL);
+
+    printf("  %llu monitor reads\n", (unsigned long long)monitor.Reads);
+    CHECK_EQ(monitor.Backwards, 0);
+    CHECK_EQ((ULONG64)monitor.Counters.BytesWritten, produced);
+    CHECK_EQ((ULONG64)monitor.Counters.BytesDrained, consumed);
+    CHECK_EQ((size_t)monitor.Counters.ToUserOccupancy, occupancy);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestInitialize);
+    RUN_TEST(TestTransfer);
+    RUN_TEST(TestConcurrentReader);
+    return TestResult();
+}
@@ -0,0 +1,469 @@
+/*++
+
+Module Name:
+
+    test_portslots.c
+
+Abstract:
+
+    Tests for the port table slots (portslots.c): PortId assignment and
+    reuse, lookups during and after removal, rundown waiting out the
+    references handed out, null-modem pairing and unpairing, and lookups
+    on other threads racing ports being added and removed. A mutex stands
+    in for the driver's table spinlock.
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "public.h"
+#include "portslots.h"
+#include "testing.h"
+
+static pthread_mutex_t TableLock = PTHREAD_MUTEX_INITIALIZER;
+
+static PPORT_SLOT
+Acquire(
+    PPORT_SLOTS Slots,
+    ULONG PortId
+)
+{
+    PPORT_SLOT slot;
+
+    pthread_mutex_lock(&TableLock);
+    slot = PortSlotsAcquire(Slots, PortId);
+    pthread_mutex_unlock(&TableLock);
+    return slot;
+}
+
+static VOID
+Remove(
+    PPORT_SLOTS Slots,
+    PPORT_SLOT Slot
+)
+{
+    pthread_mutex_lock(&TableLock);
+    PortSlotsRemove(Slots, Slot);
+    pthread_mutex_unlock(&TableLock);
+    PortSlotsRundown(Slots, Slot);
+}
+
+static VOID
+TestInsertAndReuse(
+    VOID
+)
+{
+    static PORT_SLOTS slots;
+    static PORT_SLOT ports[VCOM_MAX_PORTS + 1];
+    ULONG i;
+
+    for (i = 0; i <= VCOM_MAX_PORTS; i++) {
+        PortSlotInitialize(&ports[i]);
+        CHECK_EQ(ports[i].PortId, VCOM_INVALID_PORT_ID);
+        CHECK_EQ(ports[i].PeerId, VCOM_INVALID_PORT_ID);
+    }
+
+    for (i = 0; i < VCOM_MAX_PORTS; i++) {
+        CHECK_EQ(PortSlotsInsert(&slots, &ports[i]), STATUS_SUCCESS);
+        CHECK_EQ(ports[i].PortId, i);
+    }
+    CHECK_EQ(PortSlotsInsert(&slots, &ports[VCOM_MAX_PORTS]), STATUS_INSUFFICIENT_RESOURCES);
+    CHECK_EQ(ports[VCOM_MAX_PORTS].PortId, VCOM_INVALID_PORT_ID);
+
+    // The lowest free id goes to the next port
+    Remove(&slots, &ports[7]);
+    Remove(&slots, &ports[3]);
+    CHECK_EQ(ports[7].PortId, VCOM_INVALID_PORT_ID);
+    CHECK_EQ(PortSlotsInsert(&slots, &ports[VCOM_MAX_PORTS]), STATUS_SUCCESS);
+    CHECK_EQ(ports[VCOM_MAX_PORTS].PortId, 3);
+    CHECK_EQ(PortSlotsInsert(&slots, &ports[7]), STATUS_SUCCESS);
+    CHECK_EQ(ports[7].PortId, 7);
+
+    // Running down a port that never made it into the table does nothing
+    PortSlotInitialize(&ports[3]);
+    Remove(&slots, &ports[3]);
+    CHECK(slots.Entries[3] == &ports[VCOM_MAX_PORTS]);
+}
+
+static VOID
+TestAcquire(
+    VOID
+)
+{
+    static PORT_SLOTS slots;
+    PORT_SLOT port;
+    PPORT_SLOT found;
+
+    PortSlotInitialize(&port);
+    CHECK(Acquire(&slots, 0) == NULL);
+    CHECK_EQ(PortSlotsInsert(&slots, &port), STATUS_SUCCESS);
+
+    found = Acquire(&slots, 0);
+    CHECK(found == &port);
+    CHECK(Acquire(&slots, 1) == NULL);
+    CHECK(Acquire(&slots, VCOM_MAX_PORTS) == NULL);
+    CHECK(Acquire(&slots, VCOM_INVALID_PORT_ID) == NULL);
+    PortSlotRelease(found);
+
+    Remove(&slots, &port);
+    CHECK(Acquire(&slots, 0) == NULL);
+}
+
+//
+// Rundown: removal waits for every reference handed out before it, and
+// none is handed out once it has begun
+//
+
+typedef struct _RUNDOWN_CASE {
+    PORT_SLOTS          Slots;
+    PORT_SLOT           Port;
+    volatile LONG       Started;
+    volatile LONG       Finished;
+} RUNDOWN_CASE;
+
+static void*
+RundownThread(
+    void* Context
+)
+{
+    RUNDOWN_CASE* test = (RUNDOWN_CASE*)Context;
+
+    InterlockedExchange(&test->Started, 1);
+    Remove(&test->Slots, &test->Port);
+    InterlockedExchange(&test->Finished, 1);
+    return NULL;
+}
+
+static VOID
+TestRundownWaits(
+    VOID
+)
+{
+    static RUNDOWN_CASE test;
+    pthread_t thread;
+    PPORT_SLOT held[2];
+    ULONG spins;
+
+    PortSlotInitialize(&test.Port);
+    CHECK_EQ(PortSlotsInsert(&test.Slots, &test.Port), STATUS_SUCCESS);
+    PortSlotNoteReadyWaiter(&test.Slots, &test.Port);
+    held[0] = Acquire(&test.Slots, 0);
+    held[1] = Acquire(&test.Slots, 0);
+    CHECK(held[0] != NULL && held[1] != NULL);
+
+    pthread_create(&thread, NULL, RundownThread, &test);
+    while (ReadNoFence(&test.Started) == 0) {
+        sched_yield();
+    }
+
+    // Out of the table at once; the rundown itself refuses new references
+    for (spins = 0; ReadNoFence(&test.Slots.Entries[0]) != NULL && spins < 1000000; spins++) {
+        sched_yield();
+    }
+    CHECK(Acquire(&test.Slots, 0) == NULL);
+    for (spins = 0; (ReadNoFence64(&test.Port.Rundown.Count) & 1) == 0 && spins < 1000000; spins++) {
+        sched_yield();
+    }
+    CHECK(!ExAcquireRundownProtection(&test.Port.Rundown));
+
+    for (spins = 0; spins < 1000; spins++) {
+        sched_yield();
+    }
+    CHECK_EQ(ReadNoFence(&test.Finished), 0);
+    PortSlotRelease(held[0]);
+    for (spins = 0; spins < 1000; spins++) {
+        sched_yield();
+    }
+    CHECK_EQ(ReadNoFence(&test.Finished), 0);
+    PortSlotRelease(held[1]);
+
+    pthread_join(thread, NULL);
+    CHECK_EQ(test.Finished, 1);
+    CHECK_EQ(test.Port.PortId, VCOM_INVALID_PORT_ID);
+
+    // Its waiter hint went with it
+    CHECK_EQ(test.Port.ReadyWaiters, 0);
+    CHECK_EQ(test.Slots.ReadyWaiters, 0);
+}
+
+static VOID
+TestReadyWaiters(
+    VOID
+)
+{
+    static PORT_SLOTS slots;
+    static PORT_SLOT ports[40];
+    ULONG waiting[VCOM_MAX_PORTS / 32];
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(ports); i++) {
+        PortSlotInitialize(&ports[i]);
+        CHECK_EQ(PortSlotsInsert(&slots, &ports[i]), STATUS_SUCCESS);
+    }
+    CHECK(!PortSlotsAnyWaiters(&slots));
+
+    // A port counts once however many waits it pends
+    PortSlotNoteReadyWaiter(&slots, &ports[2]);
+    PortSlotNoteReadyWaiter(&slots, &ports[2]);
+    PortSlotNoteReadyWaiter(&slots, &ports[35]);
+    CHECK_EQ(slots.ReadyWaiters, 2);
+    CHECK(PortSlotsAnyWaiters(&slots));
+
+    CHECK_EQ(PortSlotsCollectWaiters(&slots, waiting), 2);
+    CHECK_EQ(waiting[0], 1UL << 2);
+    CHECK_EQ(waiting[1], 1UL << 3);
+    CHECK_EQ(waiting[2], 0);
+
+    CHECK(PortSlotClearReadyWaiter(&slots, &ports[2]));
+    CHECK(!PortSlotClearReadyWaiter(&slots, &ports[2]));
+    CHECK_EQ(slots.ReadyWaiters, 1);
+
+    // A port out of the table is not collected
+    pthread_mutex_lock(&TableLock);
+    PortSlotsRemove(&slots, &ports[35]);
+    pthread_mutex_unlock(&TableLock);
+    CHECK_EQ(PortSlotsCollectWaiters(&slots, waiting), 0);
+    PortSlotsRundown(&slots, &ports[35]);
+    CHECK(!PortSlotsAnyWaiters(&slots));
+}
+
+//
+// Null-modem pairs
+//
+
+static VOID
+TestLink(
+    VOID
+)
+{
+    static PORT_SLOTS slots;
+    static PORT_SLOT ports[4];
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(ports); i++) {
+        PortSlotInitialize(&ports[i]);
+        CHECK_EQ(PortSlotsInsert(&slots, &ports[i]), STATUS_SUCCESS);
+    }
+
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[1]), STATUS_SUCCESS);
+    CHECK_EQ(ports[0].PeerId, 1);
+    CHECK_EQ(ports[1].PeerId, 0);
+
+    // The same pair again, either way round, is not an error; anything
+    // else involving either end is
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[1]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsLink(&ports[1], &ports[0]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[2]), STATUS_DEVICE_BUSY);
+    CHECK_EQ(PortSlotsLink(&ports[2], &ports[1]), STATUS_DEVICE_BUSY);
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[0]), STATUS_DEVICE_BUSY);
+    CHECK_EQ(ports[2].PeerId, VCOM_INVALID_PORT_ID);
+
+    // Ports in shared-ring mode do not pair, whichever end is mapped
+    CHECK_EQ(PortSlotMap(&ports[3]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsLink(&ports[2], &ports[3]), STATUS_INVALID_DEVICE_STATE);
+    CHECK_EQ(PortSlotsLink(&ports[3], &ports[2]), STATUS_INVALID_DEVICE_STATE);
+    CHECK_EQ(ports[2].PeerId, VCOM_INVALID_PORT_ID);
+    CHECK_EQ(ports[3].PeerId, VCOM_INVALID_PORT_ID);
+    PortSlotUnmap(&ports[3]);
+
+    // Loopback
+    CHECK_EQ(PortSlotsLink(&ports[2], &ports[2]), STATUS_SUCCESS);
+    CHECK_EQ(ports[2].PeerId, 2);
+    CHECK_EQ(PortSlotsLink(&ports[2], &ports[2]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsLink(&ports[3], &ports[2]), STATUS_DEVICE_BUSY);
+}
+
+static VOID
+TestUnlink(
+    VOID
+)
+{
+    static PORT_SLOTS slots;
+    static PORT_SLOT ports[3];
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(ports); i++) {
+        PortSlotInitialize(&ports[i]);
+        CHECK_EQ(PortSlotsInsert(&slots, &ports[i]), STATUS_SUCCESS);
+    }
+    CHECK_EQ(PortSlotsUnlink(&slots, &ports[0]), VCOM_INVALID_PORT_ID);
+
+    // Undoing a pair from either end clears both
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[1]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsUnlink(&slots, &ports[1]), 0);
+    CHECK_EQ(ports[0].PeerId, VCOM_INVALID_PORT_ID);
+    CHECK_EQ(ports[1].PeerId, VCOM_INVALID_PORT_ID);
+    CHECK_EQ(PortSlotsUnlink(&slots, &ports[0]), VCOM_INVALID_PORT_ID);
+
+    // Both ends free again
+    CHECK_EQ(PortSlotsLink(&ports[1], &ports[2]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[0]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsUnlink(&slots, &ports[0]), 0);
+    CHECK_EQ(ports[0].PeerId, VCOM_INVALID_PORT_ID);
+
+    // A port being destroyed unlinks first and then leaves the table; its
+    // peer is left unpaired and its id free for the next port
+    CHECK_EQ(PortSlotsUnlink(&slots, &ports[2]), 1);
+    Remove(&slots, &ports[2]);
+    CHECK_EQ(ports[1].PeerId, VCOM_INVALID_PORT_ID);
+    PortSlotInitialize(&ports[2]);
+    CHECK_EQ(PortSlotsInsert(&slots, &ports[2]), STATUS_SUCCESS);
+    CHECK_EQ(ports[2].PortId, 2);
+    CHECK_EQ(ports[2].PeerId, VCOM_INVALID_PORT_ID);
+}
+
+// Mapping and pairing decide under the same lock, so whichever comes first
+// shuts the other out until it is undone
+static VOID
+TestMapExcludesLink(
+    VOID
+)
+{
+    static PORT_SLOTS slots;
+    static PORT_SLOT ports[2];
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(ports); i++) {
+        PortSlotInitialize(&ports[i]);
+        CHECK_EQ(PortSlotsInsert(&slots, &ports[i]), STATUS_SUCCESS);
+    }
+
+    CHECK_EQ(PortSlotMap(&ports[0]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[1]), STATUS_INVALID_DEVICE_STATE);
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[0]), STATUS_INVALID_DEVICE_STATE);
+    CHECK_EQ(ports[0].PeerId, VCOM_INVALID_PORT_ID);
+    PortSlotUnmap(&ports[0]);
+    CHECK(!ports[0].Mapped);
+
+    CHECK_EQ(PortSlotsLink(&ports[0], &ports[1]), STATUS_SUCCESS);
+    CHECK_EQ(PortSlotMap(&ports[0]), STATUS_INVALID_DEVICE_STATE);
+    CHECK_EQ(PortSlotMap(&ports[1]), STATUS_INVALID_DEVICE_STATE);
+    CHECK(!ports[0].Mapped);
+    CHECK(!ports[1].Mapped);
+
+    CHECK_EQ(PortSlotsUnlink(&slots, &ports[0]), 1);
+    CHECK_EQ(PortSlotMap(&ports[1]), STATUS_SUCCESS);
+    CHECK(ports[1].Mapped);
+}
+
+//
+// Lookup threads taking and dropping references on random ids while the
+// main thread adds and removes ports. A reference must only ever be to a
+// port that is live, and removal must not return while one is held.
+//
+
+#define STRESS_PORTS        16
+#define STRESS_LOOKERS      2
+#define STRESS_ROUNDS       20000
+
+typedef struct _STRESS_PORT {
+    PORT_SLOT           Slot;
+    volatile LONG       Live;
+    volatile LONG       Holders;
+} STRESS_PORT;
+
+typedef struct _STRESS {
+    PORT_SLOTS          Slots;
+    STRESS_PORT         Ports[STRESS_PORTS];
+    volatile LONG       Done;
+    volatile LONG64     Found;
+    volatile LONG64     Dead;
+} STRESS;
+
+static void*
+LookerThread(
+    void* Context
+)
+{
+    STRESS* stress = (STRESS*)Context;
+    unsigned long long seed = 0x2545F4914F6CDD1DULL ^ (ULONG_PTR)&seed;
+    PPORT_SLOT slot;
+    STRESS_PORT* port;
+
+    while (ReadNoFence(&stress->Done) == 0) {
+        slot = Acquire(&stress->Slots, (ULONG)(TestRandom(&seed) % STRESS_PORTS));
+        if (slot == NULL) {
+            continue;
+        }
+        port = CONTAINING_RECORD(slot, STRESS_PORT, Slot);
+        InterlockedIncrement(&port->Holders);
+        if (ReadNoFence(&port->Live) == 0) {
+            InterlockedIncrement64(&stress->Dead);
+        }
+        if (TestRandom(&seed) % 8 == 0) {
+            sched_yield();
+        }
+        InterlockedDecrement(&port->Holders);
+        InterlockedIncrement64(&stress->Found);
+        PortSlotRelease(slot);
+    }
+    return NULL;
+}
+
+static VOID
+TestConcurrentLookups(
+    VOID
+)
+{
+    static STRESS stress;
+    pthread_t threads[STRESS_LOOKERS];
+    unsigned long long seed = 0xDA942042E4DD58B5ULL;
+    ULONG heldAfterRemove = 0;
+    ULONG round;
+    ULONG i;
+
+    for (i = 0; i < STRESS_PORTS; i++) {
+        PortSlotInitialize(&stress.Ports[i].Slot);
+    }
+    for (i = 0; i < STRESS_LOOKERS; i++) {
+        pthread_create(&threads[i], NULL, LookerThread, &stress);
+    }
+
+    for (round = 0; round < STRESS_ROUNDS; round++) {
+        STRESS_PORT* port = &stress.Ports[TestRandom(&seed) % STRESS_PORTS];
+
+        if (port->Slot.PortId == VCOM_INVALID_PORT_ID) {
+            pthread_mutex_lock(&TableLock);
+            if (NT_SUCCESS(PortSlotsInsert(&stress.Slots, &port->Slot))) {
+                InterlockedExchange(&port->Live, 1);
+            }
+            pthread_mutex_unlock(&TableLock);
+        }
+        else {
+            Remove(&stress.Slots, &port->Slot);
+            heldAfterRemove += (ReadNoFence(&port->Holders) != 0);
+            InterlockedExchange(&port->Live, 0);
+        }
+        if (round % 64 == 0) {
+            sched_yield();
+        }
+    }
+
+    InterlockedExchange(&stress.Done, 1);
+    for (i = 0; i < STRESS_LOOKERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("  %lld references taken over %u adds and removes\n",
+        (long long)stress.Found, STRESS_ROUNDS);
+    CHECK(stress.Found > 0);
+    CHECK_EQ(stress.Dead, 0);
+    CHECK_EQ(heldAfterRemove, 0);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestInsertAndReuse);
+    RUN_TEST(TestAcquire);
+    RUN_TEST(TestRundownWaits);
+    RUN_TEST(TestReadyWaiters);
+    RUN_TEST(TestLink);
+    RUN_TEST(TestUnlink);
+    RUN_TEST(TestMapExcludesLink);
+    RUN_TEST(TestConcurrentLookups);
+    return TestResult();
+}
@@ -0,0 +1,378 @@
+/*++
+
+Module Name:
+
+    test_recordframe.c
+
+Abstract:
+
+    Tests for framed GET_OUTGOING chunking (recordframe.c), and a randomized
+    run of a drain loop shaped like QueueDrainOutgoing over output buffers
+    of every size, XON/XOFF control chunks included, checking that chunks
+    stay inside the buffer and put each write back together.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "recordframe.h"
+#include "testing.h"
+
+#define HEADER  sizeof(VCOM_RECORD_HEADER)
+
+static VOID
+TestRoom(
+    VOID
+)
+{
+    // Payload room is what is left after the header, down to a multiple of 8
+    CHECK_EQ(RecordFrameRoom(HEADER, 0), 0);
+    CHECK_EQ(RecordFrameRoom(HEADER + 7, 0), 0);
+    CHECK_EQ(RecordFrameRoom(HEADER + 8, 0), 8);
+    CHECK_EQ(RecordFrameRoom(HEADER + 13, 0), 8);
+    CHECK_EQ(RecordFrameRoom(100, 40), (100 - 40 - HEADER) & ~7);
+    CHECK_EQ(RecordFrameRoom(HEADER + 50, 50), 0);
+}
+
+static VOID
+TestSize(
+    VOID
+)
+{
+    size_t length;
+    size_t room;
+
+    CHECK_EQ(RecordFrameSize(0), HEADER);
+    CHECK_EQ(RecordFrameSize(1), HEADER + 8);
+    CHECK_EQ(RecordFrameSize(8), HEADER + 8);
+    CHECK_EQ(RecordFrameSize(9), HEADER + 16);
+
+    // The room an output leaves is a chunk that fits it, padding and all,
+    // and a chunk sized to the output exactly gets all of it as room
+    for (length = HEADER; length < HEADER + 100; length++) {
+        room = RecordFrameRoom(length, 0);
+        CHECK(RecordFrameSize(room) <= length);
+        CHECK(RecordFrameSize(room + 1) > length);
+    }
+    for (length = 0; length < 100; length++) {
+        CHECK_EQ(RecordFrameRoom(RecordFrameSize(length), 0), VCOM_RECORD_ALIGN(length));
+    }
+}
+
+static VOID
+TestWanted(
+    VOID
+)
+{
+    QUEUE_RECORD record;
+
+    RtlZeroMemory(&record, sizeof(record));
+
+    // Nothing in yet and more to come: wait for it
+    CHECK(!RecordFrameWanted(&record, 64));
+
+    // Bytes go out while there is room, complete or not
+    record.Length = 10;
+    CHECK(RecordFrameWanted(&record, 64));
+    CHECK(!RecordFrameWanted(&record, 0));
+    record.Consumed = 10;
+    CHECK(!RecordFrameWanted(&record, 64));
+
+    // A finished write with nothing left still needs its LAST, room or not
+    record.Complete = TRUE;
+    CHECK(RecordFrameWanted(&record, 0));
+}
+
+static VOID
+TestChunks(
+    VOID
+)
+{
+    QUEUE_RECORD record;
+    VCOM_RECORD_HEADER header;
+
+    RtlZeroMemory(&record, sizeof(record));
+    record.Sequence = 7;
+    record.Timestamp = 1234;
+    record.Length = 100;
+
+    CHECK(!RecordFrameChunk(&record, 40, &header));
+    CHECK_EQ(header.Length, 40);
+    CHECK_EQ(header.Flags, VCOM_RECORD_FIRST);
+    CHECK_EQ(header.Sequence, 7);
+    CHECK_EQ(header.Timestamp, 1234);
+    CHECK_EQ(record.Consumed, 40);
+
+    // All drained but the write is still going: not the last chunk yet
+    CHECK(!RecordFrameChunk(&record, 60, &header));
+    CHECK_EQ(header.Flags, 0);
+
+    // It finishes with more bytes, then the last of them goes
+    record.Length = 120;
+    record.Complete = TRUE;
+    CHECK(RecordFrameChunk(&record, 20, &header));
+    CHECK_EQ(header.Flags, VCOM_RECORD_LAST);
+
+    // A write that was all taken at once is FIRST and LAST
+    RtlZeroMemory(&record, sizeof(record));
+    record.Length = 5;
+    record.Complete = TRUE;
+    CHECK(RecordFrameChunk(&record, 5, &header));
+    CHECK_EQ(header.Flags, VCOM_RECORD_FIRST | VCOM_RECORD_LAST);
+
+    // A cancelled write ends with an empty TRUNCATED chunk
+    RtlZeroMemory(&record, sizeof(record));
+    record.Length = 30;
+    CHECK(!RecordFrameChunk(&record, 30, &header));
+    record.Complete = TRUE;
+    record.Truncated = TRUE;
+    CHECK(RecordFrameChunk(&record, 0, &header));
+    CHECK_EQ(header.Length, 0);
+    CHECK_EQ(header.Flags, VCOM_RECORD_LAST | VCOM_RECORD_TRUNCATED);
+}
+
+//
+// A model of the outgoing side: a byte FIFO, the records describing it,
+// and a drain that works as QueueReadFramedToMemory does.
+//
+
+#define SIM_BYTES       (1 << 16)
+#define SIM_WRITES      2000
+#define SIM_OUTPUT      600
+
+typedef struct _SIM {
+    UCHAR           Fifo[SIM_BYTES];
+    ULONG64         FifoIn;
+    ULONG64         FifoOut;
+    QUEUE_RECORD    Records[QUEUE_RECORD_SLOTS];
+    ULONG           Head;
+    ULONG           Tail;
+    BOOLEAN         ControlPending;     // an XON or XOFF waits to go out
+    UCHAR           Control;
+} SIM;
+
+// QueueDrainOutgoing: a waiting flow-control character goes first as a
+// chunk of its own, only if the whole chunk fits (QueueFlowTakeSend), then
+// as many chunks of the writes as fit (QueueReadFramedToMemory)
+static size_t
+SimDrain(
+    SIM* Sim,
+    UCHAR* Output,
+    size_t Length
+)
+{
+    VCOM_RECORD_HEADER header;
+    PQUEUE_RECORD record;
+    size_t out = 0;
+    size_t room;
+    size_t copied;
+    size_t i;
+
+    if (Sim->ControlPending && Length >= RecordFrameSize(1)) {
+        RtlZeroMemory(&header, sizeof(header));
+        header.Length = 1;
+        header.Flags = VCOM_RECORD_FIRST | VCOM_RECORD_LAST | VCOM_RECORD_CONTROL;
+        RtlCopyMemory(Output, &header, HEADER);
+        Output[HEADER] = Sim->Control;
+        Sim->ControlPending = FALSE;
+        out = RecordFrameSize(1);
+    }
+
+    while (out + HEADER <= Length && Sim->Head != Sim->Tail) {
+        room = RecordFrameRoom(Length, out);
+        record = &Sim->Records[Sim->Head & QUEUE_RECORD_MASK];
+        if (!RecordFrameWanted(record, room)) {
+            break;
+        }
+
+        copied = min((size_t)(record->Length - record->Consumed), room);
+        for (i = 0; i < copied; i++) {
+            Output[out + HEADER + i] = Sim->Fifo[Sim->FifoOut++ % SIM_BYTES];
+        }
+
+        if (RecordFrameChunk(record, copied, &header)) {
+            Sim->Head++;
+        }
+        RtlCopyMemory(Output + out, &header, HEADER);
+        out += RecordFrameSize(copied);
+    }
+    return out;
+}
+
+// An output with room for exactly one chunk: the control chunk takes all
+// of it and nothing else goes; a byte less and it waits
+static VOID
+TestControlFits(
+    VOID
+)
+{
+    static SIM sim;
+    UCHAR output[RecordFrameSize(1) + 64];
+    VCOM_RECORD_HEADER header;
+    PQUEUE_RECORD record;
+
+    RtlZeroMemory(&sim, sizeof(sim));
+    record = &sim.Records[sim.Tail++ & QUEUE_RECORD_MASK];
+    record->Sequence = 1;
+    record->Length = 5;
+    record->Complete = TRUE;
+    RtlCopyMemory(sim.Fifo, "hello", 5);
+    sim.FifoIn = 5;
+    sim.ControlPending = TRUE;
+    sim.Control = 0x13;
+
+    CHECK_EQ(SimDrain(&sim, output, RecordFrameSize(1) - 1), 0);
+    CHECK(sim.ControlPending);
+
+    RtlFillMemory(output, sizeof(output), 0xEE);
+    CHECK_EQ(SimDrain(&sim, output, RecordFrameSize(1)), RecordFrameSize(1));
+    CHECK(!sim.ControlPending);
+    RtlCopyMemory(&header, output, HEADER);
+    CHECK_EQ(header.Length, 1);
+    CHECK(header.Flags & VCOM_RECORD_CONTROL);
+    CHECK_EQ(output[HEADER], 0x13);
+    CHECK_EQ(output[RecordFrameSize(1)], 0xEE);
+    CHECK_EQ(sim.Head, 0);
+
+    // The write alone in the same space, then both in room for two
+    CHECK_EQ(SimDrain(&sim, output, RecordFrameSize(1)), RecordFrameSize(5));
+    CHECK_EQ(sim.Head, 1);
+    CHECK(memcmp(output + HEADER, "hello", 5) == 0);
+
+    record = &sim.Records[sim.Tail++ & QUEUE_RECORD_MASK];
+    record->Sequence = 2;
+    record->Length = 8;
+    record->Complete = TRUE;
+    sim.FifoIn += 8;
+    sim.ControlPending = TRUE;
+    CHECK_EQ(SimDrain(&sim, output, RecordFrameSize(1) + RecordFrameSize(8)), RecordFrameSize(1) + RecordFrameSize(8));
+    CHECK(!sim.ControlPending);
+    CHECK_EQ(sim.Head, 2);
+}
+
+static VOID
+TestRandomized(
+    VOID
+)
+{
+    static SIM sim;
+    static UCHAR output[SIM_OUTPUT + 64];
+    static ULONG written[SIM_WRITES + 1];   // bytes put in, by sequence
+    static ULONG received[SIM_WRITES + 1];  // bytes drained, by sequence
+    static UCHAR truncated[SIM_WRITES + 1];
+    unsigned long long seed = 0x5DEECE66DULL;
+    ULONG64 sequence = 0;                   // of the last record added
+    ULONG64 lastSeen = 0;                   // of the last LAST chunk
+    ULONG64 outside = 0;
+    ULONG64 badData = 0;
+    ULONG64 badFlags = 0;
+    ULONG64 chunks = 0;
+    ULONG64 controls = 0;
+    ULONG i;
+
+    RtlZeroMemory(&sim, sizeof(sim));
+
+    while (lastSeen < SIM_WRITES) {
+        ULONG action = (ULONG)(TestRandom(&seed) % 4);
+
+        if (action < 2 && sequence < SIM_WRITES && sim.Tail - sim.Head < QUEUE_RECORD_SLOTS &&
+            (sim.Head == sim.Tail || sim.Records[(sim.Tail - 1) & QUEUE_RECORD_MASK].Complete)) {
+            // A new write; its bytes go in over later steps, and now and
+            // then an XON or XOFF is owed
+            sim.ControlPending |= (TestRandom(&seed) % 8 == 0);
+            sim.Control = (UCHAR)(0x11 + 2 * (sequence & 1));
+            PQUEUE_RECORD record = &sim.Records[sim.Tail++ & QUEUE_RECORD_MASK];
+
+            RtlZeroMemory(record, sizeof(*record));
+            record->Sequence = ++sequence;
+            record->Timestamp = sequence * 10;
+        }
+        else if (action < 3 && sim.Head != sim.Tail) {
+            // More of the newest write goes in, and perhaps it finishes
+            PQUEUE_RECORD record = &sim.Records[(sim.Tail - 1) & QUEUE_RECORD_MASK];
+            ULONG add = (ULONG)(TestRandom(&seed) % 300);
+
+            if (!record->Complete) {
+                add = (ULONG)min((ULONG64)add, SIM_BYTES - (sim.FifoIn - sim.FifoOut));
+                for (i = 0; i < add; i++) {
+                    sim.Fifo[sim.FifoIn++ % SIM_BYTES] = (UCHAR)(record->Sequence + record->Length + i);
+                }
+                record->Length += add;
+                written[record->Sequence] = record->Length;
+                if (TestRandom(&seed) % 3 == 0) {
+                    record->Complete = TRUE;
+                    record->Truncated = TestRandom(&seed) % 4 == 0;
+                    truncated[record->Sequence] = record->Truncated;
+                }
+            }
+        }
+        else {
+            // A drain into an output of any length, a byte past it marked
+            size_t length = (size_t)(TestRandom(&seed) % SIM_OUTPUT);
+            size_t out;
+            size_t at = 0;
+
+            RtlFillMemory(output, sizeof(output), 0xEE);
+            out = SimDrain(&sim, output, length);
+            outside += (out > length) || (output[length] != 0xEE);
+
+            while (at < out) {
+                VCOM_RECORD_HEADER header;
+
+                RtlCopyMemory(&header, output + at, HEADER);
+                chunks++;
+                if (header.Flags & VCOM_RECORD_CONTROL) {
+                    // Only ever first, and whole
+                    controls++;
+                    badFlags += (at != 0) || (header.Length != 1);
+                    outside += at + RecordFrameSize(1) > length;
+                    at += HEADER + VCOM_RECORD_ALIGN(header.Length);
+                    continue;
+                }
+                if (header.Sequence == 0 || header.Sequence > sequence ||
+                    at + HEADER + VCOM_RECORD_ALIGN(header.Length) > length) {
+                    outside++;
+                    break;
+                }
+
+                // FIRST on the first chunk only, LAST once all is in and out
+                badFlags += ((header.Flags & VCOM_RECORD_FIRST) != 0) != (received[header.Sequence] == 0);
+                badFlags += header.Sequence != lastSeen + 1;
+                for (i = 0; i < header.Length; i++) {
+                    badData += output[at + HEADER + i] !=
+                        (UCHAR)(header.Sequence + received[header.Sequence] + i);
+                }
+                received[header.Sequence] += header.Length;
+
+                if (header.Flags & VCOM_RECORD_LAST) {
+                    badFlags += received[header.Sequence] != written[header.Sequence];
+                    badFlags += ((header.Flags & VCOM_RECORD_TRUNCATED) != 0) != truncated[header.Sequence];
+                    lastSeen = header.Sequence;
+                }
+                at += HEADER + VCOM_RECORD_ALIGN(header.Length);
+            }
+        }
+    }
+
+    printf("  %u writes in %llu chunks, %llu control\n", SIM_WRITES,
+        (unsigned long long)chunks, (unsigned long long)controls);
+    CHECK(controls > 100);
+    CHECK_EQ(outside, 0);
+    CHECK_EQ(badData, 0);
+    CHECK_EQ(badFlags, 0);
+    CHECK_EQ(sim.FifoIn, sim.FifoOut);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestRoom);
+    RUN_TEST(TestSize);
+    RUN_TEST(TestWanted);
+    RUN_TEST(TestChunks);
+    RUN_TEST(TestControlFits);
+    RUN_TEST(TestRandomized);
+    return TestResult();
+}
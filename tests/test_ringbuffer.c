@@ -0,0 +1,345 @@
+/*++
+
+Module Name:
+
+    test_ringbuffer.c
+
+Abstract:
+
+    Tests for the power-of-two ring (ringbuffer.c)
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "testing.h"
+
+// Writes the stream from running offset Counter into Spans
+static VOID
+FillSpans(
+    PRING_BUFFER_SPANS Spans,
+    ULONG64 Counter
+)
+{
+    size_t i;
+    ULONG s;
+
+    for (s = 0; s < Spans->Count; s++) {
+        for (i = 0; i < Spans->Span[s].Length; i++) {
+            Spans->Span[s].Buffer[i] = TestStreamByte(Counter++);
+        }
+    }
+}
+
+// TRUE if Spans hold the stream from running offset Counter
+static BOOLEAN
+SpansMatch(
+    PRING_BUFFER_SPANS Spans,
+    ULONG64 Counter
+)
+{
+    size_t i;
+    ULONG s;
+
+    for (s = 0; s < Spans->Count; s++) {
+        for (i = 0; i < Spans->Span[s].Length; i++) {
+            if (Spans->Span[s].Buffer[i] != TestStreamByte(Counter++)) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+static VOID
+TestInitialize(
+    VOID
+)
+{
+    RING_BUFFER_P2 ring;
+    BYTE storage[64];
+    size_t available;
+
+    CHECK(!NT_SUCCESS(RingBufferP2Initialize(&ring, storage, 0)));
+    CHECK(!NT_SUCCESS(RingBufferP2Initialize(&ring, storage, 48)));
+    CHECK(!NT_SUCCESS(RingBufferP2Initialize(&ring, NULL, 64)));
+    CHECK(NT_SUCCESS(RingBufferP2Initialize(&ring, storage, 64)));
+
+    RingBufferP2GetAvailableData(&ring, &available);
+    CHECK_EQ(available, 0);
+    RingBufferP2GetAvailableSpace(&ring, &available);
+    CHECK_EQ(available, 64);
+}
+
+//
+// One producer and one consumer thread on the same ring, with no lock
+// between them. Both move chunks of varying size, so transfers start and
+// end at every offset and wrap at every split.
+//
+
+#define STRESS_CAPACITY     256
+#define STRESS_BYTES        (8ULL * 1024 * 1024)
+
+typedef struct _STRESS {
+    RING_BUFFER_P2  Ring;
+    BYTE            Storage[STRESS_CAPACITY];
+    ULONG64         Total;
+    ULONG64         Mismatches;
+} STRESS;
+
+static void*
+StressProducer(
+    void* Context
+)
+{
+    STRESS* stress = (STRESS*)Context;
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+    ULONG64 counter = 0;
+    size_t want;
+    size_t got;
+
+    while (counter < stress->Total) {
+        want = (size_t)(TestRandom(&seed) % (STRESS_CAPACITY + 1)) + 1;
+        want = (size_t)min((ULONG64)want, stress->Total - counter);
+
+        got = RingBufferP2Reserve(&stress->Ring, want, &spans);
+        if (got == 0) {
+            sched_yield();
+            continue;
+        }
+
+        FillSpans(&spans, counter);
+        counter += got;
+
+        // Publish only part of it now and then; the rest is reserved again
+        if ((seed & 7) == 0 && got > 1) {
+            counter -= got / 2;
+            got -= got / 2;
+        }
+        RingBufferP2Commit(&stress->Ring, got);
+    }
+    return NULL;
+}
+
+static void*
+StressConsumer(
+    void* Context
+)
+{
+    STRESS* stress = (STRESS*)Context;
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0xD1B54A32D192ED03ULL;
+    ULONG64 counter = 0;
+    size_t want;
+    size_t got;
+
+    while (counter < stress->Total) {
+        want = (size_t)(TestRandom(&seed) % (STRESS_CAPACITY + 1)) + 1;
+
+        got = RingBufferP2Peek(&stress->Ring, want, &spans);
+        if (got == 0) {
+            sched_yield();
+            continue;
+        }
+
+        if (!SpansMatch(&spans, counter)) {
+            stress->Mismatches++;
+        }
+        counter += got;
+        RingBufferP2Consume(&stress->Ring, got);
+    }
+    return NULL;
+}
+
+static VOID
+TestSpscStress(
+    VOID
+)
+{
+    static STRESS stress;
+    pthread_t producer;
+    pthread_t consumer;
+
+    CHECK(NT_SUCCESS(RingBufferP2Initialize(&stress.Ring, stress.Storage, STRESS_CAPACITY)));
+    stress.Total = STRESS_BYTES;
+    stress.Mismatches = 0;
+
+    CHECK(pthread_create(&consumer, NULL, StressConsumer, &stress) == 0);
+    CHECK(pthread_create(&producer, NULL, StressProducer, &stress) == 0);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    CHECK_EQ(stress.Mismatches, 0);
+    CHECK_EQ(stress.Ring.WriteCount, STRESS_BYTES);
+    CHECK_EQ(stress.Ring.ReadCount, STRESS_BYTES);
+}
+
+// The counters are free-running; a ring whose totals are about to wrap
+// 64 bits must behave the same
+static VOID
+TestCounterWrap(
+    VOID
+)
+{
+    RING_BUFFER_P2 ring;
+    RING_BUFFER_SPANS spans;
+    BYTE storage[16];
+    size_t available;
+
+    CHECK(NT_SUCCESS(RingBufferP2Initialize(&ring, storage, sizeof(storage))));
+    ring.WriteCount = ring.ReadCount = ~0ULL - 4;
+
+    CHECK_EQ(RingBufferP2Reserve(&ring, 10, &spans), 10);
+    RtlFillMemory(spans.Span[0].Buffer, spans.Span[0].Length, 0xA5);
+    if (spans.Count == 2) {
+        RtlFillMemory(spans.Span[1].Buffer, spans.Span[1].Length, 0xA5);
+    }
+    RingBufferP2Commit(&ring, 10);
+
+    RingBufferP2GetAvailableData(&ring, &available);
+    CHECK_EQ(available, 10);
+    RingBufferP2GetAvailableSpace(&ring, &available);
+    CHECK_EQ(available, 6);
+
+    CHECK_EQ(RingBufferP2Peek(&ring, 16, &spans), 10);
+    CHECK_EQ(spans.Span[0].Buffer[0], 0xA5);
+    RingBufferP2Consume(&ring, 10);
+    RingBufferP2GetAvailableData(&ring, &available);
+    CHECK_EQ(available, 0);
+}
+
+static VOID
+TestSpansWrap(
+    VOID
+)
+{
+    RING_BUFFER_P2 ring;
+    RING_BUFFER_SPANS spans;
+    BYTE storage[16];
+
+    CHECK(NT_SUCCESS(RingBufferP2Initialize(&ring, storage, sizeof(storage))));
+    ring.WriteCount = ring.ReadCount = 12;
+
+    // Free space runs from slot 12 to the end and on from slot 0
+    CHECK_EQ(RingBufferP2Reserve(&ring, 10, &spans), 10);
+    CHECK_EQ(spans.Count, 2);
+    CHECK_EQ(spans.Total, 10);
+    CHECK(spans.Span[0].Buffer == storage + 12);
+    CHECK_EQ(spans.Span[0].Length, 4);
+    CHECK(spans.Span[1].Buffer == storage);
+    CHECK_EQ(spans.Span[1].Length, 6);
+    FillSpans(&spans, 12);
+
+    // Publishing a prefix leaves the rest free to be reserved again
+    RingBufferP2Commit(&ring, 7);
+    CHECK_EQ(RingBufferP2Reserve(&ring, 100, &spans), 9);
+    CHECK_EQ(spans.Count, 1);
+    CHECK(spans.Span[0].Buffer == storage + 3);
+
+    // The consumer sees the same split
+    CHECK_EQ(RingBufferP2Peek(&ring, 100, &spans), 7);
+    CHECK_EQ(spans.Count, 2);
+    CHECK_EQ(spans.Span[0].Length, 4);
+    CHECK_EQ(spans.Span[1].Length, 3);
+    CHECK(SpansMatch(&spans, 12));
+
+    // Peeking does not consume; consuming a prefix moves the split
+    CHECK_EQ(RingBufferP2Peek(&ring, 100, &spans), 7);
+    RingBufferP2Consume(&ring, 5);
+    CHECK_EQ(RingBufferP2Peek(&ring, 100, &spans), 2);
+    CHECK_EQ(spans.Count, 1);
+    CHECK(spans.Span[0].Buffer == storage + 1);
+    CHECK(SpansMatch(&spans, 17));
+}
+
+static VOID
+TestSpansEdges(
+    VOID
+)
+{
+    RING_BUFFER_P2 ring;
+    RING_BUFFER_SPANS spans;
+    BYTE storage[16];
+
+    CHECK(NT_SUCCESS(RingBufferP2Initialize(&ring, storage, sizeof(storage))));
+    ring.WriteCount = ring.ReadCount = 8;
+
+    // Ending exactly at the end of the storage takes one span
+    CHECK_EQ(RingBufferP2Reserve(&ring, 8, &spans), 8);
+    CHECK_EQ(spans.Count, 1);
+    CHECK_EQ(spans.Span[1].Length, 0);
+
+    // Empty: nothing to peek, and no spans
+    CHECK_EQ(RingBufferP2Peek(&ring, 16, &spans), 0);
+    CHECK_EQ(spans.Count, 0);
+    CHECK_EQ(spans.Total, 0);
+
+    // Full: nothing to reserve
+    CHECK_EQ(RingBufferP2Reserve(&ring, 16, &spans), 16);
+    CHECK_EQ(spans.Count, 2);
+    RingBufferP2Commit(&ring, 16);
+    CHECK_EQ(RingBufferP2Reserve(&ring, 1, &spans), 0);
+    CHECK_EQ(spans.Count, 0);
+
+    // A zero-length request gets nothing even with room
+    RingBufferP2Consume(&ring, 16);
+    CHECK_EQ(RingBufferP2Reserve(&ring, 0, &spans), 0);
+    CHECK_EQ(spans.Count, 0);
+}
+
+static VOID
+TestMigrate(
+    VOID
+)
+{
+    RING_BUFFER_P2 ring;
+    RING_BUFFER_SPANS spans;
+    BYTE small[16];
+    BYTE large[64];
+    BYTE tiny[8];
+
+    CHECK(NT_SUCCESS(RingBufferP2Initialize(&ring, small, sizeof(small))));
+    ring.WriteCount = ring.ReadCount = 1000;
+
+    // Buffered bytes wrap in the old storage (1000 & 15 = 8)
+    CHECK_EQ(RingBufferP2Reserve(&ring, 12, &spans), 12);
+    CHECK_EQ(spans.Count, 2);
+    FillSpans(&spans, 1000);
+    RingBufferP2Commit(&ring, 12);
+
+    CHECK_EQ(RingBufferP2Migrate(&ring, tiny, sizeof(tiny)), STATUS_BUFFER_TOO_SMALL);
+    CHECK_EQ(RingBufferP2Migrate(&ring, large, 48), STATUS_INVALID_PARAMETER);
+
+    // Grow: the counters stay, each byte moves to its counter's new slot
+    CHECK(NT_SUCCESS(RingBufferP2Migrate(&ring, large, sizeof(large))));
+    CHECK_EQ(ring.Capacity, 64);
+    CHECK_EQ(ring.WriteCount, 1012);
+    CHECK_EQ(ring.ReadCount, 1000);
+    CHECK_EQ(RingBufferP2Peek(&ring, 100, &spans), 12);
+    CHECK(spans.Span[0].Buffer == large + (1000 & 63));
+    CHECK(SpansMatch(&spans, 1000));
+
+    // And back down again, after moving the window along
+    RingBufferP2Consume(&ring, 6);
+    CHECK(NT_SUCCESS(RingBufferP2Migrate(&ring, small, sizeof(small))));
+    CHECK_EQ(RingBufferP2Peek(&ring, 100, &spans), 6);
+    CHECK(SpansMatch(&spans, 1006));
+    CHECK_EQ(RingBufferP2Reserve(&ring, 100, &spans), 10);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestInitialize);
+    RUN_TEST(TestCounterWrap);
+    RUN_TEST(TestSpansWrap);
+    RUN_TEST(TestSpansEdges);
+    RUN_TEST(TestMigrate);
+    RUN_TEST(TestSpscStress);
+    return TestResult();
+}
@@ -0,0 +1,307 @@
+/*++
+
+Module Name:
+
+    test_ringpolicy.c
+
+Abstract:
+
+    Tests for the elastic ring sizing decisions (ringpolicy.c), and a
+    simulation of ports with bursty traffic comparing elastic rings with
+    fixed DATA_BUFFER_SIZE ones.
+
+--*/
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "ringpolicy.h"
+#include "testing.h"
+
+static VOID
+PolicyInit(
+    PQUEUE_RING_POLICY Policy,
+    size_t MinCapacity,
+    size_t MaxCapacity
+)
+{
+    RtlZeroMemory(Policy, sizeof(*Policy));
+    Policy->MinCapacity = MinCapacity;
+    Policy->MaxCapacity = MaxCapacity;
+}
+
+static VOID
+TestRoundSize(
+    VOID
+)
+{
+    CHECK_EQ(RingPolicyRoundSize(0), MIN_DATA_BUFFER_SIZE);
+    CHECK_EQ(RingPolicyRoundSize(64), 64);
+    CHECK_EQ(RingPolicyRoundSize(65), 128);
+    CHECK_EQ(RingPolicyRoundSize(1000), 1024);
+    CHECK_EQ(RingPolicyRoundSize(1024), 1024);
+    CHECK_EQ(RingPolicyRoundSize(MAX_DATA_BUFFER_SIZE - 1), MAX_DATA_BUFFER_SIZE);
+    CHECK_EQ(RingPolicyRoundSize((size_t)1 << 40), MAX_DATA_BUFFER_SIZE);
+}
+
+static VOID
+TestGrowWatermark(
+    VOID
+)
+{
+    QUEUE_RING_POLICY policy;
+
+    PolicyInit(&policy, 1024, 64 * 1024);
+
+    // 75% of 1024 is 768: at the watermark stays, one past it doubles
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 1024, 0), 0);
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 1024, 768), 0);
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 1024, 769), 2048);
+
+    // A large write skips straight to a size it fits below the watermark
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 1024, 1537), 4096);
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 1024, 10000), 16384);
+
+    // The ceiling caps it, and a ring at the ceiling does not grow
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 1024, 1000000), 64 * 1024);
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 64 * 1024, 1000000), 0);
+
+    // The smallest ring still has a watermark to grow past
+    PolicyInit(&policy, 64, 64 * 1024);
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 64, 48), 0);
+    CHECK_EQ(RingPolicyGrowTarget(&policy, 64, 49), 128);
+}
+
+static VOID
+TestShrinkSamples(
+    VOID
+)
+{
+    QUEUE_RING_POLICY policy;
+    ULONG i;
+
+    PolicyInit(&policy, 1024, 64 * 1024);
+
+    // 12% of 8192 is 983; QUEUE_RING_SHRINK_SAMPLES low reads in a row shrink
+    for (i = 1; i < QUEUE_RING_SHRINK_SAMPLES; i++) {
+        CHECK(!RingPolicySampleRead(&policy, 8192, 982));
+    }
+    CHECK(RingPolicySampleRead(&policy, 8192, 982));
+    CHECK_EQ(policy.LowSamples, 0);
+
+    // One read at or above the low watermark starts the count over
+    for (i = 1; i < QUEUE_RING_SHRINK_SAMPLES; i++) {
+        CHECK(!RingPolicySampleRead(&policy, 8192, 0));
+    }
+    CHECK(!RingPolicySampleRead(&policy, 8192, 983));
+    CHECK_EQ(policy.LowSamples, 0);
+    CHECK(!RingPolicySampleRead(&policy, 8192, 0));
+    CHECK_EQ(policy.LowSamples, 1);
+
+    // A ring at its floor is never sampled
+    for (i = 0; i < 2 * QUEUE_RING_SHRINK_SAMPLES; i++) {
+        CHECK(!RingPolicySampleRead(&policy, 1024, 0));
+    }
+    CHECK_EQ(policy.LowSamples, 0);
+}
+
+static VOID
+TestShrinkTarget(
+    VOID
+)
+{
+    QUEUE_RING_POLICY policy;
+
+    PolicyInit(&policy, 1024, 64 * 1024);
+    CHECK_EQ(RingPolicyShrinkTarget(&policy, 8192), 4096);
+    CHECK_EQ(RingPolicyShrinkTarget(&policy, 2048), 1024);
+    CHECK_EQ(RingPolicyShrinkTarget(&policy, 1024), 0);
+
+    // A raised floor stops a shrink computed against the old one
+    policy.MinCapacity = 8192;
+    CHECK_EQ(RingPolicyShrinkTarget(&policy, 8192), 0);
+}
+
+// Between the watermarks a ring neither grows nor shrinks, so a ring that
+// just shrank is not grown straight back by the occupancy that shrank it
+static VOID
+TestHysteresis(
+    VOID
+)
+{
+    QUEUE_RING_POLICY policy;
+    size_t capacity = 8192;
+    size_t occupancy;
+    ULONG i;
+
+    PolicyInit(&policy, 64, 64 * 1024);
+
+    for (occupancy = 983; occupancy <= 6144; occupancy += 97) {
+        CHECK_EQ(RingPolicyGrowTarget(&policy, capacity, occupancy), 0);
+        for (i = 0; i < 2 * QUEUE_RING_SHRINK_SAMPLES; i++) {
+            CHECK(!RingPolicySampleRead(&policy, capacity, occupancy));
+        }
+    }
+
+    // Shrinking from just under the low watermark lands well under the high one
+    occupancy = 982;
+    for (i = 1; i < QUEUE_RING_SHRINK_SAMPLES; i++) {
+        (VOID)RingPolicySampleRead(&policy, capacity, occupancy);
+    }
+    CHECK(RingPolicySampleRead(&policy, capacity, occupancy));
+    capacity = RingPolicyShrinkTarget(&policy, capacity);
+    CHECK_EQ(capacity, 4096);
+    CHECK_EQ(RingPolicyGrowTarget(&policy, capacity, occupancy + 1), 0);
+}
+
+static VOID
+TestResizeFlag(
+    VOID
+)
+{
+    QUEUE_RING_POLICY policy;
+
+    PolicyInit(&policy, 1024, 64 * 1024);
+    CHECK(RingPolicyTryBeginResize(&policy));
+    CHECK(!RingPolicyTryBeginResize(&policy));
+    CHECK_EQ(policy.ResizeDone.Signaled, 0);
+
+    // Letting go wakes whoever waits for the flag
+    RingPolicyEndResize(&policy);
+    CHECK_EQ(policy.ResizeDone.Signaled, 1);
+    CHECK(RingPolicyTryBeginResize(&policy));
+    RingPolicyEndResize(&policy);
+}
+
+//
+// Ports that idle with a trickle of traffic and now and then take a burst
+// faster than their reader drains it. Each tick a port's reader takes up to
+// SIM_DRAIN bytes and its writer adds what arrived; what does not fit is
+// dropped, as EvtIoWrite does. The elastic ports resize instantly, as
+// though every allocation succeeded.
+//
+
+#define SIM_PORTS           16
+#define SIM_TICKS           400000
+#define SIM_DRAIN           256
+#define SIM_BURST_CHANCE    40000       // one tick in this many starts a burst
+#define SIM_BURST_RATE      512         // bytes per tick during a burst
+
+typedef struct _SIM_PORT {
+    size_t              Capacity;
+    size_t              Occupancy;
+    size_t              BurstLeft;
+    QUEUE_RING_POLICY   Policy;
+} SIM_PORT;
+
+typedef struct _SIM_RESULT {
+    ULONG64             Offered;
+    ULONG64             Dropped;
+    double              Footprint;      // average bytes of ring, all ports
+} SIM_RESULT;
+
+static VOID
+Simulate(
+    BOOLEAN Elastic,
+    SIM_RESULT* Result
+)
+{
+    static SIM_PORT ports[SIM_PORTS];
+    unsigned long long seed = 0x452821E638D01377ULL;
+    ULONG64 footprint = 0;
+    size_t arrived;
+    size_t target;
+    size_t taken;
+    ULONG tick;
+    ULONG p;
+
+    RtlZeroMemory(Result, sizeof(*Result));
+    for (p = 0; p < SIM_PORTS; p++) {
+        RtlZeroMemory(&ports[p], sizeof(ports[p]));
+        ports[p].Capacity = Elastic ? MIN_DATA_BUFFER_SIZE : DATA_BUFFER_SIZE;
+        PolicyInit(&ports[p].Policy, MIN_DATA_BUFFER_SIZE, DEFAULT_MAX_QUEUE_SIZE);
+    }
+
+    for (tick = 0; tick < SIM_TICKS; tick++) {
+        for (p = 0; p < SIM_PORTS; p++) {
+            SIM_PORT* port = &ports[p];
+
+            // Arrivals: a burst of 2 to 8 KB, or the odd small write
+            if (port->BurstLeft == 0 && TestRandom(&seed) % SIM_BURST_CHANCE == 0) {
+                port->BurstLeft = 2048 + (size_t)(TestRandom(&seed) % (6 * 1024));
+            }
+            if (port->BurstLeft != 0) {
+                arrived = min(port->BurstLeft, (size_t)SIM_BURST_RATE);
+                port->BurstLeft -= arrived;
+            }
+            else {
+                arrived = (TestRandom(&seed) % 8 == 0) ? (size_t)(TestRandom(&seed) % 32) + 1 : 0;
+            }
+
+            if (arrived != 0) {
+                Result->Offered += arrived;
+                if (Elastic) {
+                    target = RingPolicyGrowTarget(&port->Policy, port->Capacity, port->Occupancy + arrived);
+                    if (target != 0) {
+                        port->Capacity = target;
+                        port->Policy.GrowCount++;
+                    }
+                }
+                taken = min(arrived, port->Capacity - port->Occupancy);
+                port->Occupancy += taken;
+                Result->Dropped += arrived - taken;
+            }
+
+            // The reader drains, and the elastic ring samples what is left
+            port->Occupancy -= min(port->Occupancy, (size_t)SIM_DRAIN);
+            if (Elastic && RingPolicySampleRead(&port->Policy, port->Capacity, port->Occupancy)) {
+                target = RingPolicyShrinkTarget(&port->Policy, port->Capacity);
+                if (target != 0 && target >= port->Occupancy) {
+                    port->Capacity = target;
+                    port->Policy.ShrinkCount++;
+                }
+            }
+
+            footprint += port->Capacity;
+        }
+    }
+
+    Result->Footprint = (double)footprint / SIM_TICKS;
+}
+
+static VOID
+TestBurstSimulation(
+    VOID
+)
+{
+    SIM_RESULT fixed;
+    SIM_RESULT elastic;
+
+    Simulate(FALSE, &fixed);
+    Simulate(TRUE, &elastic);
+
+    printf("  fixed:   %llu of %llu bytes dropped, %.0f bytes of ring on average\n",
+        (unsigned long long)fixed.Dropped, (unsigned long long)fixed.Offered, fixed.Footprint);
+    printf("  elastic: %llu of %llu bytes dropped, %.0f bytes of ring on average\n",
+        (unsigned long long)elastic.Dropped, (unsigned long long)elastic.Offered, elastic.Footprint);
+
+    // Same traffic both ways
+    CHECK_EQ(fixed.Offered, elastic.Offered);
+    CHECK(fixed.Dropped > 0);
+    CHECK(elastic.Dropped < fixed.Dropped / 10);
+    CHECK(elastic.Footprint < fixed.Footprint);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestRoundSize);
+    RUN_TEST(TestGrowWatermark);
+    RUN_TEST(TestShrinkSamples);
+    RUN_TEST(TestShrinkTarget);
+    RUN_TEST(TestHysteresis);
+    RUN_TEST(TestResizeFlag);
+    RUN_TEST(TestBurstSimulation);
+    return TestResult();
+}
@@ -0,0 +1,202 @@
+/*++
+
+Module Name:
+
+    test_ringresize.c
+
+Abstract:
+
+    Resizing a ring while bytes are moving through it, the way
+    QueueResizeRing does: the new storage is allocated with no lock held,
+    then both the write and the read lock are taken to migrate, and the
+    migration is retried at twice the size if the producer outgrew the
+    allocation in the meantime.
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "testing.h"
+
+#define RESIZE_MIN          64
+#define RESIZE_MAX          4096
+#define RESIZE_BYTES        (4ULL * 1024 * 1024)
+
+typedef struct _RESIZE {
+    RING_BUFFER_P2  Ring;
+    pthread_mutex_t WriteLock;
+    pthread_mutex_t ReadLock;
+    BYTE*           Storage;
+    ULONG64         Total;
+    ULONG64         Mismatches;
+    ULONG           Resizes;
+    ULONG           Retries;
+    volatile LONG   Done;
+} RESIZE;
+
+static void*
+ResizeProducer(
+    void* Context
+)
+{
+    RESIZE* resize = (RESIZE*)Context;
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0x243F6A8885A308D3ULL;
+    ULONG64 counter = 0;
+    size_t want;
+    size_t got;
+    size_t i;
+    ULONG s;
+
+    while (counter < resize->Total) {
+        want = (size_t)(TestRandom(&seed) % 300) + 1;
+        want = (size_t)min((ULONG64)want, resize->Total - counter);
+
+        pthread_mutex_lock(&resize->WriteLock);
+        got = RingBufferP2Reserve(&resize->Ring, want, &spans);
+        for (s = 0; s < spans.Count; s++) {
+            for (i = 0; i < spans.Span[s].Length; i++) {
+                spans.Span[s].Buffer[i] = TestStreamByte(counter++);
+            }
+        }
+        RingBufferP2Commit(&resize->Ring, got);
+        pthread_mutex_unlock(&resize->WriteLock);
+
+        if (got == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void*
+ResizeConsumer(
+    void* Context
+)
+{
+    RESIZE* resize = (RESIZE*)Context;
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0x13198A2E03707344ULL;
+    ULONG64 counter = 0;
+    size_t got;
+    size_t i;
+    ULONG s;
+
+    while (counter < resize->Total) {
+        pthread_mutex_lock(&resize->ReadLock);
+        got = RingBufferP2Peek(&resize->Ring, (size_t)(TestRandom(&seed) % 300 + 1), &spans);
+        for (s = 0; s < spans.Count; s++) {
+            for (i = 0; i < spans.Span[s].Length; i++) {
+                if (spans.Span[s].Buffer[i] != TestStreamByte(counter++)) {
+                    resize->Mismatches++;
+                }
+            }
+        }
+        RingBufferP2Consume(&resize->Ring, got);
+        pthread_mutex_unlock(&resize->ReadLock);
+
+        if (got == 0) {
+            sched_yield();
+        }
+    }
+    InterlockedExchange(&resize->Done, 1);
+    return NULL;
+}
+
+// Picks a size at random, grows past what is buffered, and swaps storage
+static void*
+ResizeResizer(
+    void* Context
+)
+{
+    RESIZE* resize = (RESIZE*)Context;
+    unsigned long long seed = 0xA4093822299F31D0ULL;
+    size_t occupancy;
+    size_t newSize;
+    BYTE* newStorage;
+    BYTE* oldStorage;
+    NTSTATUS status;
+
+    while (!ReadAcquire(&resize->Done)) {
+        newSize = (size_t)RESIZE_MIN << (TestRandom(&seed) % 7);
+
+        for (;;) {
+            RingBufferP2GetAvailableData(&resize->Ring, &occupancy);
+            while (newSize < occupancy) {
+                newSize <<= 1;
+            }
+
+            newStorage = (BYTE*)malloc(newSize);
+            CHECK(newStorage != NULL);
+
+            pthread_mutex_lock(&resize->WriteLock);
+            pthread_mutex_lock(&resize->ReadLock);
+            status = RingBufferP2Migrate(&resize->Ring, newStorage, newSize);
+            if (NT_SUCCESS(status)) {
+                oldStorage = resize->Storage;
+                resize->Storage = newStorage;
+            }
+            pthread_mutex_unlock(&resize->ReadLock);
+            pthread_mutex_unlock(&resize->WriteLock);
+
+            if (NT_SUCCESS(status)) {
+                free(oldStorage);
+                resize->Resizes++;
+                break;
+            }
+
+            free(newStorage);
+            CHECK_EQ(status, STATUS_BUFFER_TOO_SMALL);
+            if (newSize >= RESIZE_MAX) {
+                break;
+            }
+            resize->Retries++;
+            newSize <<= 1;
+        }
+        sched_yield();
+    }
+    return NULL;
+}
+
+static VOID
+TestResizeInFlight(
+    VOID
+)
+{
+    static RESIZE resize;
+    pthread_t producer;
+    pthread_t consumer;
+    pthread_t resizer;
+
+    resize.Storage = (BYTE*)malloc(RESIZE_MIN);
+    CHECK(NT_SUCCESS(RingBufferP2Initialize(&resize.Ring, resize.Storage, RESIZE_MIN)));
+    pthread_mutex_init(&resize.WriteLock, NULL);
+    pthread_mutex_init(&resize.ReadLock, NULL);
+    resize.Total = RESIZE_BYTES;
+
+    CHECK(pthread_create(&consumer, NULL, ResizeConsumer, &resize) == 0);
+    CHECK(pthread_create(&producer, NULL, ResizeProducer, &resize) == 0);
+    CHECK(pthread_create(&resizer, NULL, ResizeResizer, &resize) == 0);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    pthread_join(resizer, NULL);
+
+    printf("  %u resizes, %u retried larger\n", resize.Resizes, resize.Retries);
+    CHECK_EQ(resize.Mismatches, 0);
+    CHECK(resize.Resizes > 0);
+    CHECK_EQ(resize.Ring.WriteCount, RESIZE_BYTES);
+    CHECK_EQ(resize.Ring.ReadCount, RESIZE_BYTES);
+
+    free(resize.Storage);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestResizeInFlight);
+    return TestResult();
+}
@@ -0,0 +1,305 @@
+/*++
+
+Module Name:
+
+    test_segbuffer.c
+
+Abstract:
+
+    Tests for the segmented byte queue and its shared segment pool
+    (segbuffer.c)
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "ringbuffer.h"
+#include "segbuffer.h"
+#include "testing.h"
+
+#define SEGMENT     SEG_BUFFER_SEGMENT_DATA
+
+// Writes Length bytes of the stream from running offset *Counter
+static size_t
+WriteStream(
+    PSEG_BUFFER Queue,
+    ULONG64* Counter,
+    size_t Length
+)
+{
+    BYTE data[3 * SEGMENT];
+    size_t written;
+    size_t i;
+
+    for (i = 0; i < Length; i++) {
+        data[i] = TestStreamByte(*Counter + i);
+    }
+    (VOID)SegBufferWrite(Queue, data, Length, &written);
+    *Counter += written;
+    return written;
+}
+
+// Reads up to Length bytes and checks them against the stream
+static size_t
+ReadStream(
+    PSEG_BUFFER Queue,
+    ULONG64* Counter,
+    size_t Length
+)
+{
+    BYTE data[3 * SEGMENT];
+    size_t read;
+    size_t i;
+
+    (VOID)SegBufferRead(Queue, data, Length, &read);
+    for (i = 0; i < read; i++) {
+        CHECK_EQ(data[i], TestStreamByte(*Counter + i));
+    }
+    *Counter += read;
+    return read;
+}
+
+static VOID
+TestSpansCrossSegments(
+    VOID
+)
+{
+    SEG_BUFFER queue;
+    RING_BUFFER_SPANS spans;
+    ULONG64 in = 0;
+    ULONG64 out = 0;
+
+    CHECK(NT_SUCCESS(SegBufferPoolInitialize(16 * SEG_BUFFER_SEGMENT_SIZE)));
+    CHECK(NT_SUCCESS(SegBufferInitialize(&queue, 16 * SEGMENT)));
+    CHECK_EQ(queue.Segments, 1);
+
+    // Leave the tail 10 bytes short of the end of the first segment
+    CHECK_EQ(WriteStream(&queue, &in, SEGMENT - 10), SEGMENT - 10);
+
+    // A reservation across the boundary links a second segment
+    CHECK_EQ(SegBufferReserve(&queue, 30, &spans), 30);
+    CHECK_EQ(spans.Count, 2);
+    CHECK_EQ(spans.Span[0].Length, 10);
+    CHECK_EQ(spans.Span[1].Length, 20);
+    CHECK_EQ(queue.Segments, 2);
+
+    // Committing none of it keeps the segment for the next write
+    SegBufferCommit(&queue, 0);
+    CHECK_EQ(WriteStream(&queue, &in, 30), 30);
+    CHECK_EQ(queue.Segments, 2);
+
+    // The reader sees the same split, and frees the first segment once past it
+    CHECK_EQ(ReadStream(&queue, &out, SEGMENT - 20), SEGMENT - 20);
+    CHECK_EQ(SegBufferPeek(&queue, 100, &spans), 40);
+    CHECK_EQ(spans.Count, 2);
+    CHECK_EQ(spans.Span[0].Length, 20);
+    CHECK_EQ(ReadStream(&queue, &out, 100), 40);
+    CHECK_EQ(queue.Segments, 1);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), SEG_BUFFER_SEGMENT_SIZE);
+
+    // A tail exactly at the end of a segment starts the next one
+    CHECK_EQ(WriteStream(&queue, &in, SEGMENT - 20), SEGMENT - 20);
+    CHECK_EQ(queue.TailOffset, SEGMENT);
+    CHECK_EQ(SegBufferReserve(&queue, 5, &spans), 5);
+    CHECK_EQ(spans.Count, 1);
+    CHECK(spans.Span[0].Buffer == queue.Tail->Next->Data);
+
+    SegBufferUninitialize(&queue);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), 0);
+    SegBufferPoolUninitialize();
+}
+
+static VOID
+TestLimit(
+    VOID
+)
+{
+    SEG_BUFFER queue;
+    BYTE data[100] = { 0 };
+    size_t written;
+    size_t space;
+    ULONG64 in = 0;
+
+    CHECK(NT_SUCCESS(SegBufferPoolInitialize(16 * SEG_BUFFER_SEGMENT_SIZE)));
+    CHECK(NT_SUCCESS(SegBufferInitialize(&queue, 150)));
+
+    CHECK_EQ(WriteStream(&queue, &in, 100), 100);
+    CHECK_EQ(SegBufferWrite(&queue, data, 100, &written), STATUS_BUFFER_OVERFLOW);
+    CHECK_EQ(written, 50);
+    SegBufferGetAvailableSpace(&queue, &space);
+    CHECK_EQ(space, 0);
+
+    // Lowering the limit below the occupancy leaves no space, not a huge one
+    SegBufferSetLimit(&queue, 10);
+    SegBufferGetAvailableSpace(&queue, &space);
+    CHECK_EQ(space, 0);
+
+    SegBufferUninitialize(&queue);
+    SegBufferPoolUninitialize();
+}
+
+static VOID
+TestPoolExhaustion(
+    VOID
+)
+{
+    SEG_BUFFER first;
+    SEG_BUFFER second;
+    SEG_BUFFER third;
+    RING_BUFFER_SPANS spans;
+    ULONG64 in = 0;
+    ULONG64 out = 0;
+    ULONG64 other = 0;
+
+    // Room for three segments across every queue
+    CHECK(NT_SUCCESS(SegBufferPoolInitialize(3 * SEG_BUFFER_SEGMENT_SIZE)));
+    CHECK(NT_SUCCESS(SegBufferInitialize(&first, 64 * SEGMENT)));
+    CHECK(NT_SUCCESS(SegBufferInitialize(&second, 64 * SEGMENT)));
+
+    // The first queue takes the last segment; the write stops there
+    CHECK_EQ(WriteStream(&first, &in, 3 * SEGMENT), 2 * SEGMENT);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), 3 * SEG_BUFFER_SEGMENT_SIZE);
+    CHECK_EQ(SegBufferReserve(&first, 1, &spans), 0);
+    CHECK_EQ(spans.Count, 0);
+
+    // The second queue can fill the segment it keeps, and no more
+    CHECK_EQ(WriteStream(&second, &other, SEGMENT + 1), SEGMENT);
+
+    // A third queue cannot even start
+    CHECK_EQ(SegBufferInitialize(&third, SEGMENT), STATUS_INSUFFICIENT_RESOURCES);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), 3 * SEG_BUFFER_SEGMENT_SIZE);
+
+    // Draining the first queue's head segment hands it back, and the first
+    // queue takes it again for its next write
+    CHECK_EQ(ReadStream(&first, &out, SEGMENT + 1), SEGMENT + 1);
+    CHECK_EQ(first.Segments, 1);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), 2 * SEG_BUFFER_SEGMENT_SIZE);
+    CHECK_EQ(WriteStream(&first, &in, SEGMENT), SEGMENT);
+    CHECK_EQ(first.Segments, 2);
+
+    // A reset gives back everything but the head segment
+    SegBufferReset(&first);
+    CHECK_EQ(first.Segments, 1);
+    CHECK_EQ(first.WriteCount, 0);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), 2 * SEG_BUFFER_SEGMENT_SIZE);
+
+    SegBufferUninitialize(&first);
+    SegBufferUninitialize(&second);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), 0);
+    SegBufferPoolUninitialize();
+}
+
+//
+// One producer and one consumer thread with no lock between them, on a pool
+// small enough that the producer regularly finds it empty
+//
+
+#define STRESS_BYTES    (16ULL * 1024 * 1024)
+
+typedef struct _STRESS {
+    SEG_BUFFER  Queue;
+    ULONG64     Mismatches;
+} STRESS;
+
+static void*
+StressProducer(
+    void* Context
+)
+{
+    STRESS* stress = (STRESS*)Context;
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0x3F84D5B5B5470917ULL;
+    ULONG64 counter = 0;
+    size_t want;
+    size_t got;
+    size_t i;
+    ULONG s;
+
+    while (counter < STRESS_BYTES) {
+        want = (size_t)(TestRandom(&seed) % (2 * SEGMENT)) + 1;
+        want = (size_t)min((ULONG64)want, STRESS_BYTES - counter);
+
+        got = SegBufferReserve(&stress->Queue, want, &spans);
+        if (got == 0) {
+            sched_yield();
+            continue;
+        }
+        for (s = 0; s < spans.Count; s++) {
+            for (i = 0; i < spans.Span[s].Length; i++) {
+                spans.Span[s].Buffer[i] = TestStreamByte(counter++);
+            }
+        }
+        SegBufferCommit(&stress->Queue, got);
+    }
+    return NULL;
+}
+
+static void*
+StressConsumer(
+    void* Context
+)
+{
+    STRESS* stress = (STRESS*)Context;
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0x9216D5D98979FB1BULL;
+    ULONG64 counter = 0;
+    size_t got;
+    size_t i;
+    ULONG s;
+
+    while (counter < STRESS_BYTES) {
+        got = SegBufferPeek(&stress->Queue, (size_t)(TestRandom(&seed) % (2 * SEGMENT)) + 1, &spans);
+        if (got == 0) {
+            sched_yield();
+            continue;
+        }
+        for (s = 0; s < spans.Count; s++) {
+            for (i = 0; i < spans.Span[s].Length; i++) {
+                if (spans.Span[s].Buffer[i] != TestStreamByte(counter++)) {
+                    stress->Mismatches++;
+                }
+            }
+        }
+        SegBufferConsume(&stress->Queue, got);
+    }
+    return NULL;
+}
+
+static VOID
+TestSpscStress(
+    VOID
+)
+{
+    static STRESS stress;
+    pthread_t producer;
+    pthread_t consumer;
+
+    CHECK(NT_SUCCESS(SegBufferPoolInitialize(8 * SEG_BUFFER_SEGMENT_SIZE)));
+    CHECK(NT_SUCCESS(SegBufferInitialize(&stress.Queue, 64 * SEGMENT)));
+
+    CHECK(pthread_create(&consumer, NULL, StressConsumer, &stress) == 0);
+    CHECK(pthread_create(&producer, NULL, StressProducer, &stress) == 0);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    CHECK_EQ(stress.Mismatches, 0);
+    CHECK_EQ(stress.Queue.ReadCount, STRESS_BYTES);
+    CHECK(stress.Queue.Segments <= 8);
+
+    SegBufferUninitialize(&stress.Queue);
+    CHECK_EQ(SegBufferPoolGetBytesInUse(), 0);
+    SegBufferPoolUninitialize();
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestSpansCrossSegments);
+    RUN_TEST(TestLimit);
+    RUN_TEST(TestPoolExhaustion);
+    RUN_TEST(TestSpscStress);
+    return TestResult();
+}
@@ -0,0 +1,406 @@
+/*++
+
+Module Name:
+
+    test_sharedring.c
+
+Abstract:
+
+    Tests for the driver side of the shared rings (sharedring.c), against
+    the service side in sharedpeer.h: spans across the wrap, peer indices
+    that cannot be trusted, doorbell suppression, and both directions
+    between two processes sharing the region.
+
+--*/
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "platform.h"
+#include "public.h"
+#include "ringbuffer.h"
+#include "sharedring.h"
+#include "testing.h"
+#include "sharedpeer.h"
+
+#define RING_CAPACITY   4096
+
+typedef struct _REGION {
+    VCOM_SHARED_HEADER  Header;
+    BYTE                ToUser[RING_CAPACITY];
+    BYTE                FromNetwork[RING_CAPACITY];
+    KEVENT              ToUserEvent;        // driver to service: data in ToUser
+    KEVENT              FromNetworkEvent;   // driver to service: room in FromNetwork
+    KEVENT              Doorbell;           // service to driver
+    ULONG64             Mismatches;
+    ULONG64             Timeouts;
+} REGION;
+
+static VOID
+FillSpans(
+    PRING_BUFFER_SPANS Spans,
+    ULONG64 Counter
+)
+{
+    size_t i;
+    ULONG s;
+
+    for (s = 0; s < Spans->Count; s++) {
+        for (i = 0; i < Spans->Span[s].Length; i++) {
+            Spans->Span[s].Buffer[i] = TestStreamByte(Counter++);
+        }
+    }
+}
+
+static ULONG64
+CountMismatches(
+    PRING_BUFFER_SPANS Spans,
+    ULONG64 Counter
+)
+{
+    ULONG64 mismatches = 0;
+    size_t i;
+    ULONG s;
+
+    for (s = 0; s < Spans->Count; s++) {
+        for (i = 0; i < Spans->Span[s].Length; i++) {
+            mismatches += (Spans->Span[s].Buffer[i] != TestStreamByte(Counter++));
+        }
+    }
+    return mismatches;
+}
+
+static REGION*
+RegionCreate(
+    PSHARED_RING ToUser,
+    PSHARED_RING FromNetwork,
+    PPEER_RING PeerToUser,
+    PPEER_RING PeerFromNetwork
+)
+{
+    REGION* region = (REGION*)mmap(NULL, sizeof(REGION), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    RtlZeroMemory(region, sizeof(*region));
+
+    SharedRingInitialize(ToUser, &region->Header.ToUser, region->ToUser,
+        RING_CAPACITY, TRUE, &region->ToUserEvent);
+    SharedRingInitialize(FromNetwork, &region->Header.FromNetwork, region->FromNetwork,
+        RING_CAPACITY, FALSE, &region->FromNetworkEvent);
+    PeerRingInitialize(PeerToUser, &region->Header.ToUser, region->ToUser,
+        RING_CAPACITY, &region->Doorbell);
+    PeerRingInitialize(PeerFromNetwork, &region->Header.FromNetwork, region->FromNetwork,
+        RING_CAPACITY, &region->Doorbell);
+    return region;
+}
+
+static VOID
+TestWrap(
+    VOID
+)
+{
+    SHARED_RING toUser;
+    SHARED_RING fromNet;
+    PEER_RING peerToUser;
+    PEER_RING peerFromNet;
+    RING_BUFFER_SPANS spans;
+    REGION* region = RegionCreate(&toUser, &fromNet, &peerToUser, &peerFromNet);
+
+    CHECK(region != NULL);
+
+    // Move both sides to 100 bytes short of the end
+    toUser.Index = RING_CAPACITY - 100;
+    peerToUser.Index = RING_CAPACITY - 100;
+    region->Header.ToUser.ProducerIndex = RING_CAPACITY - 100;
+    region->Header.ToUser.ConsumerIndex = RING_CAPACITY - 100;
+
+    CHECK_EQ(SharedRingReserve(&toUser, 300, &spans), 300);
+    CHECK_EQ(spans.Count, 2);
+    CHECK_EQ(spans.Span[0].Length, 100);
+    CHECK(spans.Span[1].Buffer == region->ToUser);
+    FillSpans(&spans, RING_CAPACITY - 100);
+    SharedRingCommit(&toUser, 300);
+    CHECK_EQ(region->Header.ToUser.ProducerIndex, RING_CAPACITY + 200);
+    CHECK_EQ(SharedRingGetAvailableData(&toUser), 300);
+
+    CHECK_EQ(PeerRingPeek(&peerToUser, 1000, &spans), 300);
+    CHECK_EQ(spans.Count, 2);
+    CHECK_EQ(CountMismatches(&spans, RING_CAPACITY - 100), 0);
+    PeerRingConsume(&peerToUser, 300);
+    CHECK_EQ(SharedRingGetAvailableData(&toUser), 0);
+
+    munmap(region, sizeof(*region));
+}
+
+// Indices the service writes are only hints: one behind the driver, or
+// more than a ring ahead of it, must not let the driver overrun the data
+// area in either direction
+static VOID
+TestBogusPeerIndex(
+    VOID
+)
+{
+    SHARED_RING toUser;
+    SHARED_RING fromNet;
+    PEER_RING peerToUser;
+    PEER_RING peerFromNet;
+    RING_BUFFER_SPANS spans;
+    REGION* region = RegionCreate(&toUser, &fromNet, &peerToUser, &peerFromNet);
+
+    CHECK(region != NULL);
+    toUser.Index = 1000;
+    fromNet.Index = 1000;
+
+    // A consumer index ahead of what the driver produced: full
+    region->Header.ToUser.ConsumerIndex = 1001;
+    CHECK_EQ(SharedRingReserve(&toUser, 10, &spans), 0);
+    CHECK_EQ(SharedRingGetAvailableData(&toUser), RING_CAPACITY);
+
+    // One more than a ring behind: also full
+    region->Header.ToUser.ConsumerIndex = 1000 - RING_CAPACITY - 1;
+    CHECK_EQ(SharedRingReserve(&toUser, 10, &spans), 0);
+
+    // A ring behind exactly is a full ring, and one byte less frees one byte
+    region->Header.ToUser.ConsumerIndex = 1000 - RING_CAPACITY + 1;
+    CHECK_EQ(SharedRingReserve(&toUser, 10, &spans), 1);
+
+    // A producer index behind what the driver consumed: empty
+    region->Header.FromNetwork.ProducerIndex = 999;
+    CHECK_EQ(SharedRingPeek(&fromNet, 10, &spans), 0);
+
+    // More than a ring of data claimed: empty
+    region->Header.FromNetwork.ProducerIndex = 1000 + RING_CAPACITY + 1;
+    CHECK_EQ(SharedRingPeek(&fromNet, RING_CAPACITY * 2, &spans), 0);
+
+    // Exactly a ring is believed
+    region->Header.FromNetwork.ProducerIndex = 1000 + RING_CAPACITY;
+    CHECK_EQ(SharedRingPeek(&fromNet, RING_CAPACITY * 2, &spans), RING_CAPACITY);
+
+    munmap(region, sizeof(*region));
+}
+
+// The driver sets the service's event only when the service has flagged
+// itself as waiting, and the service rings the doorbell likewise
+static VOID
+TestEventSuppression(
+    VOID
+)
+{
+    SHARED_RING toUser;
+    SHARED_RING fromNet;
+    PEER_RING peerToUser;
+    PEER_RING peerFromNet;
+    RING_BUFFER_SPANS spans;
+    REGION* region = RegionCreate(&toUser, &fromNet, &peerToUser, &peerFromNet);
+
+    CHECK(region != NULL);
+
+    SharedRingReserve(&toUser, 10, &spans);
+    SharedRingCommit(&toUser, 10);
+    CHECK_EQ(region->ToUserEvent.Signaled, 0);
+
+    region->Header.ToUser.ConsumerWaiting = 1;
+    SharedRingReserve(&toUser, 10, &spans);
+    SharedRingCommit(&toUser, 10);
+    CHECK_EQ(region->ToUserEvent.Signaled, 1);
+
+    // The driver consuming kicks a producer that waits for room
+    PeerRingReserve(&peerFromNet, 50, &spans);
+    PeerRingCommit(&peerFromNet, 50);
+    CHECK_EQ(region->Doorbell.Signaled, 0);
+    CHECK_EQ(SharedRingPeek(&fromNet, 20, &spans), 20);
+    SharedRingConsume(&fromNet, 20);
+    CHECK_EQ(region->FromNetworkEvent.Signaled, 0);
+    region->Header.FromNetwork.ProducerWaiting = 1;
+    SharedRingConsume(&fromNet, 20);
+    CHECK_EQ(region->FromNetworkEvent.Signaled, 1);
+
+    // The doorbell is wanted for a driver consumer waiting for data
+    SharedRingSetConsumerWaiting(&fromNet, TRUE);
+    PeerRingReserve(&peerFromNet, 5, &spans);
+    PeerRingCommit(&peerFromNet, 5);
+    CHECK_EQ(region->Doorbell.Signaled, 1);
+
+    // Discard drops everything published so far
+    SharedRingDiscard(&fromNet);
+    CHECK_EQ(SharedRingGetAvailableData(&fromNet), 0);
+    CHECK_EQ(region->Header.FromNetwork.ConsumerIndex, 55);
+
+    munmap(region, sizeof(*region));
+}
+
+//
+// Two processes. The parent is the driver and the child the service; each
+// blocks only after flagging itself as waiting and re-checking the ring,
+// so a lost wakeup shows as a wait that times out.
+//
+
+#define STREAM_BYTES    (8ULL * 1024 * 1024)
+#define WAIT_MS         2000
+
+static VOID
+DriverSend(
+    PSHARED_RING Ring,
+    REGION* Region
+)
+{
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0x082EFA98EC4E6C89ULL;
+    ULONG64 counter = 0;
+    size_t want;
+    size_t got;
+
+    while (counter < STREAM_BYTES) {
+        want = (size_t)(TestRandom(&seed) % 1500) + 1;
+        want = (size_t)min((ULONG64)want, STREAM_BYTES - counter);
+
+        got = SharedRingReserve(Ring, want, &spans);
+        if (got == 0) {
+            SharedRingSetProducerWaiting(Ring, TRUE);
+            if (SharedRingReserve(Ring, 1, &spans) == 0 && !PeerWait(&Region->Doorbell, WAIT_MS)) {
+                Region->Timeouts++;
+            }
+            SharedRingSetProducerWaiting(Ring, FALSE);
+            continue;
+        }
+        FillSpans(&spans, counter);
+        counter += got;
+        SharedRingCommit(Ring, got);
+    }
+}
+
+static VOID
+DriverReceive(
+    PSHARED_RING Ring,
+    REGION* Region
+)
+{
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0x452821E638D01377ULL;
+    ULONG64 counter = 0;
+    size_t got;
+
+    while (counter < STREAM_BYTES) {
+        got = SharedRingPeek(Ring, (size_t)(TestRandom(&seed) % 1500) + 1, &spans);
+        if (got == 0) {
+            SharedRingSetConsumerWaiting(Ring, TRUE);
+            if (SharedRingPeek(Ring, 1, &spans) == 0 && !PeerWait(&Region->Doorbell, WAIT_MS)) {
+                Region->Timeouts++;
+            }
+            SharedRingSetConsumerWaiting(Ring, FALSE);
+            continue;
+        }
+        Region->Mismatches += CountMismatches(&spans, counter);
+        counter += got;
+        SharedRingConsume(Ring, got);
+    }
+}
+
+static VOID
+ServiceReceive(
+    PPEER_RING Ring,
+    REGION* Region
+)
+{
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0xBE5466CF34E90C6CULL;
+    ULONG64 counter = 0;
+    size_t got;
+
+    while (counter < STREAM_BYTES) {
+        got = PeerRingPeek(Ring, (size_t)(TestRandom(&seed) % 1500) + 1, &spans);
+        if (got == 0) {
+            InterlockedExchange(&Ring->Control->ConsumerWaiting, 1);
+            if (PeerRingPeek(Ring, 1, &spans) == 0 && !PeerWait(&Region->ToUserEvent, WAIT_MS)) {
+                Region->Timeouts++;
+            }
+            InterlockedExchange(&Ring->Control->ConsumerWaiting, 0);
+            continue;
+        }
+        Region->Mismatches += CountMismatches(&spans, counter);
+        counter += got;
+        PeerRingConsume(Ring, got);
+    }
+}
+
+static VOID
+ServiceSend(
+    PPEER_RING Ring,
+    REGION* Region
+)
+{
+    RING_BUFFER_SPANS spans;
+    unsigned long long seed = 0xC0AC29B7C97C50DDULL;
+    ULONG64 counter = 0;
+    size_t want;
+    size_t got;
+
+    while (counter < STREAM_BYTES) {
+        want = (size_t)(TestRandom(&seed) % 1500) + 1;
+        want = (size_t)min((ULONG64)want, STREAM_BYTES - counter);
+
+        got = PeerRingReserve(Ring, want, &spans);
+        if (got == 0) {
+            InterlockedExchange(&Ring->Control->ProducerWaiting, 1);
+            if (PeerRingReserve(Ring, 1, &spans) == 0 && !PeerWait(&Region->FromNetworkEvent, WAIT_MS)) {
+                Region->Timeouts++;
+            }
+            InterlockedExchange(&Ring->Control->ProducerWaiting, 0);
+            continue;
+        }
+        FillSpans(&spans, counter);
+        counter += got;
+        PeerRingCommit(Ring, got);
+    }
+}
+
+static VOID
+TestTwoProcesses(
+    VOID
+)
+{
+    SHARED_RING toUser;
+    SHARED_RING fromNet;
+    PEER_RING peerToUser;
+    PEER_RING peerFromNet;
+    REGION* region = RegionCreate(&toUser, &fromNet, &peerToUser, &peerFromNet);
+    int status;
+    pid_t child;
+
+    CHECK(region != NULL);
+
+    child = fork();
+    CHECK(child >= 0);
+    if (child == 0) {
+        ServiceReceive(&peerToUser, region);
+        ServiceSend(&peerFromNet, region);
+        _exit(0);
+    }
+
+    DriverSend(&toUser, region);
+    DriverReceive(&fromNet, region);
+
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK_EQ(region->Mismatches, 0);
+    CHECK_EQ(region->Timeouts, 0);
+    CHECK_EQ(region->Header.ToUser.ConsumerIndex, STREAM_BYTES);
+    CHECK_EQ(region->Header.FromNetwork.ConsumerIndex, STREAM_BYTES);
+
+    munmap(region, sizeof(*region));
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestWrap);
+    RUN_TEST(TestBogusPeerIndex);
+    RUN_TEST(TestEventSuppression);
+    RUN_TEST(TestTwoProcesses);
+    return TestResult();
+}
@@ -0,0 +1,272 @@
+/*++
+
+Module Name:
+
+    test_swflow.c
+
+Abstract:
+
+    Tests for XON/XOFF software flow control (swflow.c): settings checks,
+    XON and XOFF taken out of incoming data, the XOFF and XON sent around
+    the receive limits, and a randomized run of incoming data checked
+    against a byte-at-a-time filter.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "swflow.h"
+#include "testing.h"
+
+#define XON     0x11
+#define XOFF    0x13
+
+static VOID
+Configure(
+    PSW_FLOW Flow,
+    ULONG FlowReplace,
+    LONG XonLimit,
+    LONG XoffLimit
+)
+{
+    SERIAL_HANDFLOW handFlow;
+    SERIAL_CHARS chars;
+
+    RtlZeroMemory(&handFlow, sizeof(handFlow));
+    RtlZeroMemory(&chars, sizeof(chars));
+    handFlow.FlowReplace = FlowReplace;
+    handFlow.XonLimit = XonLimit;
+    handFlow.XoffLimit = XoffLimit;
+    chars.XonChar = XON;
+    chars.XoffChar = XOFF;
+    CHECK(SwFlowIsValid(&handFlow, &chars));
+    SwFlowConfigure(Flow, &handFlow, &chars);
+}
+
+static VOID
+TestIsValid(
+    VOID
+)
+{
+    SERIAL_HANDFLOW handFlow;
+    SERIAL_CHARS chars;
+
+    RtlZeroMemory(&handFlow, sizeof(handFlow));
+    RtlZeroMemory(&chars, sizeof(chars));
+    chars.XonChar = XON;
+    chars.XoffChar = XOFF;
+    handFlow.FlowReplace = SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE | SERIAL_XOFF_CONTINUE;
+    handFlow.XonLimit = 2048;
+    handFlow.XoffLimit = 512;
+    CHECK(SwFlowIsValid(&handFlow, &chars));
+
+    handFlow.XoffLimit = -1;
+    CHECK(!SwFlowIsValid(&handFlow, &chars));
+    handFlow.XoffLimit = 512;
+
+    handFlow.ControlHandShake = SERIAL_DTR_MASK;
+    CHECK(!SwFlowIsValid(&handFlow, &chars));
+    handFlow.ControlHandShake = 0x100;
+    CHECK(!SwFlowIsValid(&handFlow, &chars));
+    handFlow.ControlHandShake = 0;
+
+    handFlow.FlowReplace |= 0x100;
+    CHECK(!SwFlowIsValid(&handFlow, &chars));
+
+    // One character for both is only refused while either side uses it
+    chars.XoffChar = XON;
+    handFlow.FlowReplace = SERIAL_AUTO_RECEIVE;
+    CHECK(!SwFlowIsValid(&handFlow, &chars));
+    handFlow.FlowReplace = 0;
+    CHECK(SwFlowIsValid(&handFlow, &chars));
+}
+
+static VOID
+TestReceiveStrips(
+    VOID
+)
+{
+    SW_FLOW flow;
+    UCHAR data[] = { 'a', XOFF, 'b', 'c', XON, XON, 'd' };
+    UCHAR plain[] = { 'a', XOFF, 'b' };
+
+    RtlZeroMemory(&flow, sizeof(flow));
+
+    // Without AUTO_TRANSMIT the characters are data
+    Configure(&flow, 0, 0, 0);
+    CHECK_EQ(SwFlowReceive(&flow, plain, sizeof(plain)), 3);
+    CHECK_EQ(plain[1], XOFF);
+    CHECK(!flow.XoffReceived);
+
+    Configure(&flow, SERIAL_AUTO_TRANSMIT, 0, 0);
+    CHECK_EQ(SwFlowReceive(&flow, data, sizeof(data)), 4);
+    CHECK(memcmp(data, "abcd", 4) == 0);
+    CHECK(!flow.XoffReceived);
+    CHECK_EQ(SwFlowHoldReasons(&flow), 0);
+
+    // The last character in a buffer decides, and a hold outlasts the buffer
+    data[0] = XON;
+    data[1] = 'x';
+    data[2] = XOFF;
+    CHECK_EQ(SwFlowReceive(&flow, data, 3), 1);
+    CHECK_EQ(data[0], 'x');
+    CHECK(flow.XoffReceived);
+    CHECK_EQ(SwFlowHoldReasons(&flow), SERIAL_TX_WAITING_FOR_XON);
+
+    data[0] = 'y';
+    CHECK_EQ(SwFlowReceive(&flow, data, 1), 1);
+    CHECK(flow.XoffReceived);
+    data[0] = XON;
+    CHECK_EQ(SwFlowReceive(&flow, data, 1), 0);
+    CHECK(!flow.XoffReceived);
+
+    // Turning AUTO_TRANSMIT off releases a hold
+    data[0] = XOFF;
+    CHECK_EQ(SwFlowReceive(&flow, data, 1), 0);
+    CHECK(flow.XoffReceived);
+    Configure(&flow, 0, 0, 0);
+    CHECK_EQ(SwFlowHoldReasons(&flow), 0);
+}
+
+static VOID
+TestLimits(
+    VOID
+)
+{
+    SW_FLOW flow;
+    UCHAR c;
+
+    RtlZeroMemory(&flow, sizeof(flow));
+    Configure(&flow, SERIAL_AUTO_RECEIVE, 256, 64);
+
+    // Nothing sent while the buffer fills up to the XOFF limit
+    CHECK(!SwFlowCheckLimits(&flow, 0, 1024));
+    CHECK(!SwFlowCheckLimits(&flow, 959, 65));
+    CHECK(!SwFlowTakeSend(&flow, &c));
+
+    CHECK(SwFlowCheckLimits(&flow, 960, 64));
+    CHECK(SwFlowTakeSend(&flow, &c));
+    CHECK_EQ(c, XOFF);
+    CHECK(!SwFlowTakeSend(&flow, &c));
+    CHECK_EQ(SwFlowHoldReasons(&flow), SERIAL_TX_WAITING_XOFF_SENT);
+
+    // XOFF goes once, however full the buffer gets; XON waits for the
+    // buffer to drain to its limit, not just back under the XOFF limit
+    CHECK(!SwFlowCheckLimits(&flow, 1024, 0));
+    CHECK(!SwFlowCheckLimits(&flow, 900, 124));
+    CHECK(!SwFlowCheckLimits(&flow, 257, 767));
+    CHECK(!SwFlowTakeSend(&flow, &c));
+
+    CHECK(SwFlowCheckLimits(&flow, 256, 768));
+    CHECK(SwFlowTakeSend(&flow, &c));
+    CHECK_EQ(c, XON);
+    CHECK_EQ(SwFlowHoldReasons(&flow), 0);
+    CHECK(!SwFlowCheckLimits(&flow, 0, 1024));
+
+    // With XOFF_CONTINUE transmission carries on after XOFF is sent
+    Configure(&flow, SERIAL_AUTO_RECEIVE | SERIAL_XOFF_CONTINUE, 256, 64);
+    CHECK(SwFlowCheckLimits(&flow, 1000, 24));
+    CHECK(flow.XoffSent);
+    CHECK_EQ(SwFlowHoldReasons(&flow), 0);
+
+    // Without AUTO_RECEIVE the limits are not watched
+    flow.XoffSent = FALSE;
+    Configure(&flow, 0, 256, 64);
+    CHECK(!SwFlowCheckLimits(&flow, 1024, 0));
+    CHECK(!flow.XoffSent);
+}
+
+static VOID
+TestSendReplaced(
+    VOID
+)
+{
+    SW_FLOW flow;
+    UCHAR c;
+
+    RtlZeroMemory(&flow, sizeof(flow));
+    Configure(&flow, SERIAL_AUTO_RECEIVE, 256, 64);
+
+    // XON queued over an XOFF not yet taken: the far end only sees XON
+    CHECK(SwFlowCheckLimits(&flow, 1000, 24));
+    CHECK(SwFlowCheckLimits(&flow, 10, 1014));
+    CHECK(SwFlowTakeSend(&flow, &c));
+    CHECK_EQ(c, XON);
+    CHECK(!SwFlowTakeSend(&flow, &c));
+
+    // Turning AUTO_RECEIVE off sends the XON still owed, once
+    CHECK(SwFlowCheckLimits(&flow, 1000, 24));
+    CHECK(SwFlowTakeSend(&flow, &c));
+    CHECK_EQ(c, XOFF);
+    Configure(&flow, 0, 256, 64);
+    CHECK(SwFlowTakeSend(&flow, &c));
+    CHECK_EQ(c, XON);
+    CHECK(!flow.XoffSent);
+    Configure(&flow, 0, 256, 64);
+    CHECK(!SwFlowTakeSend(&flow, &c));
+}
+
+//
+// Random buffers, sparse or dense in control characters, at every length up
+// to a few vector widths, through a filter that looks at one byte at a time
+//
+
+#define RANDOM_BUFFER   300
+#define RANDOM_ROUNDS   100000
+
+static VOID
+TestRandomized(
+    VOID
+)
+{
+    static UCHAR data[RANDOM_BUFFER];
+    static UCHAR expect[RANDOM_BUFFER];
+    unsigned long long seed = 0x510E527FADE682D1ULL;
+    SW_FLOW flow;
+    BOOLEAN held = FALSE;
+    ULONG64 stripped = 0;
+    ULONG round;
+
+    RtlZeroMemory(&flow, sizeof(flow));
+    Configure(&flow, SERIAL_AUTO_TRANSMIT, 0, 0);
+
+    for (round = 0; round < RANDOM_ROUNDS; round++) {
+        size_t length = (size_t)(TestRandom(&seed) % (RANDOM_BUFFER + 1));
+        ULONG density = 1 + (ULONG)(TestRandom(&seed) % 200);
+        size_t kept = 0;
+        size_t i;
+
+        for (i = 0; i < length; i++) {
+            ULONG64 r = TestRandom(&seed);
+
+            data[i] = (r % density == 0) ? ((r >> 32) & 1 ? XON : XOFF) : (UCHAR)(r >> 40);
+            if (data[i] == XON || data[i] == XOFF) {
+                held = (data[i] == XOFF);
+                stripped++;
+            }
+            else {
+                expect[kept++] = data[i];
+            }
+        }
+
+        CHECK_EQ(SwFlowReceive(&flow, data, length), kept);
+        CHECK(memcmp(data, expect, kept) == 0);
+        CHECK_EQ(flow.XoffReceived, held);
+    }
+
+    printf("  %llu control characters taken out\n", (unsigned long long)stripped);
+    CHECK(stripped > 100000);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestIsValid);
+    RUN_TEST(TestReceiveStrips);
+    RUN_TEST(TestLimits);
+    RUN_TEST(TestSendReplaced);
+    RUN_TEST(TestRandomized);
+    return TestResult();
+}
@@ -0,0 +1,248 @@
+/*++
+
+Module Name:
+
+    test_timerwheel.c
+
+Abstract:
+
+    Tests for the hashed timer wheel (timerwheel.c), driven by a simulated
+    clock, and a randomized run checked against a plain list of deadlines.
+
+--*/
+
+#include "platform.h"
+#include "timerwheel.h"
+#include "testing.h"
+
+#define SLOTS   TIMER_WHEEL_SLOTS
+
+static VOID
+EntryInit(
+    PTIMER_WHEEL_ENTRY Entry,
+    PVOID Context
+)
+{
+    RtlZeroMemory(Entry, sizeof(*Entry));
+    InitializeListHead(&Entry->Link);
+    Entry->Context = Context;
+}
+
+static VOID
+TestFiresOnDeadline(
+    VOID
+)
+{
+    static TIMER_WHEEL wheel;
+    TIMER_WHEEL_ENTRY entry;
+    PTIMER_WHEEL_ENTRY expired[4];
+    ULONG64 now;
+
+    TimerWheelInitialize(&wheel, 1000);
+    EntryInit(&entry, NULL);
+    TimerWheelInsert(&wheel, &entry, 1010);
+    CHECK(entry.Armed);
+    CHECK_EQ(wheel.Count, 1);
+
+    for (now = 1001; now < 1010; now++) {
+        CHECK_EQ(TimerWheelAdvance(&wheel, now, expired, 4), 0);
+    }
+    CHECK_EQ(TimerWheelAdvance(&wheel, 1010, expired, 4), 1);
+    CHECK(expired[0] == &entry);
+    CHECK(!entry.Armed);
+    CHECK_EQ(wheel.Count, 0);
+
+    // A deadline already passed goes off on the next tick
+    TimerWheelInsert(&wheel, &entry, 3);
+    CHECK_EQ(entry.Deadline, 1011);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 1011, expired, 4), 1);
+
+    // A clock that reads behind the wheel finds nothing and moves nothing
+    TimerWheelInsert(&wheel, &entry, 1012);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 500, expired, 4), 0);
+    CHECK_EQ(wheel.Current, 1011);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 1012, expired, 4), 1);
+}
+
+// Deadlines a turn or more out share a bucket with nearer ones and wait
+// for their own turn
+static VOID
+TestLaterTurns(
+    VOID
+)
+{
+    static TIMER_WHEEL wheel;
+    TIMER_WHEEL_ENTRY near;
+    TIMER_WHEEL_ENTRY far;
+    PTIMER_WHEEL_ENTRY expired[4];
+    ULONG64 now;
+    ULONG fired = 0;
+
+    TimerWheelInitialize(&wheel, 0);
+    EntryInit(&near, NULL);
+    EntryInit(&far, NULL);
+    TimerWheelInsert(&wheel, &near, 5);
+    TimerWheelInsert(&wheel, &far, 5 + 3 * SLOTS);
+
+    for (now = 1; now <= 5 + 3 * SLOTS; now++) {
+        ULONG count = TimerWheelAdvance(&wheel, now, expired, 4);
+
+        if (count != 0) {
+            fired++;
+            CHECK_EQ(count, 1);
+            CHECK_EQ(expired[0]->Deadline, now);
+        }
+    }
+    CHECK_EQ(fired, 2);
+    CHECK(!far.Armed);
+}
+
+static VOID
+TestRearmAndRemove(
+    VOID
+)
+{
+    static TIMER_WHEEL wheel;
+    TIMER_WHEEL_ENTRY entry;
+    PTIMER_WHEEL_ENTRY expired[4];
+
+    TimerWheelInitialize(&wheel, 0);
+    EntryInit(&entry, NULL);
+
+    // Re-arming replaces the deadline rather than adding a second one
+    TimerWheelInsert(&wheel, &entry, 10);
+    TimerWheelInsert(&wheel, &entry, 20);
+    CHECK_EQ(wheel.Count, 1);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 15, expired, 4), 0);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 20, expired, 4), 1);
+
+    TimerWheelInsert(&wheel, &entry, 30);
+    TimerWheelRemove(&wheel, &entry);
+    TimerWheelRemove(&wheel, &entry);
+    CHECK(!entry.Armed);
+    CHECK_EQ(wheel.Count, 0);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 100, expired, 4), 0);
+}
+
+// A full batch leaves the rest of the bucket for the next call with the
+// same Now, and a long gap is caught up in one pass
+static VOID
+TestBatchAndGap(
+    VOID
+)
+{
+    static TIMER_WHEEL wheel;
+    static TIMER_WHEEL_ENTRY entries[100];
+    PTIMER_WHEEL_ENTRY expired[32];
+    ULONG total = 0;
+    ULONG count;
+    ULONG i;
+
+    TimerWheelInitialize(&wheel, 0);
+    for (i = 0; i < 100; i++) {
+        EntryInit(&entries[i], NULL);
+        TimerWheelInsert(&wheel, &entries[i], 7);
+    }
+    CHECK_EQ(TimerWheelAdvance(&wheel, 7, expired, 32), 32);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 7, expired, 32), 32);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 7, expired, 32), 32);
+    CHECK_EQ(TimerWheelAdvance(&wheel, 7, expired, 32), 4);
+    CHECK_EQ(wheel.Count, 0);
+
+    // Deadlines spread over several turns, then a clock that jumps past all
+    for (i = 0; i < 100; i++) {
+        TimerWheelInsert(&wheel, &entries[i], 8 + i * 37);
+    }
+    do {
+        count = TimerWheelAdvance(&wheel, 1000000, expired, 32);
+        total += count;
+    } while (count == 32);
+    CHECK_EQ(total, 100);
+    CHECK_EQ(wheel.Count, 0);
+    CHECK_EQ(wheel.Current, 1000000);
+}
+
+//
+// Random arming, cancelling and clock steps, some longer than a turn. Each
+// entry must fire once, on the first advance at or past its deadline.
+//
+
+#define RANDOM_ENTRIES  64
+#define RANDOM_STEPS    200000
+
+static VOID
+TestRandomized(
+    VOID
+)
+{
+    static TIMER_WHEEL wheel;
+    static TIMER_WHEEL_ENTRY entries[RANDOM_ENTRIES];
+    static ULONG64 deadline[RANDOM_ENTRIES];    // 0 while not armed
+    PTIMER_WHEEL_ENTRY expired[RANDOM_ENTRIES];
+    unsigned long long seed = 0xA4093822299F31D0ULL;
+    ULONG64 now = 12345;
+    ULONG64 fired = 0;
+    ULONG64 early = 0;
+    ULONG64 late = 0;
+    ULONG step;
+    ULONG count;
+    ULONG i;
+
+    TimerWheelInitialize(&wheel, now);
+    for (i = 0; i < RANDOM_ENTRIES; i++) {
+        EntryInit(&entries[i], (PVOID)(ULONG_PTR)i);
+    }
+
+    for (step = 0; step < RANDOM_STEPS; step++) {
+        ULONG pick = (ULONG)(TestRandom(&seed) % RANDOM_ENTRIES);
+        ULONG action = (ULONG)(TestRandom(&seed) % 8);
+
+        if (action < 3) {
+            ULONG64 due = now + TestRandom(&seed) % (3 * SLOTS);
+
+            TimerWheelInsert(&wheel, &entries[pick], due);
+            deadline[pick] = max(due, now + 1);
+        }
+        else if (action < 4) {
+            TimerWheelRemove(&wheel, &entries[pick]);
+            deadline[pick] = 0;
+        }
+        else {
+            now += (TestRandom(&seed) % 64 == 0) ? TestRandom(&seed) % (2 * SLOTS) : TestRandom(&seed) % 3;
+            count = TimerWheelAdvance(&wheel, now, expired, RANDOM_ENTRIES);
+
+            for (i = 0; i < count; i++) {
+                ULONG index = (ULONG)(ULONG_PTR)expired[i]->Context;
+
+                early += (deadline[index] == 0 || deadline[index] > now);
+                deadline[index] = 0;
+                fired++;
+            }
+
+            // Whatever is still armed must not be due
+            for (i = 0; i < RANDOM_ENTRIES; i++) {
+                late += (deadline[i] != 0 && deadline[i] <= now);
+                CHECK_EQ(entries[i].Armed, deadline[i] != 0);
+            }
+        }
+    }
+
+    printf("  %llu expirations over %llu ticks\n",
+        (unsigned long long)fired, (unsigned long long)(now - 12345));
+    CHECK(fired > 1000);
+    CHECK_EQ(early, 0);
+    CHECK_EQ(late, 0);
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestFiresOnDeadline);
+    RUN_TEST(TestLaterTurns);
+    RUN_TEST(TestRearmAndRemove);
+    RUN_TEST(TestBatchAndGap);
+    RUN_TEST(TestRandomized);
+    return TestResult();
+}
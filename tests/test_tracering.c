@@ -0,0 +1,442 @@
+/*++
+
+Module Name:
+
+    test_tracering.c
+
+Abstract:
+
+    Tests for the binary trace ring (tracecore.c): drains in order, writers
+    lapping the drain, slots caught part way through a write, the LOST
+    record and the slot kept for it, and writer threads racing a drain.
+    Also the decoder the vcomtrace tool uses (tools/tracefmt.c).
+
+--*/
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "public.h"
+#include "tracecore.h"
+#include "tracefmt.h"
+#include "testing.h"
+
+#define SLOTS   TRACE_RING_SLOTS
+
+static VOID
+Put(
+    PTRACE_RING Ring,
+    ULONG64 Value
+)
+{
+    VCOM_TRACE_RECORD record;
+
+    RtlZeroMemory(&record, sizeof(record));
+    record.Timestamp = Value;
+    record.EventId = VCOM_TRACE_EVENT_WRITE;
+    record.Level = DPFLTR_TRACE_LEVEL;
+    record.PortId = 3;
+    record.Args[0] = Value;
+    record.Args[1] = ~Value;
+    TraceRingPut(Ring, &record);
+}
+
+static VOID
+TestDrainInOrder(
+    VOID
+)
+{
+    static TRACE_RING ring;
+    static VCOM_TRACE_RECORD records[SLOTS + 1];
+    ULONG count;
+    ULONG i;
+
+    RtlZeroMemory(&ring, sizeof(ring));
+    CHECK_EQ(TraceRingCollect(&ring, 1, 0, records, SLOTS + 1), 0);
+
+    for (i = 0; i < 10; i++) {
+        Put(&ring, i);
+    }
+    count = TraceRingCollect(&ring, 1, 0, records, SLOTS + 1);
+    CHECK_EQ(count, 10);
+    for (i = 0; i < count; i++) {
+        CHECK_EQ(records[i].Args[0], i);
+        CHECK_EQ(records[i].Args[1], ~(ULONG64)i);
+        CHECK_EQ(records[i].PortId, 3);
+    }
+
+    // Drained records are not handed out again
+    CHECK_EQ(TraceRingCollect(&ring, 1, 0, records, SLOTS + 1), 0);
+    Put(&ring, 10);
+    CHECK_EQ(TraceRingCollect(&ring, 1, 0, records, SLOTS + 1), 1);
+    CHECK_EQ(records[0].Args[0], 10);
+}
+
+// Writers that go more than a ring ahead of the drain overwrite the oldest
+// records; the drain gets the newest SLOTS and a count of the rest
+static VOID
+TestLapped(
+    VOID
+)
+{
+    static TRACE_RING ring;
+    static VCOM_TRACE_RECORD records[SLOTS + 1];
+    ULONG count;
+    ULONG i;
+
+    RtlZeroMemory(&ring, sizeof(ring));
+    Put(&ring, 0);
+    CHECK_EQ(TraceRingCollect(&ring, 1, 0, records, SLOTS + 1), 1);
+
+    for (i = 1; i <= 3 * SLOTS + 5; i++) {
+        Put(&ring, i);
+    }
+    count = TraceRingCollect(&ring, 1, 777, records, SLOTS + 1);
+    CHECK_EQ(count, SLOTS + 1);
+    CHECK_EQ(records[0].Args[0], 2 * SLOTS + 6);
+    CHECK_EQ(records[SLOTS - 1].Args[0], 3 * SLOTS + 5);
+    CHECK_EQ(records[SLOTS].EventId, VCOM_TRACE_EVENT_LOST);
+    CHECK_EQ(records[SLOTS].Args[0], 2 * SLOTS + 5);
+    CHECK_EQ(records[SLOTS].Timestamp, 777);
+
+    // Lapped exactly once, with nothing drained in between
+    for (i = 0; i < SLOTS + 1; i++) {
+        Put(&ring, i);
+    }
+    count = TraceRingCollect(&ring, 1, 0, records, SLOTS + 1);
+    CHECK_EQ(count, SLOTS + 1);
+    CHECK_EQ(records[0].Args[0], 1);
+    CHECK_EQ(records[SLOTS].Args[0], 1);
+}
+
+// A slot handed out but not yet written stops the drain there until it is
+// finished; one that a later lap has taken over counts as lost
+static VOID
+TestTornSlot(
+    VOID
+)
+{
+    static TRACE_RING ring;
+    static VCOM_TRACE_RECORD records[SLOTS + 1];
+    VCOM_TRACE_RECORD late;
+    PTRACE_SLOT torn;
+    ULONG count;
+
+    RtlZeroMemory(&ring, sizeof(ring));
+    Put(&ring, 0);
+    Put(&ring, 1);
+
+    // A writer that has claimed slot 2 and been preempted
+    torn = &ring.Slots[2];
+    ring.Next++;
+    torn->Sequence = 0;
+    Put(&ring, 3);
+
+    count = TraceRingCollect(&ring, 1, 0, records, SLOTS + 1);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(records[1].Args[0], 1);
+    CHECK_EQ(ring.Drained, 2);
+
+    // It finishes; the drain picks up from there
+    RtlZeroMemory(&late, sizeof(late));
+    late.Args[0] = 2;
+    torn->Record = late;
+    torn->Sequence = 3;
+    count = TraceRingCollect(&ring, 1, 0, records, SLOTS + 1);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(records[0].Args[0], 2);
+    CHECK_EQ(records[1].Args[0], 3);
+
+    // A slot holding some other lap's record is not passed off as this one
+    Put(&ring, 4);
+    ring.Slots[4].Sequence = 4 + SLOTS + 1;
+    Put(&ring, 5);
+    count = TraceRingCollect(&ring, 1, 55, records, SLOTS + 1);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(records[0].Args[0], 5);
+    CHECK_EQ(records[1].EventId, VCOM_TRACE_EVENT_LOST);
+    CHECK_EQ(records[1].Args[0], 1);
+}
+
+// A writer that comes round to a slot still being written by the previous
+// lap drops its record instead of writing into the other one's
+static VOID
+TestSlotStillClaimed(
+    VOID
+)
+{
+    static TRACE_RING ring;
+    static VCOM_TRACE_RECORD records[SLOTS + 1];
+    ULONG count;
+    ULONG i;
+
+    RtlZeroMemory(&ring, sizeof(ring));
+    for (i = 0; i < SLOTS; i++) {
+        Put(&ring, i);
+    }
+    ring.Slots[0].Sequence = 0;
+    Put(&ring, SLOTS);
+    CHECK_EQ(ring.Slots[0].Sequence, 0);
+
+    // The earlier writer finishes; its record is older than the drain wants
+    ring.Slots[0].Sequence = 1;
+    count = TraceRingCollect(&ring, 1, 0, records, SLOTS + 1);
+    CHECK_EQ(count, SLOTS);
+    CHECK_EQ(records[0].Args[0], 1);
+    CHECK_EQ(records[SLOTS - 2].Args[0], SLOTS - 1);
+    CHECK_EQ(records[SLOTS - 1].EventId, VCOM_TRACE_EVENT_LOST);
+    CHECK_EQ(records[SLOTS - 1].Args[0], 2);
+
+    // And the slot is not stuck: the next lap writes it again
+    for (i = 0; i < SLOTS; i++) {
+        Put(&ring, SLOTS + 1 + i);
+    }
+    count = TraceRingCollect(&ring, 1, 0, records, SLOTS + 1);
+    CHECK_EQ(count, SLOTS);
+    CHECK_EQ(records[SLOTS - 1].Args[0], 2 * SLOTS);
+}
+
+// The LOST record has its own fixed fields and always has room, however
+// small the drain's buffer
+static VOID
+TestLostRecord(
+    VOID
+)
+{
+    static TRACE_RING rings[2];
+    static VCOM_TRACE_RECORD records[8];
+    ULONG count;
+    ULONG i;
+
+    RtlZeroMemory(rings, sizeof(rings));
+    for (i = 0; i < SLOTS + 3; i++) {
+        Put(&rings[0], i);
+    }
+    Put(&rings[1], 1000);
+
+    CHECK_EQ(TraceRingCollect(rings, 2, 0, records, 0), 0);
+
+    // Room for two: one record and the report
+    count = TraceRingCollect(rings, 2, 999, records, 2);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(records[0].Args[0], 3);
+    CHECK_EQ(records[1].Timestamp, 999);
+    CHECK_EQ(records[1].EventId, VCOM_TRACE_EVENT_LOST);
+    CHECK_EQ(records[1].Level, DPFLTR_ERROR_LEVEL);
+    CHECK_EQ(records[1].PortId, VCOM_INVALID_PORT_ID);
+    CHECK_EQ(records[1].Processor, 0);
+    CHECK_EQ(records[1].Args[0], 3);
+    CHECK_EQ(records[1].Args[1], 0);
+
+    // With room for one, a drain with nothing lost still gets one record
+    count = TraceRingCollect(rings, 2, 0, records, 1);
+    CHECK_EQ(count, 0);
+    count = TraceRingCollect(rings, 2, 0, records, 8);
+    CHECK_EQ(count, 7);
+    CHECK_EQ(records[0].Args[0], 4);
+    CHECK_EQ(records[6].Args[0], 10);
+}
+
+//
+// Writer threads sharing one ring while another thread drains it. Every
+// record written is either drained whole or counted lost.
+//
+
+#define WRITERS         3
+#define WRITES          200000
+
+typedef struct _RACE {
+    TRACE_RING          Ring;
+    volatile LONG       Done;
+    ULONG64             Drained;
+    ULONG64             Lost;
+    ULONG64             Torn;
+    ULONG64             OutOfOrder;
+    ULONG64             Last[WRITERS];
+} RACE;
+
+static VOID
+RaceCheck(
+    RACE* Race,
+    const VCOM_TRACE_RECORD* Records,
+    ULONG Count
+)
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        ULONG64 value = Records[i].Args[0];
+        ULONG writer = (ULONG)(value >> 32);
+
+        if (Records[i].EventId == VCOM_TRACE_EVENT_LOST) {
+            Race->Lost += value;
+            continue;
+        }
+        if (Records[i].Args[1] != ~value || Records[i].Timestamp != value ||
+            writer >= WRITERS) {
+            Race->Torn++;
+            continue;
+        }
+        Race->OutOfOrder += ((value & 0xFFFFFFFF) + 1 <= Race->Last[writer]);
+        Race->Last[writer] = (value & 0xFFFFFFFF) + 1;
+        Race->Drained++;
+    }
+}
+
+static void*
+WriterThread(
+    void* Context
+)
+{
+    RACE* race = (RACE*)Context;
+    static volatile LONG nextWriter;
+    ULONG64 writer = (ULONG64)InterlockedIncrement(&nextWriter) - 1;
+    ULONG64 i;
+
+    for (i = 0; i < WRITES; i++) {
+        Put(&race->Ring, (writer << 32) | i);
+    }
+    return NULL;
+}
+
+static VOID
+TestConcurrentWriters(
+    VOID
+)
+{
+    static RACE race;
+    static VCOM_TRACE_RECORD records[64];
+    pthread_t threads[WRITERS];
+    ULONG drains = 0;
+    ULONG count;
+    ULONG i;
+
+    for (i = 0; i < WRITERS; i++) {
+        pthread_create(&threads[i], NULL, WriterThread, &race);
+    }
+
+    // Drain while the writers run, until they have all stopped
+    while (ReadNoFence64(&race.Ring.Next) < (LONG64)WRITERS * WRITES) {
+        count = TraceRingCollect(&race.Ring, 1, 0, records, RTL_NUMBER_OF(records));
+        RaceCheck(&race, records, count);
+        drains++;
+    }
+    for (i = 0; i < WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    do {
+        count = TraceRingCollect(&race.Ring, 1, 0, records, RTL_NUMBER_OF(records));
+        RaceCheck(&race, records, count);
+    } while (count != 0);
+
+    printf("  %u drains, %llu records drained, %llu lost\n", drains,
+        (unsigned long long)race.Drained, (unsigned long long)race.Lost);
+    CHECK_EQ(race.Torn, 0);
+    CHECK_EQ(race.OutOfOrder, 0);
+    CHECK_EQ(race.Drained + race.Lost, (ULONG64)WRITERS * WRITES);
+    CHECK(race.Drained > 0);
+}
+
+//
+// The decoder
+//
+
+static VOID
+TestEventNames(
+    VOID
+)
+{
+    CHECK(strcmp(TraceEventName(VCOM_TRACE_EVENT_IOCTL), "IOCTL") == 0);
+    CHECK(strcmp(TraceEventName(VCOM_TRACE_EVENT_READ_TIMEOUT), "READ_TIMEOUT") == 0);
+    CHECK(strcmp(TraceEventName(VCOM_TRACE_EVENT_PORT_REMOVED), "PORT_REMOVED") == 0);
+    CHECK(strcmp(TraceEventName(VCOM_TRACE_EVENT_LOST), "LOST") == 0);
+    CHECK(TraceEventName(0) == NULL);
+    CHECK(TraceEventName(1234) == NULL);
+}
+
+static VOID
+TestFormat(
+    VOID
+)
+{
+    VCOM_TRACE_RECORD record;
+    char line[256];
+
+    RtlZeroMemory(&record, sizeof(record));
+    record.Timestamp = 1000 + 25000;
+    record.EventId = VCOM_TRACE_EVENT_OUTGOING_RESIZED;
+    record.Level = DPFLTR_INFO_LEVEL;
+    record.Processor = 2;
+    record.PortId = 7;
+    record.Args[0] = 4096;
+    record.Args[1] = 65536;
+    TraceFormatRecord(&record, 1000, line, sizeof(line));
+    CHECK(strcmp(line, "      2.5000 ms  cpu 2   I port 7     OUTGOING_RESIZED capacity 4096 -> 65536") == 0);
+
+    record.EventId = VCOM_TRACE_EVENT_LOST;
+    record.Level = DPFLTR_ERROR_LEVEL;
+    record.PortId = VCOM_INVALID_PORT_ID;
+    record.Args[0] = 12;
+    TraceFormatRecord(&record, 1000, line, sizeof(line));
+    CHECK(strstr(line, "port -     LOST") != NULL);
+    CHECK(strstr(line, "12 records lost") != NULL);
+
+    record.EventId = 99;
+    TraceFormatRecord(&record, 1000, line, sizeof(line));
+    CHECK(strstr(line, "event 99 0xc 0x10000") != NULL);
+
+    // Cut short, still terminated
+    CHECK(TraceFormatRecord(&record, 1000, line, 8) > 8);
+    CHECK_EQ(strlen(line), 7);
+}
+
+// Per-processor groups merge into time order; equal times keep the order
+// they came in
+static VOID
+TestSort(
+    VOID
+)
+{
+    static VCOM_TRACE_RECORD records[1000];
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+    ULONG64 time[4] = { 0 };
+    ULONG misordered = 0;
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(records); i++) {
+        ULONG cpu = i / 250;
+
+        time[cpu] += TestRandom(&seed) % 3;
+        RtlZeroMemory(&records[i], sizeof(records[i]));
+        records[i].Timestamp = time[cpu];
+        records[i].Processor = cpu;
+        records[i].Args[0] = i;
+    }
+    CHECK(TraceSortRecords(records, RTL_NUMBER_OF(records)));
+
+    for (i = 1; i < RTL_NUMBER_OF(records); i++) {
+        misordered += (records[i].Timestamp < records[i - 1].Timestamp);
+        misordered += (records[i].Timestamp == records[i - 1].Timestamp &&
+            records[i].Args[0] < records[i - 1].Args[0]);
+    }
+    CHECK_EQ(misordered, 0);
+    CHECK(TraceSortRecords(records, 0));
+    CHECK(TraceSortRecords(records, 1));
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestDrainInOrder);
+    RUN_TEST(TestLapped);
+    RUN_TEST(TestTornSlot);
+    RUN_TEST(TestSlotStillClaimed);
+    RUN_TEST(TestLostRecord);
+    RUN_TEST(TestConcurrentWriters);
+    RUN_TEST(TestEventNames);
+    RUN_TEST(TestFormat);
+    RUN_TEST(TestSort);
+    return TestResult();
+}
@@ -0,0 +1,251 @@
+/*++
+
+Module Name:
+
+    test_waitmask.c
+
+Abstract:
+
+    Tests for the wait-mask transitions (waitmask.c), and a simulated
+    receive loop counting WaitCommEvent and ReadFile calls per byte when a
+    wait completes at once with whatever it has against when it pends.
+
+--*/
+
+#include "platform.h"
+#include "public.h"
+#include "waitmask.h"
+#include "testing.h"
+
+static VOID
+TestNoMask(
+    VOID
+)
+{
+    WAIT_MASK_STATE state;
+    ULONG events = 0xffffffff;
+
+    WaitMaskReset(&state);
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskReject);
+    CHECK_EQ(events, 0);
+
+    // Nothing is recorded without a mask, so a later mask starts clean
+    CHECK(!WaitMaskWanted(&state, SERIAL_EV_RXCHAR));
+    CHECK(!WaitMaskRecord(&state, SERIAL_EV_RXCHAR));
+    CHECK_EQ(WaitMaskSet(&state, SERIAL_EV_RXCHAR), STATUS_SUCCESS);
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskPend);
+}
+
+static VOID
+TestRecordAndTake(
+    VOID
+)
+{
+    WAIT_MASK_STATE state;
+    ULONG events = 0;
+
+    WaitMaskReset(&state);
+    CHECK_EQ(WaitMaskSet(&state, SERIAL_EV_RXCHAR | SERIAL_EV_CTS), STATUS_SUCCESS);
+    CHECK(WaitMaskWanted(&state, SERIAL_EV_CTS | SERIAL_EV_DSR));
+    CHECK(!WaitMaskWanted(&state, SERIAL_EV_DSR));
+
+    // A wait pends until an event in the mask arrives; others are dropped
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskPend);
+    CHECK(!WaitMaskRecord(&state, SERIAL_EV_DSR | SERIAL_EV_TXEMPTY));
+    CHECK_EQ(state.History, 0);
+    CHECK(WaitMaskRecord(&state, SERIAL_EV_RXCHAR | SERIAL_EV_DSR));
+    CHECK_EQ(WaitMaskTake(&state), SERIAL_EV_RXCHAR);
+    CHECK_EQ(WaitMaskTake(&state), 0);
+
+    // With nobody waiting, events coalesce and the next wait gets them all
+    CHECK(WaitMaskRecord(&state, SERIAL_EV_RXCHAR));
+    CHECK(WaitMaskRecord(&state, SERIAL_EV_RXCHAR));
+    CHECK(WaitMaskRecord(&state, SERIAL_EV_CTS));
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskComplete);
+    CHECK_EQ(events, SERIAL_EV_RXCHAR | SERIAL_EV_CTS);
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskPend);
+    CHECK_EQ(events, 0);
+}
+
+static VOID
+TestSecondWaitRejected(
+    VOID
+)
+{
+    WAIT_MASK_STATE state;
+    ULONG events = 0;
+
+    WaitMaskReset(&state);
+    CHECK_EQ(WaitMaskSet(&state, SERIAL_EV_RXFLAG), STATUS_SUCCESS);
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskPend);
+    CHECK_EQ(WaitMaskBeginWait(&state, TRUE, &events), WaitMaskReject);
+
+    // Even with history to hand out, a pending wait takes it first
+    CHECK(WaitMaskRecord(&state, SERIAL_EV_RXFLAG));
+    CHECK_EQ(WaitMaskBeginWait(&state, TRUE, &events), WaitMaskReject);
+    CHECK_EQ(state.History, SERIAL_EV_RXFLAG);
+}
+
+static VOID
+TestSetAndReset(
+    VOID
+)
+{
+    WAIT_MASK_STATE state;
+    ULONG events = 0;
+
+    WaitMaskReset(&state);
+    CHECK_EQ(WaitMaskSet(&state, SERIAL_EV_RXCHAR | SERIAL_EV_ERR), STATUS_SUCCESS);
+    CHECK(WaitMaskRecord(&state, SERIAL_EV_ERR));
+
+    // A new mask starts the history afresh, even for events it still has
+    CHECK_EQ(WaitMaskSet(&state, SERIAL_EV_ERR), STATUS_SUCCESS);
+    CHECK_EQ(state.History, 0);
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskPend);
+
+    // Events the port never raises are refused and leave the mask alone
+    CHECK_EQ(WaitMaskSet(&state, SERIAL_EV_ERR | 0x8000), STATUS_INVALID_PARAMETER);
+    CHECK_EQ(state.Mask, SERIAL_EV_ERR);
+    CHECK_EQ(WaitMaskSet(&state, VCOM_SUPPORTED_EVENTS), STATUS_SUCCESS);
+
+    CHECK(WaitMaskRecord(&state, SERIAL_EV_RING));
+    WaitMaskReset(&state);
+    CHECK_EQ(state.Mask, 0);
+    CHECK_EQ(state.History, 0);
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskReject);
+
+    // Clearing the mask is allowed, and rejects the next wait
+    CHECK_EQ(WaitMaskSet(&state, SERIAL_EV_RXCHAR), STATUS_SUCCESS);
+    CHECK_EQ(WaitMaskSet(&state, 0), STATUS_SUCCESS);
+    CHECK_EQ(WaitMaskBeginWait(&state, FALSE, &events), WaitMaskReject);
+}
+
+//
+// A receive loop on a simulated clock. Bytes arrive at random ticks; the
+// application waits for EV_RXCHAR, then reads whatever has arrived, then
+// spends a few ticks on it. Spinning is a wait that completes at once
+// whether or not anything came in, as one that never pended would; pended
+// is a wait that stays until an event comes, with events coalescing in the
+// history while the application is busy.
+//
+
+#define SIM_TICKS       1000000
+#define SIM_WORK_TICKS  4
+
+typedef struct _SIM_RESULT {
+    ULONG64 Bytes;
+    ULONG64 Waits;
+    ULONG64 Reads;
+} SIM_RESULT;
+
+static VOID
+SimulateReceive(
+    BOOLEAN Pend,
+    ULONG ArrivalOneIn,
+    SIM_RESULT* Result
+)
+{
+    WAIT_MASK_STATE state;
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+    ULONG busy = 0;
+    BOOLEAN pending = FALSE;
+    BOOLEAN woken = FALSE;
+    ULONG events;
+    ULONG tick;
+
+    RtlZeroMemory(Result, sizeof(*Result));
+    WaitMaskReset(&state);
+    (VOID)WaitMaskSet(&state, SERIAL_EV_RXCHAR);
+
+    for (tick = 0; tick < SIM_TICKS; tick++) {
+        if (TestRandom(&seed) % ArrivalOneIn == 0) {
+            Result->Bytes++;
+            if (WaitMaskRecord(&state, SERIAL_EV_RXCHAR) && pending) {
+                (VOID)WaitMaskTake(&state);
+                pending = FALSE;
+                woken = TRUE;
+            }
+        }
+
+        if (busy != 0) {
+            busy--;
+            continue;
+        }
+        if (pending) {
+            continue;
+        }
+
+        if (!woken) {
+            Result->Waits++;
+            if (!Pend) {
+                // Completes straight away; a read only if the history says so
+                woken = WaitMaskTake(&state) != 0;
+                if (!woken) {
+                    continue;
+                }
+            }
+            else {
+                switch (WaitMaskBeginWait(&state, FALSE, &events)) {
+                case WaitMaskComplete:
+                    woken = TRUE;
+                    break;
+                case WaitMaskPend:
+                    pending = TRUE;
+                    continue;
+                default:
+                    CHECK(FALSE);
+                    return;
+                }
+            }
+        }
+
+        woken = FALSE;
+        Result->Reads++;
+        busy = SIM_WORK_TICKS;
+    }
+}
+
+static VOID
+TestCallsPerByte(
+    VOID
+)
+{
+    static const ULONG rates[] = { 2, 16, 256 };
+    SIM_RESULT spin;
+    SIM_RESULT pend;
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(rates); i++) {
+        SimulateReceive(FALSE, rates[i], &spin);
+        SimulateReceive(TRUE, rates[i], &pend);
+
+        printf("  a byte every %3lu ticks: spinning %7.2f calls/byte, pended %5.2f calls/byte\n",
+            (unsigned long)rates[i],
+            (double)(spin.Waits + spin.Reads) / (double)spin.Bytes,
+            (double)(pend.Waits + pend.Reads) / (double)pend.Bytes);
+
+        // Same input, and a pended loop never waits more than once per read
+        CHECK_EQ(spin.Bytes, pend.Bytes);
+        CHECK(pend.Waits <= pend.Reads + 1);
+        CHECK(pend.Reads <= pend.Bytes);
+        CHECK(pend.Waits + pend.Reads <= spin.Waits + spin.Reads);
+    }
+
+    // Sparse traffic is where spinning is worst
+    SimulateReceive(FALSE, 256, &spin);
+    SimulateReceive(TRUE, 256, &pend);
+    CHECK(spin.Waits + spin.Reads > 10 * (pend.Waits + pend.Reads));
+}
+
+int
+main(
+    void
+)
+{
+    RUN_TEST(TestNoMask);
+    RUN_TEST(TestRecordAndTake);
+    RUN_TEST(TestSecondWaitRejected);
+    RUN_TEST(TestSetAndReset);
+    RUN_TEST(TestCallsPerByte);
+    return TestResult();
+}
@@ -0,0 +1,114 @@
+/*++
+
+Module Name:
+
+    testing.h
+
+Abstract:
+
+    Minimal harness for the host tests and benchmarks. CHECK failures are
+    counted and reported, and the test keeps going; main returns
+    TestResult(). Benchmarks time with TestNow and shrink their runs when
+    given --quick, which is how ctest runs them.
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int TestFailures;
+
+#define CHECK(_e_)                                                          \
+    do {                                                                    \
+        if (!(_e_)) {                                                       \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n",                    \
+                __FILE__, __LINE__, #_e_);                                  \
+            TestFailures++;                                                 \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQ(_a_, _b_)                                                  \
+    do {                                                                    \
+        unsigned long long _va_ = (unsigned long long)(_a_);                \
+        unsigned long long _vb_ = (unsigned long long)(_b_);                \
+        if (_va_ != _vb_) {                                                 \
+            fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %llu != %llu\n", \
+                __FILE__, __LINE__, #_a_, #_b_, _va_, _vb_);                \
+            TestFailures++;                                                 \
+        }                                                                   \
+    } while (0)
+
+#define RUN_TEST(_test_)                                                    \
+    do {                                                                    \
+        int _before_ = TestFailures;                                        \
+        _test_();                                                           \
+        printf("%s %s\n", (TestFailures == _before_) ? "PASS" : "FAIL", #_test_); \
+    } while (0)
+
+static inline int
+TestResult(
+    void
+)
+{
+    if (TestFailures != 0) {
+        printf("%d check(s) failed\n", TestFailures);
+        return 1;
+    }
+    return 0;
+}
+
+// Deterministic xorshift64, so a failing run can be repeated
+static inline unsigned long long
+TestRandom(
+    unsigned long long* State
+)
+{
+    unsigned long long x = *State;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *State = x;
+    return x;
+}
+
+// Byte a test stream holds at running offset Counter; not periodic in any
+// power of two, so a byte landing in the wrong slot of a ring is caught
+static inline unsigned char
+TestStreamByte(
+    unsigned long long Counter
+)
+{
+    return (unsigned char)(Counter * 131 + (Counter >> 9));
+}
+
+// Seconds on the monotonic clock
+static inline double
+TestNow(
+    void
+)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static inline int
+TestQuick(
+    int argc,
+    char** argv
+)
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
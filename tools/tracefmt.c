@@ -0,0 +1,169 @@
+/*++
+
+Module Name:
+
+    tracefmt.c
+
+Abstract:
+
+    Binary trace decoding
+
+Environment:
+
+    User-mode
+
+--*/
+
+#include <stdio.h>
+
+#include "platform.h"
+#include "public.h"
+#include "tracefmt.h"
+
+const char*
+TraceEventName(
+    _In_  USHORT              EventId
+)
+{
+    switch (EventId) {
+    case VCOM_TRACE_EVENT_IOCTL:                return "IOCTL";
+    case VCOM_TRACE_EVENT_WRITE:                return "WRITE";
+    case VCOM_TRACE_EVENT_READ:                 return "READ";
+    case VCOM_TRACE_EVENT_WRITE_TIMEOUT:        return "WRITE_TIMEOUT";
+    case VCOM_TRACE_EVENT_READ_TIMEOUT:         return "READ_TIMEOUT";
+    case VCOM_TRACE_EVENT_OUTGOING_RESIZED:     return "OUTGOING_RESIZED";
+    case VCOM_TRACE_EVENT_INCOMING_RESIZED:     return "INCOMING_RESIZED";
+    case VCOM_TRACE_EVENT_PORT_ADDED:           return "PORT_ADDED";
+    case VCOM_TRACE_EVENT_PORT_REMOVED:         return "PORT_REMOVED";
+    case VCOM_TRACE_EVENT_LOST:                 return "LOST";
+    default:                                    return NULL;
+    }
+}
+
+static char
+TraceLevelLetter(
+    _In_  USHORT              Level
+)
+{
+    switch (Level) {
+    case DPFLTR_ERROR_LEVEL:    return 'E';
+    case DPFLTR_WARNING_LEVEL:  return 'W';
+    case DPFLTR_TRACE_LEVEL:    return 'T';
+    case DPFLTR_INFO_LEVEL:     return 'I';
+    default:                    return '?';
+    }
+}
+
+int
+TraceFormatRecord(
+    _In_  const VCOM_TRACE_RECORD* Record,
+    _In_  ULONG64             Base,
+    _Out_writes_bytes_(Size) char* Buffer,
+    _In_  size_t              Size
+)
+{
+    const char* name = TraceEventName(Record->EventId);
+    unsigned long long a0 = (unsigned long long)Record->Args[0];
+    unsigned long long a1 = (unsigned long long)Record->Args[1];
+    double ms = (double)(LONG64)(Record->Timestamp - Base) / 10000.0;
+    char port[16];
+    char args[64];
+
+    if (Record->PortId == VCOM_INVALID_PORT_ID) {
+        snprintf(port, sizeof(port), "-");
+    }
+    else {
+        snprintf(port, sizeof(port), "%lu", (unsigned long)Record->PortId);
+    }
+
+    switch (Record->EventId) {
+    case VCOM_TRACE_EVENT_IOCTL:
+        snprintf(args, sizeof(args), "code 0x%08llx input %llu", a0, a1);
+        break;
+    case VCOM_TRACE_EVENT_WRITE:
+    case VCOM_TRACE_EVENT_READ:
+        snprintf(args, sizeof(args), "length %llu", a0);
+        break;
+    case VCOM_TRACE_EVENT_WRITE_TIMEOUT:
+    case VCOM_TRACE_EVENT_READ_TIMEOUT:
+        snprintf(args, sizeof(args), "transferred %llu", a0);
+        break;
+    case VCOM_TRACE_EVENT_OUTGOING_RESIZED:
+    case VCOM_TRACE_EVENT_INCOMING_RESIZED:
+        snprintf(args, sizeof(args), "capacity %llu -> %llu", a0, a1);
+        break;
+    case VCOM_TRACE_EVENT_PORT_ADDED:
+    case VCOM_TRACE_EVENT_PORT_REMOVED:
+        args[0] = '\0';
+        break;
+    case VCOM_TRACE_EVENT_LOST:
+        snprintf(args, sizeof(args), "%llu records lost", a0);
+        break;
+    default:
+        snprintf(args, sizeof(args), "0x%llx 0x%llx", a0, a1);
+        break;
+    }
+
+    if (name == NULL) {
+        return snprintf(Buffer, Size, "%12.4f ms  cpu %-3lu %c port %-5s event %u %s",
+            ms, (unsigned long)Record->Processor, TraceLevelLetter(Record->Level), port,
+            (unsigned)Record->EventId, args);
+    }
+    return snprintf(Buffer, Size, "%12.4f ms  cpu %-3lu %c port %-5s %-16s %s",
+        ms, (unsigned long)Record->Processor, TraceLevelLetter(Record->Level), port,
+        name, args);
+}
+
+BOOLEAN
+TraceSortRecords(
+    _Inout_updates_(Count) PVCOM_TRACE_RECORD Records,
+    _In_  size_t              Count
+)
+{
+    PVCOM_TRACE_RECORD scratch;
+    PVCOM_TRACE_RECORD from = Records;
+    PVCOM_TRACE_RECORD to;
+    PVCOM_TRACE_RECORD swap;
+    size_t width;
+    size_t start;
+
+    if (Count < 2) {
+        return TRUE;
+    }
+    scratch = (PVCOM_TRACE_RECORD)malloc(Count * sizeof(*Records));
+    if (scratch == NULL) {
+        return FALSE;
+    }
+    to = scratch;
+
+    // Bottom-up merge sort: stable, and each processor's group is already
+    // in order
+    for (width = 1; width < Count; width *= 2) {
+        for (start = 0; start < Count; start += 2 * width) {
+            size_t mid = min(start + width, Count);
+            size_t end = min(start + 2 * width, Count);
+            size_t left = start;
+            size_t right = mid;
+            size_t out = start;
+
+            while (left < mid && right < end) {
+                to[out++] = (from[right].Timestamp < from[left].Timestamp) ? from[right++] : from[left++];
+            }
+            while (left < mid) {
+                to[out++] = from[left++];
+            }
+            while (right < end) {
+                to[out++] = from[right++];
+            }
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != Records) {
+        RtlCopyMemory(Records, from, Count * sizeof(*Records));
+    }
+    free(scratch);
+    return TRUE;
+}
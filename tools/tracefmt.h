@@ -0,0 +1,48 @@
+/*++
+
+Module Name:
+
+    tracefmt.h
+
+Abstract:
+
+    Decoding of the driver's binary trace (VCOM_TRACE_RECORD, drained with
+    IOCTL_VCOM_DRAIN_TRACE): event names, one line of text per record, and
+    merging the per-processor groups a drain returns into time order.
+
+--*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // "WRITE", "LOST" and so on; NULL for an ID this decoder does not know
+    const char*
+        TraceEventName(
+            _In_  USHORT              EventId
+        );
+
+    // Formats Record into Buffer, its time in milliseconds after Base (both
+    // interrupt time, 100ns). Returns what snprintf does.
+    int
+        TraceFormatRecord(
+            _In_  const VCOM_TRACE_RECORD* Record,
+            _In_  ULONG64             Base,
+            _Out_writes_bytes_(Size) char* Buffer,
+            _In_  size_t              Size
+        );
+
+    // Sorts Records on Timestamp, keeping records with equal ones in the
+    // order given, so each processor's records stay in the order written.
+    // FALSE if there was no memory to do it.
+    BOOLEAN
+        TraceSortRecords(
+            _Inout_updates_(Count) PVCOM_TRACE_RECORD Records,
+            _In_  size_t              Count
+        );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,116 @@
+/*++
+
+Module Name:
+
+    vcomtrace.c
+
+Abstract:
+
+    Prints the driver's binary trace as text. Takes files (or standard
+    input) holding the VCOM_TRACE_RECORDs that IOCTL_VCOM_DRAIN_TRACE
+    returned, as the control service saves them, one drain after another;
+    merges them into time order and prints a line per record, timed from
+    the first.
+
+        vcomtrace [file ...]
+
+--*/
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "platform.h"
+#include "public.h"
+#include "tracefmt.h"
+
+typedef struct _RECORDS {
+    PVCOM_TRACE_RECORD  Items;
+    size_t              Count;
+    size_t              Capacity;
+} RECORDS;
+
+static int
+ReadRecords(
+    FILE* File,
+    const char* Name,
+    RECORDS* Records
+)
+{
+    VCOM_TRACE_RECORD record;
+    PVCOM_TRACE_RECORD grown;
+    size_t got;
+
+    for (;;) {
+        got = fread(&record, 1, sizeof(record), File);
+        if (got == 0) {
+            break;
+        }
+        if (got != sizeof(record)) {
+            fprintf(stderr, "vcomtrace: %s: %zu stray bytes at the end\n", Name, got);
+            return 1;
+        }
+
+        if (Records->Count == Records->Capacity) {
+            Records->Capacity = max(Records->Capacity * 2, (size_t)1024);
+            grown = (PVCOM_TRACE_RECORD)realloc(Records->Items, Records->Capacity * sizeof(record));
+            if (grown == NULL) {
+                fprintf(stderr, "vcomtrace: out of memory\n");
+                return 1;
+            }
+            Records->Items = grown;
+        }
+        Records->Items[Records->Count++] = record;
+    }
+
+    if (ferror(File)) {
+        fprintf(stderr, "vcomtrace: %s: %s\n", Name, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    RECORDS records = { 0 };
+    char line[256];
+    FILE* file;
+    size_t i;
+    int failed = 0;
+    int arg;
+
+    if (argc < 2) {
+        failed = ReadRecords(stdin, "<stdin>", &records);
+    }
+    for (arg = 1; arg < argc && !failed; arg++) {
+        file = fopen(argv[arg], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "vcomtrace: %s: %s\n", argv[arg], strerror(errno));
+            failed = 1;
+            break;
+        }
+        failed = ReadRecords(file, argv[arg], &records);
+        fclose(file);
+    }
+    if (failed) {
+        free(records.Items);
+        return 1;
+    }
+
+    if (!TraceSortRecords(records.Items, records.Count)) {
+        fprintf(stderr, "vcomtrace: out of memory\n");
+        free(records.Items);
+        return 1;
+    }
+
+    for (i = 0; i < records.Count; i++) {
+        TraceFormatRecord(&records.Items[i], records.Items[0].Timestamp, line, sizeof(line));
+        puts(line);
+    }
+
+    free(records.Items);
+    return 0;
+}